@@ -0,0 +1,182 @@
+#include "cache_risposte.h"
+#include "pacchetto.h"
+#include <stdio.h>
+#include <string.h>
+
+// Stato di una voce della cache
+typedef enum {
+    VOCE_VUOTA = 0,   // Nessuna risposta disponibile
+    VOCE_IN_VOLO,     // Una sessione sta interrogando la stampante
+    VOCE_VALIDA       // Risposta disponibile fino a scadenza
+} StatoVoce;
+
+typedef struct {
+    char comando[CACHE_MAX_COMANDO];   // Comando in allowlist (chiave)
+    int comando_len;
+    StatoVoce stato;
+    LONG generazione;                  // Generazione della cache all'avvio della richiesta in volo
+    DWORD timestamp;                   // GetTickCount() al momento della pubblicazione
+    char risposta[CACHE_MAX_RISPOSTA];
+    int risposta_len;
+} VoceCache;
+
+static VoceCache voci[CACHE_MAX_VOCI];
+static int num_voci = 0;
+static DWORD ttl = CACHE_TTL_MS;
+static LONG generazione = 0;           // Incrementata a ogni invalidazione
+static CRITICAL_SECTION cs_cache;
+static CONDITION_VARIABLE cv_cache;
+static BOOL cache_pronta = FALSE;
+
+static volatile LONG cont_hit = 0;
+static volatile LONG cont_miss = 0;
+static volatile LONG cont_coalescenti = 0;
+
+// Cerca la voce associata al comando (da chiamare con cs_cache acquisita)
+static VoceCache* trova_voce(const char* comando, int comando_len) {
+    for (int i = 0; i < num_voci; i++) {
+        if (voci[i].comando_len == comando_len && memcmp(voci[i].comando, comando, (size_t)comando_len) == 0) {
+            return &voci[i];
+        }
+    }
+    return NULL;
+}
+
+void cache_init(const char* allowlist, DWORD ttl_ms) {
+    if (!cache_pronta) {
+        InitializeCriticalSection(&cs_cache);
+        InitializeConditionVariable(&cv_cache);
+        cache_pronta = TRUE;
+    }
+
+    EnterCriticalSection(&cs_cache);
+    memset(voci, 0, sizeof(voci));
+    num_voci = 0;
+    ttl = ttl_ms;
+
+    // Scompone la lista "cmd1,cmd2,..." ignorando spazi e voci vuote
+    const char* p = allowlist ? allowlist : "";
+    while (*p && num_voci < CACHE_MAX_VOCI) {
+        while (*p == ',' || *p == ' ') p++;
+        const char* fine = p;
+        while (*fine && *fine != ',') fine++;
+        int len = (int)(fine - p);
+        while (len > 0 && p[len - 1] == ' ') len--;
+        if (len > 0 && len < CACHE_MAX_COMANDO) {
+            memcpy(voci[num_voci].comando, p, (size_t)len);
+            voci[num_voci].comando_len = len;
+            num_voci++;
+        }
+        p = fine;
+    }
+    LeaveCriticalSection(&cs_cache);
+}
+
+EsitoCache cache_acquisisci(const char* comando, int comando_len, char* risposta, int max_risposta_len, int* risposta_len, DWORD attesa_max_ms) {
+    *risposta_len = 0;
+    if (!cache_pronta) return CACHE_NON_CACHEABILE;
+
+    EnterCriticalSection(&cs_cache);
+    VoceCache* voce = trova_voce(comando, comando_len);
+    if (voce == NULL) {
+        LeaveCriticalSection(&cs_cache);
+        return CACHE_NON_CACHEABILE;
+    }
+
+    BOOL in_attesa = FALSE;
+    DWORD inizio_attesa = GetTickCount();
+    for (;;) {
+        if (voce->stato == VOCE_VALIDA && GetTickCount() - voce->timestamp <= ttl
+            && voce->risposta_len <= max_risposta_len) {
+            memcpy(risposta, voce->risposta, (size_t)voce->risposta_len);
+            *risposta_len = voce->risposta_len;
+            LeaveCriticalSection(&cs_cache);
+            InterlockedIncrement(in_attesa ? &cont_coalescenti : &cont_hit);
+            return CACHE_HIT;
+        }
+        if (voce->stato != VOCE_IN_VOLO) break;
+
+        // Richiesta identica gia' in corso: si accoda al suo risultato, ma non oltre attesa_max_ms.
+        // Se il leader e' fermo (coda lunga, stampante lenta) si interroga la stampante senza
+        // prendere il suo posto: la voce resta sua e la sua risposta servira' le richieste successive
+        DWORD trascorsi = GetTickCount() - inizio_attesa;
+        if (trascorsi >= attesa_max_ms) {
+            LeaveCriticalSection(&cs_cache);
+            InterlockedIncrement(&cont_miss);
+            return CACHE_NON_CACHEABILE;
+        }
+        in_attesa = TRUE;
+        SleepConditionVariableCS(&cv_cache, &cs_cache, attesa_max_ms - trascorsi);
+    }
+
+    // Nessuna risposta valida: il chiamante diventa il leader per questo comando
+    voce->stato = VOCE_IN_VOLO;
+    voce->generazione = generazione;
+    LeaveCriticalSection(&cs_cache);
+    InterlockedIncrement(&cont_miss);
+    return CACHE_LEADER;
+}
+
+BOOL cache_comando_cacheabile(const char* comando, int comando_len) {
+    if (!cache_pronta) return FALSE;
+
+    EnterCriticalSection(&cs_cache);
+    BOOL cacheabile = trova_voce(comando, comando_len) != NULL;
+    LeaveCriticalSection(&cs_cache);
+    return cacheabile;
+}
+
+// Ritorna TRUE se la risposta puo' essere servita ad altri client: un pacchetto completo con CHK
+// corretto (dopo eventuali ACK) che non e' un errore. Una risposta parziale per una lettura
+// scaduta, o corrotta sulla linea, resterebbe in cache per l'intero TTL.
+static BOOL risposta_memorizzabile(const char** risposta, int* risposta_len) {
+    VistaPacchetto pacchetto;
+    if (!pacchetto_risposta_positiva(*risposta, *risposta_len, &pacchetto)) return FALSE;
+    *risposta = pacchetto.byte;
+    *risposta_len = pacchetto.lunghezza;
+    return TRUE;
+}
+
+void cache_pubblica(const char* comando, int comando_len, const char* risposta, int risposta_len) {
+    if (!cache_pronta) return;
+
+    EnterCriticalSection(&cs_cache);
+    VoceCache* voce = trova_voce(comando, comando_len);
+    if (voce != NULL && voce->stato == VOCE_IN_VOLO) {
+        // Una risposta arrivata dopo un'invalidazione potrebbe descrivere uno stato superato: non la si memorizza
+        if (risposta_memorizzabile(&risposta, &risposta_len) && risposta_len <= CACHE_MAX_RISPOSTA && voce->generazione == generazione) {
+            memcpy(voce->risposta, risposta, (size_t)risposta_len);
+            voce->risposta_len = risposta_len;
+            voce->timestamp = GetTickCount();
+            voce->stato = VOCE_VALIDA;
+        } else {
+            voce->stato = VOCE_VUOTA;
+        }
+    }
+    LeaveCriticalSection(&cs_cache);
+    WakeAllConditionVariable(&cv_cache);
+}
+
+void cache_invalida(void) {
+    if (!cache_pronta) return;
+
+    EnterCriticalSection(&cs_cache);
+    generazione++;
+    for (int i = 0; i < num_voci; i++) {
+        if (voci[i].stato == VOCE_VALIDA) voci[i].stato = VOCE_VUOTA;
+    }
+    LeaveCriticalSection(&cs_cache);
+}
+
+void cache_statistiche(LONG* hit, LONG* miss, LONG* coalescenti) {
+    if (hit) *hit = cont_hit;
+    if (miss) *miss = cont_miss;
+    if (coalescenti) *coalescenti = cont_coalescenti;
+}
+
+void cache_cleanup(void) {
+    if (cache_pronta) {
+        DeleteCriticalSection(&cs_cache);
+        cache_pronta = FALSE;
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef CACHE_RISPOSTE_H
+#define CACHE_RISPOSTE_H
+
+#include <windows.h>
+
+// Comandi di sola lettura serviti dalla cache se non diversamente configurato.
+#define CACHE_COMANDI_DEFAULT "<?s,<?d"
+#define CACHE_TTL_MS 1000          // Validita' di una risposta in cache (ms)
+#define CACHE_MAX_VOCI 16          // Numero massimo di comandi in allowlist
+#define CACHE_MAX_COMANDO 32       // Lunghezza massima di un comando cacheabile
+#define CACHE_MAX_RISPOSTA 1024    // Dimensione massima di una risposta memorizzata
+
+// Esito della richiesta alla cache.
+typedef enum {
+    CACHE_NON_CACHEABILE = 0, // Comando fuori allowlist o attesa della richiesta in volo scaduta: va alla stampante
+    CACHE_HIT,                // Risposta copiata dalla cache (o dalla richiesta in volo)
+    CACHE_LEADER              // Il chiamante deve interrogare la stampante e poi chiamare cache_pubblica()
+} EsitoCache;
+
+// Inizializza la cache con una lista di comandi separati da virgola (es. "<?s,<?d").
+// Una lista vuota disabilita la cache.
+void cache_init(const char* allowlist, DWORD ttl_ms);
+
+// Cerca la risposta per il comando. Se un'altra sessione sta gia' interrogando
+// la stampante per lo stesso comando, attende il suo risultato invece di duplicare la richiesta;
+// trascorsi attesa_max_ms ritorna CACHE_NON_CACHEABILE e il chiamante interroga da se' la stampante.
+EsitoCache cache_acquisisci(const char* comando, int comando_len, char* risposta, int max_risposta_len, int* risposta_len, DWORD attesa_max_ms);
+
+// Ritorna TRUE se il comando e' nella allowlist della cache.
+BOOL cache_comando_cacheabile(const char* comando, int comando_len);
+
+// Pubblica la risposta ottenuta dal leader e sveglia le sessioni in attesa. Viene memorizzata solo
+// una risposta positiva e valida (pacchetto completo, CHK corretto); altrimenti, come con
+// risposta_len <= 0, la voce viene scartata e le sessioni in attesa riprovano.
+void cache_pubblica(const char* comando, int comando_len, const char* risposta, int risposta_len);
+
+// Invalida tutte le risposte memorizzate (da chiamare per ogni comando che modifica lo stato).
+void cache_invalida(void);
+
+// Restituisce i contatori di utilizzo della cache.
+void cache_statistiche(LONG* hit, LONG* miss, LONG* coalescenti);
+
+// Rilascia le risorse della cache.
+void cache_cleanup(void);
+
+#endif // CACHE_RISPOSTE_H
@@ -0,0 +1,235 @@
+#include "cattura.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ALLINEA_CATTURA(n) (((n) + 7) & ~(size_t)7)
+
+// Slot del buffer circolare: coda limitata a piu' produttori senza lock. Ogni slot ha un numero
+// di sequenza che indica chi puo' usarlo: == posizione libero per il produttore,
+// == posizione + 1 pronto per lo scrittore, che lo restituisce con posizione + CATTURA_NUM_SLOT.
+typedef struct {
+    volatile LONG64 sequenza;
+    IntestazioneRecordCattura intestazione;
+    char dati[CATTURA_MAX_DATI];
+} SlotCattura;
+
+static SlotCattura slot[CATTURA_NUM_SLOT];
+static volatile LONG64 posizione_produttori = 0;
+static LONG64 posizione_scrittore = 0;
+
+static volatile BOOL abilitata = FALSE;
+static volatile BOOL attiva = FALSE;           // Thread di scrittura in esecuzione
+static HANDLE h_file = INVALID_HANDLE_VALUE;
+static HANDLE h_thread_scrittura = NULL;
+static HANDLE evento_dati = NULL;
+
+// Blocco corrente, riscritto su file a ogni scrittura finche' non e' pieno
+static unsigned char blocco[CATTURA_DIMENSIONE_BLOCCO];
+static BOOL blocco_modificato = FALSE;
+
+static volatile LONG cont_catturati = 0;
+static volatile LONG cont_scartati = 0;
+static volatile LONG cont_troncati = 0;
+
+static void nuovo_blocco(unsigned long long sequenza) {
+    IntestazioneBloccoCattura* b = (IntestazioneBloccoCattura*)blocco;
+    memset(b, 0, sizeof(*b));
+    b->magia = CATTURA_MAGIA_BLOCCO;
+    b->versione = CATTURA_VERSIONE;
+    b->sequenza = sequenza;
+    b->usati = sizeof(IntestazioneBloccoCattura);
+}
+
+static void scrivi_blocco(void) {
+    IntestazioneBloccoCattura* b = (IntestazioneBloccoCattura*)blocco;
+    LARGE_INTEGER offset;
+    offset.QuadPart = (LONGLONG)(b->sequenza % CATTURA_NUM_BLOCCHI) * CATTURA_DIMENSIONE_BLOCCO;
+    DWORD scritti;
+    SetFilePointerEx(h_file, offset, NULL, FILE_BEGIN);
+    WriteFile(h_file, blocco, b->usati, &scritti, NULL);
+    blocco_modificato = FALSE;
+}
+
+// Trova il blocco piu' recente di un file esistente: la cattura riprende dal successivo
+static unsigned long long prossimo_blocco_su_file(void) {
+    unsigned long long prossimo = 0;
+    for (int i = 0; i < CATTURA_NUM_BLOCCHI; i++) {
+        IntestazioneBloccoCattura b;
+        DWORD letti = 0;
+        LARGE_INTEGER offset;
+        offset.QuadPart = (LONGLONG)i * CATTURA_DIMENSIONE_BLOCCO;
+        if (!SetFilePointerEx(h_file, offset, NULL, FILE_BEGIN) || !ReadFile(h_file, &b, sizeof(b), &letti, NULL) || letti < sizeof(b)) break;
+        if (b.magia == CATTURA_MAGIA_BLOCCO && b.sequenza + 1 > prossimo) prossimo = b.sequenza + 1;
+    }
+    return prossimo;
+}
+
+// Copia nel blocco corrente i frame pronti nel buffer circolare
+static void svuota_slot(void) {
+    IntestazioneBloccoCattura* b = (IntestazioneBloccoCattura*)blocco;
+    for (;;) {
+        SlotCattura* s = &slot[posizione_scrittore & (CATTURA_NUM_SLOT - 1)];
+        if (s->sequenza != posizione_scrittore + 1) break; // Nessun frame pronto
+
+        size_t totale = ALLINEA_CATTURA(sizeof(IntestazioneRecordCattura) + s->intestazione.lunghezza);
+        if (b->usati + totale > CATTURA_DIMENSIONE_BLOCCO) {
+            scrivi_blocco();
+            nuovo_blocco(b->sequenza + 1);
+        }
+        unsigned char* destinazione = blocco + b->usati;
+        memcpy(destinazione, &s->intestazione, sizeof(IntestazioneRecordCattura));
+        memcpy(destinazione + sizeof(IntestazioneRecordCattura), s->dati, s->intestazione.lunghezza);
+        memset(destinazione + sizeof(IntestazioneRecordCattura) + s->intestazione.lunghezza, 0,
+               totale - sizeof(IntestazioneRecordCattura) - s->intestazione.lunghezza);
+        b->usati += (unsigned int)totale;
+        blocco_modificato = TRUE;
+
+        // Restituisce lo slot ai produttori per il giro successivo
+        InterlockedExchange64(&s->sequenza, posizione_scrittore + CATTURA_NUM_SLOT);
+        posizione_scrittore++;
+    }
+}
+
+static DWORD WINAPI thread_scrittura(LPVOID lpParam) {
+    (void)lpParam;
+    while (attiva) {
+        WaitForSingleObject(evento_dati, CATTURA_INTERVALLO_SCRITTURA_MS);
+        svuota_slot();
+        if (blocco_modificato) scrivi_blocco();
+    }
+    svuota_slot();
+    if (blocco_modificato) scrivi_blocco();
+    return 0;
+}
+
+BOOL cattura_init(const char* percorso) {
+    for (LONG64 i = 0; i < CATTURA_NUM_SLOT; i++) slot[i].sequenza = i;
+
+    h_file = CreateFileA(percorso, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h_file == INVALID_HANDLE_VALUE) return FALSE;
+    nuovo_blocco(prossimo_blocco_su_file());
+
+    evento_dati = CreateEvent(NULL, FALSE, FALSE, NULL);
+    attiva = TRUE;
+    h_thread_scrittura = CreateThread(NULL, 0, thread_scrittura, NULL, 0, NULL);
+    if (h_thread_scrittura == NULL) {
+        attiva = FALSE;
+        CloseHandle(evento_dati);
+        CloseHandle(h_file);
+        evento_dati = NULL;
+        h_file = INVALID_HANDLE_VALUE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void cattura_abilita(BOOL stato) {
+    abilitata = stato && attiva;
+}
+
+BOOL cattura_abilitata(void) {
+    return abilitata;
+}
+
+void cattura_frame(DirezioneCattura direzione, int session_id, const char* dati, int lunghezza) {
+    if (!abilitata || lunghezza <= 0) return;
+
+    // Prenota uno slot: se lo scrittore non lo ha ancora liberato il buffer e' pieno
+    LONG64 posizione;
+    SlotCattura* s;
+    for (;;) {
+        posizione = posizione_produttori;
+        s = &slot[posizione & (CATTURA_NUM_SLOT - 1)];
+        LONG64 sequenza = s->sequenza;
+        if (sequenza < posizione) {
+            InterlockedIncrement(&cont_scartati);
+            return;
+        }
+        if (sequenza == posizione && InterlockedCompareExchange64(&posizione_produttori, posizione + 1, posizione) == posizione) break;
+    }
+
+    int catturati = lunghezza > CATTURA_MAX_DATI ? CATTURA_MAX_DATI : lunghezza;
+    if (catturati < lunghezza) InterlockedIncrement(&cont_troncati);
+    FILETIME adesso;
+    GetSystemTimeAsFileTime(&adesso);
+    memset(&s->intestazione, 0, sizeof(s->intestazione));
+    s->intestazione.timestamp = ((unsigned long long)adesso.dwHighDateTime << 32) | adesso.dwLowDateTime;
+    s->intestazione.session_id = session_id;
+    s->intestazione.lunghezza = (unsigned short)catturati;
+    s->intestazione.lunghezza_originale = (unsigned short)(lunghezza > 0xFFFF ? 0xFFFF : lunghezza);
+    s->intestazione.direzione = (unsigned char)direzione;
+    memcpy(s->dati, dati, (size_t)catturati);
+    InterlockedExchange64(&s->sequenza, posizione + 1); // Pubblica lo slot allo scrittore
+    InterlockedIncrement(&cont_catturati);
+
+    // Ogni mezzo buffer di frame lo scrittore viene svegliato senza attendere l'intervallo
+    if ((posizione & (CATTURA_NUM_SLOT / 2 - 1)) == 0) SetEvent(evento_dati);
+}
+
+void cattura_statistiche(LONG* catturati, LONG* scartati, LONG* troncati) {
+    if (catturati) *catturati = cont_catturati;
+    if (scartati) *scartati = cont_scartati;
+    if (troncati) *troncati = cont_troncati;
+}
+
+static int confronta_blocchi(const void* a, const void* b) {
+    unsigned long long sa = (*(const IntestazioneBloccoCattura* const*)a)->sequenza;
+    unsigned long long sb = (*(const IntestazioneBloccoCattura* const*)b)->sequenza;
+    return sa < sb ? -1 : (sa > sb ? 1 : 0);
+}
+
+long cattura_leggi_file(const char* percorso, VisitaFrameCattura visita, void* contesto) {
+    FILE* f = fopen(percorso, "rb");
+    if (f == NULL) return -1;
+
+    unsigned char* contenuto = (unsigned char*)malloc((size_t)CATTURA_NUM_BLOCCHI * CATTURA_DIMENSIONE_BLOCCO);
+    if (contenuto == NULL) {
+        fclose(f);
+        return -1;
+    }
+    size_t letti = fread(contenuto, 1, (size_t)CATTURA_NUM_BLOCCHI * CATTURA_DIMENSIONE_BLOCCO, f);
+    fclose(f);
+
+    // L'ordine cronologico e' quello dei numeri di sequenza, non la posizione nel file circolare
+    IntestazioneBloccoCattura* blocchi[CATTURA_NUM_BLOCCHI];
+    int num_blocchi = 0;
+    for (size_t offset = 0; offset + sizeof(IntestazioneBloccoCattura) <= letti; offset += CATTURA_DIMENSIONE_BLOCCO) {
+        IntestazioneBloccoCattura* b = (IntestazioneBloccoCattura*)(contenuto + offset);
+        if (b->magia != CATTURA_MAGIA_BLOCCO || b->versione != CATTURA_VERSIONE) continue;
+        if (b->usati > CATTURA_DIMENSIONE_BLOCCO || offset + b->usati > letti) continue;
+        blocchi[num_blocchi++] = b;
+    }
+    qsort(blocchi, (size_t)num_blocchi, sizeof(blocchi[0]), confronta_blocchi);
+
+    long frame = 0;
+    for (int i = 0; i < num_blocchi; i++) {
+        const unsigned char* base = (const unsigned char*)blocchi[i];
+        size_t pos = sizeof(IntestazioneBloccoCattura);
+        while (pos + sizeof(IntestazioneRecordCattura) <= blocchi[i]->usati) {
+            const IntestazioneRecordCattura* r = (const IntestazioneRecordCattura*)(base + pos);
+            size_t totale = ALLINEA_CATTURA(sizeof(IntestazioneRecordCattura) + r->lunghezza);
+            if (pos + totale > blocchi[i]->usati) break;
+            if (visita) visita(r, base + pos + sizeof(IntestazioneRecordCattura), contesto);
+            frame++;
+            pos += totale;
+        }
+    }
+    free(contenuto);
+    return frame;
+}
+
+void cattura_cleanup(void) {
+    if (h_thread_scrittura == NULL) return;
+
+    abilitata = FALSE;
+    attiva = FALSE;
+    SetEvent(evento_dati);
+    WaitForSingleObject(h_thread_scrittura, INFINITE);
+    CloseHandle(h_thread_scrittura);
+    CloseHandle(evento_dati);
+    CloseHandle(h_file);
+    h_thread_scrittura = NULL;
+    evento_dati = NULL;
+    h_file = INVALID_HANDLE_VALUE;
+}
@@ -0,0 +1,68 @@
+#ifndef CATTURA_H
+#define CATTURA_H
+
+#include <windows.h>
+
+#define CATTURA_FILE_DEFAULT "cattura.bin"     // File circolare delle catture
+#define CATTURA_DIMENSIONE_BLOCCO 65536        // I record non attraversano mai i blocchi
+#define CATTURA_NUM_BLOCCHI 256                // 16 MB: raggiunta la fine si sovrascrive il blocco piu' vecchio
+#define CATTURA_NUM_SLOT 1024                  // Slot del buffer in memoria (potenza di 2)
+#define CATTURA_MAX_DATI 512                   // Byte catturati per frame, i frame piu' lunghi vengono troncati
+#define CATTURA_INTERVALLO_SCRITTURA_MS 100    // Intervallo massimo prima che un frame arrivi su file
+
+#define CATTURA_MAGIA_BLOCCO 0x54504143UL      // "CAPT"
+#define CATTURA_VERSIONE 1
+
+// Direzione del frame catturato
+typedef enum {
+    CATTURA_DA_CLIENT = 1,      // Dati ricevuti dal client
+    CATTURA_A_CLIENT = 2,       // Risposta inviata al client
+    CATTURA_A_STAMPANTE = 3,    // Pacchetto inviato alla stampante
+    CATTURA_DA_STAMPANTE = 4    // Risposta della stampante
+} DirezioneCattura;
+
+// Formato su file, condiviso con il decodificatore: ogni blocco inizia con IntestazioneBloccoCattura
+// seguita da record (IntestazioneRecordCattura + dati) allineati a 8 byte.
+typedef struct {
+    unsigned int magia;
+    unsigned short versione;
+    unsigned short riservato;
+    unsigned long long sequenza;         // Numero progressivo del blocco (ordine cronologico)
+    unsigned int usati;                  // Byte occupati nel blocco, intestazione compresa
+    unsigned int riservato2;
+} IntestazioneBloccoCattura;
+
+typedef struct {
+    unsigned long long timestamp;        // FILETIME (100 ns dal 1601, UTC)
+    int session_id;
+    unsigned short lunghezza;            // Byte catturati
+    unsigned short lunghezza_originale;  // Byte del frame (maggiore di lunghezza se troncato)
+    unsigned char direzione;             // DirezioneCattura
+    unsigned char riservato[7];
+} IntestazioneRecordCattura;
+
+// Prepara il buffer di cattura e il file (la cattura parte disabilitata).
+BOOL cattura_init(const char* percorso);
+
+// Abilita o disabilita la cattura durante l'esecuzione.
+void cattura_abilita(BOOL abilitata);
+
+// Ritorna TRUE se la cattura e' abilitata.
+BOOL cattura_abilitata(void);
+
+// Cattura un frame. Non blocca mai: se il buffer e' pieno il frame viene scartato e conteggiato.
+void cattura_frame(DirezioneCattura direzione, int session_id, const char* dati, int lunghezza);
+
+// Restituisce i contatori della cattura.
+void cattura_statistiche(LONG* catturati, LONG* scartati, LONG* troncati);
+
+// Scrive i frame pendenti e chiude il file.
+void cattura_cleanup(void);
+
+typedef void (*VisitaFrameCattura)(const IntestazioneRecordCattura* record, const unsigned char* dati, void* contesto);
+
+// Legge un file di cattura chiamando visita per ogni frame, in ordine cronologico.
+// Ritorna il numero di frame letti, -1 se il file non e' leggibile.
+long cattura_leggi_file(const char* percorso, VisitaFrameCattura visita, void* contesto);
+
+#endif // CATTURA_H
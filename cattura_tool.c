@@ -0,0 +1,94 @@
+/*
+ * File: cattura_tool.c
+ * Descrizione: Decodificatore offline del file di cattura del server
+ *              Stampa i frame in ordine cronologico con ora, sessione e direzione; i pacchetti
+ *              del protocollo vengono scomposti in STX / adds / len / dati / pack_id / CHK / ETX
+ *              con la verifica del checksum.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+#include "cattura.h"
+#include "pacchetto.h"
+
+static const char* nome_direzione(unsigned char direzione) {
+    switch (direzione) {
+        case CATTURA_DA_CLIENT:    return "CLIENT -> GW   ";
+        case CATTURA_A_CLIENT:     return "GW -> CLIENT   ";
+        case CATTURA_A_STAMPANTE:  return "GW -> STAMPANTE";
+        case CATTURA_DA_STAMPANTE: return "STAMPANTE -> GW";
+        default:                   return "?              ";
+    }
+}
+
+// Stampa i dati come testo, sostituendo i caratteri di controllo con <XX>
+static void stampa_testo(const unsigned char* dati, int lunghezza) {
+    for (int i = 0; i < lunghezza; i++) {
+        if (dati[i] >= 32 && dati[i] <= 126) putchar(dati[i]); else printf("<%02X>", dati[i]);
+    }
+}
+
+// Scompone un pacchetto [STX][adds 2][len 3][N][dati][pack_id][CHK 2][ETX].
+// Ritorna il numero di byte consumati, 0 se i dati non iniziano con un pacchetto completo.
+static int decodifica_pacchetto(const unsigned char* p, int disponibili) {
+    if (disponibili < PACCHETTO_CORNICE || p[0] != PACCHETTO_STX) return 0;
+    for (int i = 3; i < 6; i++) if (p[i] < '0' || p[i] > '9') return 0;
+    int len = (p[3] - '0') * 100 + (p[4] - '0') * 10 + (p[5] - '0');
+    int totale = len + PACCHETTO_CORNICE;
+    if (totale > disponibili || p[totale - 1] != PACCHETTO_ETX) return 0;
+
+    printf("STX adds=%c%c len=%03d tipo=%c dati='", p[1], p[2], len, p[6]);
+    stampa_testo(p + 7, len);
+    printf("' pack_id=%c CHK=%c%c ", p[7 + len], p[8 + len], p[9 + len]);
+    // pacchetto_valido verifica anche il tipo 'N': un tipo diverso viene segnalato come CHK errato
+    if (pacchetto_valido((const char*)p, totale)) printf("(ok) ETX"); else printf("(ERRATO) ETX");
+    return totale;
+}
+
+static void stampa_record(const IntestazioneRecordCattura* r, const unsigned char* dati) {
+    FILETIME utc, locale;
+    SYSTEMTIME st;
+    utc.dwLowDateTime = (DWORD)(r->timestamp & 0xFFFFFFFFu);
+    utc.dwHighDateTime = (DWORD)(r->timestamp >> 32);
+    FileTimeToLocalFileTime(&utc, &locale);
+    FileTimeToSystemTime(&locale, &st);
+    printf("%02d:%02d:%02d.%03d%03d  sess %-7d %s  ", st.wHour, st.wMinute, st.wSecond, st.wMilliseconds,
+           (int)((r->timestamp / 10) % 1000), r->session_id, nome_direzione(r->direzione));
+
+    // Un frame puo' contenere piu' pacchetti o righe di testo: si decodifica quel che si riconosce
+    int pos = 0;
+    while (pos < r->lunghezza) {
+        int consumati = decodifica_pacchetto(dati + pos, r->lunghezza - pos);
+        if (consumati == 0) {
+            const unsigned char* stx = memchr(dati + pos + 1, 0x02, (size_t)(r->lunghezza - pos - 1));
+            consumati = stx ? (int)(stx - (dati + pos)) : r->lunghezza - pos;
+            printf("\"");
+            stampa_testo(dati + pos, consumati);
+            printf("\"");
+        }
+        pos += consumati;
+        if (pos < r->lunghezza) printf(" | ");
+    }
+    if (r->lunghezza < r->lunghezza_originale) printf(" [troncato: %d di %d byte]", r->lunghezza, r->lunghezza_originale);
+    printf("\n");
+}
+
+static void visita_frame(const IntestazioneRecordCattura* record, const unsigned char* dati, void* contesto) {
+    (void)contesto;
+    stampa_record(record, dati);
+}
+
+int main(int argc, char* argv[]) {
+    const char* percorso = argc >= 2 ? argv[1] : CATTURA_FILE_DEFAULT;
+    long frame = cattura_leggi_file(percorso, visita_frame, NULL);
+    if (frame < 0) {
+        printf("Impossibile leggere il file di cattura %s.\n", percorso);
+        printf("Uso: %s [file cattura]\n", argv[0]);
+        return 1;
+    }
+    printf("%ld frame.\n", frame);
+    return 0;
+}
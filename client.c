@@ -22,6 +22,9 @@
 #define SEPARATOR "------------------------------------------------------------"
 #define SEPARATOR_COLOR 8 // Grigio scuro (per linee di separazione)
 
+// Attesa massima di una risposta dal server (le stampe lunghe possono richiedere decine di secondi)
+#define TIMEOUT_RISPOSTA_MS 45000
+
 // Inclusione delle librerie necessarie
 #define __STDC_WANT_LIB_EXT1__ 1  // Richiesto per usare strtok_s (versione sicura di strtok)
 #include <stdio.h>      // Input/Output standard (printf, scanf, ecc.)
@@ -31,6 +34,7 @@
 #include <windows.h>    // Funzioni specifiche di Windows (colori console, ecc.)
 #include <stdlib.h>     // Funzioni di utilità generale (malloc, free, system, ecc.)
 #include "error_table.h"     // Definizione e gestione centralizzata dei codici di errore
+#include "connessione.h"     // Connessione persistente al server con invio dei comandi in pipeline
 
 // Dichiarazione esplicita di strtok_s per compatibilità con alcuni compilatori (es. MinGW)
 char* strtok_s(char* str, const char* delim, char** context);
@@ -44,6 +48,7 @@ void print_separator(); // Stampa una linea di separazione colorata
 void print_colored(const char* msg, int color); // Stampa un messaggio con un colore specifico
 void mostra_stato(const char* comando, const char* risposta, int successo); // Mostra l'esito di un'operazione
 void stampa_risposta_server(char* campo_dati); // Stampa la risposta ricevuta dal server in modo formattato
+void mostra_risposta(const char* risposta, int risposta_len, EsitoFrame esito); // Estrae il campo dati e lo stampa
 
 /*
  * Funzioni di utilità per l'interfaccia utente
@@ -167,10 +172,8 @@ void mostra_conferma_comando(const char* comando) {
 
 int main() {
     WSADATA wsa; // Struttura che contiene informazioni sulla versione di Winsock
-    SOCKET sock; // Variabile per il socket
-    struct sockaddr_in server; // Struttura per l'indirizzo del server
-    char message[1024], server_reply[1024] = {0}; // Buffer per messaggi e risposte
-    int recv_size = 0;  // Dichiara qui per renderla accessibile in tutto il main
+    Connessione conn; // Connessione persistente al server, usata da tutte le modalita'
+    char message[1024]; // Comando digitato dall'utente
 
     char ip_server[64] = "10.0.70.11";
     char porta_str[16] = "9999";
@@ -224,41 +227,19 @@ int main() {
         return 1;
     }
  
-    // Crea un socket TCP (SOCK_STREAM) IPv4 (AF_INET)
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == INVALID_SOCKET) {
-        set_color(12);
-        printf("[X] Errore creazione socket: %d\n", WSAGetLastError());
-        set_color(7);
-        WSACleanup();
-        return 1;
-    }
- 
-    // Imposta l'indirizzo IP e la porta del server a cui connettersi
-    server.sin_addr.s_addr = inet_addr(ip_server); // Converte stringa IP in formato binario
-    server.sin_family = AF_INET; // Famiglia di indirizzi IPv4
-    server.sin_port = htons(porta); // Converte la porta in formato network byte order
-    
-    // Imposta un timeout di connessione di 5 secondi
-    DWORD timeout = 5000; // 5 secondi in millisecondi
-    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
-    
     // Stampa informazioni di debug sulla connessione
     printf("\n[DEBUG] Tentativo di connessione a %s:%d...\n", ip_server, porta);
     
-    // Prova a connetterti al server
-    if (connect(sock, (struct sockaddr*)&server, sizeof(server)) < 0) {
+    // Prova a connetterti al server (timeout di connessione e di invio di 5 secondi)
+    if (!conn_apri(&conn, ip_server, porta, 5000)) {
         printf("[DEBUG] Errore connessione: %d\n", WSAGetLastError());
-        closesocket(sock);
         WSACleanup();
         return 1;
     }
     
     printf("[DEBUG] Connessione stabilita con successo\n");
     
-    // Imposta il socket in modalità non bloccante
-    u_long mode = 1;
-    ioctlsocket(sock, FIONBIO, &mode);
+    // Il socket resta bloccante: conn_ricevi attende le risposte con WSAPoll, senza tentativi a vuoto
 
     set_color(10); // Verde
     printf("[OK] Connesso al server.\n");
@@ -337,54 +318,31 @@ int main() {
                 }
 
                 if (strcmp(rele_cmd, "feed") == 0) {
-                    SOCKET sock_temp = socket(AF_INET, SOCK_STREAM, 0);
-                    if (sock_temp == INVALID_SOCKET) {
+                    // FEED viaggia sulla connessione principale: la risposta arriva dopo l'impulso del rele
+                    if (!conn_invia(&conn, "FEED")) {
                         set_color(COLOR_ERROR);
-                        printf("[X] Errore creazione socket temporaneo: %d\n", WSAGetLastError());
+                        printf("[X] Errore durante l'invio del comando 'FEED': %d.\n", WSAGetLastError());
                         set_color(COLOR_DEFAULT);
                         continue;
                     }
-
-                    struct sockaddr_in server_temp;
-                    server_temp.sin_addr.s_addr = inet_addr(ip_server);
-                    server_temp.sin_family = AF_INET;
-                    server_temp.sin_port = htons(porta);
-
-                    if (connect(sock_temp, (struct sockaddr*)&server_temp, sizeof(server_temp)) < 0) {
-                        set_color(COLOR_ERROR);
-                        printf("[X] Errore connessione temporanea al server: %d\n", WSAGetLastError());
-                        closesocket(sock_temp);
-                        continue;
-                    }
-
-                    char to_send[32];
-                    snprintf(to_send, sizeof(to_send), "FEED\r\n");
-                    
-                    if (send(sock_temp, to_send, (int)strlen(to_send), 0) < 0) {
-                        set_color(COLOR_ERROR);
-                        printf("[X] Errore durante l'invio del comando 'FEED': %d.\n", WSAGetLastError());
-                    } else {
-                        // Ora attendiamo una possibile risposta (errore) dal server
-                        char server_reply[256];
-                        DWORD timeout = 500; // Mezzo secondo di timeout
-                        setsockopt(sock_temp, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
-                        int recv_size = recv(sock_temp, server_reply, sizeof(server_reply) - 1, 0);
-
-                        if (recv_size > 0) {
-                            server_reply[recv_size] = '\0';
-                            // Controlla se la risposta è un messaggio di successo o un errore
-                            if (strncmp(server_reply, "OK:", 3) == 0) {
-                                set_color(COLOR_SUCCESS);
-                                printf("Risposta dal server: %s", server_reply);
-                            } else {
-                                set_color(COLOR_ERROR);
-                                printf("Errore dal server: %s", server_reply);
-                            }
-                            set_color(COLOR_DEFAULT);
+                    char feed_reply[256];
+                    EsitoFrame feed_esito;
+                    int feed_len = conn_ricevi(&conn, feed_reply, sizeof(feed_reply), &feed_esito, TIMEOUT_RISPOSTA_MS);
+                    if (feed_len > 0) {
+                        // Controlla se la risposta è un messaggio di successo o un errore
+                        if (strncmp(feed_reply, "OK:", 3) == 0) {
+                            set_color(COLOR_SUCCESS);
+                            printf("Risposta dal server: %s\n", feed_reply);
+                        } else {
+                            set_color(COLOR_ERROR);
+                            printf("Errore dal server: %s\n", feed_reply);
                         }
+                        set_color(COLOR_DEFAULT);
+                    } else {
+                        set_color(COLOR_ERROR);
+                        printf("[X] Nessuna risposta dal server al comando 'FEED'.\n");
+                        set_color(COLOR_DEFAULT);
                     }
-                    
-                    closesocket(sock_temp);
                 } else {
                     set_color(COLOR_WARNING);
                     printf("Comando non riconosciuto: '%s'. Comandi validi: 'feed', 'exit'.\n", rele_cmd);
@@ -394,10 +352,12 @@ int main() {
             continue; // Torna all'inizio del loop principale per chiedere un nuovo comando
         }
 
-        // Modalità multi-comando: raccogli tutti i comandi, poi inviali in sequenza (nuova connessione per ogni comando)
+        // Modalità multi-comando: raccogli tutti i comandi, poi inviali in pipeline sulla connessione
+        // principale e leggi le risposte, che il server restituisce nell'ordine dei comandi
         if (strcmp(message, "multi") == 0) {
             #define MAX_MULTI 50
             char multi_cmds[MAX_MULTI][1024];
+            const char* lotto[MAX_MULTI];
             int n_multi = 0;
             while (n_multi < MAX_MULTI) {
                 printf("> ");
@@ -405,234 +365,84 @@ int main() {
                 if (fgets(multi_cmds[n_multi], sizeof(multi_cmds[n_multi]), stdin) == NULL) break;
                 multi_cmds[n_multi][strcspn(multi_cmds[n_multi], "\n")] = 0;
                 if (strlen(multi_cmds[n_multi]) == 0) break; // riga vuota = fine batch
+                lotto[n_multi] = multi_cmds[n_multi];
                 n_multi++;
             }
-            for (int i = 0; i < n_multi; ++i) {
-                // --- Riapri connessione per ogni comando ---
-                SOCKET sock_multi;
-                struct sockaddr_in server_multi;
-                sock_multi = socket(AF_INET, SOCK_STREAM, 0);
-                if (sock_multi == INVALID_SOCKET) {
-                    set_color(COLOR_ERROR);
-                    printf("[X] Errore creazione socket: %d\n", WSAGetLastError());
-                    set_color(COLOR_DEFAULT);
-                    continue;
-                }
-                server_multi.sin_addr.s_addr = inet_addr(ip_server);
-                server_multi.sin_family = AF_INET;
-                server_multi.sin_port = htons(porta);
-                if (connect(sock_multi, (struct sockaddr*)&server_multi, sizeof(server_multi)) < 0) {
-                    set_color(COLOR_ERROR);
-                    printf("[X] Errore connessione: %d\n", WSAGetLastError());
-                    set_color(COLOR_DEFAULT);
-                    closesocket(sock_multi);
-                    continue;
-                }
-                char to_send[1024];
-                int sent;
-                snprintf(to_send, sizeof(to_send), "%s\r\n", multi_cmds[i]);
-#ifdef DEBUG_PROTOCOL
-                printf("[DEBUG] Invio comando (multi #%d): %s\n", i+1, multi_cmds[i]);
-#endif
-                sent = send(sock_multi, to_send, (int)strlen(to_send), 0);
 #ifdef DEBUG_PROTOCOL
-                printf("[DEBUG] Bytes inviati: %d\n", sent);
+            printf("[DEBUG] Invio in pipeline di %d comandi\n", n_multi);
 #endif
-                if (sent < 0) {
-                    set_color(COLOR_ERROR);
-                    printf("[X] Errore invio messaggio: %d\n", WSAGetLastError());
-                    set_color(COLOR_DEFAULT);
-                    closesocket(sock_multi);
-                    continue;
-                }
-                memset(server_reply, 0, sizeof(server_reply));
-                int recv_size = recv(sock_multi, server_reply, sizeof(server_reply) - 1, 0);
-                if (recv_size <= 0) {
-                    set_color(COLOR_ERROR);
-                    printf("[X] Errore o connessione chiusa dal server.\n");
-                    set_color(COLOR_DEFAULT);
-                    closesocket(sock_multi);
-                    continue;
-                }
-                printf("Risposta dal server (multi #%d):\n", i+1);
-                set_color(10);
-                // Estrazione campo dati da pacchetto protocollo
-                char campo_dati[1024] = "";
-                int len = (int)strlen(server_reply);
-
-                if (len > 8 && (unsigned char)server_reply[0] == 0x02 && (unsigned char)server_reply[len-1] == 0x03) {
-                    // [STX][adds][len][N][dati][pack_id][CHK][ETX]
-                    int dati_len = ((server_reply[5]-'0')*100 + (server_reply[6]-'0')*10 + (server_reply[7]-'0'));
-                    if (dati_len > 0 && dati_len < (int)sizeof(campo_dati) && 8+dati_len <= len-3) {
-                        memcpy(campo_dati, &server_reply[9], dati_len);
-                        campo_dati[dati_len] = 0;
-                    } else {
-                        strncpy(campo_dati, server_reply, sizeof(campo_dati)-1);
-                        campo_dati[sizeof(campo_dati)-1] = 0;
-                    }
-                } else {
-                    strncpy(campo_dati, server_reply, sizeof(campo_dati)-1);
-                    campo_dati[sizeof(campo_dati)-1] = 0;
-                }
-                stampa_risposta_server(campo_dati);
-                closesocket(sock_multi);
-            } // End of for loop for multi_cmds
-
-            // --- Re-establish main connection after multi-commands ---
-            printf("[INFO] Re-establishing main connection with server...\n");
-            closesocket(sock); // Close the old main socket
-
-            sock = socket(AF_INET, SOCK_STREAM, 0);
-            if (sock == INVALID_SOCKET) {
+            int inviati = conn_invia_lotto(&conn, lotto, n_multi);
+            if (inviati < 0) {
                 set_color(COLOR_ERROR);
-                printf("[X] Errore creazione socket per riconnessione: %d\n", WSAGetLastError());
+                printf("[X] Errore invio messaggio: %d\n", WSAGetLastError());
                 set_color(COLOR_DEFAULT);
-                WSACleanup();
-                return 1; // Or handle error more gracefully
+                continue;
             }
-
-            // Server address structure is already set up (server.sin_addr, server.sin_family, server.sin_port)
-            // Attempt to reconnect
-            if (connect(sock, (struct sockaddr*)&server, sizeof(server)) < 0) {
-                set_color(COLOR_ERROR);
-                printf("[X] Errore riconnessione al server: %d\n", WSAGetLastError());
+            if (inviati < n_multi) {
+                set_color(COLOR_WARNING);
+                printf("[!] Lotto troppo grande: inviati solo i primi %d comandi.\n", inviati);
                 set_color(COLOR_DEFAULT);
-                closesocket(sock);
-                WSACleanup();
-                return 1; // Or handle error more gracefully
             }
-
-            // Set the new socket to non-blocking mode
-            u_long mode = 1; // Non-blocking mode
-            if (ioctlsocket(sock, FIONBIO, &mode) != 0) {
-                set_color(COLOR_ERROR);
-                printf("[X] Errore impostazione socket non bloccante dopo riconnessione: %d\n", WSAGetLastError());
-                set_color(COLOR_DEFAULT);
-                closesocket(sock);
-                WSACleanup();
-                return 1; // Or handle error more gracefully
+            // Le risposte mancanti arriverebbero in ritardo e verrebbero lette come risposte ai
+            // comandi successivi: come per il comando singolo, la connessione viene chiusa
+            int connessione_persa = 0;
+            for (int i = 0; i < inviati; ++i) {
+                char risposta[1024];
+                EsitoFrame esito;
+                int risposta_len = conn_ricevi(&conn, risposta, sizeof(risposta), &esito, TIMEOUT_RISPOSTA_MS);
+                if (risposta_len <= 0) {
+                    set_color(COLOR_ERROR);
+                    if (risposta_len == 0) {
+                        printf("[X] Nessuna risposta dal server al comando multi #%d (%s) entro %d secondi. Uscita.\n", i+1, multi_cmds[i], TIMEOUT_RISPOSTA_MS / 1000);
+                    } else {
+                        printf("[X] Connessione chiusa o errore di ricezione al comando multi #%d: %d. Uscita.\n", i+1, WSAGetLastError());
+                    }
+                    set_color(COLOR_DEFAULT);
+                    conn_chiudi(&conn);
+                    connessione_persa = 1;
+                    break;
+                }
+                printf("Risposta dal server (multi #%d: %s):\n", i+1, multi_cmds[i]);
+                set_color(10);
+                mostra_risposta(risposta, risposta_len, esito);
             }
-            set_color(COLOR_SUCCESS);
-            printf("[OK] Riconnesso al server.\n");
-            set_color(COLOR_DEFAULT);
-            // --- End of re-establishment ---
-
+            if (connessione_persa) break;
             continue;
         }
 
-        char to_send[1024];
-        int sent;
-        snprintf(to_send, sizeof(to_send), "%s\r\n", message);
 #ifdef DEBUG_PROTOCOL
         printf("[DEBUG] Invio comando: %s\n", message);
 #endif
-        sent = send(sock, to_send, (int)strlen(to_send), 0);
-#ifdef DEBUG_PROTOCOL
-        printf("[DEBUG] Bytes inviati: %d\n", sent);
-#endif
-        if (sent < 0) {
+        if (!conn_invia(&conn, message)) {
             set_color(COLOR_ERROR);
             printf("[X] Errore invio messaggio: %d. Riprova.\n", WSAGetLastError());
             set_color(COLOR_DEFAULT);
             continue; // Skip to next command input if send fails
         }
 
-        // Ricevi la risposta dal server
-        int retries = 0;
-        const int MAX_RETRIES_RECV = 180; // Aumentato per gestire stampe lunghe
-        const int RETRY_DELAY_MS_RECV = 250; // Renamed for clarity
-
-        memset(server_reply, 0, sizeof(server_reply)); // Pulisci il buffer
-        recv_size = -1; // Initialize recv_size for this attempt
-
-        for (retries = 0; retries < MAX_RETRIES_RECV; ++retries) {
-            recv_size = recv(sock, server_reply, sizeof(server_reply) - 1, 0);
-            if (recv_size > 0) { // Dati ricevuti correttamente
-                break; // Esci dal ciclo di tentativi
-            }
-            if (recv_size == 0) { // Connessione chiusa dal server
-                break; // Esci dal ciclo di tentativi
-            }
-            // A questo punto, recv_size < 0 (errore)
-            if (WSAGetLastError() == WSAEWOULDBLOCK) {
-                if (retries < MAX_RETRIES_RECV - 1) { // Non attendere all'ultimo tentativo se fallisce
-                    // printf("[DEBUG] WSAEWOULDBLOCK su recv, tentativo %d di %d...\n", retries + 1, MAX_RETRIES_RECV);
-                    Sleep(RETRY_DELAY_MS_RECV); // Attendi prima del prossimo tentativo
-                    continue; // Prova di nuovo recv()
-                } else {
-                    // L'ultimo tentativo ha comunque dato WSAEWOULDBLOCK, esci per gestire l'errore
-                    break;
-                }
-            } else {
-                // Errore diverso da WSAEWOULDBLOCK, non ritentare
-                break; // Esci dal ciclo di tentativi
-            }
-        }
-
-        if (recv_size <= 0) {
+        // Ricevi la risposta dal server: il frame viene ricomposto anche se arriva in piu' segmenti
+        char risposta[1024];
+        EsitoFrame esito;
+        int risposta_len = conn_ricevi(&conn, risposta, sizeof(risposta), &esito, TIMEOUT_RISPOSTA_MS);
+        if (risposta_len <= 0) {
             set_color(COLOR_ERROR);
-            if (recv_size == 0) {
-                printf("[X] Connessione chiusa dal server. Uscita.\n");
+            if (risposta_len == 0) {
+                printf("[X] Nessuna risposta dal server entro %d secondi. Uscita.\n", TIMEOUT_RISPOSTA_MS / 1000);
             } else {
-                printf("[X] Errore ricezione dati: %d. Uscita.\n", WSAGetLastError());
+                printf("[X] Connessione chiusa o errore di ricezione: %d. Uscita.\n", WSAGetLastError());
             }
             set_color(COLOR_DEFAULT);
-            closesocket(sock);
-            sock = INVALID_SOCKET; // Evita riutilizzo
+            conn_chiudi(&conn); // Evita riutilizzo
             break; // Esci dal ciclo while(1)
         }
 
-        
-
         // Stampa la risposta in modo più leggibile
         printf("Risposta dal server:\n");
         set_color(10);
-        char campo_dati[1024] = "";
-        int parsed_correctly = 0;
-        int len = (int)strlen(server_reply);
-
-        // Check for minimal packet length (11 bytes: STX(1)+ADDS(2)+LUNGH_field(3)+PROT-ID(1)+PACK-ID(2)+CHK(1)+ETX(1) + 0 data bytes)
-        if (len >= 11 && (unsigned char)server_reply[0] == 0x02 && (unsigned char)server_reply[len-1] == 0x03) {
-            // Check PROT-ID (should be 'N' at index 6)
-            if (server_reply[6] == 'N') {
-                // Ensure LUNGH characters (indices 3,4,5) are digits
-                if (isdigit((unsigned char)server_reply[3]) && isdigit((unsigned char)server_reply[4]) && isdigit((unsigned char)server_reply[5])) {
-                    int dati_len_from_field = (server_reply[3] - '0') * 100 +
-                                              (server_reply[4] - '0') * 10  +
-                                              (server_reply[5] - '0');
-
-                    // Validate extracted DATI length against overall packet length
-                    // Expected total length = 7 (header up to DATI) + dati_len_from_field + 4 (trailer) = 11 + dati_len_from_field
-                    if (dati_len_from_field >= 0 && dati_len_from_field < (int)sizeof(campo_dati) && (11 + dati_len_from_field == len)) {
-                        memcpy(campo_dati, &server_reply[7], dati_len_from_field); // DATI starts at index 7
-                        campo_dati[dati_len_from_field] = '\0';
-                        parsed_correctly = 1;
-                    } else {
-                        // Optional: Log DATI length mismatch for debugging
-                        // printf("[DEBUG] Single cmd: DATI length mismatch. Field: %d, Calculated from total len: %d\n", dati_len_from_field, len - 11);
-                    }
-                } else {
-                    // Optional: Log LUNGH field non-digit for debugging
-                    // printf("[DEBUG] Single cmd: LUNGH field contains non-digit characters.\n");
-                }
-            } else {
-                // Optional: Log PROT-ID mismatch for debugging
-                // printf("[DEBUG] Single cmd: PROT-ID is not 'N'. Actual: %c\n", server_reply[6]);
-            }
-        }
-
-        if (!parsed_correctly) {
-            // If structured parsing failed, copy the raw reply for pattern matching in stampa_risposta_server
-            // printf("[DEBUG] Single cmd: Structured parsing of reply failed. Using raw reply for stampa_risposta_server.\n");
-            strncpy(campo_dati, server_reply, sizeof(campo_dati) - 1);
-            campo_dati[sizeof(campo_dati) - 1] = '\0';
-        }
-        stampa_risposta_server(campo_dati);
+        mostra_risposta(risposta, risposta_len, esito);
     }
     // Codice di pulizia e chiusura di main
-    if (sock != INVALID_SOCKET) {
-        closesocket(sock);
-    }
+    conn_chiudi(&conn);
     WSACleanup();
 
     set_color(COLOR_SUCCESS);
@@ -641,6 +451,18 @@ int main() {
     return 0;
 }
 
+// Estrae il campo dati da una risposta ricomposta dal decodificatore e la stampa
+void mostra_risposta(const char* risposta, int risposta_len, EsitoFrame esito) {
+    if (esito == FRAME_CHK_ERRATO) {
+        set_color(COLOR_WARNING);
+        printf("[!] Checksum del pacchetto errato: la risposta potrebbe essere corrotta.\n");
+        set_color(10);
+    }
+    char campo_dati[1024];
+    conn_campo_dati(risposta, risposta_len, campo_dati, sizeof(campo_dati));
+    stampa_risposta_server(campo_dati);
+}
+
 void stampa_risposta_server(char* campo_dati) {
     // Prima cerca la sequenza di stato diretta della stampante (es. ESxxxx, ONxxxx)
     if (strlen(campo_dati) >= 6) { // Lunghezza minima per 'EXxxxx' o 'OXxxxx'
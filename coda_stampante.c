@@ -0,0 +1,338 @@
+#include "coda_stampante.h"
+#include <stdio.h>
+
+static FunzioneInvioStampante funzione_invio = NULL;
+static FunzioneInattivita funzione_inattivita = NULL;
+static DWORD intervallo_inattivita = INFINITE;
+static DWORD t_ultima_attivita = 0;               // Fine dell'ultimo comando o battito eseguito
+static HANDLE h_thread_stampante = NULL;
+static volatile BOOL coda_attiva = FALSE;
+
+// Costo virtuale di un comando: ogni corsia avanza di COSTO_VIRTUALE / peso per comando servito
+#define COSTO_VIRTUALE 840
+
+// Peso di ogni corsia: a parita' di comandi in attesa, la corsia urgente viene servita 8 volte
+// e quella dei documenti 4 volte per ogni interrogazione
+static const unsigned int pesi_corsie[CODA_NUM_CORSIE] = { 8, 4, 1 };
+static const char* nomi_corsie[CODA_NUM_CORSIE] = { "URGENTE", "DOCUMENTO", "INTERROGAZIONI" };
+
+// Code FIFO delle richieste in attesa della stampante, una per corsia
+typedef struct {
+    RichiestaStampante* testa;
+    RichiestaStampante* coda;
+    unsigned long long ultima_fine;   // Fine virtuale dell'ultima richiesta accodata
+    LONG eseguite;
+    LONGLONG attesa_totale_ms;
+    LONG attesa_max_ms;
+} CorsiaCoda;
+
+static CorsiaCoda corsie[CODA_NUM_CORSIE];
+static unsigned long long tempo_virtuale = 0; // Fine virtuale dell'ultima richiesta servita
+static LONG richieste_in_coda = 0;
+static CRITICAL_SECTION cs_coda;
+static CONDITION_VARIABLE cv_nuova_richiesta;  // Segnalata quando arriva una richiesta
+static CONDITION_VARIABLE cv_completata;       // Segnalata quando una richiesta termina
+static CONDITION_VARIABLE cv_posto_libero;     // Segnalata quando si libera un posto in coda
+
+static LONG posti_occupati = 0;                // Richieste ammesse e non ancora attese
+static volatile LONG cont_eseguite = 0;
+static volatile LONG cont_respinte = 0;
+static volatile LONG tempo_medio_ms = 100;     // Media mobile del tempo di servizio della stampante
+
+// Affinita' di documento: finche' una sessione ha un documento aperto la stampante serve solo lei
+static int sessione_affine = CODA_NESSUNA_SESSIONE;
+static DWORD affinita_timeout_ms = CODA_AFFINITA_TIMEOUT_MS;
+static DWORD t_affinita_inizio = 0;            // Concessione dell'affinita'
+static DWORD t_affinita_ultimo = 0;            // Ultimo comando eseguito della sessione affine
+static LONG affinita_concesse = 0;
+static LONG affinita_scadute = 0;              // Rilasciate per inattivita' invece che a documento chiuso
+static LONGLONG affinita_durata_totale_ms = 0;
+static LONG affinita_durata_max_ms = 0;
+
+// Chiude l'affinita' corrente registrandone la durata (da chiamare con cs_coda acquisita)
+static void rilascia_affinita(BOOL scaduta) {
+    LONG durata = (LONG)(GetTickCount() - t_affinita_inizio);
+    affinita_durata_totale_ms += durata;
+    if (durata > affinita_durata_max_ms) affinita_durata_max_ms = durata;
+    if (scaduta) affinita_scadute++;
+    sessione_affine = CODA_NESSUNA_SESSIONE;
+}
+
+// Estrae la prossima richiesta da servire: tra le corsie vince quella con la fine virtuale
+// minore (accodamento equo con clock proprio). Se una sessione ha l'affinita' si considerano
+// solo le sue richieste; se non ne ha in coda, in *attesa_ms viene restituito il tempo
+// residuo prima che l'affinita' scada. Da chiamare con cs_coda acquisita.
+static RichiestaStampante* estrai_prossima(DWORD* attesa_ms) {
+    *attesa_ms = INFINITE;
+    if (sessione_affine != CODA_NESSUNA_SESSIONE) {
+        DWORD inattivita = GetTickCount() - t_affinita_ultimo;
+        if (!coda_attiva || inattivita >= affinita_timeout_ms) {
+            rilascia_affinita(coda_attiva);
+        } else {
+            *attesa_ms = affinita_timeout_ms - inattivita;
+        }
+    }
+
+    CorsiaCoda* scelta = NULL;
+    RichiestaStampante* precedente_scelta = NULL;
+    for (int i = 0; i < CODA_NUM_CORSIE; i++) {
+        // Prima richiesta della corsia servibile ora (la testa, o la prima della sessione affine)
+        RichiestaStampante* precedente = NULL;
+        RichiestaStampante* candidata = corsie[i].testa;
+        while (candidata != NULL && sessione_affine != CODA_NESSUNA_SESSIONE && candidata->session_id != sessione_affine) {
+            precedente = candidata;
+            candidata = candidata->prossima;
+        }
+        if (candidata == NULL) continue;
+        RichiestaStampante* attuale = scelta == NULL ? NULL : (precedente_scelta ? precedente_scelta->prossima : scelta->testa);
+        if (attuale == NULL || candidata->fine_virtuale < attuale->fine_virtuale) {
+            scelta = &corsie[i];
+            precedente_scelta = precedente;
+        }
+    }
+    if (scelta == NULL) return NULL;
+
+    RichiestaStampante* richiesta = precedente_scelta ? precedente_scelta->prossima : scelta->testa;
+    if (precedente_scelta) precedente_scelta->prossima = richiesta->prossima; else scelta->testa = richiesta->prossima;
+    if (scelta->coda == richiesta) scelta->coda = precedente_scelta;
+    richieste_in_coda--;
+    tempo_virtuale = richiesta->fine_virtuale;
+    return richiesta;
+}
+
+// Aggiorna l'affinita' dopo l'esecuzione di un comando (da chiamare con cs_coda acquisita).
+// L'esito del comando non viene esaminato: un documento rifiutato dalla stampante libera la
+// stampante allo scadere di affinita_timeout_ms.
+static void aggiorna_affinita(const RichiestaStampante* richiesta) {
+    switch (richiesta->affinita) {
+        case AFFINITA_DOCUMENTO:
+            if (sessione_affine == CODA_NESSUNA_SESSIONE) {
+                sessione_affine = richiesta->session_id;
+                t_affinita_inizio = GetTickCount();
+                affinita_concesse++;
+            }
+            if (sessione_affine == richiesta->session_id) t_affinita_ultimo = GetTickCount();
+            break;
+        case AFFINITA_FINE_DOCUMENTO:
+            if (sessione_affine == richiesta->session_id) rilascia_affinita(FALSE);
+            break;
+        default:
+            break;
+    }
+}
+
+// Thread unico che esegue le richieste, una corsia alla volta secondo i pesi
+static DWORD WINAPI thread_stampante(LPVOID lpParam) {
+    (void)lpParam;
+    for (;;) {
+        EnterCriticalSection(&cs_coda);
+        RichiestaStampante* richiesta;
+        DWORD attesa_ms;
+        FunzioneInattivita inattivita = NULL;
+        while ((richiesta = estrai_prossima(&attesa_ms)) == NULL && (coda_attiva || richieste_in_coda > 0)) {
+            // Coda vuota, o solo richieste di altre sessioni mentre un documento e' aperto
+            if (funzione_inattivita != NULL && coda_attiva) {
+                DWORD ferma = GetTickCount() - t_ultima_attivita;
+                if (ferma >= intervallo_inattivita) {
+                    inattivita = funzione_inattivita;
+                    break;
+                }
+                if (attesa_ms > intervallo_inattivita - ferma) attesa_ms = intervallo_inattivita - ferma;
+            }
+            SleepConditionVariableCS(&cv_nuova_richiesta, &cs_coda, attesa_ms);
+        }
+        if (inattivita != NULL) { // Stampante ferma da intervallo_inattivita
+            LeaveCriticalSection(&cs_coda);
+            inattivita();
+            t_ultima_attivita = GetTickCount();
+            continue;
+        }
+        if (richiesta == NULL) { // Coda vuota e chiusura richiesta
+            LeaveCriticalSection(&cs_coda);
+            break;
+        }
+        LeaveCriticalSection(&cs_coda);
+
+        DWORD inizio = GetTickCount();
+        LONG attesa = (LONG)(inizio - richiesta->t_accodata);
+        richiesta->risposta_len = funzione_invio(richiesta->session_id, richiesta->pacchetto, richiesta->pacchetto_len,
+                                                 richiesta->risposta, richiesta->max_risposta_len);
+        t_ultima_attivita = GetTickCount();
+        LONG durata = (LONG)(t_ultima_attivita - inizio);
+        InterlockedExchange(&tempo_medio_ms, (tempo_medio_ms * 7 + durata) / 8);
+        InterlockedIncrement(&cont_eseguite);
+
+        EnterCriticalSection(&cs_coda);
+        CorsiaCoda* corsia = &corsie[richiesta->corsia];
+        corsia->eseguite++;
+        corsia->attesa_totale_ms += attesa;
+        if (attesa > corsia->attesa_max_ms) corsia->attesa_max_ms = attesa;
+        aggiorna_affinita(richiesta);
+        richiesta->completata = TRUE;
+        LeaveCriticalSection(&cs_coda);
+        WakeAllConditionVariable(&cv_completata);
+    }
+    return 0;
+}
+
+BOOL coda_init(FunzioneInvioStampante invio) {
+    funzione_invio = invio;
+    InitializeCriticalSection(&cs_coda);
+    InitializeConditionVariable(&cv_nuova_richiesta);
+    InitializeConditionVariable(&cv_completata);
+    InitializeConditionVariable(&cv_posto_libero);
+    coda_attiva = TRUE;
+
+    h_thread_stampante = CreateThread(NULL, 0, thread_stampante, NULL, 0, NULL);
+    if (h_thread_stampante == NULL) {
+        coda_attiva = FALSE;
+        DeleteCriticalSection(&cs_coda);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void coda_imposta_inattivita(FunzioneInattivita funzione, DWORD intervallo_ms) {
+    EnterCriticalSection(&cs_coda);
+    funzione_inattivita = funzione;
+    intervallo_inattivita = intervallo_ms;
+    t_ultima_attivita = GetTickCount();
+    LeaveCriticalSection(&cs_coda);
+    WakeConditionVariable(&cv_nuova_richiesta); // Il thread ricalcola la sua attesa
+}
+
+void coda_imposta_affinita(DWORD timeout_ms) {
+    EnterCriticalSection(&cs_coda);
+    affinita_timeout_ms = timeout_ms > 0 ? timeout_ms : CODA_AFFINITA_TIMEOUT_MS;
+    LeaveCriticalSection(&cs_coda);
+    WakeConditionVariable(&cv_nuova_richiesta); // Il thread ricalcola la sua attesa
+}
+
+DWORD coda_timeout_affinita(void) {
+    return affinita_timeout_ms;
+}
+
+BOOL coda_ammetti(int session_id, DWORD attesa_ms) {
+    DWORD inizio = GetTickCount();
+    EnterCriticalSection(&cs_coda);
+    // La sessione che ha l'affinita' viene sempre ammessa: gli altri client attendono proprio lei
+    while (posti_occupati >= CODA_MAX_GLOBALE && coda_attiva && session_id != sessione_affine) {
+        DWORD trascorso = GetTickCount() - inizio;
+        if (trascorso >= attesa_ms ||
+            !SleepConditionVariableCS(&cv_posto_libero, &cs_coda, attesa_ms - trascorso)) {
+            if (posti_occupati < CODA_MAX_GLOBALE || session_id == sessione_affine) break; // Posto liberato proprio allo scadere
+            LeaveCriticalSection(&cs_coda);
+            InterlockedIncrement(&cont_respinte);
+            return FALSE;
+        }
+    }
+    if (!coda_attiva) {
+        LeaveCriticalSection(&cs_coda);
+        InterlockedIncrement(&cont_respinte);
+        return FALSE;
+    }
+    posti_occupati++;
+    LeaveCriticalSection(&cs_coda);
+    return TRUE;
+}
+
+void coda_accoda(RichiestaStampante* richiesta) {
+    richiesta->completata = FALSE;
+    richiesta->risposta_len = 0;
+    richiesta->prossima = NULL;
+    richiesta->t_accodata = GetTickCount();
+    if ((unsigned)richiesta->corsia >= CODA_NUM_CORSIE) richiesta->corsia = CORSIA_INTERROGAZIONI;
+
+    EnterCriticalSection(&cs_coda);
+    CorsiaCoda* corsia = &corsie[richiesta->corsia];
+    // Una corsia rimasta vuota riparte dal tempo virtuale corrente, senza accumulare credito
+    unsigned long long inizio = corsia->ultima_fine > tempo_virtuale ? corsia->ultima_fine : tempo_virtuale;
+    richiesta->fine_virtuale = inizio + COSTO_VIRTUALE / pesi_corsie[richiesta->corsia];
+    corsia->ultima_fine = richiesta->fine_virtuale;
+    if (corsia->coda) corsia->coda->prossima = richiesta; else corsia->testa = richiesta;
+    corsia->coda = richiesta;
+    richieste_in_coda++;
+    LeaveCriticalSection(&cs_coda);
+    WakeConditionVariable(&cv_nuova_richiesta);
+}
+
+void coda_attendi(RichiestaStampante* richiesta) {
+    EnterCriticalSection(&cs_coda);
+    while (!richiesta->completata) {
+        SleepConditionVariableCS(&cv_completata, &cs_coda, INFINITE);
+    }
+    posti_occupati--;
+    LeaveCriticalSection(&cs_coda);
+    WakeConditionVariable(&cv_posto_libero);
+}
+
+int coda_suggerimento_retry_ms(void) {
+    // Tempo per smaltire le richieste davanti, con un minimo per non far ritentare a vuoto
+    LONG stima = posti_occupati * tempo_medio_ms;
+    return stima < 100 ? 100 : (int)stima;
+}
+
+void coda_statistiche(LONG* in_coda, LONG* eseguite, LONG* respinte) {
+    if (in_coda) *in_coda = posti_occupati;
+    if (eseguite) *eseguite = cont_eseguite;
+    if (respinte) *respinte = cont_respinte;
+}
+
+void coda_statistiche_corsia(CorsiaStampante corsia, LONG* eseguite, LONG* attesa_media_ms, LONG* attesa_max_ms) {
+    LONG n = 0, media = 0, massimo = 0;
+    if ((unsigned)corsia < CODA_NUM_CORSIE) {
+        EnterCriticalSection(&cs_coda);
+        n = corsie[corsia].eseguite;
+        media = n > 0 ? (LONG)(corsie[corsia].attesa_totale_ms / n) : 0;
+        massimo = corsie[corsia].attesa_max_ms;
+        LeaveCriticalSection(&cs_coda);
+    }
+    if (eseguite) *eseguite = n;
+    if (attesa_media_ms) *attesa_media_ms = media;
+    if (attesa_max_ms) *attesa_max_ms = massimo;
+}
+
+void coda_rilascia_sessione(int session_id) {
+    EnterCriticalSection(&cs_coda);
+    BOOL rilasciata = sessione_affine == session_id;
+    if (rilasciata) rilascia_affinita(TRUE);
+    LeaveCriticalSection(&cs_coda);
+    if (rilasciata) WakeConditionVariable(&cv_nuova_richiesta);
+}
+
+BOOL coda_affinita_corrente(int* session_id, LONG* durata_ms) {
+    EnterCriticalSection(&cs_coda);
+    BOOL attiva = sessione_affine != CODA_NESSUNA_SESSIONE;
+    if (session_id) *session_id = sessione_affine;
+    if (durata_ms) *durata_ms = attiva ? (LONG)(GetTickCount() - t_affinita_inizio) : 0;
+    LeaveCriticalSection(&cs_coda);
+    return attiva;
+}
+
+void coda_statistiche_affinita(LONG* concesse, LONG* scadute, LONG* durata_media_ms, LONG* durata_max_ms) {
+    EnterCriticalSection(&cs_coda);
+    LONG rilasciate = affinita_concesse - (sessione_affine != CODA_NESSUNA_SESSIONE ? 1 : 0);
+    if (concesse) *concesse = affinita_concesse;
+    if (scadute) *scadute = affinita_scadute;
+    if (durata_media_ms) *durata_media_ms = rilasciate > 0 ? (LONG)(affinita_durata_totale_ms / rilasciate) : 0;
+    if (durata_max_ms) *durata_max_ms = affinita_durata_max_ms;
+    LeaveCriticalSection(&cs_coda);
+}
+
+const char* coda_nome_corsia(CorsiaStampante corsia) {
+    return (unsigned)corsia < CODA_NUM_CORSIE ? nomi_corsie[corsia] : "?";
+}
+
+void coda_cleanup(void) {
+    if (h_thread_stampante == NULL) return;
+
+    EnterCriticalSection(&cs_coda);
+    coda_attiva = FALSE;
+    LeaveCriticalSection(&cs_coda);
+    WakeAllConditionVariable(&cv_nuova_richiesta);
+    WakeAllConditionVariable(&cv_posto_libero);
+
+    WaitForSingleObject(h_thread_stampante, INFINITE);
+    CloseHandle(h_thread_stampante);
+    h_thread_stampante = NULL;
+}
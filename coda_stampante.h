@@ -0,0 +1,102 @@
+#ifndef CODA_STAMPANTE_H
+#define CODA_STAMPANTE_H
+
+#include <windows.h>
+
+#define CODA_MAX_GLOBALE 32            // Comandi in coda (o in esecuzione) verso la stampante, per tutti i client
+#define CODA_MAX_CLIENTE 4             // Comandi in coda per singolo client
+#define CODA_ATTESA_AMMISSIONE_MS 2000 // Attesa massima di un posto in coda prima di rispondere "occupato"
+#define CODA_AFFINITA_TIMEOUT_MS 120000 // Inattivita' predefinita dopo cui una sessione perde l'esclusiva sulla stampante
+#define CODA_NESSUNA_SESSIONE -1
+
+// Corsie di priorita' della coda, servite con accodamento equo pesato
+typedef enum {
+    CORSIA_URGENTE = 0,    // Comandi amministrativi e di ripristino (chiave, clear, annullo)
+    CORSIA_DOCUMENTO,      // Prosecuzione di un documento commerciale (righe, storni, totale)
+    CORSIA_INTERROGAZIONI, // Interrogazioni e comandi non riconosciuti (report, export giornale)
+    CODA_NUM_CORSIE
+} CorsiaStampante;
+
+// Effetto di un comando sull'affinita' di documento
+typedef enum {
+    AFFINITA_NESSUNA = 0,      // Comando indipendente dai documenti
+    AFFINITA_DOCUMENTO,        // Apre o prosegue un documento: la sessione ottiene l'esclusiva
+    AFFINITA_FINE_DOCUMENTO    // Chiude o annulla il documento: l'esclusiva viene rilasciata
+} AffinitaDocumento;
+
+// Funzione che invia un pacchetto alla stampante fisica e ne riceve la risposta. Puo' modificare
+// il pacchetto sul posto (es. il pack_id) prima di inviarlo.
+typedef int (*FunzioneInvioStampante)(int session_id, char* pacchetto, int pacchetto_len, char* risposta, int max_risposta_len);
+
+// Funzione eseguita dal thread della stampante quando non ci sono comandi da servire
+typedef void (*FunzioneInattivita)(void);
+
+// Richiesta accodata per la stampante. I buffer appartengono al chiamante
+// e devono restare validi fino al ritorno di coda_attendi(); il thread della stampante
+// puo' scrivere nel pacchetto (vedi FunzioneInvioStampante).
+typedef struct RichiestaStampante {
+    char* pacchetto;
+    int pacchetto_len;
+    char* risposta;
+    int max_risposta_len;
+    int risposta_len;                  // Risultato della funzione di invio
+    int session_id;
+    CorsiaStampante corsia;
+    AffinitaDocumento affinita;
+    volatile LONG completata;
+    DWORD t_accodata;                  // GetTickCount() al momento dell'accodamento
+    unsigned long long fine_virtuale;  // Tempo virtuale di fine servizio (ordinamento tra corsie)
+    struct RichiestaStampante* prossima;
+} RichiestaStampante;
+
+// Avvia il thread che serializza l'accesso alla stampante.
+BOOL coda_init(FunzioneInvioStampante invio);
+
+// Imposta la funzione che il thread della stampante esegue dopo intervallo_ms senza comandi
+// (es. un battito verso la stampante), sempre in serie con i comandi. NULL la disattiva.
+void coda_imposta_inattivita(FunzioneInattivita funzione, DWORD intervallo_ms);
+
+// Imposta l'inattivita' dopo cui la sessione con un documento aperto perde l'esclusiva sulla
+// stampante (0 = CODA_AFFINITA_TIMEOUT_MS). Scaduta l'esclusiva gli altri terminali tornano a
+// essere serviti, ma i loro comandi di documento restano respinti finche' lo scontrino e' aperto.
+void coda_imposta_affinita(DWORD timeout_ms);
+
+// Legge l'inattivita' configurata per l'esclusiva.
+DWORD coda_timeout_affinita(void);
+
+// Riserva un posto nella coda globale, attendendo al massimo attesa_ms.
+// Ritorna TRUE se il posto e' stato riservato, FALSE se la coda e' piena.
+// La sessione che ha un documento aperto viene ammessa anche a coda piena.
+BOOL coda_ammetti(int session_id, DWORD attesa_ms);
+
+// Accoda una richiesta (nella corsia indicata da richiesta->corsia) per cui e' gia' stato riservato un posto con coda_ammetti().
+void coda_accoda(RichiestaStampante* richiesta);
+
+// Attende il completamento della richiesta e libera il suo posto in coda.
+void coda_attendi(RichiestaStampante* richiesta);
+
+// Stima in millisecondi dopo cui ha senso ritentare un comando respinto.
+int coda_suggerimento_retry_ms(void);
+
+// Restituisce i contatori della coda.
+void coda_statistiche(LONG* in_coda, LONG* eseguite, LONG* respinte);
+
+// Rilascia l'affinita' della sessione, se la possiede (da chiamare alla disconnessione del client).
+void coda_rilascia_sessione(int session_id);
+
+// Ritorna TRUE se una sessione ha l'esclusiva sulla stampante, indicandone id e durata finora.
+BOOL coda_affinita_corrente(int* session_id, LONG* durata_ms);
+
+// Restituisce i contatori dell'affinita': concessioni, scadenze per inattivita', durata media e massima (ms).
+void coda_statistiche_affinita(LONG* concesse, LONG* scadute, LONG* durata_media_ms, LONG* durata_max_ms);
+
+// Restituisce i contatori di una corsia: comandi eseguiti, attesa media e massima in coda (ms).
+void coda_statistiche_corsia(CorsiaStampante corsia, LONG* eseguite, LONG* attesa_media_ms, LONG* attesa_max_ms);
+
+// Nome leggibile della corsia (per i log).
+const char* coda_nome_corsia(CorsiaStampante corsia);
+
+// Ferma il thread della stampante (le richieste gia' accodate vengono completate).
+void coda_cleanup(void);
+
+#endif // CODA_STAMPANTE_H
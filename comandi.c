@@ -0,0 +1,404 @@
+#include "comandi.h"
+#include "pacchetto.h"
+#include <stddef.h>
+#include <string.h>
+#include <windows.h> // Per SRWLOCK
+
+// Modello condiviso della stampante fisica: lettori concorrenti, un solo scrittore alla volta
+static StatoStampante stampante;
+static SRWLOCK lock_stampante = SRWLOCK_INIT;
+
+// Firma dei parser: ricevono gli argomenti (cio' che segue il prefisso del comando)
+// e ritornano NULL se validi, altrimenti la descrizione dell'errore.
+typedef const char* (*ParserComando)(const char* arg, int len, ComandoStampante* cmd);
+
+// Firma dei gestori che aggiornano lo stato a comando accettato
+typedef void (*GestoreComando)(StatoStampante* stato, const ComandoStampante* cmd);
+
+typedef struct {
+    const char* nome;
+    ParserComando analizza;
+    GestoreComando applica;
+} VoceComando;
+
+// Legge fino a max_cifre cifre decimali a partire da *pos. Ritorna il numero di cifre lette.
+static int leggi_numero(const char* s, int len, int* pos, int max_cifre, int* valore) {
+    int cifre = 0;
+    int v = 0;
+    while (*pos < len && cifre < max_cifre && s[*pos] >= '0' && s[*pos] <= '9') {
+        v = v * 10 + (s[*pos] - '0');
+        (*pos)++;
+        cifre++;
+    }
+    *valore = v;
+    return cifre;
+}
+
+// =====================
+// === PARSER ===
+// =====================
+static const char* analizza_senza_argomenti(const char* arg, int len, ComandoStampante* cmd) {
+    (void)arg; (void)cmd;
+    return len == 0 ? NULL : "Argomenti non previsti";
+}
+
+static const char* analizza_chiave(const char* arg, int len, ComandoStampante* cmd) {
+    if (len != 1 || arg[0] < '0' || arg[0] > '0' + MAX_CHIAVE) return "Chiave non valida (C0..C5)";
+    cmd->chiave = arg[0] - '0';
+    return NULL;
+}
+
+// Formato: xx/$yyyy con nota opzionale tra parentesi
+static const char* analizza_registrazione(const char* arg, int len, ComandoStampante* cmd) {
+    int pos = 0;
+    if (leggi_numero(arg, len, &pos, 2, &cmd->reparto) == 0) return "Reparto mancante";
+    if (pos + 1 >= len || arg[pos] != '/' || arg[pos + 1] != '$') return "Separatore /$ mancante";
+    pos += 2;
+    if (leggi_numero(arg, len, &pos, 9, &cmd->importo) == 0) return "Importo mancante";
+    if (pos < len && arg[pos] >= '0' && arg[pos] <= '9') return "Importo troppo lungo";
+
+    cmd->testo[0] = '\0';
+    if (pos == len) return NULL;
+    if (arg[pos] != '(' || arg[len - 1] != ')') return "Nota non racchiusa tra parentesi";
+    int nota_len = len - pos - 2;
+    if (nota_len >= MAX_TESTO_COMANDO) return "Nota troppo lunga";
+    memcpy(cmd->testo, arg + pos + 1, (size_t)nota_len);
+    cmd->testo[nota_len] = '\0';
+    return NULL;
+}
+
+static const char* analizza_totale(const char* arg, int len, ComandoStampante* cmd) {
+    if (len != 1 || arg[0] < '1' || arg[0] > '3') return "Tipo pagamento non valido (T1..T3)";
+    cmd->pagamento = arg[0] - '0';
+    return NULL;
+}
+
+// Formato: "/testo
+static const char* analizza_fidelity(const char* arg, int len, ComandoStampante* cmd) {
+    if (len < 1 || arg[0] != '/') return "Separatore / mancante";
+    if (len - 1 >= MAX_TESTO_COMANDO) return "Riga fidelity troppo lunga";
+    memcpy(cmd->testo, arg + 1, (size_t)(len - 1));
+    cmd->testo[len - 1] = '\0';
+    return NULL;
+}
+
+// =====================
+// === GESTORI ===
+// =====================
+static void azzera_documento(StatoStampante* stato) {
+    stato->documento_aperto = 0;
+    stato->sessione_documento = SESSIONE_NESSUNA;
+    stato->righe_documento = 0;
+    stato->totale = 0;
+    stato->ultimo_importo = 0;
+    stato->ultimo_reparto = 0;
+    stato->fidelity_attiva = 0;
+    stato->fidelity1[0] = '\0';
+    stato->fidelity2[0] = '\0';
+}
+
+static void applica_azzeramento(StatoStampante* stato, const ComandoStampante* cmd) {
+    (void)cmd;
+    azzera_documento(stato);
+    stato->incerto = 0; // Nessun documento aperto: la sequenza torna nota
+}
+
+// Il modello non sa piu' cosa c'e' sulla stampante: chiave e lock diventano sconosciuti e le
+// verifiche di sequenza passano alla stampante fino alla chiusura del documento o a un <?s
+static void segna_incerto(StatoStampante* stato) {
+    stato->chiave = CHIAVE_SCONOSCIUTA;
+    stato->lock = 0;
+    stato->incerto = 1;
+}
+
+static void applica_chiave(StatoStampante* stato, const ComandoStampante* cmd) {
+    if (cmd->chiave == 0) {
+        stato->lock = !stato->lock; // C0 seleziona/deseleziona il lock
+    } else {
+        stato->lock = 0;
+    }
+    stato->chiave = cmd->chiave;
+}
+
+static void applica_registrazione(StatoStampante* stato, const ComandoStampante* cmd) {
+    if (!stato->documento_aperto) stato->sessione_documento = cmd->session_id;
+    stato->documento_aperto = 1;
+    stato->righe_documento++;
+    stato->totale += cmd->importo;
+    stato->ultimo_importo = cmd->importo;
+    stato->ultimo_reparto = cmd->reparto;
+}
+
+static void applica_storno(StatoStampante* stato, const ComandoStampante* cmd) {
+    (void)cmd;
+    stato->totale -= stato->ultimo_importo;
+    stato->ultimo_importo = 0;
+}
+
+static void applica_fidelity(StatoStampante* stato, const ComandoStampante* cmd) {
+    char* riga = stato->fidelity1[0] == '\0' ? stato->fidelity1 : stato->fidelity2;
+    strncpy(riga, cmd->testo, sizeof(stato->fidelity1) - 1);
+    riga[sizeof(stato->fidelity1) - 1] = '\0';
+    stato->fidelity_attiva = 1;
+}
+
+// =====================
+// === TABELLE DI DISPATCH ===
+// =====================
+// Descrizione di ogni comando, indicizzata per codice
+static const VoceComando voci_comandi[] = {
+    [CMD_SCONOSCIUTO]     = { "SCONOSCIUTO",       NULL,                     NULL },
+    [CMD_CLEAR]           = { "CLEAR",             analizza_senza_argomenti, applica_azzeramento },
+    [CMD_ANNULLA_DOC]     = { "ANNULLA DOCUMENTO", analizza_senza_argomenti, applica_azzeramento },
+    [CMD_CHIAVE]          = { "CHIAVE",            analizza_chiave,          applica_chiave },
+    [CMD_REGISTRA]        = { "REGISTRAZIONE",     analizza_registrazione,   applica_registrazione },
+    [CMD_STORNO]          = { "STORNO",            analizza_senza_argomenti, applica_storno },
+    [CMD_SUBTOTALE]       = { "SUBTOTALE",         analizza_senza_argomenti, NULL },
+    [CMD_TOTALE]          = { "TOTALE",            analizza_totale,          applica_azzeramento },
+    [CMD_FIDELITY]        = { "FIDELITY",          analizza_fidelity,        applica_fidelity },
+    [CMD_CHIUDI_DOC]      = { "CHIUDI DOCUMENTO",  analizza_senza_argomenti, applica_azzeramento },
+    [CMD_RICHIESTA_STATO] = { "RICHIESTA STATO",   analizza_senza_argomenti, NULL },
+    [CMD_RICHIESTA_DATA]  = { "RICHIESTA DATA",    analizza_senza_argomenti, NULL },
+};
+
+// Dispatch sul carattere che segue il prefisso ("=X" oppure "<?X"): i caratteri
+// non presenti valgono CMD_SCONOSCIUTO e il comando viene inoltrato senza controlli.
+static const unsigned char dispatch_comandi[128] = {
+    ['K'] = CMD_CLEAR,
+    ['k'] = CMD_ANNULLA_DOC,
+    ['C'] = CMD_CHIAVE,
+    ['R'] = CMD_REGISTRA,
+    ['a'] = CMD_STORNO,
+    ['S'] = CMD_SUBTOTALE,
+    ['T'] = CMD_TOTALE,
+    ['"'] = CMD_FIDELITY,
+    ['c'] = CMD_CHIUDI_DOC,
+};
+
+static const unsigned char dispatch_interrogazioni[128] = {
+    ['s'] = CMD_RICHIESTA_STATO,
+    ['d'] = CMD_RICHIESTA_DATA,
+};
+
+void stampante_init(void) {
+    AcquireSRWLockExclusive(&lock_stampante);
+    memset(&stampante, 0, sizeof(stampante));
+    stampante.chiave = CHIAVE_SCONOSCIUTA;
+    ReleaseSRWLockExclusive(&lock_stampante);
+}
+
+void stampante_snapshot(StatoStampante* copia) {
+    AcquireSRWLockShared(&lock_stampante);
+    *copia = stampante;
+    ReleaseSRWLockShared(&lock_stampante);
+}
+
+void stampante_ripristina(const StatoStampante* stato) {
+    AcquireSRWLockExclusive(&lock_stampante);
+    stampante = *stato;
+    stampante.sessione_documento = SESSIONE_NESSUNA;
+    ReleaseSRWLockExclusive(&lock_stampante);
+}
+
+const char* stampante_valida(const ComandoStampante* cmd) {
+    AcquireSRWLockShared(&lock_stampante);
+    const char* esito = comando_valida(&stampante, cmd);
+    ReleaseSRWLockShared(&lock_stampante);
+    return esito;
+}
+
+void stampante_applica(const ComandoStampante* cmd) {
+    if (voci_comandi[cmd->codice].applica == NULL) return; // Nessun effetto: evita il lock esclusivo
+    AcquireSRWLockExclusive(&lock_stampante);
+    comando_applica(&stampante, cmd);
+    stampante.versione++;
+    ReleaseSRWLockExclusive(&lock_stampante);
+}
+
+void stampante_registra_risposta(const ComandoStampante* cmd, const char* risposta, int risposta_len) {
+    AcquireSRWLockExclusive(&lock_stampante);
+    if (comando_registra_risposta(&stampante, cmd, risposta, risposta_len)) stampante.versione++;
+    ReleaseSRWLockExclusive(&lock_stampante);
+}
+
+void stampante_rilascia_sessione(int session_id) {
+    AcquireSRWLockExclusive(&lock_stampante);
+    if (stampante.documento_aperto && stampante.sessione_documento == session_id) {
+        stampante.sessione_documento = SESSIONE_NESSUNA;
+        stampante.versione++;
+    }
+    ReleaseSRWLockExclusive(&lock_stampante);
+}
+
+int comando_di_documento(const ComandoStampante* cmd) {
+    switch (cmd->codice) {
+        case CMD_REGISTRA:
+        case CMD_STORNO:
+        case CMD_SUBTOTALE:
+        case CMD_TOTALE:
+        case CMD_FIDELITY:
+        case CMD_CHIUDI_DOC:
+        case CMD_ANNULLA_DOC:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// L'esclusiva della coda scade con l'inattivita', il documento sulla stampante no: senza questo
+// controllo le righe di un altro terminale finirebbero nello scontrino lasciato in sospeso.
+int comando_documento_altrui(const StatoStampante* stato, const ComandoStampante* cmd) {
+    return comando_di_documento(cmd) && stato->documento_aperto && !stato->incerto && stato->sessione_documento != SESSIONE_NESSUNA
+        && cmd->session_id != SESSIONE_NESSUNA && cmd->session_id != stato->sessione_documento;
+}
+
+void sessione_init(StatoSessione* sessione, int session_id) {
+    memset(sessione, 0, sizeof(*sessione));
+    sessione->session_id = session_id;
+}
+
+const char* comando_valida(const StatoStampante* stato, const ComandoStampante* cmd) {
+    if (stato->incerto) {
+        // Modello non allineato: restano le verifiche sugli argomenti, il resto lo decide la stampante
+        if (cmd->codice == CMD_REGISTRA) {
+            if (cmd->reparto < 1 || cmd->reparto > MAX_REPARTO) return "E08";
+            if (cmd->importo == 0) return "E24";
+        }
+        return NULL;
+    }
+    if (comando_documento_altrui(stato, cmd)) return "E20"; // Scontrino aperto da un altro terminale
+    switch (cmd->codice) {
+        case CMD_CHIAVE:
+            if (stato->documento_aperto) return "E20";  // Cambio chiave a documento aperto
+            return NULL;
+        case CMD_REGISTRA:
+            if (stato->lock) return "E21";
+            if (stato->chiave != CHIAVE_SCONOSCIUTA && stato->chiave != CHIAVE_REG) return "E21";
+            if (cmd->reparto < 1 || cmd->reparto > MAX_REPARTO) return "E08";
+            if (cmd->importo == 0) return "E24";
+            if (cmd->importo > MAX_TOTALE_DOCUMENTO - stato->totale) return "E41";
+            return NULL;
+        case CMD_STORNO:
+            if (!stato->documento_aperto || stato->ultimo_importo == 0) return "E20";
+            return NULL;
+        case CMD_SUBTOTALE:
+        case CMD_CHIUDI_DOC:
+            if (!stato->documento_aperto) return "E20";
+            return NULL;
+        case CMD_TOTALE:
+            if (!stato->documento_aperto) return "E05";
+            if (stato->totale < 0) return "E40";
+            return NULL;
+        default:
+            return NULL; // Nessun vincolo noto: decide la stampante
+    }
+}
+
+const char* comando_analizza(const char* comando, int comando_len, ComandoStampante* cmd) {
+    memset(cmd, 0, offsetof(ComandoStampante, testo));
+    cmd->testo[0] = '\0';
+
+    const unsigned char* dispatch = NULL;
+    int prefisso_len = 0;
+    switch (comando_len > 0 ? comando[0] : 0) {
+        case '=':
+            dispatch = dispatch_comandi;
+            prefisso_len = 2;
+            break;
+        case '<':
+            if (comando_len >= 2 && comando[1] == '?') {
+                dispatch = dispatch_interrogazioni;
+                prefisso_len = 3;
+                cmd->interrogazione = 1;
+            }
+            break;
+    }
+    if (dispatch == NULL || comando_len < prefisso_len || (unsigned char)comando[prefisso_len - 1] >= 128) {
+        return NULL; // Comando non gestito localmente
+    }
+
+    cmd->codice = (CodiceComando)dispatch[(unsigned char)comando[prefisso_len - 1]];
+    if (cmd->codice == CMD_SCONOSCIUTO) return NULL;
+    return voci_comandi[cmd->codice].analizza(comando + prefisso_len, comando_len - prefisso_len, cmd);
+}
+
+void comando_applica(StatoStampante* stato, const ComandoStampante* cmd) {
+    GestoreComando applica = voci_comandi[cmd->codice].applica;
+    if (applica) applica(stato, cmd);
+}
+
+// Legge il valore intero del campo "nome=valore" (campi separati da spazi o '|'). Ritorna 1 se presente.
+static int campo_stato(const char* dati, int dati_len, const char* nome, int* valore) {
+    int nome_len = (int)strlen(nome);
+    int inizio = 0;
+    while (inizio < dati_len) {
+        int fine = inizio;
+        while (fine < dati_len && dati[fine] != ' ' && dati[fine] != '|') fine++;
+        if (fine - inizio > nome_len + 1 && memcmp(dati + inizio, nome, (size_t)nome_len) == 0 && dati[inizio + nome_len] == '=') {
+            int pos = inizio + nome_len + 1;
+            int negativo = dati[pos] == '-';
+            if (negativo) pos++;
+            int v;
+            if (leggi_numero(dati, fine, &pos, 9, &v) > 0 && pos == fine) {
+                *valore = negativo ? -v : v;
+                return 1;
+            }
+        }
+        inizio = fine + 1;
+    }
+    return 0;
+}
+
+int comando_sincronizza(StatoStampante* stato, const char* dati, int dati_len) {
+    int riconosciuti = 0;
+    int chiave, lock, doc, righe, totale;
+    if (campo_stato(dati, dati_len, "CHIAVE", &chiave) && chiave >= 0 && chiave <= MAX_CHIAVE) {
+        stato->chiave = chiave;
+        riconosciuti++;
+    }
+    if (campo_stato(dati, dati_len, "LOCK", &lock)) {
+        stato->lock = lock != 0;
+        riconosciuti++;
+    }
+    if (campo_stato(dati, dati_len, "DOC", &doc)) {
+        riconosciuti++;
+        int ha_righe = campo_stato(dati, dati_len, "RIGHE", &righe);
+        int ha_totale = campo_stato(dati, dati_len, "TOTALE", &totale);
+        if (!doc) {
+            azzera_documento(stato);
+            stato->incerto = 0;
+        } else if (!stato->documento_aperto || stato->incerto
+                   || (ha_righe && righe != stato->righe_documento) || (ha_totale && totale != stato->totale)) {
+            // Documento aperto o proseguito senza passare dal gateway: l'ultimo importo non e' noto
+            if (!stato->documento_aperto) stato->sessione_documento = SESSIONE_NESSUNA;
+            stato->documento_aperto = 1;
+            if (ha_righe) stato->righe_documento = righe;
+            if (ha_totale) stato->totale = totale;
+            stato->incerto = 1;
+        }
+    }
+    return riconosciuti > 0;
+}
+
+int comando_registra_risposta(StatoStampante* stato, const ComandoStampante* cmd, const char* risposta, int risposta_len) {
+    StatoStampante prima = *stato;
+    // I comandi non riconosciuti possono cambiare la stampante, salvo le interrogazioni
+    int modifica = cmd->codice == CMD_SCONOSCIUTO ? !cmd->interrogazione : voci_comandi[cmd->codice].applica != NULL;
+    VistaPacchetto pacchetto;
+    if (!pacchetto_trova(risposta, risposta_len, &pacchetto)) {
+        if (modifica) segna_incerto(stato); // Non si sa se il comando e' stato eseguito
+    } else if (pacchetto_risposta_positiva(pacchetto.byte, pacchetto.lunghezza, NULL)) {
+        if (cmd->codice == CMD_RICHIESTA_STATO) {
+            comando_sincronizza(stato, pacchetto.byte + PACCHETTO_INIZIO_DATI, pacchetto.lunghezza - PACCHETTO_CORNICE);
+        } else if (cmd->codice == CMD_SCONOSCIUTO) {
+            if (modifica) segna_incerto(stato); // Eseguito, ma con un effetto che il gateway non conosce
+        } else {
+            comando_applica(stato, cmd);
+        }
+    }
+    return memcmp(&prima, stato, sizeof(prima)) != 0;
+}
+
+const char* comando_nome(CodiceComando codice) {
+    return voci_comandi[codice].nome;
+}
@@ -0,0 +1,132 @@
+#ifndef COMANDI_H
+#define COMANDI_H
+
+#include <time.h>
+
+#define MAX_TESTO_COMANDO 128   // Lunghezza massima di note e righe fidelity
+#define MAX_CHIAVE 5            // Chiavi valide: 0 = lock ... 5 = SRV
+#define CHIAVE_SCONOSCIUTA -1   // Posizione chiave non ancora osservata
+#define CHIAVE_REG 1            // Chiave di registrazione
+#define MAX_REPARTO 99          // Numero massimo di reparto accettato
+#define MAX_TOTALE_DOCUMENTO 99999999 // Limite del totale di un documento (in centesimi)
+#define SESSIONE_NESSUNA 0      // Nessuna sessione (gli ID di sessione partono da 1)
+
+// =====================
+// === STATO STAMPANTE ===
+// =====================
+// Stato della stampante fisica: un'unica istanza condivisa da tutte le sessioni,
+// aggiornata solo dalle risposte positive della stampante.
+typedef struct {
+    int chiave;           // 0 = lock, 1 = REG, 2 = X, 3 = Z, 4 = PRG, 5 = SRV (-1 = sconosciuta)
+    int lock;             // 1 = lock attivo, 0 = no lock
+    int totale;           // Totale corrente
+    int fidelity_attiva;  // 1 se attiva, 0 se no
+    char fidelity1[128];  // Riga fidelity 1
+    char fidelity2[128];  // Riga fidelity 2
+    int ultimo_importo;   // ultimo importo registrato
+    int ultimo_reparto;   // ultimo reparto registrato
+    int documento_aperto; // 1 se e' in corso un documento commerciale
+    int righe_documento;  // Numero di registrazioni nel documento in corso
+    unsigned long versione; // Incrementata a ogni modifica dello stato
+    int sessione_documento; // Sessione che ha aperto il documento in corso (SESSIONE_NESSUNA se non nota)
+    int incerto;          // 1 se la stampante potrebbe essere cambiata senza che il modello lo sappia
+} StatoStampante;
+
+// Stato proprio di ogni connessione client
+typedef struct {
+    int session_id;       // ID di sessione univoco per ogni connessione
+    int error_count;      // Conteggio errori consecutivi
+    time_t last_command;  // Timestamp dell'ultimo comando
+} StatoSessione;
+
+// Comandi riconosciuti dal motore locale
+typedef enum {
+    CMD_SCONOSCIUTO = 0,  // Non gestito localmente: viene inoltrato alla stampante cosi' com'e'
+    CMD_CLEAR,            // =K
+    CMD_ANNULLA_DOC,      // =k
+    CMD_CHIAVE,           // =Cn
+    CMD_REGISTRA,         // =Rxx/$yyyy(nota)
+    CMD_STORNO,           // =a
+    CMD_SUBTOTALE,        // =S
+    CMD_TOTALE,           // =Tn
+    CMD_FIDELITY,         // ="/testo
+    CMD_CHIUDI_DOC,       // =c
+    CMD_RICHIESTA_STATO,  // <?s
+    CMD_RICHIESTA_DATA    // <?d
+} CodiceComando;
+
+// Comando analizzato con argomenti tipizzati
+typedef struct {
+    CodiceComando codice;
+    int chiave;                      // CMD_CHIAVE
+    int reparto;                     // CMD_REGISTRA
+    int importo;                     // CMD_REGISTRA
+    int pagamento;                   // CMD_TOTALE (1 = contanti, 2 = non riscosso, 3 = assegni)
+    int session_id;                  // Sessione che invia il comando (SESSIONE_NESSUNA se non nota)
+    int interrogazione;              // 1 per i comandi "<?..." (non modificano la stampante)
+    char testo[MAX_TESTO_COMANDO];   // Nota di CMD_REGISTRA o riga di CMD_FIDELITY
+} ComandoStampante;
+
+// Inizializza lo stato condiviso della stampante (chiave sconosciuta, nessun documento aperto).
+void stampante_init(void);
+
+// Copia coerente dello stato condiviso, senza round trip verso la stampante.
+void stampante_snapshot(StatoStampante* copia);
+
+// Sostituisce lo stato condiviso (es. con lo stato ricostruito dal giornale all'avvio).
+// La sessione proprietaria del documento non viene ripresa: gli ID non sopravvivono al riavvio.
+void stampante_ripristina(const StatoStampante* stato);
+
+// Valida il comando sullo stato condiviso (vedi comando_valida).
+const char* stampante_valida(const ComandoStampante* cmd);
+
+// Applica allo stato condiviso un comando accettato dalla stampante.
+void stampante_applica(const ComandoStampante* cmd);
+
+// Aggiorna lo stato condiviso con la risposta della stampante al comando (vedi comando_registra_risposta).
+// Va chiamata nell'ordine in cui la stampante esegue i comandi.
+void stampante_registra_risposta(const ComandoStampante* cmd, const char* risposta, int risposta_len);
+
+// Dimentica la sessione come proprietaria del documento aperto (alla sua disconnessione):
+// il documento potra' essere proseguito o annullato da un'altra sessione.
+void stampante_rilascia_sessione(int session_id);
+
+// Inizializza lo stato di una nuova sessione.
+void sessione_init(StatoSessione* sessione, int session_id);
+
+// Analizza il comando tramite la tabella di dispatch (cmd->session_id viene azzerato).
+// Ritorna NULL se il comando e' ben formato (o sconosciuto, con cmd->codice = CMD_SCONOSCIUTO),
+// altrimenti la descrizione dell'errore di sintassi.
+const char* comando_analizza(const char* comando, int comando_len, ComandoStampante* cmd);
+
+// Verifica che il comando sia ammesso nello stato corrente (sequenza documento, reparti, importi).
+// I comandi di documento di una sessione diversa da quella che ha aperto il documento sono respinti.
+// Con lo stato incerto restano solo le verifiche sugli argomenti: il resto lo decide la stampante.
+// Ritorna NULL se ammesso, altrimenti il codice errore RT corrispondente (es. "E20", vedi error_table.h).
+const char* comando_valida(const StatoStampante* stato, const ComandoStampante* cmd);
+
+// Ritorna 1 se il comando appartiene a un documento commerciale (registrazione, storno, subtotale, chiusure).
+int comando_di_documento(const ComandoStampante* cmd);
+
+// Ritorna 1 se il comando di documento riguarda un documento aperto da un'altra sessione nota.
+int comando_documento_altrui(const StatoStampante* stato, const ComandoStampante* cmd);
+
+// Applica allo stato l'effetto di un comando accettato dalla stampante.
+void comando_applica(StatoStampante* stato, const ComandoStampante* cmd);
+
+// Aggiorna lo stato con la risposta della stampante (byte ricevuti, ACK compresi; NULL se non e'
+// arrivata): applica il comando se eseguito, riallinea lo stato con la risposta a <?s e segna lo
+// stato come incerto se il comando potrebbe averlo cambiato in modo non noto (comando non
+// riconosciuto eseguito, risposta assente o non valida). Ritorna 1 se lo stato e' cambiato.
+int comando_registra_risposta(StatoStampante* stato, const ComandoStampante* cmd, const char* risposta, int risposta_len);
+
+// Riallinea lo stato con i campi CHIAVE=, LOCK=, DOC=, RIGHE= e TOTALE= di una risposta di stato
+// (separati da spazi o '|', come nella risposta a STATO). I campi assenti restano invariati; un
+// documento aperto di cui il modello non conosceva le righe resta incerto. Ritorna 1 se almeno
+// un campo e' stato riconosciuto.
+int comando_sincronizza(StatoStampante* stato, const char* dati, int dati_len);
+
+// Nome leggibile del comando (per i log).
+const char* comando_nome(CodiceComando codice);
+
+#endif // COMANDI_H
@@ -0,0 +1,465 @@
+#include "connessione.h"
+#include <ws2tcpip.h>
+#include <stdio.h>
+#include <string.h>
+
+// Stati del decodificatore
+#define DECOD_ATTESA 0      // Tra un frame e l'altro
+#define DECOD_PACCHETTO 1   // Dentro un pacchetto iniziato da STX
+#define DECOD_TESTO 2       // Dentro una riga di testo
+#define DECOD_COMPLETO 3    // Frame consegnato, da azzerare al prossimo byte
+
+void decodificatore_init(DecodificatoreFrame* dec) {
+    dec->len = 0;
+    dec->atteso = 0;
+    dec->stato = DECOD_ATTESA;
+    dec->scartati = 0;
+    dec->n_da_rileggere = 0;
+}
+
+static int cifra_hex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Controlla l'intestazione [STX][adds 2][len 3]['N'] e ricava la lunghezza totale del pacchetto
+static int lunghezza_pacchetto(const char* p) {
+    if (p[6] != 'N') return 0;
+    int dati_len = 0;
+    for (int i = 3; i < 6; i++) {
+        if (p[i] < '0' || p[i] > '9') return 0;
+        dati_len = dati_len * 10 + (p[i] - '0');
+    }
+    return dati_len + PACCHETTO_CORNICE;
+}
+
+// Verifica il CHK: XOR da STX fino a pack_id incluso, in ASCII HEX
+static BOOL chk_corretto(const char* p, int len) {
+    unsigned char chk = 0;
+    for (int i = 0; i < len - 3; i++) chk ^= (unsigned char)p[i];
+    int alto = cifra_hex(p[len - 3]);
+    int basso = cifra_hex(p[len - 2]);
+    return alto >= 0 && basso >= 0 && ((alto << 4) | basso) == chk;
+}
+
+// Abbandona il frame in corso; un STX ricevuto al suo posto apre subito un nuovo pacchetto
+static void risincronizza(DecodificatoreFrame* dec, char c) {
+    dec->scartati += (unsigned long)dec->len;
+    dec->len = 0;
+    dec->atteso = 0;
+    dec->stato = DECOD_ATTESA;
+    if ((unsigned char)c == PACCHETTO_STX) {
+        dec->frame[dec->len++] = c;
+        dec->stato = DECOD_PACCHETTO;
+    } else {
+        dec->scartati++;
+    }
+}
+
+// Aggiunge byte in coda a quelli da rileggere
+static void accoda_da_rileggere(DecodificatoreFrame* dec, const char* dati, int len) {
+    if (len > (int)sizeof(dec->da_rileggere) - dec->n_da_rileggere) {
+        len = (int)sizeof(dec->da_rileggere) - dec->n_da_rileggere;
+    }
+    memcpy(dec->da_rileggere + dec->n_da_rileggere, dati, (size_t)len);
+    dec->n_da_rileggere += len;
+}
+
+// Abbandona il pacchetto in corso (intestazione non valida o ETX mancante). Un pacchetto troncato
+// puo' contenere l'inizio del successivo: i byte dal primo STX dopo quello iniziale vengono riletti.
+static void scarta_pacchetto(DecodificatoreFrame* dec) {
+    const char* stx = dec->len > 1 ? memchr(dec->frame + 1, PACCHETTO_STX, (size_t)(dec->len - 1)) : NULL;
+    int scartati = stx != NULL ? (int)(stx - dec->frame) : dec->len;
+    dec->scartati += (unsigned long)scartati;
+    if (stx != NULL) accoda_da_rileggere(dec, stx, dec->len - scartati);
+    dec->len = 0;
+    dec->atteso = 0;
+    dec->stato = DECOD_ATTESA;
+}
+
+// Decodifica un byte. Ritorna TRUE se completa un frame.
+static BOOL decodifica_byte(DecodificatoreFrame* dec, char c, EsitoFrame* esito) {
+    switch (dec->stato) {
+        case DECOD_ATTESA:
+            if (c == '\r' || c == '\n') break; // Separatori tra le risposte
+            dec->frame[dec->len++] = c;
+            dec->stato = (unsigned char)c == PACCHETTO_STX ? DECOD_PACCHETTO : DECOD_TESTO;
+            break;
+
+        case DECOD_PACCHETTO:
+            dec->frame[dec->len++] = c;
+            if (dec->len == PACCHETTO_INIZIO_DATI) {
+                dec->atteso = lunghezza_pacchetto(dec->frame);
+                if (dec->atteso == 0) scarta_pacchetto(dec);
+            } else if (dec->atteso > 0 && dec->len == dec->atteso) {
+                if ((unsigned char)c != PACCHETTO_ETX) {
+                    scarta_pacchetto(dec);
+                    break;
+                }
+                dec->frame[dec->len] = '\0';
+                dec->stato = DECOD_COMPLETO;
+                *esito = chk_corretto(dec->frame, dec->len) ? FRAME_PACCHETTO : FRAME_CHK_ERRATO;
+                return TRUE;
+            }
+            break;
+
+        case DECOD_TESTO:
+            if ((unsigned char)c == PACCHETTO_STX) {
+                risincronizza(dec, c); // Testo spurio davanti a un pacchetto
+                break;
+            }
+            if (c == '\n') {
+                while (dec->len > 0 && dec->frame[dec->len - 1] == '\r') dec->len--;
+                dec->frame[dec->len] = '\0';
+                dec->stato = DECOD_COMPLETO;
+                *esito = FRAME_TESTO;
+                return TRUE;
+            }
+            if (dec->len < CONN_MAX_FRAME) {
+                dec->frame[dec->len++] = c;
+            } else {
+                dec->scartati++; // Riga troppo lunga: si conserva l'inizio
+            }
+            break;
+    }
+    return FALSE;
+}
+
+// Decodifica i byte da rileggere. Ritorna TRUE se completano un frame: quelli che lo seguono
+// restano da rileggere. Un nuovo pacchetto scartato viene riletto prima dei byte restanti.
+static BOOL rileggi(DecodificatoreFrame* dec, EsitoFrame* esito) {
+    while (dec->n_da_rileggere > 0) {
+        char copia[CONN_MAX_FRAME];
+        int n = dec->n_da_rileggere;
+        memcpy(copia, dec->da_rileggere, (size_t)n);
+        dec->n_da_rileggere = 0;
+        for (int i = 0; i < n; i++) {
+            if (decodifica_byte(dec, copia[i], esito)) {
+                accoda_da_rileggere(dec, copia + i + 1, n - i - 1);
+                return TRUE;
+            }
+            if (dec->n_da_rileggere > 0) {
+                accoda_da_rileggere(dec, copia + i + 1, n - i - 1);
+                break;
+            }
+        }
+    }
+    return FALSE;
+}
+
+int decodificatore_spingi(DecodificatoreFrame* dec, const char* dati, int len, EsitoFrame* esito) {
+    *esito = FRAME_NESSUNO;
+    if (dec->stato == DECOD_COMPLETO) {
+        dec->len = 0;
+        dec->atteso = 0;
+        dec->stato = DECOD_ATTESA;
+    }
+    if (rileggi(dec, esito)) return 0;
+    for (int i = 0; i < len; i++) {
+        if (decodifica_byte(dec, dati[i], esito)) return i + 1;
+        if (dec->n_da_rileggere > 0 && rileggi(dec, esito)) return i + 1;
+    }
+    return len;
+}
+
+BOOL decodificatore_da_rileggere(const DecodificatoreFrame* dec) {
+    return dec->n_da_rileggere > 0;
+}
+
+// connect() bloccante non rispetta SO_SNDTIMEO: si connette in modalita' non bloccante, attende
+// con WSAPoll il tempo che resta e ripristina la modalita' bloccante
+static BOOL connetti_entro(SOCKET s, const struct addrinfo* ai, DWORD inizio, DWORD timeout_ms) {
+    u_long non_bloccante = 1;
+    if (ioctlsocket(s, FIONBIO, &non_bloccante) != 0) return FALSE;
+    if (connect(s, ai->ai_addr, (int)ai->ai_addrlen) != 0) {
+        if (WSAGetLastError() != WSAEWOULDBLOCK) return FALSE;
+        DWORD trascorso = GetTickCount() - inizio;
+        WSAPOLLFD attesa;
+        attesa.fd = s;
+        attesa.events = POLLWRNORM;
+        attesa.revents = 0;
+        int pronti = WSAPoll(&attesa, 1, trascorso < timeout_ms ? (int)(timeout_ms - trascorso) : 0);
+        if (pronti == SOCKET_ERROR) return FALSE;
+        if (pronti == 0) {
+            WSASetLastError(WSAETIMEDOUT);
+            return FALSE;
+        }
+        int errore = 0;
+        int errore_len = sizeof(errore);
+        if (getsockopt(s, SOL_SOCKET, SO_ERROR, (char*)&errore, &errore_len) != 0) return FALSE;
+        if (errore != 0) {
+            WSASetLastError(errore);
+            return FALSE;
+        }
+    }
+    u_long bloccante = 0;
+    return ioctlsocket(s, FIONBIO, &bloccante) == 0;
+}
+
+BOOL conn_apri(Connessione* conn, const char* host, int porta, DWORD timeout_ms) {
+    conn->sock = INVALID_SOCKET;
+    conn->ricezione_inizio = 0;
+    conn->ricezione_len = 0;
+    conn->primo_in_attesa = 0;
+    conn->n_in_attesa = 0;
+    decodificatore_init(&conn->decodificatore);
+
+    char porta_str[16];
+    snprintf(porta_str, sizeof(porta_str), "%d", porta);
+    struct addrinfo hints;
+    struct addrinfo* risultato = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (getaddrinfo(host, porta_str, &hints, &risultato) != 0 || risultato == NULL) {
+        return FALSE;
+    }
+
+    // Si prova ogni indirizzo risolto finche' uno accetta la connessione, entro timeout_ms in tutto
+    DWORD inizio = GetTickCount();
+    for (struct addrinfo* ai = risultato; ai != NULL; ai = ai->ai_next) {
+        SOCKET s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == INVALID_SOCKET) continue;
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout_ms, sizeof(timeout_ms));
+        if (connetti_entro(s, ai, inizio, timeout_ms)) {
+            // I comandi sono brevi e attendono risposta: niente ritardo di Nagle
+            BOOL nodelay = TRUE;
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+            conn->sock = s;
+            break;
+        }
+        int errore = WSAGetLastError();
+        closesocket(s);
+        WSASetLastError(errore);
+    }
+    freeaddrinfo(risultato);
+    return conn->sock != INVALID_SOCKET;
+}
+
+// Invia tutti i byte, anche se il socket e' in modalita' non bloccante
+static BOOL invia_tutto(SOCKET sock, const char* dati, int len) {
+    int inviati = 0;
+    while (inviati < len) {
+        int n = send(sock, dati + inviati, len - inviati, 0);
+        if (n > 0) {
+            inviati += n;
+            continue;
+        }
+        if (n < 0 && WSAGetLastError() == WSAEWOULDBLOCK) {
+            WSAPOLLFD attesa;
+            attesa.fd = sock;
+            attesa.events = POLLWRNORM;
+            attesa.revents = 0;
+            if (WSAPoll(&attesa, 1, -1) > 0) continue;
+        }
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL conn_invia(Connessione* conn, const char* comando) {
+    return conn_invia_lotto(conn, &comando, 1) == 1;
+}
+
+int conn_invia_lotto(Connessione* conn, const char* const* comandi, int n) {
+    char buffer[CONN_BUFFER_INVIO];
+    int len = 0;
+    int accodati = 0;
+    while (accodati < n) {
+        int comando_len = (int)strlen(comandi[accodati]);
+        if (len + comando_len + 2 > (int)sizeof(buffer)) break;
+        memcpy(buffer + len, comandi[accodati], (size_t)comando_len);
+        len += comando_len;
+        buffer[len++] = '\r';
+        buffer[len++] = '\n';
+        accodati++;
+    }
+    if (len > 0 && !invia_tutto(conn->sock, buffer, len)) return -1;
+    return accodati;
+}
+
+// Legge dal socket i byte disponibili. Ritorna FALSE se la connessione e' chiusa o in errore.
+static BOOL leggi_socket(Connessione* conn) {
+    int letti = recv(conn->sock, conn->ricezione, (int)sizeof(conn->ricezione), 0);
+    if (letti > 0) {
+        conn->ricezione_inizio = 0;
+        conn->ricezione_len = letti;
+        return TRUE;
+    }
+    return letti < 0 && WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+int conn_ricevi(Connessione* conn, char* risposta, int max_len, EsitoFrame* esito, DWORD timeout_ms) {
+    DWORD inizio = GetTickCount();
+    for (;;) {
+        // Prima si decodificano i byte gia' letti: una lettura puo' contenere piu' risposte
+        while (conn->ricezione_inizio < conn->ricezione_len || decodificatore_da_rileggere(&conn->decodificatore)) {
+            DecodificatoreFrame* dec = &conn->decodificatore;
+            conn->ricezione_inizio += decodificatore_spingi(dec, conn->ricezione + conn->ricezione_inizio,
+                                                            conn->ricezione_len - conn->ricezione_inizio, esito);
+            if (*esito != FRAME_NESSUNO) {
+                int copia_len = dec->len < max_len - 1 ? dec->len : max_len - 1;
+                memcpy(risposta, dec->frame, (size_t)copia_len);
+                risposta[copia_len] = '\0';
+                return copia_len;
+            }
+        }
+        if (conn->sock == INVALID_SOCKET) return -1;
+
+        DWORD trascorso = GetTickCount() - inizio;
+        DWORD resto = trascorso < timeout_ms ? timeout_ms - trascorso : 0;
+        WSAPOLLFD attesa;
+        attesa.fd = conn->sock;
+        attesa.events = POLLRDNORM;
+        attesa.revents = 0;
+        int pronti = WSAPoll(&attesa, 1, (int)resto);
+        if (pronti == SOCKET_ERROR) return -1;
+        if (pronti == 0) return 0;
+        if (!leggi_socket(conn)) return -1;
+    }
+}
+
+static RichiestaInAttesa* richiesta(Connessione* conn, int i) {
+    return &conn->in_attesa[(conn->primo_in_attesa + i) % CONN_MAX_IN_ATTESA];
+}
+
+// Toglie dalla coda la richiesta piu' vecchia e ne chiama la callback, se non e' gia' scaduta.
+// Ritorna 1 se la callback e' stata chiamata.
+static int completa_prima(Connessione* conn, EsitoFrame esito, const char* risposta, int len) {
+    RichiestaInAttesa r = *richiesta(conn, 0);
+    conn->primo_in_attesa = (conn->primo_in_attesa + 1) % CONN_MAX_IN_ATTESA;
+    conn->n_in_attesa--;
+    if (r.scaduta) return 0; // Risposta tardiva: il chiamante e' gia' stato avvisato
+    r.callback(conn, r.contesto, esito, risposta, len);
+    return 1;
+}
+
+BOOL conn_invia_async(Connessione* conn, const char* comando, DWORD scadenza_ms, CallbackRisposta callback, void* contesto) {
+    if (conn->sock == INVALID_SOCKET || conn->n_in_attesa == CONN_MAX_IN_ATTESA) return FALSE;
+    // La richiesta si registra prima dell'invio: la risposta puo' arrivare appena partito il comando
+    RichiestaInAttesa* r = richiesta(conn, conn->n_in_attesa);
+    r->callback = callback;
+    r->contesto = contesto;
+    r->scadenza = GetTickCount() + scadenza_ms;
+    r->scaduta = FALSE;
+    conn->n_in_attesa++;
+    if (!conn_invia(conn, comando)) {
+        conn->n_in_attesa--;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Chiude tutte le richieste in attesa con FRAME_CONNESSIONE_CHIUSA. Ritorna le callback chiamate.
+static int chiudi_richieste(Connessione* conn) {
+    int chiamate = 0;
+    while (conn->n_in_attesa > 0) {
+        chiamate += completa_prima(conn, FRAME_CONNESSIONE_CHIUSA, "", 0);
+    }
+    return chiamate;
+}
+
+// Consegna alle richieste in attesa le risposte gia' lette. Le risposte non richieste vengono scartate.
+static int consegna_ricevuti(Connessione* conn) {
+    int chiamate = 0;
+    while (conn->ricezione_inizio < conn->ricezione_len || decodificatore_da_rileggere(&conn->decodificatore)) {
+        EsitoFrame esito;
+        DecodificatoreFrame* dec = &conn->decodificatore;
+        conn->ricezione_inizio += decodificatore_spingi(dec, conn->ricezione + conn->ricezione_inizio,
+                                                        conn->ricezione_len - conn->ricezione_inizio, &esito);
+        if (esito != FRAME_NESSUNO && conn->n_in_attesa > 0) {
+            chiamate += completa_prima(conn, esito, dec->frame, dec->len);
+        }
+    }
+    return chiamate;
+}
+
+// Avvisa le richieste che hanno superato la scadenza, restando in coda per mantenere l'ordine
+// delle risposte successive. Aggiorna *attesa_ms con il tempo fino alla prossima scadenza.
+static int controlla_scadenze(Connessione* conn, DWORD ora, DWORD* attesa_ms) {
+    int chiamate = 0;
+    for (int i = 0; i < conn->n_in_attesa; i++) {
+        RichiestaInAttesa* r = richiesta(conn, i);
+        if (r->scaduta) continue;
+        LONG resto = (LONG)(r->scadenza - ora);
+        if (resto <= 0) {
+            r->scaduta = TRUE;
+            r->callback(conn, r->contesto, FRAME_SCADUTO, "", 0);
+            chiamate++;
+        } else if ((DWORD)resto < *attesa_ms) {
+            *attesa_ms = (DWORD)resto;
+        }
+    }
+    return chiamate;
+}
+
+int conn_poll(Connessione** connessioni, int n, DWORD timeout_ms) {
+    WSAPOLLFD attese[CONN_MAX_POLL];
+    Connessione* servite[CONN_MAX_POLL];
+    int n_attese = 0;
+    int chiamate = 0;
+    DWORD attesa_ms = timeout_ms;
+    DWORD ora = GetTickCount();
+
+    for (int i = 0; i < n && n_attese < CONN_MAX_POLL; i++) {
+        Connessione* conn = connessioni[i];
+        if (conn->sock == INVALID_SOCKET || conn->n_in_attesa == 0) continue;
+        chiamate += consegna_ricevuti(conn); // Risposte gia' lette da una chiamata precedente
+        chiamate += controlla_scadenze(conn, ora, &attesa_ms);
+        if (conn->sock == INVALID_SOCKET || conn->n_in_attesa == 0) continue; // Nulla da attendere, o chiusa da una callback
+        attese[n_attese].fd = conn->sock;
+        attese[n_attese].events = POLLRDNORM;
+        attese[n_attese].revents = 0;
+        servite[n_attese++] = conn;
+    }
+    if (n_attese == 0) return chiamate;
+    if (chiamate > 0) attesa_ms = 0; // Ci sono gia' eventi da restituire: si raccoglie solo quanto pronto
+
+    int pronti = WSAPoll(attese, (ULONG)n_attese, (int)attesa_ms);
+    if (pronti == SOCKET_ERROR) return -1;
+
+    ora = GetTickCount();
+    for (int i = 0; i < n_attese; i++) {
+        Connessione* conn = servite[i];
+        if (attese[i].revents != 0 && conn->sock == attese[i].fd) {
+            if (leggi_socket(conn)) {
+                chiamate += consegna_ricevuti(conn);
+            } else {
+                chiamate += chiudi_richieste(conn);
+                conn_chiudi(conn);
+                continue;
+            }
+        }
+        DWORD prossima = timeout_ms;
+        chiamate += controlla_scadenze(conn, ora, &prossima);
+    }
+    return chiamate;
+}
+
+int conn_campo_dati(const char* risposta, int len, char* dati, int max_dati) {
+    const char* inizio = risposta;
+    int dati_len = len;
+    if (len >= PACCHETTO_CORNICE && (unsigned char)risposta[0] == PACCHETTO_STX && (unsigned char)risposta[len - 1] == PACCHETTO_ETX &&
+        risposta[6] == 'N' && len - PACCHETTO_CORNICE <= PACCHETTO_MAX_DATI) {
+        inizio = risposta + PACCHETTO_INIZIO_DATI;
+        dati_len = len - PACCHETTO_CORNICE;
+    }
+    if (dati_len > max_dati - 1) dati_len = max_dati - 1;
+    memcpy(dati, inizio, (size_t)dati_len);
+    dati[dati_len] = '\0';
+    return dati_len;
+}
+
+void conn_chiudi(Connessione* conn) {
+    chiudi_richieste(conn);
+    if (conn->sock != INVALID_SOCKET) {
+        closesocket(conn->sock);
+        conn->sock = INVALID_SOCKET;
+    }
+    conn->ricezione_inizio = 0;
+    conn->ricezione_len = 0;
+    decodificatore_init(&conn->decodificatore);
+}
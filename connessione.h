@@ -0,0 +1,114 @@
+#ifndef CONNESSIONE_H
+#define CONNESSIONE_H
+
+#include <winsock2.h>
+#include <windows.h>
+#include "pacchetto.h"
+
+#define CONN_BUFFER_RICEZIONE 4096     // Byte letti dal socket e non ancora decodificati
+#define CONN_BUFFER_INVIO 8192         // Un lotto di comandi viene inviato con una sola send
+#define CONN_MAX_COMANDO 1024          // Lunghezza massima di un comando, terminatore compreso
+#define CONN_MAX_FRAME (PACCHETTO_MAX_DATI + PACCHETTO_CORNICE)
+#define CONN_MAX_IN_ATTESA 32          // Richieste asincrone in attesa di risposta per connessione
+#define CONN_MAX_POLL 1024             // Connessioni servite da una chiamata a conn_poll
+
+// Esito di un frame completato dal decodificatore
+typedef enum {
+    FRAME_NESSUNO = 0,      // Frame non ancora completo
+    FRAME_PACCHETTO,        // Pacchetto STX..ETX con CHK corretto
+    FRAME_TESTO,            // Riga di testo del gateway (es. "OK: FEED eseguito."), senza terminatore
+    FRAME_CHK_ERRATO,       // Pacchetto completo ma con CHK errato
+    FRAME_SCADUTO,          // Solo per le callback: scadenza della richiesta superata
+    FRAME_CONNESSIONE_CHIUSA // Solo per le callback: connessione chiusa o in errore
+} EsitoFrame;
+
+// Decodificatore incrementale dei frame ricevuti dal server. Riceve i byte cosi' come
+// arrivano dal socket (frame spezzati o piu' frame nella stessa lettura) e ricompone un
+// frame alla volta nel proprio buffer, senza allocazioni. I pacchetti sono delimitati dal
+// campo len; i byte che non formano un pacchetto valido vengono scartati fino al prossimo STX,
+// cercato anche tra i byte gia' ricevuti del pacchetto scartato.
+typedef struct {
+    char frame[CONN_MAX_FRAME + 1];     // Frame corrente, terminato da '\0' quando completo
+    int len;
+    int atteso;                         // Lunghezza totale del pacchetto in corso, 0 se non ancora nota
+    int stato;
+    unsigned long scartati;             // Byte scartati per risincronizzarsi
+    char da_rileggere[CONN_MAX_FRAME];  // Byte di un pacchetto scartato, dal primo STX successivo
+    int n_da_rileggere;
+} DecodificatoreFrame;
+
+typedef struct Connessione Connessione;
+
+// Completamento di una richiesta asincrona. risposta e' valida solo durante la chiamata
+// (vuota per FRAME_SCADUTO e FRAME_CONNESSIONE_CHIUSA). La callback puo' inviare nuove
+// richieste o chiudere la connessione.
+typedef void (*CallbackRisposta)(Connessione* conn, void* contesto, EsitoFrame esito, const char* risposta, int len);
+
+typedef struct {
+    CallbackRisposta callback;
+    void* contesto;
+    DWORD scadenza;                     // GetTickCount entro cui deve arrivare la risposta
+    BOOL scaduta;                       // Callback gia' chiamata: la risposta, se arriva, viene scartata
+} RichiestaInAttesa;
+
+// Connessione persistente al server. I comandi possono essere inviati in pipeline:
+// il server risponde nell'ordine dei comandi, una risposta per comando.
+struct Connessione {
+    SOCKET sock;
+    DecodificatoreFrame decodificatore;
+    char ricezione[CONN_BUFFER_RICEZIONE];
+    int ricezione_inizio;               // Primo byte letto non ancora passato al decodificatore
+    int ricezione_len;
+    RichiestaInAttesa in_attesa[CONN_MAX_IN_ATTESA]; // Coda circolare, nell'ordine di invio
+    int primo_in_attesa;
+    int n_in_attesa;
+};
+
+// Prepara il decodificatore per un nuovo flusso.
+void decodificatore_init(DecodificatoreFrame* dec);
+
+// Passa al decodificatore fino a len byte e si ferma al primo frame completato, indicato in
+// *esito (FRAME_NESSUNO se servono altri byte). Ritorna i byte consumati: quelli restanti vanno
+// ripassati dopo aver letto il frame, che resta valido fino alla chiamata successiva.
+int decodificatore_spingi(DecodificatoreFrame* dec, const char* dati, int len, EsitoFrame* esito);
+
+// Ritorna TRUE se restano byte gia' ricevuti da decodificare dopo il frame consegnato:
+// decodificatore_spingi va chiamata di nuovo anche senza nuovi byte (len = 0).
+BOOL decodificatore_da_rileggere(const DecodificatoreFrame* dec);
+
+// Si connette a host:porta (IPv4, IPv6 o nome) entro timeout_ms, che resta anche come timeout
+// di invio. Winsock deve essere gia' inizializzato.
+// Ritorna FALSE in caso di errore (il codice resta in WSAGetLastError).
+BOOL conn_apri(Connessione* conn, const char* host, int porta, DWORD timeout_ms);
+
+// Invia un comando, aggiungendo il terminatore di riga.
+BOOL conn_invia(Connessione* conn, const char* comando);
+
+// Invia in pipeline un lotto di comandi accodandoli in un unico buffer, senza attendere
+// le risposte. Ritorna il numero di comandi inviati (meno di n se il buffer si riempie), -1 in errore.
+int conn_invia_lotto(Connessione* conn, const char* const* comandi, int n);
+
+// Attende la prossima risposta: un pacchetto STX..ETX oppure una riga di testo, con il tipo in
+// *esito. Ritorna la lunghezza copiata in risposta (terminata da '\0'), 0 allo scadere del
+// timeout (con timeout 0 non attende), -1 se la connessione e' chiusa o in errore.
+int conn_ricevi(Connessione* conn, char* risposta, int max_len, EsitoFrame* esito, DWORD timeout_ms);
+
+// Invia un comando in modo asincrono: callback viene chiamata da conn_poll all'arrivo della
+// risposta oppure allo scadere di scadenza_ms. Ritorna FALSE se l'invio fallisce o se ci sono
+// gia' CONN_MAX_IN_ATTESA richieste in attesa. Su una connessione con richieste asincrone in
+// attesa non va usato conn_ricevi.
+BOOL conn_invia_async(Connessione* conn, const char* comando, DWORD scadenza_ms, CallbackRisposta callback, void* contesto);
+
+// Attende fino a timeout_ms eventi su tutte le connessioni con richieste in attesa (al piu'
+// CONN_MAX_POLL) e chiama le callback delle risposte arrivate e delle richieste scadute.
+// Ritorna il numero di callback chiamate, -1 in caso di errore di WSAPoll.
+int conn_poll(Connessione** connessioni, int n, DWORD timeout_ms);
+
+// Copia in dati il campo dati di una risposta a pacchetto, oppure la risposta intera
+// se non e' un pacchetto del protocollo. Ritorna la lunghezza copiata.
+int conn_campo_dati(const char* risposta, int len, char* dati, int max_dati);
+
+// Chiude la connessione; le richieste asincrone in attesa ricevono FRAME_CONNESSIONE_CHIUSA.
+void conn_chiudi(Connessione* conn);
+
+#endif // CONNESSIONE_H
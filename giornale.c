@@ -0,0 +1,362 @@
+#include "giornale.h"
+#include "pacchetto.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Formato del file: intestazione fissa seguita da record allineati a 8 byte.
+// Un record e' valido solo se la sua magia e il checksum corrispondono: la magia viene scritta
+// per ultima, quindi un record troncato da un crash viene ignorato e chiude il giornale.
+#define GIORNALE_MAGIA_FILE "GIORNSTM"
+#define GIORNALE_VERSIONE 1
+#define GIORNALE_MAGIA_RECORD 0x52474F4AUL   // "JOGR"
+#define ALLINEA_RECORD(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct {
+    char magia[8];
+    unsigned int versione;
+    unsigned int dimensione_intestazione;
+    unsigned char riservato[48];
+} IntestazioneGiornale;
+
+typedef struct {
+    volatile unsigned int magia;
+    unsigned short tipo;
+    unsigned short lunghezza;
+    unsigned long long sequenza;
+    unsigned long long riferimento;
+    FILETIME timestamp;
+    unsigned int checksum;
+    unsigned int riservato;
+} IntestazioneRecord;
+
+static HANDLE h_file = INVALID_HANDLE_VALUE;
+static HANDLE h_mappa = NULL;
+static unsigned char* vista = NULL;
+static char percorso_giornale[MAX_PATH];
+
+static volatile LONG64 offset_scrittura = 0;   // Fine dell'ultimo record scritto
+static LONG64 offset_sincronizzato = 0;        // Fine dell'ultimo record sincronizzato su disco
+static unsigned long long prossima_sequenza = 1;
+static RicostruzioneGiornale specchio;         // Stato corrente, scritto come istantanea a ogni rotazione
+
+static CRITICAL_SECTION cs_file;               // Serializza flush e rotazione (la scrittura ha un solo thread)
+static HANDLE evento_flush = NULL;
+static HANDLE h_thread_flush = NULL;
+static volatile BOOL giornale_attivo = FALSE;
+
+static volatile LONG cont_record = 0;
+static volatile LONG cont_sincronizzazioni = 0;
+static volatile LONG cont_rotazioni = 0;
+
+// FNV-1a su intestazione (esclusi magia e checksum) e dati
+static unsigned int calcola_checksum(const IntestazioneRecord* r, const unsigned char* dati) {
+    unsigned int h = 2166136261u;
+    const unsigned char* campi = (const unsigned char*)&r->tipo;
+    size_t campi_len = offsetof(IntestazioneRecord, checksum) - offsetof(IntestazioneRecord, tipo);
+    for (size_t i = 0; i < campi_len; i++) h = (h ^ campi[i]) * 16777619u;
+    for (int i = 0; i < r->lunghezza; i++) h = (h ^ dati[i]) * 16777619u;
+    return h;
+}
+
+// Ripercorre i record validi a partire dall'intestazione. Ritorna l'offset di fine dell'ultimo record valido.
+static size_t scandisci_record(const unsigned char* base, size_t dimensione, VisitaRecordGiornale visita, void* contesto, long* letti) {
+    size_t offset = sizeof(IntestazioneGiornale);
+    *letti = 0;
+    while (offset + sizeof(IntestazioneRecord) <= dimensione) {
+        const IntestazioneRecord* r = (const IntestazioneRecord*)(base + offset);
+        if (r->magia != GIORNALE_MAGIA_RECORD) break;
+        size_t totale = ALLINEA_RECORD(sizeof(IntestazioneRecord) + r->lunghezza);
+        if (offset + totale > dimensione) break;
+        const unsigned char* dati = base + offset + sizeof(IntestazioneRecord);
+        if (calcola_checksum(r, dati) != r->checksum) break;
+
+        RecordGiornale record;
+        record.tipo = (TipoRecordGiornale)r->tipo;
+        record.sequenza = r->sequenza;
+        record.riferimento = r->riferimento;
+        record.timestamp = r->timestamp;
+        record.dati = (const char*)dati;
+        record.lunghezza = r->lunghezza;
+        if (visita) visita(&record, contesto);
+        (*letti)++;
+        offset += totale;
+    }
+    return offset;
+}
+
+static BOOL intestazione_valida(const unsigned char* base, size_t dimensione) {
+    const IntestazioneGiornale* i = (const IntestazioneGiornale*)base;
+    return dimensione >= sizeof(IntestazioneGiornale) && memcmp(i->magia, GIORNALE_MAGIA_FILE, 8) == 0
+        && i->versione == GIORNALE_VERSIONE && i->dimensione_intestazione == sizeof(IntestazioneGiornale);
+}
+
+static void visita_ricostruzione(const RecordGiornale* record, void* contesto) {
+    giornale_applica_record((RicostruzioneGiornale*)contesto, record);
+}
+
+// Apre e mappa il file del giornale; un file nuovo (o non riconosciuto) viene azzerato.
+// Da chiamare con cs_file acquisita.
+static BOOL apri_file(const char* percorso) {
+    h_file = CreateFileA(percorso, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h_file == INVALID_HANDLE_VALUE) return FALSE;
+
+    // La mappatura estende il file alla dimensione del giornale: le pagine nuove sono a zero
+    h_mappa = CreateFileMapping(h_file, NULL, PAGE_READWRITE, 0, GIORNALE_DIMENSIONE, NULL);
+    if (h_mappa != NULL) vista = (unsigned char*)MapViewOfFile(h_mappa, FILE_MAP_WRITE, 0, 0, GIORNALE_DIMENSIONE);
+    if (vista == NULL) {
+        if (h_mappa) CloseHandle(h_mappa);
+        CloseHandle(h_file);
+        h_mappa = NULL;
+        h_file = INVALID_HANDLE_VALUE;
+        return FALSE;
+    }
+
+    if (!intestazione_valida(vista, GIORNALE_DIMENSIONE)) {
+        memset(vista, 0, GIORNALE_DIMENSIONE);
+        IntestazioneGiornale* i = (IntestazioneGiornale*)vista;
+        memcpy(i->magia, GIORNALE_MAGIA_FILE, 8);
+        i->versione = GIORNALE_VERSIONE;
+        i->dimensione_intestazione = sizeof(IntestazioneGiornale);
+        FlushViewOfFile(vista, 0);
+    }
+    long letti;
+    offset_scrittura = (LONG64)scandisci_record(vista, GIORNALE_DIMENSIONE, visita_ricostruzione, &specchio, &letti);
+    offset_sincronizzato = offset_scrittura;
+    return TRUE;
+}
+
+// Da chiamare con cs_file acquisita
+static void chiudi_file(void) {
+    if (vista) {
+        FlushViewOfFile(vista, 0);
+        FlushFileBuffers(h_file);
+        UnmapViewOfFile(vista);
+        vista = NULL;
+    }
+    if (h_mappa) CloseHandle(h_mappa);
+    if (h_file != INVALID_HANDLE_VALUE) CloseHandle(h_file);
+    h_mappa = NULL;
+    h_file = INVALID_HANDLE_VALUE;
+}
+
+// Sincronizza su disco i record scritti dall'ultimo flush (commit di gruppo)
+static void sincronizza(void) {
+    EnterCriticalSection(&cs_file);
+    LONG64 scritto = offset_scrittura;
+    if (vista != NULL && scritto > offset_sincronizzato) {
+        FlushViewOfFile(vista + offset_sincronizzato, (SIZE_T)(scritto - offset_sincronizzato));
+        FlushFileBuffers(h_file);
+        offset_sincronizzato = scritto;
+        cont_sincronizzazioni++;
+    }
+    LeaveCriticalSection(&cs_file);
+}
+
+static DWORD WINAPI thread_flush(LPVOID lpParam) {
+    (void)lpParam;
+    while (giornale_attivo) {
+        WaitForSingleObject(evento_flush, GIORNALE_INTERVALLO_FLUSH_MS);
+        sincronizza();
+    }
+    sincronizza();
+    return 0;
+}
+
+static unsigned long long scrivi_record(TipoRecordGiornale tipo, unsigned long long riferimento, const void* dati, int lunghezza);
+
+// Conserva il file pieno come .1 e ne apre uno nuovo che riparte dall'istantanea dello stato
+static BOOL ruota_file(void) {
+    char percorso_precedente[MAX_PATH + 2];
+    snprintf(percorso_precedente, sizeof(percorso_precedente), "%s.1", percorso_giornale);
+
+    EnterCriticalSection(&cs_file);
+    chiudi_file();
+    MoveFileExA(percorso_giornale, percorso_precedente, MOVEFILE_REPLACE_EXISTING);
+    RicostruzioneGiornale stato_corrente = specchio;
+    BOOL aperto = apri_file(percorso_giornale);
+    specchio = stato_corrente; // Se lo spostamento e' fallito la scansione ha riletto record gia' applicati
+    LeaveCriticalSection(&cs_file);
+    if (!aperto) return FALSE;
+
+    cont_rotazioni++;
+    scrivi_record(GIORNALE_ISTANTANEA, 0, &specchio.stato, (int)sizeof(specchio.stato));
+    return TRUE;
+}
+
+// Scrive un record nella vista mappata: dal ritorno il record sopravvive a un crash del processo,
+// la sincronizzazione su disco (per le cadute di alimentazione) avviene a gruppi nel thread di flush.
+static unsigned long long scrivi_record(TipoRecordGiornale tipo, unsigned long long riferimento, const void* dati, int lunghezza) {
+    if (lunghezza < 0) lunghezza = 0;
+    if (lunghezza > 0xFFFF) lunghezza = 0xFFFF;
+    size_t totale = ALLINEA_RECORD(sizeof(IntestazioneRecord) + (size_t)lunghezza);
+    if ((size_t)offset_scrittura + totale > GIORNALE_DIMENSIONE) {
+        // Se la rotazione fallisce (o il file non si libera) il giornale viene disattivato
+        if (!ruota_file() || (size_t)offset_scrittura + totale > GIORNALE_DIMENSIONE) {
+            giornale_attivo = FALSE;
+            return 0;
+        }
+    }
+
+    IntestazioneRecord* r = (IntestazioneRecord*)(vista + offset_scrittura);
+    unsigned char* payload = (unsigned char*)r + sizeof(IntestazioneRecord);
+    r->tipo = (unsigned short)tipo;
+    r->lunghezza = (unsigned short)lunghezza;
+    r->sequenza = prossima_sequenza++;
+    r->riferimento = riferimento;
+    GetSystemTimeAsFileTime(&r->timestamp);
+    r->riservato = 0;
+    if (lunghezza > 0) memcpy(payload, dati, (size_t)lunghezza);
+    r->checksum = calcola_checksum(r, payload);
+    MemoryBarrier();
+    r->magia = GIORNALE_MAGIA_RECORD;
+
+    LONG64 fine = offset_scrittura + (LONG64)totale;
+    InterlockedExchange64(&offset_scrittura, fine);
+    cont_record++;
+    if (fine - offset_sincronizzato >= GIORNALE_BATCH_FLUSH) SetEvent(evento_flush);
+
+    RecordGiornale record = { tipo, r->sequenza, riferimento, r->timestamp, (const char*)payload, lunghezza };
+    giornale_applica_record(&specchio, &record);
+    return record.sequenza;
+}
+
+BOOL giornale_init(const char* percorso, RicostruzioneGiornale* ricostruzione) {
+    strncpy(percorso_giornale, percorso, sizeof(percorso_giornale) - 1);
+    percorso_giornale[sizeof(percorso_giornale) - 1] = '\0';
+    giornale_ricostruzione_init(&specchio);
+    InitializeCriticalSection(&cs_file);
+
+    EnterCriticalSection(&cs_file);
+    BOOL aperto = apri_file(percorso_giornale);
+    LeaveCriticalSection(&cs_file);
+    if (ricostruzione) *ricostruzione = specchio;
+    if (!aperto) {
+        DeleteCriticalSection(&cs_file);
+        return FALSE;
+    }
+    prossima_sequenza = specchio.ultima_sequenza + 1;
+
+    evento_flush = CreateEvent(NULL, FALSE, FALSE, NULL);
+    giornale_attivo = TRUE;
+    h_thread_flush = CreateThread(NULL, 0, thread_flush, NULL, 0, NULL);
+    if (h_thread_flush == NULL) {
+        giornale_attivo = FALSE;
+        CloseHandle(evento_flush);
+        evento_flush = NULL;
+        EnterCriticalSection(&cs_file);
+        chiudi_file();
+        LeaveCriticalSection(&cs_file);
+        DeleteCriticalSection(&cs_file);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+unsigned long long giornale_registra_comando(const char* pacchetto, int pacchetto_len) {
+    if (!giornale_attivo) return 0;
+    return scrivi_record(GIORNALE_COMANDO, 0, pacchetto, pacchetto_len);
+}
+
+void giornale_registra_risposta(unsigned long long sequenza, const char* risposta, int risposta_len) {
+    if (!giornale_attivo || sequenza == 0) return;
+    scrivi_record(GIORNALE_RISPOSTA, sequenza, risposta, risposta_len);
+}
+
+void giornale_statistiche(LONG* record, LONG* sincronizzazioni, LONG* rotazioni) {
+    if (record) *record = cont_record;
+    if (sincronizzazioni) *sincronizzazioni = cont_sincronizzazioni;
+    if (rotazioni) *rotazioni = cont_rotazioni;
+}
+
+void giornale_cleanup(void) {
+    if (h_thread_flush == NULL) return;
+
+    giornale_attivo = FALSE;
+    SetEvent(evento_flush);
+    WaitForSingleObject(h_thread_flush, INFINITE);
+    CloseHandle(h_thread_flush);
+    CloseHandle(evento_flush);
+    h_thread_flush = NULL;
+    evento_flush = NULL;
+
+    EnterCriticalSection(&cs_file);
+    chiudi_file();
+    LeaveCriticalSection(&cs_file);
+    DeleteCriticalSection(&cs_file);
+}
+
+long giornale_leggi_file(const char* percorso, VisitaRecordGiornale visita, void* contesto) {
+    FILE* f = fopen(percorso, "rb");
+    if (f == NULL) return -1;
+
+    unsigned char* contenuto = (unsigned char*)malloc(GIORNALE_DIMENSIONE);
+    size_t letti_byte = contenuto ? fread(contenuto, 1, GIORNALE_DIMENSIONE, f) : 0;
+    fclose(f);
+    if (contenuto == NULL || !intestazione_valida(contenuto, letti_byte)) {
+        free(contenuto);
+        return -1;
+    }
+
+    long letti;
+    scandisci_record(contenuto, letti_byte, visita, contesto, &letti);
+    free(contenuto);
+    return letti;
+}
+
+void giornale_ricostruzione_init(RicostruzioneGiornale* ricostruzione) {
+    memset(ricostruzione, 0, sizeof(*ricostruzione));
+    ricostruzione->stato.chiave = CHIAVE_SCONOSCIUTA;
+}
+
+// Individua il campo dati di un pacchetto registrato: solo un pacchetto completo e con CHK corretto
+static BOOL dati_pacchetto(const char* pacchetto, int pacchetto_len, const char** dati, int* dati_len) {
+    VistaPacchetto vista;
+    if (!pacchetto_trova(pacchetto, pacchetto_len, &vista)) return FALSE;
+    *dati = vista.byte + PACCHETTO_INIZIO_DATI;
+    *dati_len = vista.lunghezza - PACCHETTO_CORNICE;
+    return TRUE;
+}
+
+BOOL giornale_leggi_istantanea(const RecordGiornale* record, StatoStampante* stato) {
+    // I campi aggiunti in coda a StatoStampante mancano nelle istantanee precedenti e restano a zero
+    if (record->lunghezza < (int)offsetof(StatoStampante, sessione_documento) || record->lunghezza > (int)sizeof(StatoStampante)) {
+        return FALSE;
+    }
+    memset(stato, 0, sizeof(*stato));
+    memcpy(stato, record->dati, (size_t)record->lunghezza);
+    return TRUE;
+}
+
+void giornale_applica_record(RicostruzioneGiornale* ricostruzione, const RecordGiornale* record) {
+    ricostruzione->record++;
+    if (record->sequenza > ricostruzione->ultima_sequenza) ricostruzione->ultima_sequenza = record->sequenza;
+
+    const char* dati;
+    int dati_len;
+    switch (record->tipo) {
+        case GIORNALE_ISTANTANEA:
+            giornale_leggi_istantanea(record, &ricostruzione->stato);
+            break;
+        case GIORNALE_COMANDO:
+            ricostruzione->comandi++;
+            if (!dati_pacchetto(record->dati, record->lunghezza, &dati, &dati_len)
+                || comando_analizza(dati, dati_len, &ricostruzione->comando_in_sospeso) != NULL) {
+                ricostruzione->comando_in_sospeso.codice = CMD_SCONOSCIUTO;
+            }
+            ricostruzione->sequenza_in_sospeso = record->sequenza;
+            break;
+        case GIORNALE_RISPOSTA:
+            if (record->riferimento != ricostruzione->sequenza_in_sospeso) break;
+            // Stesso aggiornamento del server: applicato, riallineato (<?s) o segnato come incerto
+            if (comando_registra_risposta(&ricostruzione->stato, &ricostruzione->comando_in_sospeso, record->dati, record->lunghezza)) {
+                ricostruzione->stato.versione++;
+            }
+            if (!pacchetto_risposta_positiva(record->dati, record->lunghezza, NULL)) {
+                ricostruzione->comandi_rifiutati++;
+            }
+            ricostruzione->sequenza_in_sospeso = 0;
+            break;
+    }
+}
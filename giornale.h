@@ -0,0 +1,73 @@
+#ifndef GIORNALE_H
+#define GIORNALE_H
+
+#include <windows.h>
+#include "comandi.h"
+
+#define GIORNALE_FILE_DEFAULT "giornale_stampante.bin" // File del giornale (il precedente viene conservato come .1)
+#define GIORNALE_DIMENSIONE (8 * 1024 * 1024)          // Dimensione del file mappato in memoria
+#define GIORNALE_INTERVALLO_FLUSH_MS 20                // Intervallo massimo tra due sincronizzazioni su disco
+#define GIORNALE_BATCH_FLUSH 4096                      // Byte non sincronizzati oltre cui si anticipa il flush
+
+// Tipo di record del giornale
+typedef enum {
+    GIORNALE_COMANDO = 1,     // Pacchetto inviato alla stampante
+    GIORNALE_RISPOSTA = 2,    // Risposta della stampante (riferimento = sequenza del comando)
+    GIORNALE_ISTANTANEA = 3   // Stato ricostruito (StatoStampante) scritto all'inizio di un nuovo file
+} TipoRecordGiornale;
+
+// Record letto dal giornale
+typedef struct {
+    TipoRecordGiornale tipo;
+    unsigned long long sequenza;
+    unsigned long long riferimento;  // Per le risposte: sequenza del comando
+    FILETIME timestamp;
+    const char* dati;
+    int lunghezza;
+} RecordGiornale;
+
+typedef void (*VisitaRecordGiornale)(const RecordGiornale* record, void* contesto);
+
+// Stato della stampante ricostruito ripercorrendo il giornale
+typedef struct {
+    StatoStampante stato;
+    long record;                              // Record validi letti
+    long comandi;                             // Comandi inviati alla stampante
+    long comandi_rifiutati;                   // Comandi con risposta negativa o assente
+    unsigned long long ultima_sequenza;
+    unsigned long long sequenza_in_sospeso;   // Ultimo comando senza risposta registrata (0 = nessuno)
+    ComandoStampante comando_in_sospeso;
+} RicostruzioneGiornale;
+
+// Apre (o crea) il giornale mappandolo in memoria, ripercorre i record presenti per ricostruire
+// lo stato della stampante e avvia il thread che sincronizza il file su disco a gruppi.
+BOOL giornale_init(const char* percorso, RicostruzioneGiornale* ricostruzione);
+
+// Registra un pacchetto inviato alla stampante e ne ritorna il numero di sequenza (0 se il giornale non e' attivo).
+// Le funzioni di registrazione vanno chiamate da un solo thread (il thread della coda stampante).
+unsigned long long giornale_registra_comando(const char* pacchetto, int pacchetto_len);
+
+// Registra la risposta (o la sua assenza, con risposta_len <= 0) al comando con la sequenza indicata.
+void giornale_registra_risposta(unsigned long long sequenza, const char* risposta, int risposta_len);
+
+// Restituisce i contatori del giornale.
+void giornale_statistiche(LONG* record, LONG* sincronizzazioni, LONG* rotazioni);
+
+// Sincronizza i record pendenti e chiude il giornale.
+void giornale_cleanup(void);
+
+// Legge un file di giornale (anche mentre il server lo sta scrivendo) chiamando visita per ogni record valido.
+// Ritorna il numero di record letti, -1 se il file non e' leggibile o non e' un giornale.
+long giornale_leggi_file(const char* percorso, VisitaRecordGiornale visita, void* contesto);
+
+// Inizializza una ricostruzione vuota (chiave sconosciuta, nessun documento aperto).
+void giornale_ricostruzione_init(RicostruzioneGiornale* ricostruzione);
+
+// Legge lo stato di un record GIORNALE_ISTANTANEA. Accetta anche le istantanee scritte prima
+// dell'aggiunta di sessione_documento e incerto (campi azzerati). Ritorna FALSE se il formato non e' riconosciuto.
+BOOL giornale_leggi_istantanea(const RecordGiornale* record, StatoStampante* stato);
+
+// Applica un record alla ricostruzione dello stato.
+void giornale_applica_record(RicostruzioneGiornale* ricostruzione, const RecordGiornale* record);
+
+#endif // GIORNALE_H
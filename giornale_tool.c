@@ -0,0 +1,143 @@
+/*
+ * File: giornale_tool.c
+ * Descrizione: Strumento di consultazione del giornale della stampante
+ *              dump   : elenca i record (comandi, risposte, istantanee) in forma leggibile
+ *              replay : ripercorre i comandi ricostruendo i documenti commerciali per le verifiche
+ *              Il giornale puo' essere letto anche mentre il server e' in esecuzione.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+#include "giornale.h"
+
+// Stampa data e ora locali del record
+static void stampa_timestamp(const FILETIME* timestamp) {
+    FILETIME locale;
+    SYSTEMTIME st;
+    FileTimeToLocalFileTime(timestamp, &locale);
+    FileTimeToSystemTime(&locale, &st);
+    printf("%04d-%02d-%02d %02d:%02d:%02d.%03d", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+}
+
+// Stampa i dati come testo, sostituendo i caratteri di controllo con <XX>
+static void stampa_dati(const char* dati, int lunghezza) {
+    for (int i = 0; i < lunghezza; i++) {
+        unsigned char c = (unsigned char)dati[i];
+        if (c >= 32 && c <= 126) putchar(c); else printf("<%02X>", c);
+    }
+}
+
+static void visita_dump(const RecordGiornale* record, void* contesto) {
+    (void)contesto;
+    printf("%8llu  ", record->sequenza);
+    stampa_timestamp(&record->timestamp);
+    switch (record->tipo) {
+        case GIORNALE_COMANDO:
+            printf("  CMD         ");
+            stampa_dati(record->dati, record->lunghezza);
+            break;
+        case GIORNALE_RISPOSTA:
+            printf("  RIS %-7llu ", record->riferimento);
+            if (record->lunghezza > 0) stampa_dati(record->dati, record->lunghezza); else printf("(nessuna risposta)");
+            break;
+        case GIORNALE_ISTANTANEA: {
+            StatoStampante stato;
+            if (giornale_leggi_istantanea(record, &stato)) {
+                printf("  ISTANTANEA  CHIAVE=%d DOC=%d RIGHE=%d TOTALE=%d", stato.chiave, stato.documento_aperto, stato.righe_documento, stato.totale);
+            } else {
+                printf("  ISTANTANEA  (formato non riconosciuto)");
+            }
+            break;
+        }
+        default:
+            printf("  TIPO %d (%d byte)", (int)record->tipo, record->lunghezza);
+            break;
+    }
+    printf("\n");
+}
+
+// Contesto del replay: stato ricostruito e riepilogo dei documenti chiusi
+typedef struct {
+    RicostruzioneGiornale ricostruzione;
+    long documenti_chiusi;
+    long documenti_annullati;
+    long long incasso_totale;
+} ContestoReplay;
+
+static void visita_replay(const RecordGiornale* record, void* contesto) {
+    ContestoReplay* replay = (ContestoReplay*)contesto;
+    StatoStampante prima = replay->ricostruzione.stato;
+    ComandoStampante comando = replay->ricostruzione.comando_in_sospeso;
+    giornale_applica_record(&replay->ricostruzione, record);
+    if (record->tipo != GIORNALE_RISPOSTA) return;
+
+    const StatoStampante* dopo = &replay->ricostruzione.stato;
+    BOOL accettato = dopo->versione != prima.versione;
+    printf("%8llu  %-18s %s", record->riferimento, comando_nome(comando.codice), accettato ? "OK " : "RIF");
+    if (accettato && comando.codice == CMD_REGISTRA) {
+        printf("  reparto %d, importo %d -> totale %d", comando.reparto, comando.importo, dopo->totale);
+    }
+    printf("\n");
+
+    // Fine di un documento: riepilogo
+    if (prima.documento_aperto && !dopo->documento_aperto) {
+        if (comando.codice == CMD_TOTALE || comando.codice == CMD_CHIUDI_DOC) {
+            replay->documenti_chiusi++;
+            replay->incasso_totale += prima.totale;
+            printf("          --- Documento chiuso: %d righe, totale %d ---\n", prima.righe_documento, prima.totale);
+        } else {
+            replay->documenti_annullati++;
+            printf("          --- Documento annullato: %d righe, totale %d ---\n", prima.righe_documento, prima.totale);
+        }
+    }
+}
+
+static void stampa_uso(const char* programma) {
+    printf("Uso: %s dump|replay [file giornale]\n", programma);
+    printf("     file giornale predefinito: %s\n", GIORNALE_FILE_DEFAULT);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        stampa_uso(argv[0]);
+        return 1;
+    }
+    const char* percorso = argc >= 3 ? argv[2] : GIORNALE_FILE_DEFAULT;
+    long letti;
+
+    if (strcmp(argv[1], "dump") == 0) {
+        letti = giornale_leggi_file(percorso, visita_dump, NULL);
+        if (letti < 0) {
+            printf("Impossibile leggere il giornale %s.\n", percorso);
+            return 1;
+        }
+        printf("%ld record.\n", letti);
+    } else if (strcmp(argv[1], "replay") == 0) {
+        ContestoReplay replay;
+        memset(&replay, 0, sizeof(replay));
+        giornale_ricostruzione_init(&replay.ricostruzione);
+        letti = giornale_leggi_file(percorso, visita_replay, &replay);
+        if (letti < 0) {
+            printf("Impossibile leggere il giornale %s.\n", percorso);
+            return 1;
+        }
+        const StatoStampante* stato = &replay.ricostruzione.stato;
+        printf("\n%ld comandi (%ld rifiutati), %ld documenti chiusi per un totale di %lld, %ld annullati.\n",
+               replay.ricostruzione.comandi, replay.ricostruzione.comandi_rifiutati,
+               replay.documenti_chiusi, replay.incasso_totale, replay.documenti_annullati);
+        if (stato->documento_aperto) {
+            printf("Documento ancora aperto: %d righe, totale %d.\n", stato->righe_documento, stato->totale);
+        }
+        if (replay.ricostruzione.sequenza_in_sospeso != 0) {
+            printf("Ultimo comando (%s, sequenza %llu) senza risposta registrata.\n",
+                   comando_nome(replay.ricostruzione.comando_in_sospeso.codice), replay.ricostruzione.sequenza_in_sospeso);
+        }
+    } else {
+        stampa_uso(argv[0]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,227 @@
+#include "latenza_stampante.h"
+#include <stdio.h>
+#include <string.h>
+
+// Limiti di una classe: scadenza usata finche' non ci sono abbastanza misure,
+// e intervallo entro cui resta la scadenza calcolata
+typedef struct {
+    const char* nome;
+    DWORD iniziale_ms;
+    DWORD minima_ms;
+    DWORD massima_ms;
+} LimitiClasse;
+
+// Le operazioni lunghe hanno come minimo la scadenza iniziale: una chiusura Z puo' durare minuti
+// anche quando le misure precedenti sono state tutte brevi. Le chiusure del documento stampano
+// totale e piede dello scontrino: una scadenza sul p99 delle righe le farebbe fallire dopo che la
+// stampante le ha eseguite, e non si possono ritentare senza rischiare un secondo scontrino.
+static const LimitiClasse limiti[LATENZA_NUM_CLASSI] = {
+    { "interrogazioni", 3000, 30, 5000 },
+    { "operazioni", 10000, 100, 30000 },
+    { "chiusure", 15000, 10000, 60000 },
+    { "lunghe", 120000, 120000, 300000 }
+};
+
+// Misure di una classe. L'istogramma a intervalli logaritmici approssima i percentili
+// con memoria costante; il dimezzamento periodico lo fa seguire i cambi di comportamento
+// della stampante (es. carta in esaurimento, linea piu' lenta).
+typedef struct {
+    DWORD conteggi[LATENZA_NUM_INTERVALLI];
+    DWORD totale;                  // Somma dei conteggi (dopo i dimezzamenti)
+    LONG64 media_us;               // Media mobile esponenziale (peso 1/8)
+    LONG64 variazione_us;          // Scarto medio dalla media (peso 1/4)
+    LONG campioni;
+    LONG scadute;
+    int scadute_consecutive;
+} MisureClasse;
+
+static MisureClasse misure[LATENZA_NUM_CLASSI];
+static DWORD limite_intervallo[LATENZA_NUM_INTERVALLI]; // Estremo superiore di ogni intervallo (ms)
+static int scadenze_consecutive = 0;                   // Su tutte le classi
+static CRITICAL_SECTION cs_latenza;
+static BOOL latenza_pronta = FALSE;
+
+// Prefissi dei comandi lunghi (scritti solo da latenza_init, prima dei thread)
+static char comandi_lunghi[LATENZA_MAX_COMANDI_LUNGHI][LATENZA_MAX_PREFISSO];
+static int comandi_lunghi_len[LATENZA_MAX_COMANDI_LUNGHI];
+static int num_comandi_lunghi = 0;
+
+void latenza_init(const char* elenco_lunghi) {
+    // Scompone la lista "pref1,pref2,..." ignorando spazi e voci vuote
+    num_comandi_lunghi = 0;
+    const char* p = elenco_lunghi ? elenco_lunghi : "";
+    while (*p && num_comandi_lunghi < LATENZA_MAX_COMANDI_LUNGHI) {
+        while (*p == ',' || *p == ' ') p++;
+        const char* fine = p;
+        while (*fine && *fine != ',') fine++;
+        int len = (int)(fine - p);
+        while (len > 0 && p[len - 1] == ' ') len--;
+        if (len > 0 && len < LATENZA_MAX_PREFISSO) {
+            memcpy(comandi_lunghi[num_comandi_lunghi], p, (size_t)len);
+            comandi_lunghi_len[num_comandi_lunghi] = len;
+            num_comandi_lunghi++;
+        }
+        p = fine;
+    }
+
+    if (!latenza_pronta) {
+        InitializeCriticalSection(&cs_latenza);
+        latenza_pronta = TRUE;
+    }
+    EnterCriticalSection(&cs_latenza);
+    memset(misure, 0, sizeof(misure));
+    scadenze_consecutive = 0;
+    double limite = 1.0;
+    for (int i = 0; i < LATENZA_NUM_INTERVALLI; i++) {
+        limite_intervallo[i] = (DWORD)(limite + 0.999);
+        limite *= 1.25; // Errore massimo del percentile: 25%
+    }
+    LeaveCriticalSection(&cs_latenza);
+}
+
+BOOL latenza_comando_lungo(const char* comando, int comando_len) {
+    for (int i = 0; i < num_comandi_lunghi; i++) {
+        if (comando_len >= comandi_lunghi_len[i] && memcmp(comando, comandi_lunghi[i], (size_t)comandi_lunghi_len[i]) == 0) return TRUE;
+    }
+    return FALSE;
+}
+
+ClasseLatenza latenza_classe(CodiceComando codice, const char* comando, int comando_len) {
+    switch (codice) {
+        case CMD_RICHIESTA_STATO:
+        case CMD_RICHIESTA_DATA:
+            return CLASSE_INTERROGAZIONE;
+        case CMD_TOTALE:
+        case CMD_CHIUDI_DOC:
+        case CMD_ANNULLA_DOC:
+            return CLASSE_CHIUSURA;
+        case CMD_SCONOSCIUTO:
+            // Senza prefissi configurati non si sa quali comandi sono lunghi: tutti hanno la scadenza generosa
+            if (num_comandi_lunghi == 0 || latenza_comando_lungo(comando, comando_len)) return CLASSE_LUNGA;
+            return CLASSE_OPERAZIONE;
+        default:
+            return CLASSE_OPERAZIONE;
+    }
+}
+
+// Percentile (0-100) dall'istogramma, arrotondato all'estremo superiore dell'intervallo
+// (da chiamare con cs_latenza acquisita)
+static DWORD percentile(const MisureClasse* m, int p) {
+    if (m->totale == 0) return 0;
+    DWORD soglia = (DWORD)(((unsigned long long)m->totale * (unsigned)p + 99) / 100);
+    DWORD cumulati = 0;
+    for (int i = 0; i < LATENZA_NUM_INTERVALLI; i++) {
+        cumulati += m->conteggi[i];
+        if (cumulati >= soglia) return limite_intervallo[i];
+    }
+    return limite_intervallo[LATENZA_NUM_INTERVALLI - 1];
+}
+
+// (da chiamare con cs_latenza acquisita)
+static DWORD calcola_scadenza(ClasseLatenza classe) {
+    const MisureClasse* m = &misure[classe];
+    const LimitiClasse* l = &limiti[classe];
+    DWORD scadenza;
+    if (m->campioni < LATENZA_MIN_CAMPIONI) {
+        scadenza = l->iniziale_ms;
+    } else {
+        // Il doppio del p99 copre le code dell'istogramma; media + 4 scarti reagisce
+        // prima a un peggioramento improvviso, quando il p99 non si e' ancora spostato
+        DWORD da_percentile = percentile(m, 99) * 2;
+        DWORD da_media = (DWORD)((m->media_us + 4 * m->variazione_us) / 1000) + 1;
+        scadenza = da_percentile > da_media ? da_percentile : da_media;
+        if (scadenza < l->minima_ms) scadenza = l->minima_ms;
+    }
+    int raddoppi = m->scadute_consecutive < LATENZA_MAX_RADDOPPI ? m->scadute_consecutive : LATENZA_MAX_RADDOPPI;
+    scadenza <<= raddoppi;
+    return scadenza > l->massima_ms ? l->massima_ms : scadenza;
+}
+
+DWORD latenza_scadenza(ClasseLatenza classe) {
+    if (!latenza_pronta) return limiti[classe].iniziale_ms;
+    EnterCriticalSection(&cs_latenza);
+    DWORD scadenza = calcola_scadenza(classe);
+    LeaveCriticalSection(&cs_latenza);
+    return scadenza;
+}
+
+DWORD latenza_ritrasmissione(ClasseLatenza classe) {
+    if (!latenza_pronta) return 0;
+    EnterCriticalSection(&cs_latenza);
+    const MisureClasse* m = &misure[classe];
+    DWORD attesa = 0;
+    if (m->campioni >= LATENZA_MIN_CAMPIONI) {
+        attesa = percentile(m, 99);
+        if (attesa < limiti[classe].minima_ms) attesa = limiti[classe].minima_ms;
+    }
+    LeaveCriticalSection(&cs_latenza);
+    return attesa;
+}
+
+void latenza_registra(ClasseLatenza classe, LONG64 us) {
+    if (!latenza_pronta) return;
+    if (us < 0) us = 0;
+    DWORD ms = (DWORD)((us + 999) / 1000);
+    int intervallo = 0;
+    while (intervallo < LATENZA_NUM_INTERVALLI - 1 && ms > limite_intervallo[intervallo]) intervallo++;
+
+    EnterCriticalSection(&cs_latenza);
+    MisureClasse* m = &misure[classe];
+    if (m->totale >= LATENZA_FINESTRA) {
+        m->totale = 0;
+        for (int i = 0; i < LATENZA_NUM_INTERVALLI; i++) {
+            m->conteggi[i] /= 2;
+            m->totale += m->conteggi[i];
+        }
+    }
+    m->conteggi[intervallo]++;
+    m->totale++;
+
+    if (m->campioni == 0) {
+        m->media_us = us;
+        m->variazione_us = us / 2;
+    } else {
+        LONG64 scarto = us > m->media_us ? us - m->media_us : m->media_us - us;
+        m->variazione_us += (scarto - m->variazione_us) / 4;
+        m->media_us += (us - m->media_us) / 8;
+    }
+    m->campioni++;
+    m->scadute_consecutive = 0;
+    scadenze_consecutive = 0;
+    LeaveCriticalSection(&cs_latenza);
+}
+
+void latenza_registra_scaduta(ClasseLatenza classe) {
+    if (!latenza_pronta) return;
+    EnterCriticalSection(&cs_latenza);
+    misure[classe].scadute++;
+    misure[classe].scadute_consecutive++;
+    scadenze_consecutive++;
+    LeaveCriticalSection(&cs_latenza);
+}
+
+BOOL latenza_stampante_muta(void) {
+    if (!latenza_pronta) return FALSE;
+    EnterCriticalSection(&cs_latenza);
+    BOOL muta = scadenze_consecutive >= LATENZA_SOGLIA_MUTA;
+    LeaveCriticalSection(&cs_latenza);
+    return muta;
+}
+
+void latenza_statistiche(ClasseLatenza classe, StatisticheLatenza* statistiche) {
+    memset(statistiche, 0, sizeof(*statistiche));
+    if (!latenza_pronta) return;
+    EnterCriticalSection(&cs_latenza);
+    const MisureClasse* m = &misure[classe];
+    statistiche->campioni = m->campioni;
+    statistiche->scadute = m->scadute;
+    statistiche->media_ms = (DWORD)(m->media_us / 1000);
+    statistiche->p50_ms = percentile(m, 50);
+    statistiche->p99_ms = percentile(m, 99);
+    statistiche->scadenza_ms = calcola_scadenza(classe);
+    LeaveCriticalSection(&cs_latenza);
+}
+
+const char* latenza_nome_classe(ClasseLatenza classe) {
+    return classe < LATENZA_NUM_CLASSI ? limiti[classe].nome : "?";
+}
@@ -0,0 +1,70 @@
+#ifndef LATENZA_STAMPANTE_H
+#define LATENZA_STAMPANTE_H
+
+#include <windows.h>
+#include "comandi.h"
+
+#define LATENZA_NUM_INTERVALLI 60      // Intervalli dell'istogramma, in scala logaritmica da 1 ms a circa 10 minuti
+#define LATENZA_FINESTRA 256           // Campioni dopo cui l'istogramma viene dimezzato (le misure vecchie pesano meno)
+#define LATENZA_MIN_CAMPIONI 8         // Sotto questa soglia si usa la scadenza iniziale della classe
+#define LATENZA_MAX_RADDOPPI 3         // Dopo ogni scadenza consecutiva la scadenza raddoppia, fino a 8 volte
+#define LATENZA_SOGLIA_MUTA 3          // Scadenze consecutive dopo cui la stampante e' considerata non raggiungibile
+#define LATENZA_MAX_COMANDI_LUNGHI 16  // Prefissi configurabili dei comandi lunghi
+#define LATENZA_MAX_PREFISSO 16        // Lunghezza massima di un prefisso
+
+// Classi di comandi con tempi di risposta molto diversi
+typedef enum {
+    CLASSE_INTERROGAZIONE = 0, // Richieste di stato e data: poche decine di ms
+    CLASSE_OPERAZIONE,         // Comandi di documento e di configurazione riconosciuti
+    CLASSE_CHIUSURA,           // Totale, chiusura e annullo del documento: stampano e non si possono ripetere
+    CLASSE_LUNGA,              // Report, chiusure Z, export del giornale: scadenza mai sotto i 2 minuti
+    LATENZA_NUM_CLASSI
+} ClasseLatenza;
+
+// Stato delle misure di una classe (vedi latenza_statistiche)
+typedef struct {
+    LONG campioni;             // Risposte complete misurate
+    LONG scadute;              // Risposte non arrivate entro la scadenza
+    DWORD media_ms;            // Media mobile esponenziale
+    DWORD p50_ms;
+    DWORD p99_ms;
+    DWORD scadenza_ms;         // Scadenza che verrebbe usata ora
+} StatisticheLatenza;
+
+// Azzera le misure e imposta i prefissi dei comandi lunghi, separati da virgola (es. "=C10,=C3/").
+// Con una lista vuota tutti i comandi non riconosciuti sono considerati lunghi.
+// Da chiamare prima di avviare il thread della coda stampante.
+void latenza_init(const char* comandi_lunghi);
+
+// Classe del comando (codice come analizzato da comando_analizza, comando senza cornice).
+ClasseLatenza latenza_classe(CodiceComando codice, const char* comando, int comando_len);
+
+// Ritorna TRUE se il comando inizia con uno dei prefissi dei comandi lunghi configurati
+// (FALSE con la lista vuota).
+BOOL latenza_comando_lungo(const char* comando, int comando_len);
+
+// Tempo entro cui deve arrivare la risposta completa a un comando della classe: deriva dal
+// 99-esimo percentile e dalla media mobile osservati, entro i limiti della classe.
+DWORD latenza_scadenza(ClasseLatenza classe);
+
+// Attesa dopo cui conviene ritrasmettere un comando idempotente la cui risposta non e' ancora
+// arrivata: il 99-esimo percentile della classe (solo l'1% delle risposte arriva piu' tardi).
+// Ritorna 0 se le misure sono ancora troppo poche per deciderlo.
+DWORD latenza_ritrasmissione(ClasseLatenza classe);
+
+// Registra la latenza (dall'invio all'ETX) di una risposta completa.
+void latenza_registra(ClasseLatenza classe, LONG64 us);
+
+// Registra una risposta non arrivata entro la scadenza.
+void latenza_registra_scaduta(ClasseLatenza classe);
+
+// Ritorna TRUE se le ultime LATENZA_SOGLIA_MUTA richieste sono tutte scadute.
+BOOL latenza_stampante_muta(void);
+
+// Restituisce le misure di una classe.
+void latenza_statistiche(ClasseLatenza classe, StatisticheLatenza* statistiche);
+
+// Nome leggibile della classe (per i log).
+const char* latenza_nome_classe(ClasseLatenza classe);
+
+#endif // LATENZA_STAMPANTE_H
@@ -0,0 +1,203 @@
+#include "limite_client.h"
+#include <stdio.h>
+#include <string.h>
+
+// Limite configurato per una classe e un ambito
+typedef struct {
+    volatile LONG al_minuto;
+    volatile LONG raffica;
+} LimiteClasse;
+
+// Stato di una voce della tabella degli indirizzi
+typedef enum {
+    IP_LIBERO = 0,
+    IP_IN_SCRITTURA,   // Un thread sta copiando l'indirizzo
+    IP_PRONTO
+} StatoIp;
+
+typedef struct {
+    volatile LONG stato;
+    DWORD hash;
+    char ip[LIMITE_MAX_TESTO_IP];
+    LimiteClient limite;
+} VoceIp;
+
+static LimiteClasse limiti[LIMITE_NUM_AMBITI][LATENZA_NUM_CLASSI];
+// Le voci si occupano e non si liberano mai: i puntatori restituiti da limite_ip restano validi.
+// L'ultima e' condivisa dagli indirizzi che non trovano posto.
+static VoceIp tabella_ip[LIMITE_MAX_IP];
+
+#define TOKEN 1000 // Un token in millesimi
+
+void limite_init(void) {
+    static const DWORD predefiniti[LATENZA_NUM_CLASSI][2] = {
+        { LIMITE_SESSIONE_INTERROGAZIONI_MINUTO, LIMITE_SESSIONE_INTERROGAZIONI_RAFFICA },
+        { LIMITE_SESSIONE_OPERAZIONI_MINUTO, LIMITE_SESSIONE_OPERAZIONI_RAFFICA },
+        { LIMITE_SESSIONE_CHIUSURE_MINUTO, LIMITE_SESSIONE_CHIUSURE_RAFFICA },
+        { LIMITE_SESSIONE_LUNGHE_MINUTO, LIMITE_SESSIONE_LUNGHE_RAFFICA }
+    };
+    for (int i = 0; i < LATENZA_NUM_CLASSI; i++) {
+        limite_configura((ClasseLatenza)i, LIMITE_SESSIONE, predefiniti[i][0], predefiniti[i][1]);
+        limite_configura((ClasseLatenza)i, LIMITE_IP, predefiniti[i][0] * LIMITE_IP_FATTORE, predefiniti[i][1] * LIMITE_IP_FATTORE);
+    }
+    VoceIp* altri = &tabella_ip[LIMITE_MAX_IP - 1];
+    strcpy(altri->ip, "altri");
+    altri->stato = IP_PRONTO;
+}
+
+void limite_configura(ClasseLatenza classe, AmbitoLimite ambito, DWORD al_minuto, DWORD raffica) {
+    if (classe >= LATENZA_NUM_CLASSI || ambito >= LIMITE_NUM_AMBITI) return;
+    if (raffica == 0) raffica = 1;
+    if (raffica > 1000000) raffica = 1000000; // I token in millesimi devono stare in 32 bit
+    InterlockedExchange(&limiti[ambito][classe].raffica, (LONG)raffica);
+    InterlockedExchange(&limiti[ambito][classe].al_minuto, (LONG)al_minuto);
+}
+
+void limite_configurazione(ClasseLatenza classe, AmbitoLimite ambito, DWORD* al_minuto, DWORD* raffica) {
+    *al_minuto = (DWORD)limiti[ambito][classe].al_minuto;
+    *raffica = (DWORD)limiti[ambito][classe].raffica;
+}
+
+void limite_sessione_init(LimiteClient* sessione) {
+    memset(sessione, 0, sizeof(*sessione));
+}
+
+// Preleva un token dal secchio, ricaricandolo per il tempo trascorso. Il valore e'
+// [token in millesimi (32 bit)][GetTickCount() dell'ultima ricarica (32 bit)], 0 = pieno.
+// Ritorna 0 se il token e' stato prelevato, altrimenti i ms mancanti al prossimo token.
+static DWORD secchio_preleva(volatile LONG64* secchio, const LimiteClasse* limite, DWORD adesso) {
+    LONG64 al_minuto = limite->al_minuto;
+    if (al_minuto <= 0) return 0; // Limite disabilitato
+    LONG64 capienza = (LONG64)limite->raffica * TOKEN;
+
+    for (;;) {
+        LONG64 stato = *secchio;
+        LONG64 token;
+        DWORD ricarica;
+        if (stato == 0) {
+            token = capienza;
+            ricarica = adesso;
+        } else {
+            token = (LONG64)((unsigned long long)stato >> 32);
+            ricarica = (DWORD)(stato & 0xFFFFFFFF);
+            // al_minuto token ogni 60000 ms = al_minuto / 60 millesimi di token per ms
+            LONG64 aggiunti = (LONG64)(DWORD)(adesso - ricarica) * al_minuto / 60;
+            if (aggiunti > 0) {
+                token += aggiunti;
+                ricarica += (DWORD)(aggiunti * 60 / al_minuto); // Il resto della divisione non va perso
+            }
+            if (token >= capienza) {
+                token = capienza;
+                ricarica = adesso;
+            }
+        }
+        if (token < TOKEN) {
+            return (DWORD)((TOKEN - token) * 60 / al_minuto) + 1;
+        }
+        token -= TOKEN;
+        if (token == 0 && ricarica == 0) ricarica = 1; // 0 significa "pieno"
+        LONG64 nuovo = (LONG64)(((unsigned long long)token << 32) | (ricarica & 0xFFFFFFFF));
+        if (InterlockedCompareExchange64(secchio, nuovo, stato) == stato) return 0;
+    }
+}
+
+// Restituisce un token prelevato (l'altro secchio del comando era vuoto)
+static void secchio_restituisci(volatile LONG64* secchio) {
+    for (;;) {
+        LONG64 stato = *secchio;
+        if (stato == 0) return; // Gia' pieno
+        LONG64 nuovo = stato + ((LONG64)TOKEN << 32); // La ricarica successiva lo limita alla raffica
+        if (InterlockedCompareExchange64(secchio, nuovo, stato) == stato) return;
+    }
+}
+
+DWORD limite_preleva(LimiteClient* sessione, LimiteClient* ip, ClasseLatenza classe) {
+    if (classe >= LATENZA_NUM_CLASSI) classe = CLASSE_LUNGA;
+    DWORD adesso = GetTickCount();
+    DWORD attesa = secchio_preleva(&sessione->secchi[classe], &limiti[LIMITE_SESSIONE][classe], adesso);
+    if (attesa > 0) return attesa;
+    if (ip != NULL) {
+        attesa = secchio_preleva(&ip->secchi[classe], &limiti[LIMITE_IP][classe], adesso);
+        if (attesa > 0) {
+            secchio_restituisci(&sessione->secchi[classe]);
+            return attesa;
+        }
+        InterlockedIncrement(&ip->utilizzo.comandi[classe]);
+    }
+    InterlockedIncrement(&sessione->utilizzo.comandi[classe]);
+    return 0;
+}
+
+void limite_registra_attesa(LimiteClient* sessione, LimiteClient* ip, DWORD attesa_ms) {
+    InterlockedIncrement(&sessione->utilizzo.rallentati);
+    InterlockedExchangeAdd(&sessione->utilizzo.attesa_ms, (LONG)attesa_ms);
+    if (ip != NULL) {
+        InterlockedIncrement(&ip->utilizzo.rallentati);
+        InterlockedExchangeAdd(&ip->utilizzo.attesa_ms, (LONG)attesa_ms);
+    }
+}
+
+// Copia in ip l'indirizzo senza porta: "10.0.0.5:51234" -> "10.0.0.5", "[::1]:51234" -> "::1"
+static void estrai_ip(const char* indirizzo, char* ip) {
+    const char* inizio = indirizzo;
+    const char* fine;
+    if (*inizio == '[') {
+        inizio++;
+        fine = strchr(inizio, ']');
+    } else {
+        fine = strrchr(inizio, ':');
+    }
+    size_t len = fine != NULL ? (size_t)(fine - inizio) : strlen(inizio);
+    if (len >= LIMITE_MAX_TESTO_IP) len = LIMITE_MAX_TESTO_IP - 1;
+    memcpy(ip, inizio, len);
+    ip[len] = '\0';
+}
+
+LimiteClient* limite_ip(const char* indirizzo) {
+    char ip[LIMITE_MAX_TESTO_IP];
+    estrai_ip(indirizzo, ip);
+    DWORD hash = 2166136261u; // FNV-1a
+    for (const char* p = ip; *p; p++) hash = (hash ^ (unsigned char)*p) * 16777619u;
+    if (hash == 0) hash = 1;
+
+    for (int n = 0; n < LIMITE_MAX_IP - 1; n++) {
+        VoceIp* v = &tabella_ip[(hash + (DWORD)n) % (LIMITE_MAX_IP - 1)];
+        LONG stato = v->stato;
+        if (stato == IP_LIBERO) {
+            stato = InterlockedCompareExchange(&v->stato, IP_IN_SCRITTURA, IP_LIBERO);
+            if (stato == IP_LIBERO) {
+                strcpy(v->ip, ip);
+                v->hash = hash;
+                InterlockedExchange(&v->stato, IP_PRONTO);
+                return &v->limite;
+            }
+        }
+        while (stato == IP_IN_SCRITTURA) { // Un altro thread la sta occupando, forse per lo stesso indirizzo
+            Sleep(0);
+            stato = v->stato;
+        }
+        if (v->hash == hash && strcmp(v->ip, ip) == 0) return &v->limite;
+    }
+    return &tabella_ip[LIMITE_MAX_IP - 1].limite;
+}
+
+int limite_elenco_ip(UtilizzoIp* elenco, int max_voci) {
+    int n = 0;
+    for (int i = 0; i < LIMITE_MAX_IP && n < max_voci; i++) {
+        const VoceIp* v = &tabella_ip[i];
+        if (v->stato != IP_PRONTO) continue;
+        if (i == LIMITE_MAX_IP - 1) { // La voce condivisa compare solo se usata
+            LONG comandi = 0;
+            for (int c = 0; c < LATENZA_NUM_CLASSI; c++) comandi += v->limite.utilizzo.comandi[c];
+            if (comandi == 0) continue;
+        }
+        strcpy(elenco[n].ip, v->ip);
+        memcpy((void*)&elenco[n].utilizzo, (const void*)&v->limite.utilizzo, sizeof(UtilizzoClient));
+        n++;
+    }
+    return n;
+}
+
+const char* limite_nome_ambito(AmbitoLimite ambito) {
+    return ambito == LIMITE_IP ? "ip" : "sessione";
+}
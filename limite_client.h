@@ -0,0 +1,82 @@
+#ifndef LIMITE_CLIENT_H
+#define LIMITE_CLIENT_H
+
+#include <windows.h>
+#include "latenza_stampante.h"
+
+#define LIMITE_MAX_IP 256              // Indirizzi sorgente distinti con un proprio secchio (gli altri condividono l'ultimo)
+#define LIMITE_MAX_TESTO_IP 48         // Testo di un indirizzo IPv4 o IPv6
+
+// Limiti di default per classe di comando (comandi al minuto e raffica massima). Il limite dei
+// comandi lunghi vale solo per quelli indicati con i prefissi (vedi latenza_comando_lungo).
+// Un client solo non puo' consumare tutto il limite del suo indirizzo: piu' casse
+// dietro lo stesso IP (NAT, server POS) hanno un limite complessivo piu' ampio.
+#define LIMITE_SESSIONE_INTERROGAZIONI_MINUTO 1200
+#define LIMITE_SESSIONE_INTERROGAZIONI_RAFFICA 40
+#define LIMITE_SESSIONE_OPERAZIONI_MINUTO 600
+#define LIMITE_SESSIONE_OPERAZIONI_RAFFICA 60
+#define LIMITE_SESSIONE_CHIUSURE_MINUTO 60
+#define LIMITE_SESSIONE_CHIUSURE_RAFFICA 10
+#define LIMITE_SESSIONE_LUNGHE_MINUTO 6
+#define LIMITE_SESSIONE_LUNGHE_RAFFICA 2
+#define LIMITE_IP_FATTORE 3            // Limite di un indirizzo rispetto a quello di una sessione
+
+// A chi si applica un limite
+typedef enum {
+    LIMITE_SESSIONE = 0,
+    LIMITE_IP,
+    LIMITE_NUM_AMBITI
+} AmbitoLimite;
+
+// Contatori di utilizzo di una sessione o di un indirizzo
+typedef struct {
+    volatile LONG comandi[LATENZA_NUM_CLASSI]; // Comandi ammessi per classe
+    volatile LONG rallentati;                  // Comandi che hanno dovuto attendere un token
+    volatile LONG attesa_ms;                   // Attesa complessiva imposta dal limite
+} UtilizzoClient;
+
+// Secchi di token di una sessione o di un indirizzo. Lo stato di ogni secchio e' un solo
+// valore a 64 bit (token in millesimi e istante dell'ultima ricarica) aggiornato con
+// InterlockedCompareExchange64: nessun lock sul percorso dei comandi. Tutto a zero = secchi pieni.
+typedef struct {
+    volatile LONG64 secchi[LATENZA_NUM_CLASSI];
+    UtilizzoClient utilizzo;
+} LimiteClient;
+
+// Istantanea dell'utilizzo di un indirizzo (vedi limite_elenco_ip)
+typedef struct {
+    char ip[LIMITE_MAX_TESTO_IP];
+    UtilizzoClient utilizzo;
+} UtilizzoIp;
+
+// Imposta i limiti di default. Da chiamare prima di avviare i thread client.
+void limite_init(void);
+
+// Configura il limite di una classe: al_minuto = 0 disabilita il limite.
+void limite_configura(ClasseLatenza classe, AmbitoLimite ambito, DWORD al_minuto, DWORD raffica);
+
+// Legge il limite configurato per una classe.
+void limite_configurazione(ClasseLatenza classe, AmbitoLimite ambito, DWORD* al_minuto, DWORD* raffica);
+
+// Prepara i secchi (pieni) e i contatori di una nuova sessione.
+void limite_sessione_init(LimiteClient* sessione);
+
+// Secchi dell'indirizzo sorgente (testo come "10.0.0.5:51234" o "[::1]:51234": la porta viene
+// ignorata). Il puntatore resta valido fino all'uscita del processo.
+LimiteClient* limite_ip(const char* indirizzo);
+
+// Preleva un token per un comando della classe dai secchi della sessione e dell'indirizzo
+// (ip puo' essere NULL). Ritorna 0 se il comando puo' procedere, altrimenti i ms dopo cui
+// riprovare; in quel caso nessun token viene consumato.
+DWORD limite_preleva(LimiteClient* sessione, LimiteClient* ip, ClasseLatenza classe);
+
+// Registra l'attesa imposta a un comando rallentato (per sessione e indirizzo).
+void limite_registra_attesa(LimiteClient* sessione, LimiteClient* ip, DWORD attesa_ms);
+
+// Copia l'utilizzo degli indirizzi visti finora. Ritorna il numero di voci scritte.
+int limite_elenco_ip(UtilizzoIp* elenco, int max_voci);
+
+// Nome dell'ambito (per la console di amministrazione).
+const char* limite_nome_ambito(AmbitoLimite ambito);
+
+#endif // LIMITE_CLIENT_H
@@ -0,0 +1,121 @@
+#include "pacchetto.h"
+#include <string.h>
+
+static const char cifre_hex[] = "0123456789ABCDEF";
+
+void pacchetto_hex(unsigned char valore, char* destinazione) {
+    destinazione[0] = cifre_hex[valore >> 4];
+    destinazione[1] = cifre_hex[valore & 0x0F];
+}
+
+// Valore di una cifra esadecimale, -1 se il carattere non lo e'
+static int valore_hex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+VistaPacchetto pacchetto_costruisci(const char* adds, const char* dati, int dati_len, char* buffer, int max_len) {
+    VistaPacchetto vista = { buffer, 0 };
+    if (dati_len < 0) return vista;
+    if (dati_len > PACCHETTO_MAX_DATI) dati_len = PACCHETTO_MAX_DATI;
+    if (dati_len + PACCHETTO_CORNICE > max_len) return vista;
+
+    buffer[0] = PACCHETTO_STX;
+    buffer[1] = adds[0];
+    buffer[2] = adds[1];
+    buffer[3] = (char)('0' + dati_len / 100);
+    buffer[4] = (char)('0' + dati_len / 10 % 10);
+    buffer[5] = (char)('0' + dati_len % 10);
+    buffer[6] = 'N';
+    char* campo_dati = buffer + PACCHETTO_INIZIO_DATI;
+    if (dati != campo_dati) memcpy(campo_dati, dati, (size_t)dati_len);
+    int pos = PACCHETTO_INIZIO_DATI + dati_len;
+    buffer[pos++] = '1'; // pack_id fisso
+
+    // CHK: XOR da STX fino a pack_id incluso, in ASCII HEX
+    unsigned char chk = 0;
+    for (int i = 0; i < pos; i++) chk ^= (unsigned char)buffer[i];
+    pacchetto_hex(chk, buffer + pos);
+    pos += 2;
+    buffer[pos++] = PACCHETTO_ETX;
+
+    vista.lunghezza = pos;
+    return vista;
+}
+
+void pacchetto_riindirizza(char* pacchetto, int lunghezza, const char* adds) {
+    if (lunghezza < 8 || (unsigned char)pacchetto[0] != PACCHETTO_STX || (unsigned char)pacchetto[lunghezza - 1] != PACCHETTO_ETX) {
+        return; // Non e' un pacchetto del protocollo, lo si inoltra cosi' com'e'
+    }
+    unsigned char delta = (unsigned char)(pacchetto[1] ^ pacchetto[2] ^ adds[0] ^ adds[1]);
+    if (delta == 0) return;
+
+    int alto = valore_hex(pacchetto[lunghezza - 3]);
+    int basso = valore_hex(pacchetto[lunghezza - 2]);
+    if (alto < 0 || basso < 0) return; // CHK non esadecimale, meglio non toccare nulla
+
+    pacchetto[1] = adds[0];
+    pacchetto[2] = adds[1];
+    pacchetto_hex((unsigned char)(((alto << 4) | basso) ^ delta), pacchetto + lunghezza - 3);
+}
+
+void pacchetto_imposta_id(char* pacchetto, int lunghezza, char pack_id) {
+    if (lunghezza < PACCHETTO_CORNICE || (unsigned char)pacchetto[0] != PACCHETTO_STX || (unsigned char)pacchetto[lunghezza - 1] != PACCHETTO_ETX) {
+        return;
+    }
+    int alto = valore_hex(pacchetto[lunghezza - 3]);
+    int basso = valore_hex(pacchetto[lunghezza - 2]);
+    if (alto < 0 || basso < 0) return;
+
+    unsigned char delta = (unsigned char)(pacchetto[lunghezza - 4] ^ pack_id);
+    pacchetto[lunghezza - 4] = pack_id;
+    pacchetto_hex((unsigned char)(((alto << 4) | basso) ^ delta), pacchetto + lunghezza - 3);
+}
+
+int pacchetto_valido(const char* pacchetto, int lunghezza) {
+    if (lunghezza < PACCHETTO_CORNICE || (unsigned char)pacchetto[0] != PACCHETTO_STX || (unsigned char)pacchetto[lunghezza - 1] != PACCHETTO_ETX) return 0;
+    if (pacchetto[6] != 'N') return 0;
+    int dati_len = 0;
+    for (int i = 3; i < 6; i++) {
+        if (pacchetto[i] < '0' || pacchetto[i] > '9') return 0;
+        dati_len = dati_len * 10 + (pacchetto[i] - '0');
+    }
+    if (dati_len + PACCHETTO_CORNICE != lunghezza) return 0;
+
+    unsigned char chk = 0;
+    for (int i = 0; i < lunghezza - 3; i++) chk ^= (unsigned char)pacchetto[i];
+    int alto = valore_hex(pacchetto[lunghezza - 3]);
+    int basso = valore_hex(pacchetto[lunghezza - 2]);
+    return alto >= 0 && basso >= 0 && ((alto << 4) | basso) == chk;
+}
+
+int pacchetto_trova(const char* byte, int lunghezza, VistaPacchetto* vista) {
+    if (byte == NULL || lunghezza <= 0) return 0;
+    const char* stx = memchr(byte, PACCHETTO_STX, (size_t)lunghezza);
+    while (stx != NULL) {
+        int disponibili = lunghezza - (int)(stx - byte);
+        if (disponibili >= PACCHETTO_CORNICE) {
+            int dati_len = 0;
+            int i = 3;
+            while (i < 6 && stx[i] >= '0' && stx[i] <= '9') dati_len = dati_len * 10 + (stx[i++] - '0');
+            int pacchetto_len = dati_len + PACCHETTO_CORNICE;
+            if (i == 6 && pacchetto_len <= disponibili && pacchetto_valido(stx, pacchetto_len)) {
+                vista->byte = stx;
+                vista->lunghezza = pacchetto_len;
+                return 1;
+            }
+        }
+        stx = memchr(stx + 1, PACCHETTO_STX, (size_t)(disponibili - 1));
+    }
+    return 0;
+}
+
+int pacchetto_risposta_positiva(const char* byte, int lunghezza, VistaPacchetto* vista) {
+    VistaPacchetto trovato;
+    if (!pacchetto_trova(byte, lunghezza, &trovato)) return 0;
+    if (trovato.lunghezza > PACCHETTO_CORNICE && trovato.byte[PACCHETTO_INIZIO_DATI] == PACCHETTO_ERRORE) return 0;
+    if (vista != NULL) *vista = trovato;
+    return 1;
+}
@@ -0,0 +1,50 @@
+#ifndef PACCHETTO_H
+#define PACCHETTO_H
+
+// Formato del pacchetto: [STX][adds 2][len 3]['N'][dati][pack_id][CHK 2][ETX]
+#define PACCHETTO_STX 0x02
+#define PACCHETTO_ETX 0x03
+#define PACCHETTO_ACK 0x06          // Inviato dalla stampante prima della risposta: pacchetto ricevuto
+#define PACCHETTO_NAK 0x15          // Inviato dalla stampante: pacchetto rifiutato (CHK errato), da ritrasmettere
+#define PACCHETTO_INIZIO_DATI 7     // Offset del campo dati
+#define PACCHETTO_CORNICE 11        // Byte del pacchetto oltre ai dati
+#define PACCHETTO_MAX_DATI 999      // Il campo len ha tre cifre
+#define PACCHETTO_ERRORE 'E'        // Primo byte dei dati di una risposta di errore
+
+// Vista su un pacchetto costruito nel buffer del chiamante (nessuna copia).
+// lunghezza e' 0 se il pacchetto non e' stato costruito.
+typedef struct {
+    const char* byte;
+    int lunghezza;
+} VistaPacchetto;
+
+// Scrive in buffer esattamente i byte del pacchetto, senza azzerare il resto del buffer.
+// I dati possono essere gia' stati scritti in buffer + PACCHETTO_INIZIO_DATI (ad esempio
+// da snprintf): in quel caso non vengono copiati. Dati oltre PACCHETTO_MAX_DATI vengono troncati.
+VistaPacchetto pacchetto_costruisci(const char* adds, const char* dati, int dati_len, char* buffer, int max_len);
+
+// Scrive il byte come due cifre esadecimali maiuscole (senza terminatore).
+void pacchetto_hex(unsigned char valore, char* destinazione);
+
+// Sostituisce l'adds di un pacchetto aggiornando il CHK in XOR con la differenza dei due adds,
+// senza ricalcolarlo sull'intero pacchetto. I dati che non sono un pacchetto restano invariati.
+void pacchetto_riindirizza(char* pacchetto, int lunghezza, const char* adds);
+
+// Sostituisce il pack_id di un pacchetto aggiornando il CHK. I dati che non sono un pacchetto
+// restano invariati.
+void pacchetto_imposta_id(char* pacchetto, int lunghezza, char pack_id);
+
+// Ritorna 1 se i byte sono esattamente un pacchetto completo: STX, campo len coerente con la
+// lunghezza, 'N', CHK corretto ed ETX finale. 0 altrimenti.
+int pacchetto_valido(const char* pacchetto, int lunghezza);
+
+// Individua il primo pacchetto valido nei byte ricevuti, ignorando quelli che precedono lo STX
+// (ACK/NAK) e quelli che seguono l'ETX. Ritorna 1 e la vista sul pacchetto, 0 se non c'e'
+// un pacchetto completo e con CHK corretto (risposta troncata o corrotta).
+int pacchetto_trova(const char* byte, int lunghezza, VistaPacchetto* vista);
+
+// Ritorna 1 se i byte contengono un pacchetto valido (vedi pacchetto_trova) che non e' un errore:
+// solo allora la stampante ha eseguito il comando. vista puo' essere NULL.
+int pacchetto_risposta_positiva(const char* byte, int lunghezza, VistaPacchetto* vista);
+
+#endif // PACCHETTO_H
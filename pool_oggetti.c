@@ -0,0 +1,78 @@
+#include "pool_oggetti.h"
+#include <malloc.h>
+
+#define ALLINEA_POOL(n) (((n) + MEMORY_ALLOCATION_ALIGNMENT - 1) & ~(size_t)(MEMORY_ALLOCATION_ALIGNMENT - 1))
+
+// Ogni oggetto e' preceduto dalla voce della lista libera, allineata come richiesto da SLIST
+#define INTESTAZIONE_OGGETTO ALLINEA_POOL(sizeof(SLIST_ENTRY))
+#define INTESTAZIONE_BLOCCO ALLINEA_POOL(sizeof(void*))
+
+void pool_init(PoolOggetti* pool, size_t dimensione, int per_blocco) {
+    InitializeSListHead(&pool->liberi);
+    InitializeCriticalSection(&pool->cs_crescita);
+    pool->dimensione = dimensione;
+    pool->passo = INTESTAZIONE_OGGETTO + ALLINEA_POOL(dimensione);
+    pool->per_blocco = per_blocco > 0 ? per_blocco : 1;
+    pool->blocchi = NULL;
+    pool->num_blocchi = 0;
+    pool->in_uso = 0;
+    pool->prese = 0;
+}
+
+// Alloca un nuovo blocco: il primo oggetto va al chiamante, gli altri nella lista libera.
+// Da chiamare con cs_crescita acquisita.
+static PSLIST_ENTRY cresci(PoolOggetti* pool) {
+    unsigned char* blocco = (unsigned char*)_aligned_malloc(INTESTAZIONE_BLOCCO + pool->passo * (size_t)pool->per_blocco, MEMORY_ALLOCATION_ALIGNMENT);
+    if (blocco == NULL) return NULL;
+    *(void**)blocco = pool->blocchi;
+    pool->blocchi = blocco;
+    InterlockedIncrement(&pool->num_blocchi);
+
+    unsigned char* primo = blocco + INTESTAZIONE_BLOCCO;
+    for (int i = 1; i < pool->per_blocco; i++) {
+        InterlockedPushEntrySList(&pool->liberi, (PSLIST_ENTRY)(primo + pool->passo * (size_t)i));
+    }
+    return (PSLIST_ENTRY)primo;
+}
+
+void* pool_prendi(PoolOggetti* pool) {
+    PSLIST_ENTRY voce = InterlockedPopEntrySList(&pool->liberi);
+    if (voce == NULL) {
+        // Un solo thread alla volta fa crescere il pool; chi attende riprova prima la lista
+        EnterCriticalSection(&pool->cs_crescita);
+        voce = InterlockedPopEntrySList(&pool->liberi);
+        if (voce == NULL) voce = cresci(pool);
+        LeaveCriticalSection(&pool->cs_crescita);
+        if (voce == NULL) return NULL;
+    }
+    InterlockedIncrement(&pool->in_uso);
+    InterlockedIncrement(&pool->prese);
+    return (unsigned char*)voce + INTESTAZIONE_OGGETTO;
+}
+
+void pool_restituisci(PoolOggetti* pool, void* oggetto) {
+    if (oggetto == NULL) return;
+    InterlockedPushEntrySList(&pool->liberi, (PSLIST_ENTRY)((unsigned char*)oggetto - INTESTAZIONE_OGGETTO));
+    InterlockedDecrement(&pool->in_uso);
+}
+
+void pool_statistiche(PoolOggetti* pool, LONG* blocchi, LONG* in_uso, LONG* prese) {
+    if (blocchi) *blocchi = pool->num_blocchi;
+    if (in_uso) *in_uso = pool->in_uso;
+    if (prese) *prese = pool->prese;
+}
+
+void pool_cleanup(PoolOggetti* pool) {
+    EnterCriticalSection(&pool->cs_crescita);
+    InitializeSListHead(&pool->liberi);
+    void* blocco = pool->blocchi;
+    while (blocco != NULL) {
+        void* prossimo = *(void**)blocco;
+        _aligned_free(blocco);
+        blocco = prossimo;
+    }
+    pool->blocchi = NULL;
+    pool->num_blocchi = 0;
+    LeaveCriticalSection(&pool->cs_crescita);
+    DeleteCriticalSection(&pool->cs_crescita);
+}
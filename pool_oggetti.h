@@ -0,0 +1,37 @@
+#ifndef POOL_OGGETTI_H
+#define POOL_OGGETTI_H
+
+#include <windows.h>
+
+// Pool di oggetti di dimensione fissa. Gli oggetti liberi stanno in una lista senza lock
+// (SLIST di Windows); quando la lista e' vuota il pool cresce di un blocco di per_blocco
+// oggetti. Gli oggetti restituiti non vengono azzerati: il contenuto e' quello lasciato
+// dall'uso precedente.
+typedef struct {
+    SLIST_HEADER liberi;            // Oggetti disponibili (primo campo: richiede allineamento a 16 byte)
+    size_t passo;                   // Byte occupati da ogni oggetto, intestazione compresa
+    size_t dimensione;
+    int per_blocco;
+    CRITICAL_SECTION cs_crescita;   // Serializza l'allocazione di nuovi blocchi
+    void* blocchi;                  // Catena dei blocchi allocati
+    volatile LONG num_blocchi;
+    volatile LONG in_uso;
+    volatile LONG prese;
+} PoolOggetti;
+
+// Prepara un pool di oggetti da dimensione byte, allocati per_blocco alla volta.
+void pool_init(PoolOggetti* pool, size_t dimensione, int per_blocco);
+
+// Prende un oggetto dal pool. Ritorna NULL solo se la memoria e' esaurita.
+void* pool_prendi(PoolOggetti* pool);
+
+// Restituisce al pool un oggetto ottenuto con pool_prendi.
+void pool_restituisci(PoolOggetti* pool, void* oggetto);
+
+// Restituisce blocchi allocati, oggetti in uso e numero totale di prese.
+void pool_statistiche(PoolOggetti* pool, LONG* blocchi, LONG* in_uso, LONG* prese);
+
+// Libera tutti i blocchi del pool (nessun oggetto deve essere ancora in uso).
+void pool_cleanup(PoolOggetti* pool);
+
+#endif // POOL_OGGETTI_H
@@ -21,7 +21,7 @@ static void send_relay_command(const char* cmd) {
     }
 }
 
-void relay_init(const char* port) {
+void relay_init(const char* port, DWORD baud_rate, BYTE byte_size, BYTE parity, BYTE stop_bits, BOOL rts_cts) {
     char full_port_name[20];    // Buffer per il nome completo della porta
     snprintf(full_port_name, sizeof(full_port_name), "\\\\.\\%s", port);    // Crea il nome completo della porta
 
@@ -41,10 +41,13 @@ void relay_init(const char* port) {
         return;
     }
 
-    dcbSerialParams.BaudRate = CBR_9600;
-    dcbSerialParams.ByteSize = 8;
-    dcbSerialParams.StopBits = ONESTOPBIT;
-    dcbSerialParams.Parity = NOPARITY;
+    dcbSerialParams.BaudRate = baud_rate;
+    dcbSerialParams.ByteSize = byte_size;
+    dcbSerialParams.StopBits = stop_bits;
+    dcbSerialParams.Parity = parity;
+    dcbSerialParams.fParity = (parity == NOPARITY) ? FALSE : TRUE;
+    dcbSerialParams.fOutxCtsFlow = rts_cts;    // Con RTS/CTS il relè puo' sospendere la trasmissione
+    dcbSerialParams.fRtsControl = rts_cts ? RTS_CONTROL_HANDSHAKE : RTS_CONTROL_ENABLE;
 
     if (!SetCommState(hRelay, &dcbSerialParams)) {
         CloseHandle(hRelay);
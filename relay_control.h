@@ -3,8 +3,9 @@
 
 #include <windows.h>
 
-// Inizializza il modulo relè sulla porta specificata.
-void relay_init(const char* port);
+// Inizializza il modulo relè sulla porta specificata con velocita' (es. CBR_9600), data bit,
+// parita' (NOPARITY...), stop bit (ONESTOPBIT...) e controllo di flusso RTS/CTS indicati.
+void relay_init(const char* port, DWORD baud_rate, BYTE byte_size, BYTE parity, BYTE stop_bits, BOOL rts_cts);
 
 // Invia il comando per accendere il relè.
 void relay_on(void);
@@ -0,0 +1,521 @@
+/*
+ * File: replay_tool.c
+ * Descrizione: Banco di prova deterministico basato sul traffico catturato (vedi cattura.c)
+ *              emulatore : stampante TCP che risponde ai pacchetti con le risposte registrate nella cattura
+ *              replay    : ripropone al server i comandi catturati, una connessione per sessione, con i
+ *                          tempi originali o accelerati; confronta le risposte con quelle registrate e
+ *                          riporta le differenze di latenza e throughput
+ *              Con il server configurato sulla stampante TCP dell'emulatore il percorso completo
+ *              (tcp_client_handler, pacchetto_costruisci, invia_a_stampante_dispatcher) viene esercitato
+ *              con il mix di comandi reale.
+ */
+
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <windows.h>
+#include "cattura.h"
+#include "pacchetto.h"
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define MAX_SESSIONI_REPLAY 256
+#define MAX_RISPOSTA_REPLAY 2048
+#define TIMEOUT_RISPOSTA_MS 10000
+#define MAX_DIFFERENZE_STAMPATE 20
+
+// Frame letto dalla cattura
+typedef struct {
+    unsigned long long timestamp;
+    int session_id;
+    int direzione;
+    int lunghezza;
+    int troncato;
+    char* dati;
+} FrameCatturato;
+
+static FrameCatturato* frames = NULL;
+static int num_frames = 0;
+static int capacita_frames = 0;
+
+static void visita_carica(const IntestazioneRecordCattura* record, const unsigned char* dati, void* contesto) {
+    (void)contesto;
+    if (num_frames == capacita_frames) {
+        int nuova_capacita = capacita_frames ? capacita_frames * 2 : 1024;
+        FrameCatturato* nuovi = (FrameCatturato*)realloc(frames, sizeof(FrameCatturato) * (size_t)nuova_capacita);
+        if (nuovi == NULL) return;
+        frames = nuovi;
+        capacita_frames = nuova_capacita;
+    }
+    FrameCatturato* f = &frames[num_frames];
+    f->dati = (char*)malloc((size_t)record->lunghezza + 1);
+    if (f->dati == NULL) return;
+    memcpy(f->dati, dati, record->lunghezza);
+    f->dati[record->lunghezza] = '\0';
+    f->timestamp = record->timestamp;
+    f->session_id = record->session_id;
+    f->direzione = record->direzione;
+    f->lunghezza = record->lunghezza;
+    f->troncato = record->lunghezza < record->lunghezza_originale;
+    num_frames++;
+}
+
+// Individua il campo dati di un pacchetto [STX][adds 2][len 3][N][dati][pack_id][CHK 2][ETX]
+static int dati_pacchetto(const char* p, int lunghezza, const char** dati, int* dati_len) {
+    if (!pacchetto_valido(p, lunghezza)) return 0;
+    *dati = p + PACCHETTO_INIZIO_DATI;
+    *dati_len = lunghezza - PACCHETTO_CORNICE;
+    return 1;
+}
+
+// =====================
+// === EMULATORE STAMPANTE ===
+// =====================
+// Coppia comando/risposta registrata tra gateway e stampante
+typedef struct {
+    const char* dati;        // Campo dati del comando (chiave di ricerca)
+    int dati_len;
+    const FrameCatturato* risposta;
+    int usata;
+} CoppiaRegistrata;
+
+static CoppiaRegistrata* coppie = NULL;
+static int num_coppie = 0;
+static CRITICAL_SECTION cs_coppie;
+
+// Il gateway parla con la stampante da un solo thread (coda_stampante.c), che cattura ogni
+// pacchetto subito prima dell'invio e la sua risposta subito dopo: in ordine di cattura la
+// risposta e' quindi il frame dalla stampante che segue il comando, qualunque sia la sessione.
+// Le coppie con un frame troncato non sono riproducibili e vengono ignorate.
+static int prepara_coppie(void) {
+    int troncate = 0;
+    coppie = (CoppiaRegistrata*)calloc((size_t)num_frames + 1, sizeof(CoppiaRegistrata));
+    if (coppie == NULL) return 0;
+    for (int i = 0; i < num_frames; i++) {
+        if (frames[i].direzione != CATTURA_A_STAMPANTE) continue;
+        int j = i + 1;
+        while (j < num_frames && frames[j].direzione != CATTURA_A_STAMPANTE && frames[j].direzione != CATTURA_DA_STAMPANTE) j++;
+        if (j == num_frames || frames[j].direzione != CATTURA_DA_STAMPANTE) continue; // Comando senza risposta
+        if (frames[i].troncato || frames[j].troncato) {
+            troncate++;
+            continue;
+        }
+        const char* dati;
+        int dati_len;
+        if (!dati_pacchetto(frames[i].dati, frames[i].lunghezza, &dati, &dati_len)) continue;
+        coppie[num_coppie].dati = dati;
+        coppie[num_coppie].dati_len = dati_len;
+        coppie[num_coppie].risposta = &frames[j];
+        num_coppie++;
+    }
+    return troncate;
+}
+
+// Cerca la risposta registrata per il comando: la prima non ancora usata, altrimenti l'ultima
+// usata (interrogazioni ripetute piu' volte che nella cattura). Ritorna NULL se il comando non compare.
+static const FrameCatturato* cerca_risposta(const char* dati, int dati_len) {
+    const FrameCatturato* trovata = NULL;
+    EnterCriticalSection(&cs_coppie);
+    for (int i = 0; i < num_coppie; i++) {
+        if (coppie[i].dati_len != dati_len || memcmp(coppie[i].dati, dati, (size_t)dati_len) != 0) continue;
+        trovata = coppie[i].risposta;
+        if (!coppie[i].usata) {
+            coppie[i].usata = 1;
+            break;
+        }
+    }
+    LeaveCriticalSection(&cs_coppie);
+    return trovata;
+}
+
+static DWORD WINAPI emulatore_connessione(LPVOID lpParam) {
+    SOCKET s = (SOCKET)(UINT_PTR)lpParam;
+    char buffer[MAX_RISPOSTA_REPLAY];
+    int buffer_len = 0;
+
+    for (;;) {
+        int n = recv(s, buffer + buffer_len, (int)sizeof(buffer) - buffer_len, 0);
+        if (n <= 0) break;
+        buffer_len += n;
+
+        // Risponde a ogni pacchetto completo (terminato da ETX)
+        char* etx;
+        while ((etx = memchr(buffer, 0x03, (size_t)buffer_len)) != NULL) {
+            int pacchetto_len = (int)(etx - buffer) + 1;
+            const char* dati;
+            int dati_len;
+            char risposta[MAX_RISPOSTA_REPLAY];
+            int risposta_len = 0;
+            const FrameCatturato* registrata = NULL;
+            if (dati_pacchetto(buffer, pacchetto_len, &dati, &dati_len)) registrata = cerca_risposta(dati, dati_len);
+            if (registrata != NULL) {
+                memcpy(risposta, registrata->dati, (size_t)registrata->lunghezza);
+                risposta_len = registrata->lunghezza;
+            } else {
+                const char* errore = "E|G|9999|NON IN CATTURA";
+                risposta_len = pacchetto_costruisci("00", errore, (int)strlen(errore), risposta, sizeof(risposta)).lunghezza;
+                printf("[EMULATORE] Comando senza risposta registrata: %.*s\n", pacchetto_len, buffer);
+            }
+            if (pacchetto_len > 2) pacchetto_riindirizza(risposta, risposta_len, buffer + 1);
+            send(s, risposta, risposta_len, 0);
+
+            buffer_len -= pacchetto_len;
+            memmove(buffer, buffer + pacchetto_len, (size_t)buffer_len);
+        }
+        if (buffer_len == (int)sizeof(buffer)) buffer_len = 0; // Dati senza ETX: scartati
+    }
+    closesocket(s);
+    return 0;
+}
+
+static int esegui_emulatore(int porta) {
+    InitializeCriticalSection(&cs_coppie);
+    int troncate = prepara_coppie();
+    printf("Emulatore stampante: %d risposte registrate (%d ignorate perche' troncate), in ascolto sulla porta %d.\n",
+           num_coppie, troncate, porta);
+
+    SOCKET ascolto = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in indirizzo;
+    memset(&indirizzo, 0, sizeof(indirizzo));
+    indirizzo.sin_family = AF_INET;
+    indirizzo.sin_addr.s_addr = INADDR_ANY;
+    indirizzo.sin_port = htons((unsigned short)porta);
+    if (ascolto == INVALID_SOCKET || bind(ascolto, (struct sockaddr*)&indirizzo, sizeof(indirizzo)) == SOCKET_ERROR
+        || listen(ascolto, SOMAXCONN) == SOCKET_ERROR) {
+        printf("Impossibile mettersi in ascolto sulla porta %d (errore %d).\n", porta, WSAGetLastError());
+        return 1;
+    }
+    for (;;) {
+        SOCKET client = accept(ascolto, NULL, NULL);
+        if (client == INVALID_SOCKET) break;
+        HANDLE h = CreateThread(NULL, 0, emulatore_connessione, (LPVOID)(UINT_PTR)client, 0, NULL);
+        if (h) CloseHandle(h); else closesocket(client);
+    }
+    closesocket(ascolto);
+    return 0;
+}
+
+// =====================
+// === REPLAY ===
+// =====================
+// Comando di una sessione da riproporre con la risposta attesa
+typedef struct {
+    char testo[1024];
+    unsigned long long timestamp;
+    const FrameCatturato* attesa;     // Risposta registrata (NULL se assente nella cattura)
+    double latenza_originale_ms;
+    double latenza_replay_ms;
+    char risposta[MAX_RISPOSTA_REPLAY];
+    int risposta_len;
+    int esito;                         // 0 = identica, 1 = diversa, 2 = nessuna risposta, 3 = non confrontabile
+    int incompleto;                    // Riga tagliata dal troncamento del frame: non viene inviata
+} ComandoReplay;
+
+typedef struct {
+    int session_id;
+    ComandoReplay* comandi;
+    int num_comandi;
+    int capacita;
+    const char* ip;
+    int porta;
+    double velocita;
+    LARGE_INTEGER inizio;
+    unsigned long long timestamp_base;
+} SessioneReplay;
+
+static SessioneReplay sessioni[MAX_SESSIONI_REPLAY];
+static int num_sessioni = 0;
+static LARGE_INTEGER frequenza;
+
+static SessioneReplay* trova_sessione(int session_id) {
+    for (int i = 0; i < num_sessioni; i++) if (sessioni[i].session_id == session_id) return &sessioni[i];
+    if (num_sessioni == MAX_SESSIONI_REPLAY) return NULL;
+    memset(&sessioni[num_sessioni], 0, sizeof(SessioneReplay));
+    sessioni[num_sessioni].session_id = session_id;
+    return &sessioni[num_sessioni++];
+}
+
+static ComandoReplay* aggiungi_comando(SessioneReplay* s) {
+    if (s->num_comandi == s->capacita) {
+        int nuova_capacita = s->capacita ? s->capacita * 2 : 64;
+        ComandoReplay* nuovi = (ComandoReplay*)realloc(s->comandi, sizeof(ComandoReplay) * (size_t)nuova_capacita);
+        if (nuovi == NULL) return NULL;
+        s->comandi = nuovi;
+        s->capacita = nuova_capacita;
+    }
+    ComandoReplay* c = &s->comandi[s->num_comandi++];
+    memset(c, 0, sizeof(*c));
+    return c;
+}
+
+// Ricostruisce per ogni sessione la sequenza dei comandi (righe dei frame ricevuti dai client)
+// e associa a ciascuno, in ordine, la risposta inviata dal gateway. Di un frame troncato si
+// conservano le righe complete; quella tagliata resta come segnaposto non inviato, cosi'
+// l'associazione con le risposte successive non scorre.
+static void prepara_sessioni(void) {
+    for (int i = 0; i < num_frames; i++) {
+        const FrameCatturato* f = &frames[i];
+        if (f->direzione != CATTURA_DA_CLIENT) continue;
+        SessioneReplay* s = trova_sessione(f->session_id);
+        if (s == NULL) continue;
+        const char* riga = f->dati;
+        const char* fine_frame = f->dati + f->lunghezza;
+        while (riga < fine_frame) {
+            const char* newline = memchr(riga, '\n', (size_t)(fine_frame - riga));
+            const char* fine = newline ? newline : fine_frame;
+            int len = (int)(fine - riga);
+            while (len > 0 && (riga[len - 1] == '\r' || riga[len - 1] == ' ')) len--;
+            if (len > 0 && len < (int)sizeof(((ComandoReplay*)0)->testo)) {
+                ComandoReplay* c = aggiungi_comando(s);
+                if (c == NULL) return;
+                memcpy(c->testo, riga, (size_t)len);
+                c->timestamp = f->timestamp;
+                c->incompleto = f->troncato && newline == NULL;
+                c->esito = c->incompleto ? 3 : 0;
+            }
+            riga = newline ? newline + 1 : fine_frame;
+        }
+    }
+
+    for (int k = 0; k < num_sessioni; k++) {
+        SessioneReplay* s = &sessioni[k];
+        int prossimo = 0;
+        for (int i = 0; i < num_frames && prossimo < s->num_comandi; i++) {
+            if (frames[i].direzione != CATTURA_A_CLIENT || frames[i].session_id != s->session_id) continue;
+            ComandoReplay* c = &s->comandi[prossimo++];
+            c->attesa = &frames[i];
+            c->latenza_originale_ms = (double)(frames[i].timestamp - c->timestamp) / 10000.0;
+            if (frames[i].troncato) c->esito = 3;
+        }
+    }
+}
+
+// Confronta due risposte ignorando adds e CHK, che dipendono dall'identificativo del client
+static int risposte_equivalenti(const char* a, int a_len, const char* b, int b_len) {
+    if (a_len != b_len) return 0;
+    if (a_len >= 11 && a[0] == 0x02 && b[0] == 0x02) {
+        return memcmp(a + 3, b + 3, (size_t)(a_len - 6)) == 0 && a[a_len - 1] == b[b_len - 1];
+    }
+    return memcmp(a, b, (size_t)a_len) == 0;
+}
+
+// Legge una risposta: un pacchetto fino a ETX oppure una riga di testo fino a '\n'
+static int leggi_risposta(SOCKET s, char* buffer, int* buffer_len, char* risposta, int max_risposta) {
+    for (;;) {
+        for (int i = 0; i < *buffer_len; i++) {
+            if (buffer[i] == 0x03 || (buffer[i] == '\n' && buffer[0] != 0x02)) {
+                int len = i + 1 < max_risposta ? i + 1 : max_risposta;
+                memcpy(risposta, buffer, (size_t)len);
+                *buffer_len -= i + 1;
+                memmove(buffer, buffer + i + 1, (size_t)*buffer_len);
+                return len;
+            }
+        }
+        if (*buffer_len == MAX_RISPOSTA_REPLAY) *buffer_len = 0;
+        int n = recv(s, buffer + *buffer_len, MAX_RISPOSTA_REPLAY - *buffer_len, 0);
+        if (n <= 0) return 0;
+        *buffer_len += n;
+    }
+}
+
+static DWORD WINAPI replay_sessione(LPVOID lpParam) {
+    SessioneReplay* s = (SessioneReplay*)lpParam;
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(s->ip);
+    server.sin_port = htons((unsigned short)s->porta);
+    DWORD timeout = TIMEOUT_RISPOSTA_MS;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server, sizeof(server)) == SOCKET_ERROR) {
+        printf("Sessione %d: connessione al server fallita (errore %d).\n", s->session_id, WSAGetLastError());
+        for (int i = 0; i < s->num_comandi; i++) s->comandi[i].esito = 2;
+        if (sock != INVALID_SOCKET) closesocket(sock);
+        return 1;
+    }
+
+    char buffer[MAX_RISPOSTA_REPLAY];
+    int buffer_len = 0;
+    for (int i = 0; i < s->num_comandi; i++) {
+        ComandoReplay* c = &s->comandi[i];
+        // Attende l'istante originale del comando, scalato per la velocita' richiesta
+        if (s->velocita > 0) {
+            double scadenza_ms = (double)(c->timestamp - s->timestamp_base) / 10000.0 / s->velocita;
+            LARGE_INTEGER adesso;
+            QueryPerformanceCounter(&adesso);
+            double trascorso_ms = (double)(adesso.QuadPart - s->inizio.QuadPart) * 1000.0 / (double)frequenza.QuadPart;
+            if (scadenza_ms > trascorso_ms) Sleep((DWORD)(scadenza_ms - trascorso_ms));
+        }
+        if (c->incompleto) continue;
+
+        char linea[1026];
+        int linea_len = snprintf(linea, sizeof(linea), "%s\n", c->testo);
+        LARGE_INTEGER t_invio, t_risposta;
+        QueryPerformanceCounter(&t_invio);
+        if (send(sock, linea, linea_len, 0) != linea_len) {
+            c->esito = 2;
+            continue;
+        }
+        c->risposta_len = leggi_risposta(sock, buffer, &buffer_len, c->risposta, sizeof(c->risposta));
+        QueryPerformanceCounter(&t_risposta);
+        c->latenza_replay_ms = (double)(t_risposta.QuadPart - t_invio.QuadPart) * 1000.0 / (double)frequenza.QuadPart;
+
+        if (c->risposta_len == 0) {
+            c->esito = 2;
+        } else if (c->esito != 3) {
+            c->esito = c->attesa != NULL && risposte_equivalenti(c->attesa->dati, c->attesa->lunghezza, c->risposta, c->risposta_len) ? 0 : 1;
+        }
+    }
+    closesocket(sock);
+    return 0;
+}
+
+static int confronta_double(const void* a, const void* b) {
+    double da = *(const double*)a, db = *(const double*)b;
+    return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+// Media e 95esimo percentile di una serie di latenze
+static void statistiche_latenza(double* valori, int n, double* media, double* p95) {
+    *media = 0;
+    *p95 = 0;
+    if (n == 0) return;
+    double somma = 0;
+    for (int i = 0; i < n; i++) somma += valori[i];
+    qsort(valori, (size_t)n, sizeof(double), confronta_double);
+    *media = somma / n;
+    *p95 = valori[(n * 95) / 100 < n ? (n * 95) / 100 : n - 1];
+}
+
+static void stampa_testo(const char* dati, int lunghezza) {
+    for (int i = 0; i < lunghezza; i++) {
+        unsigned char c = (unsigned char)dati[i];
+        if (c >= 32 && c <= 126) putchar(c); else printf("<%02X>", c);
+    }
+}
+
+static int esegui_replay(const char* ip, int porta, double velocita) {
+    prepara_sessioni();
+    int totale_comandi = 0;
+    unsigned long long primo = ~0ULL, ultimo = 0;
+    for (int k = 0; k < num_sessioni; k++) {
+        totale_comandi += sessioni[k].num_comandi;
+        for (int i = 0; i < sessioni[k].num_comandi; i++) {
+            unsigned long long t = sessioni[k].comandi[i].timestamp;
+            if (t < primo) primo = t;
+            if (t > ultimo) ultimo = t;
+        }
+    }
+    if (totale_comandi == 0) {
+        printf("Nessun comando client nella cattura.\n");
+        return 1;
+    }
+    printf("Replay di %d comandi da %d sessioni verso %s:%d (velocita' %s%.1fx).\n", totale_comandi, num_sessioni, ip, porta,
+           velocita > 0 ? "" : "massima, ", velocita > 0 ? velocita : 0.0);
+
+    QueryPerformanceFrequency(&frequenza);
+    LARGE_INTEGER inizio, fine;
+    QueryPerformanceCounter(&inizio);
+    HANDLE thread[MAX_SESSIONI_REPLAY];
+    for (int k = 0; k < num_sessioni; k++) {
+        sessioni[k].ip = ip;
+        sessioni[k].porta = porta;
+        sessioni[k].velocita = velocita;
+        sessioni[k].inizio = inizio;
+        sessioni[k].timestamp_base = primo;
+        thread[k] = CreateThread(NULL, 0, replay_sessione, &sessioni[k], 0, NULL);
+    }
+    for (int k = 0; k < num_sessioni; k++) {
+        if (thread[k]) {
+            WaitForSingleObject(thread[k], INFINITE);
+            CloseHandle(thread[k]);
+        }
+    }
+    QueryPerformanceCounter(&fine);
+    double durata_replay_ms = (double)(fine.QuadPart - inizio.QuadPart) * 1000.0 / (double)frequenza.QuadPart;
+    double durata_originale_ms = (double)(ultimo - primo) / 10000.0;
+
+    // Riepilogo
+    int identiche = 0, diverse = 0, senza_risposta = 0, non_confrontabili = 0, stampate = 0;
+    double* lat_originale = (double*)malloc(sizeof(double) * (size_t)totale_comandi);
+    double* lat_replay = (double*)malloc(sizeof(double) * (size_t)totale_comandi);
+    int n_originale = 0, n_replay = 0;
+    for (int k = 0; k < num_sessioni; k++) {
+        for (int i = 0; i < sessioni[k].num_comandi; i++) {
+            ComandoReplay* c = &sessioni[k].comandi[i];
+            switch (c->esito) {
+                case 0: identiche++; break;
+                case 1: diverse++; break;
+                case 2: senza_risposta++; break;
+                default: non_confrontabili++; break;
+            }
+            if (c->attesa != NULL && lat_originale) lat_originale[n_originale++] = c->latenza_originale_ms;
+            if (c->risposta_len > 0 && lat_replay) lat_replay[n_replay++] = c->latenza_replay_ms;
+            if ((c->esito == 1 || c->esito == 2) && stampate++ < MAX_DIFFERENZE_STAMPATE) {
+                printf("Sessione %d, comando %d '%s':\n  atteso:   ", sessioni[k].session_id, i + 1, c->testo);
+                if (c->attesa) stampa_testo(c->attesa->dati, c->attesa->lunghezza); else printf("(nessuna risposta in cattura)");
+                printf("\n  ottenuto: ");
+                if (c->risposta_len > 0) stampa_testo(c->risposta, c->risposta_len); else printf("(nessuna risposta)");
+                printf("\n");
+            }
+        }
+    }
+
+    double media_orig, p95_orig, media_replay, p95_replay;
+    statistiche_latenza(lat_originale, lat_originale ? n_originale : 0, &media_orig, &p95_orig);
+    statistiche_latenza(lat_replay, lat_replay ? n_replay : 0, &media_replay, &p95_replay);
+    free(lat_originale);
+    free(lat_replay);
+
+    printf("\nRisposte: %d identiche, %d diverse, %d mancanti, %d non confrontabili (frame troncati).\n",
+           identiche, diverse, senza_risposta, non_confrontabili);
+    printf("Latenza media:  originale %8.2f ms, replay %8.2f ms (%+.2f ms)\n", media_orig, media_replay, media_replay - media_orig);
+    printf("Latenza p95:    originale %8.2f ms, replay %8.2f ms (%+.2f ms)\n", p95_orig, p95_replay, p95_replay - p95_orig);
+    if (durata_originale_ms > 0 && durata_replay_ms > 0) {
+        double tp_orig = totale_comandi * 1000.0 / durata_originale_ms;
+        double tp_replay = totale_comandi * 1000.0 / durata_replay_ms;
+        printf("Throughput:     originale %8.1f cmd/s, replay %8.1f cmd/s (%+.1f%%)\n", tp_orig, tp_replay, (tp_replay / tp_orig - 1.0) * 100.0);
+    }
+    return diverse == 0 && senza_risposta == 0 ? 0 : 2;
+}
+
+static void stampa_uso(const char* programma) {
+    printf("Uso: %s emulatore <porta> [file cattura]\n", programma);
+    printf("     %s replay <ip server> <porta server> [velocita'] [file cattura]\n", programma);
+    printf("     velocita': 1 = tempi originali (predefinito), 10 = dieci volte piu' veloce, 0 = senza pause\n");
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        stampa_uso(argv[0]);
+        return 1;
+    }
+    int emulatore = strcmp(argv[1], "emulatore") == 0;
+    if (!emulatore && (strcmp(argv[1], "replay") != 0 || argc < 4)) {
+        stampa_uso(argv[0]);
+        return 1;
+    }
+    const char* percorso = CATTURA_FILE_DEFAULT;
+    if (emulatore && argc >= 4) percorso = argv[3];
+    if (!emulatore && argc >= 6) percorso = argv[5];
+
+    if (cattura_leggi_file(percorso, visita_carica, NULL) < 0) {
+        printf("Impossibile leggere il file di cattura %s.\n", percorso);
+        return 1;
+    }
+
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        printf("Errore inizializzazione Winsock: %d\n", WSAGetLastError());
+        return 1;
+    }
+    int esito = emulatore ? esegui_emulatore(atoi(argv[2]))
+                          : esegui_replay(argv[2], atoi(argv[3]), argc >= 5 ? atof(argv[4]) : 1.0);
+    WSACleanup();
+    return esito;
+}
@@ -45,11 +45,28 @@ int crea_risposta_errore(const char* adds, char famiglia_errore, const char* cod
 
 // Definizione costanti configurabili
 #define DEFAULT_PORT 9999   // Porta di default
+#define INDIRIZZI_ASCOLTO_DEFAULT "::" // Tutte le interfacce, IPv4 e IPv6 sullo stesso socket
+#define MAX_INDIRIZZI_ASCOLTO 8 // Socket di ascolto (uno per indirizzo configurato)
+#define MAX_ACCETTATORI 16  // Thread di accept, ripartiti tra i socket di ascolto
 #define MAX_BUFFER 4096     // Dimensione massima buffer
 #define MAX_ADDS 3         // Lunghezza massima di adds (2 caratteri + terminatore)
+#define ADDS_SERVER "SV"   // adds dei pacchetti generati dal server (battito, sonda): mai assegnato a un client
+#define MAX_COMANDO 1000   // Lunghezza massima di un comando client (campo len a 3 cifre + terminatore)
 #define BUFFER_CHUNK 128   // Dimensione chunk per buffer
+#define MAX_USCITA 8192    // Buffer di uscita per connessione: risposte raccolte e inviate insieme
+#define DIM_BUFFER_PACCHETTO 2048 // Buffer di pacchetto e risposta di un comando verso la stampante
 #define MAX_ERROR_COUNT 3   // Numero massimo di errori consecutivi
-#define TIMEOUT_MS 30000    // Timeout connessione (30 secondi)
+#define DRENAGGIO_SCADENZA_MS 30000       // Alla chiusura: tempo concesso agli scontrini in corso
+#define DRENAGGIO_ATTESA_FORZATA_MS 5000  // Dopo la scadenza: tempo per completare i comandi gia' inoltrati
+#define SESSIONE_POLL_MS 250              // Intervallo con cui i thread client verificano la chiusura
+#define DOCUMENTO_POLL_MS 50              // Intervallo di verifica mentre un altro terminale ha lo scontrino aperto
+#define DOCUMENTO_MARGINE_MS 1000         // Attesa oltre l'esclusiva perche' la chiusura del documento venga applicata
+#define MAX_PORTE_SERIALI_CLIENT 16       // Porte COM servite per i client seriali (adds da S1 a SG)
+#define KEEPALIVE_INATTIVITA_MS 5000      // Silenzio dopo cui TCP inizia a sondare il peer
+#define KEEPALIVE_INTERVALLO_MS 1000      // Intervallo tra le sonde senza risposta
+#define KEEPALIVE_TENTATIVI 3             // Sonde perse dopo cui la connessione viene interrotta (~8 s)
+#define ADMIN_PORTA_DEFAULT 9998          // Console di amministrazione su 127.0.0.1 (0 = disabilitata)
+#define ADMIN_MAX_RISPOSTA 16384          // Testo massimo della risposta a un comando di amministrazione
 #define DEFAULT_PRINTER_IP "10.0.70.32"
 #define DEFAULT_PRINTER_PORT 3000
 
@@ -58,11 +75,24 @@ int crea_risposta_errore(const char* adds, char famiglia_errore, const char* cod
 #include <string.h>     // Funzioni stringhe
 #include <winsock2.h>   // Socket Windows
 #include <windows.h>    // Funzioni Windows (necessario per API seriali)
-#include <ws2tcpip.h>   // Per inet_pton (necessario per alcune versioni MinGW/GCC)
+#include <ws2tcpip.h>   // Per inet_ntop e getaddrinfo (necessario per alcune versioni MinGW/GCC)
+#include <mstcpip.h>    // SIO_KEEPALIVE_VALS per i Windows senza TCP_KEEPCNT
 #include <time.h>       // Gestione tempo
 #include <WinError.h>   // Per ERROR_OPERATION_ABORTED etc.
 #include <stdlib.h>     // Funzioni standard
+#include <ctype.h>      // toupper per i parametri delle linee seriali
+#include <stdarg.h>     // Risposte formattate della console di amministrazione
 #include "relay_control.h"  // Inclusione del modulo relè
+#include "cache_risposte.h" // Cache delle risposte ai comandi di stato
+#include "latenza_stampante.h" // Scadenze delle risposte in base alla latenza osservata
+#include "comandi.h"        // Motore comandi e stato stampante
+#include "error_table.h"    // Codici errore RT usati dalla validazione locale
+#include "coda_stampante.h" // Coda dei comandi verso la stampante
+#include "giornale.h"       // Giornale dei comandi inviati alla stampante
+#include "cattura.h"        // Cattura binaria del traffico client/stampante
+#include "pool_oggetti.h"   // Pool dei contesti client e dei buffer dei pacchetti
+#include "pacchetto.h"      // Costruzione dei pacchetti del protocollo
+#include "limite_client.h"  // Limiti di frequenza dei comandi per sessione e indirizzo
 
 // === DEFINIZIONI PER MODALITÀ DI COMUNICAZIONE ===
 typedef enum {
@@ -73,8 +103,9 @@ typedef enum {
 
 // Variabili globali per la configurazione del server e della stampante
 CommunicationMode g_server_listen_mode = MODE_UNINITIALIZED;
-char g_server_listen_serial_port_name[20]; // Es. "COM1"
+char g_server_listen_serial_ports[128] = ""; // Porte COM dei client seriali, separate da virgola (es. "COM3,COM4")
 int g_server_listen_tcp_port = DEFAULT_PORT;
+char g_server_listen_addresses[128] = INDIRIZZI_ASCOLTO_DEFAULT; // Indirizzi separati da virgola
 
 CommunicationMode g_printer_connection_mode = MODE_UNINITIALIZED;
 char g_printer_conn_ip_address[16];      // Es. "192.168.1.100"
@@ -84,27 +115,81 @@ HANDLE h_printer_comm_port = INVALID_HANDLE_VALUE; // Handle per la porta serial
 
 BOOL g_relay_module_enabled = FALSE; // Flag per indicare se il modulo relè è stato abilitato e inizializzato correttamente
 
-// Parametri seriali stampante (fissi come da richiesta)
+// Parametri seriali stampante di default (modificabili all'avvio, es. "COM2:115200:8N1:rtscts")
 #define PRINTER_BAUD_RATE 9600
 #define PRINTER_PARITY NOPARITY
 #define PRINTER_STOP_BITS ONESTOPBIT
 #define PRINTER_BYTE_SIZE 8
+#define SONDA_VELOCITA_TIMEOUT_MS 500  // Attesa della risposta a ogni velocita' provata dalla negoziazione
+#define SERIALE_ATTESA_LETTURA_MS 500  // Letture sincrone fuori dai comandi (le risposte usano la scadenza della classe)
+#define SERIALE_MARGINE_SCRITTURA_MS 1000 // Oltre al tempo di trasmissione dei byte alla velocita' della linea
+
+// Parametri di una linea seriale: porta della stampante, porte dei client seriali, rele'
+typedef struct {
+    DWORD baud_rate;
+    BYTE byte_size;
+    BYTE parity;
+    BYTE stop_bits;
+    BOOL rts_cts;      // Controllo di flusso hardware RTS/CTS
+    BOOL negozia;      // Solo stampante: all'avvio si cerca la velocita' piu' alta a cui risponde
+} ParametriSeriale;
+
+// Byte trasferiti su una linea seriale e tempo speso a trasmetterli e riceverli
+// (l'attesa della stampante prima del primo byte di risposta non e' compresa)
+typedef struct {
+    LONG64 byte_inviati;
+    LONG64 byte_ricevuti;
+    LONG64 us_trasferimento;
+} StatisticheLinea;
+
+ParametriSeriale g_printer_serial_params = { PRINTER_BAUD_RATE, PRINTER_BYTE_SIZE, PRINTER_PARITY, PRINTER_STOP_BITS, FALSE, FALSE };
+static StatisticheLinea linea_stampante; // Aggiornata solo dal thread della coda stampante
+
+// Pack_id e ritrasmissioni verso la stampante (solo thread della coda stampante)
+#define STAMPANTE_MAX_RITRASMISSIONI 2 // Ritrasmissioni di un pacchetto dopo il primo invio
+#define ECO_PACK_ID_CONFERME 3         // Risposte consecutive con il pack_id del comando per considerarlo ripetuto
+static char pack_id_stampante = '0';   // pack_id dell'ultimo comando inviato
+static int eco_pack_id = 0;            // Risposte consecutive che ripetono il pack_id del comando
+static volatile LONG cont_nak_stampante = 0;
+static volatile LONG cont_ritrasmissioni_stampante = 0;
+static volatile LONG cont_risposte_scartate = 0;
+
+// Connessione TCP con la stampante e battito (solo thread della coda stampante)
+#define STAMPANTE_CONNESSIONE_MS 2000  // Attesa massima di connect: una stampante spenta non consuma l'intera scadenza
+#define STAMPANTE_BATTITO_MS 2000      // Inattivita' dopo cui il thread della coda interroga la stampante
+static SOCKET sock_stampante = INVALID_SOCKET; // Riusata tra i comandi, riaperta dopo errori e scadenze
+static int errori_consecutivi_stampante = 0;   // Comandi e battiti senza risposta completa
+static volatile LONG cont_connessioni_stampante = 0;
+static volatile LONG cont_battiti_stampante = 0;
+
+// Valori di ripiego per gli header MinGW che non definiscono le opzioni di keepalive (Windows 10 1709+)
+#ifndef TCP_KEEPIDLE
+#define TCP_KEEPIDLE 3
+#endif
+#ifndef TCP_KEEPCNT
+#define TCP_KEEPCNT 16
+#endif
+#ifndef TCP_KEEPINTVL
+#define TCP_KEEPINTVL 17
+#endif
 
 // Prototipi delle funzioni
 DWORD WINAPI tcp_client_handler(LPVOID lpParam); // Rinominata da client_handler
 DWORD WINAPI serial_client_handler(LPVOID lpParam); // lpParam sarà l'handle della porta seriale del client
 
 // Funzioni per l'invio alla stampante
-int invia_a_stampante_dispatcher(const char* pacchetto, int pacchetto_len, char* risposta, int max_risposta_len);
-int invia_a_stampante_tcp(const char* ip, int porta, const char* pacchetto, int pacchetto_len, char* risposta, int max_risposta_len);
-int invia_a_stampante_seriale(HANDLE hComm, const char* pacchetto, int pacchetto_len, char* risposta, int max_risposta_len);
+int invia_a_stampante_dispatcher(const char* pacchetto, int pacchetto_len, char* risposta, int max_risposta_len, DWORD scadenza_ms, DWORD ritrasmissione_ms);
+int invia_a_stampante_tcp(const char* ip, int porta, const char* pacchetto, int pacchetto_len, char* risposta, int max_risposta_len, DWORD scadenza_ms);
+int invia_a_stampante_seriale(HANDLE hComm, const char* pacchetto, int pacchetto_len, char* risposta, int max_risposta_len, DWORD scadenza_ms, DWORD ritrasmissione_ms);
 
 void print_log(const char* msg, int color);
 
 // Prototipi per la gestione TCP e Seriale del server
 void start_tcp_server(int port);
-void start_serial_server(const char* port_name);
-BOOL configure_serial_port(const char* port_name, HANDLE* hSerial, int baud_rate, BYTE parity, BYTE stop_bits, BYTE byte_size, BOOL for_printer_comm);
+int start_serial_server(const char* porte);
+BOOL configure_serial_port(const char* port_name, HANDLE* hSerial, const ParametriSeriale* parametri, BOOL for_printer_comm);
+BOOL analizza_linea_seriale(const char* specifica, const ParametriSeriale* predefiniti, char* porta, size_t dim_porta, ParametriSeriale* parametri);
+BOOL negozia_velocita_stampante(HANDLE hComm, ParametriSeriale* parametri);
 void close_serial_port_handle(HANDLE* hComm); // Funzione helper per chiudere la porta seriale
 int read_from_serial_port(HANDLE hComm, char* buffer, int buffer_len); // Funzione helper per leggere dalla seriale
 int write_to_serial_port(HANDLE hComm, const char* data, int data_len); // Funzione helper per scrivere su seriale
@@ -127,6 +212,18 @@ int write_to_serial_port(HANDLE hComm, const char* data, int data_len); // Funzi
 // Utilizzato per segnalare ai thread di terminare
 volatile int server_running = 1;
 
+// Livelli di log, dal meno al piu' dettagliato: i messaggi oltre il livello corrente non vengono
+// stampati (comando "log" della console di amministrazione)
+typedef enum {
+    LOG_ERRORI = 0,
+    LOG_AVVISI,
+    LOG_INFO,
+    LOG_DEBUG
+} LivelloLog;
+static volatile LONG livello_log = LOG_DEBUG;
+int g_admin_port = ADMIN_PORTA_DEFAULT;
+static HANDLE evento_arresto = NULL; // Segnalato dal comando "exit" (console o amministrazione)
+
 /*
  * Protocollo di comunicazione
  * ==========================
@@ -137,11 +234,12 @@ volatile int server_running = 1;
  * 
  * Campi:
  * - STX: 0x02 (inizio pacchetto)
- * - adds: 2 caratteri identificativi client ("00".."99")
+ * - adds: 2 caratteri identificativi client ("00".."99" TCP, "S1".."SG" seriali; ADDS_SERVER per il server)
  * - len: 3 cifre, lunghezza campo dati ("008")
  * - N: protocol id (fisso 'N')
  * - dati: campo dati (testo risposta)
- * - pack_id: cifra ciclica 0-9 (qui sempre '1')
+ * - pack_id: cifra ciclica 0-9 (sempre '1' nelle risposte del server; verso la stampante cambia a ogni comando
+ *            e resta uguale nelle ritrasmissioni, vedi invia_a_stampante_registrata)
  * - CHK: checksum XOR di tutti i byte da adds a pack_id (2 cifre esadecimali ASCII)
  * - ETX: 0x03 (fine pacchetto)
  * 
@@ -180,6 +278,10 @@ volatile int server_running = 1;
  * Comandi di stato:
  * <?s          : Richiede stato (echo)
  * <?d          : Richiede data/ora corrente
+ *
+ * Comandi gestiti dal server (non inoltrati alla stampante):
+ * FEED         : Avanzamento carta tramite relè
+ * STATO        : Stato della stampante secondo il modello condiviso (chiave, documento, totale) e sessione con l'esclusiva
  */
 
 // =====================
@@ -200,75 +302,18 @@ unsigned char calcola_chk(const char* data, int len) {
 // Prototipo funzione per log con timestamp e colore
 void print_log(const char* msg, int color);
 
-// Costruisce il pacchetto di risposta secondo il protocollo specificato
-int costruisci_pacchetto(const char* adds, const char* dati, int dati_len_logico, char* pacchetto, int max_len) {
-    memset(pacchetto, 0, max_len);
-
-    char lungh[4];
-    if (dati_len_logico > 999) dati_len_logico = 999;
-    snprintf(lungh, sizeof(lungh), "%03d", dati_len_logico);
-
-    int pos = 0;
-    pacchetto[pos++] = 0x02; // STX
-    memcpy(pacchetto + pos, adds, 2); pos += 2;
-    memcpy(pacchetto + pos, lungh, 3); pos += 3;
-    pacchetto[pos++] = 'N';
-    memcpy(pacchetto + pos, dati, (size_t)dati_len_logico); pos += dati_len_logico;
-    pacchetto[pos++] = '1'; // pack_id fisso
-
-    // Calcola il checksum da STX fino a pack_id incluso
-    unsigned char chk = 0;
-    for (int i = 0; i < pos; i++) {
-        chk ^= (unsigned char)pacchetto[i];
-    }
-
-    // Scrivi il checksum in ASCII HEX
-    snprintf((char*)(pacchetto + pos), 3, "%02X", chk);
-    pos += 2;
-
-    pacchetto[pos++] = 0x03; // ETX
-
-    return pos;
-}
-
-// =====================
-// === STATO STAMPANTE ===
-// =====================
-// Ogni client ha il suo stato separato (simulazione di una stampante dedicata per ogni connessione)
-typedef struct {
-    int chiave;           // 0 = lock, 1 = REG, 2 = X, 3 = Z, 4 = PRG, 5 = SRV
-    int lock;             // 1 = lock attivo, 0 = no lock
-    int totale;           // Totale corrente
-    int fidelity_attiva;  // 1 se attiva, 0 se no
-    char fidelity1[128];  // Riga fidelity 1
-    char fidelity2[128];  // Riga fidelity 2
-    int ultimo_importo;   // ultimo importo registrato
-    int ultimo_reparto;   // ultimo reparto registrato
-    int error_count;      // Conteggio errori consecutivi
-    time_t last_command;  // Timestamp dell'ultimo comando
-    int session_id;       // ID di sessione univoco per ogni connessione
-} StatoStampante;
-
 // =====================
 // === LOGICA COMANDI ===
 // =====================
-// Questa funzione processa ogni comando ricevuto dal client e restituisce la risposta secondo il protocollo
-// (Qui puoi implementare la logica di ogni comando, per ora è solo un placeholder)
-int crea_risposta(const char* adds, const char* comando, int comando_len, char* pacchetto, int max_len, StatoStampante* stato) {
-    // Gestione degli errori consecutivi
-    if (stato->error_count >= 3) {
-        return crea_risposta_errore(adds, 
-                                  FAMIGLIA_ERRORE_BLOCCANTE, 
-                                  "0003", 
-                                  "Troppi errori consecutivi", 
-                                  pacchetto, 
-                                  max_len);
-    }
+// Questa funzione analizza ogni comando ricevuto dal client prima che raggiunga la stampante.
+// Il comando viene riconosciuto tramite la tabella di dispatch di comandi.c e i suoi argomenti
+// vengono convertiti in cmd; i comandi malformati o fuori sequenza vengono respinti con lo
+// stesso codice E.. della stampante (vedi error_table.h) senza impegnarla.
+// Ritorna la lunghezza del pacchetto di risposta se il comando e' stato risolto localmente,
+// 0 se il comando deve essere inoltrato alla stampante.
+int crea_risposta(const char* adds, const char* comando, int comando_len, char* pacchetto, int max_len, StatoSessione* sessione, ComandoStampante* cmd) {
+    sessione->last_command = time(NULL);
 
-    // Resetta il contatore errori
-    stato->error_count = 0;
-    stato->last_command = time(NULL);
-    
     // Verifica se il comando è vuoto
     if (comando_len == 0) {
         return crea_risposta_errore(adds, 
@@ -278,492 +323,1299 @@ int crea_risposta(const char* adds, const char* comando, int comando_len, char*
                                   pacchetto, 
                                   max_len);
     }
-    
-    if (strncmp(comando, "=K", 2) == 0) {
-        // Comando di reset
-        stato->ultimo_importo = 0;
-        stato->ultimo_reparto = 0;
-        stato->error_count = 0;
-        
-        // Risposta di successo
-        return costruisci_pacchetto(adds, "O|N|0000|Reset completato", 22, pacchetto, max_len);
-    } 
-    // Aggiungi qui altri comandi...
-    else {
-        // Comando non riconosciuto
+
+    // Comando speciale STATO: risponde con il modello condiviso della stampante, senza interrogarla
+    if (comando_len == 5 && _strnicmp(comando, "STATO", 5) == 0) {
+        StatoStampante stato;
+        stampante_snapshot(&stato);
+        int sessione_affine = CODA_NESSUNA_SESSIONE;
+        LONG durata_affinita = 0;
+        coda_affinita_corrente(&sessione_affine, &durata_affinita);
+        // I dati vengono scritti direttamente nel campo dati del pacchetto
+        char* dati = pacchetto + PACCHETTO_INIZIO_DATI;
+        int spazio = max_len - PACCHETTO_CORNICE + 1;
+        int dati_len = snprintf(dati, (size_t)spazio, "O|N|0000|CHIAVE=%d LOCK=%d DOC=%d RIGHE=%d TOTALE=%d INCERTO=%d VER=%lu AFFINITA=%d/%ldMS",
+                                stato.chiave, stato.lock, stato.documento_aperto, stato.righe_documento, stato.totale, stato.incerto, stato.versione,
+                                sessione_affine, durata_affinita);
+        cmd->codice = CMD_SCONOSCIUTO;
+        if (dati_len < 0 || dati_len >= spazio) return -1;
+        return pacchetto_costruisci(adds, dati, dati_len, pacchetto, max_len).lunghezza;
+    }
+
+    const char* errore_sintassi = comando_analizza(comando, comando_len, cmd);
+    cmd->session_id = sessione->session_id;
+    const char* codice_rt = errore_sintassi ? "E01" : stampante_valida(cmd);
+    if (codice_rt == NULL) {
+        // Comando ammesso (o sconosciuto al gateway): lo decide la stampante
+        sessione->error_count = 0;
+        return 0;
+    }
+
+    // Gestione degli errori consecutivi
+    sessione->error_count++;
+    if (sessione->error_count >= MAX_ERROR_COUNT) {
         return crea_risposta_errore(adds, 
-                                  FAMIGLIA_ERRORE_GENERICO, 
-                                  "0002", 
-                                  "Comando non riconosciuto", 
+                                  FAMIGLIA_ERRORE_BLOCCANTE, 
+                                  "0003", 
+                                  "Troppi errori consecutivi", 
                                   pacchetto, 
                                   max_len);
     }
+
+    // Stesso codice E.. che restituirebbe la stampante, senza il round trip
+    char messaggio[256];
+    const char* descrizione = descrizione_errore(codice_rt);
+    if (errore_sintassi) {
+        snprintf(messaggio, sizeof(messaggio), "%s (%s: %s)", descrizione, comando_nome(cmd->codice), errore_sintassi);
+    } else {
+        snprintf(messaggio, sizeof(messaggio), "%s", descrizione ? descrizione : comando_nome(cmd->codice));
+    }
+    return crea_risposta_errore(adds, 
+                              FAMIGLIA_ERRORE_GENERICO, 
+                              codice_rt, 
+                              messaggio, 
+                              pacchetto, 
+                              max_len);
 }
 
 // =====================
 // === THREAD CLIENT ===
 // =====================
-// Ogni client viene gestito da un thread separato, con il suo stato stampante
+// Ogni client viene gestito da un thread separato; lo stato della stampante e' condiviso (vedi comandi.c)
+// e l'accesso alla stampante fisica passa dalla coda di coda_stampante.c.
+
+// Comando inoltrato alla stampante e non ancora completato.
+// Pacchetto e risposta sono buffer del pool, presi per il solo tempo del comando: il client
+// li scrive e li legge, il thread della coda li usa tramite i puntatori della richiesta.
+typedef struct {
+    RichiestaStampante richiesta;
+    char comando[MAX_COMANDO];     // Testo del comando (chiave della cache)
+    int comando_len;
+    EsitoCache esito_cache;
+    char* pacchetto;
+    char* risposta;
+} ComandoInVolo;
+
+// Chiusura di una sessione richiesta dalla console di amministrazione
+typedef enum {
+    CHIUSURA_NESSUNA = 0,
+    CHIUSURA_DRENA,        // Come all'arresto del server: dopo l'eventuale scontrino aperto
+    CHIUSURA_FORZATA       // Subito dopo i comandi gia' inoltrati alla stampante
+} ChiusuraSessione;
+
+// Contesto di un client (TCP o seriale) servito da un thread
+typedef struct ContestoClient {
+    SOCKET sock;                   // Socket del client TCP (INVALID_SOCKET per i client seriali)
+    HANDLE h_seriale;              // Porta del client seriale (INVALID_HANDLE_VALUE per i client TCP)
+    HANDLE evento_scrittura;       // Evento delle scritture overlapped sulla porta del client seriale
+    ParametriSeriale linea_parametri; // Solo client seriali: configurazione della porta
+    StatisticheLinea linea;        // Solo client seriali: byte e tempi di trasferimento
+    char adds[MAX_ADDS];
+    StatoSessione sessione;
+    ComandoInVolo in_volo[CODA_MAX_CLIENTE]; // Buffer circolare dei comandi inoltrati, in ordine di arrivo
+    int primo_in_volo;
+    int n_in_volo;
+    char uscita[MAX_USCITA];       // Risposte in attesa di invio, nell'ordine dei comandi
+    int uscita_len;
+    int uscita_risposte;
+    BOOL documento_aperto;         // Scontrino aperto dalla sessione e non ancora chiuso
+    char indirizzo[INET6_ADDRSTRLEN + 16]; // Peer TCP o porta COM (console di amministrazione)
+    DWORD t_connessione;           // GetTickCount() all'apertura della sessione
+    volatile LONG comandi;         // Comandi ricevuti
+    volatile LONG chiusura;        // ChiusuraSessione richiesta dalla console di amministrazione
+    LimiteClient limite;           // Secchi di token e contatori di utilizzo della sessione
+    LimiteClient* limite_ip;       // Secchi dell'indirizzo sorgente (NULL per i client seriali)
+    struct ContestoClient* precedente; // Registro delle sessioni aperte
+    struct ContestoClient* successivo;
+} ContestoClient;
+
+// Registro delle sessioni aperte, letto dalla console di amministrazione
+static SRWLOCK lock_registro = SRWLOCK_INIT;
+static ContestoClient* registro_sessioni = NULL;
+// Ultimo ID di sessione assegnato: unico tra tutti i thread di accept e le porte seriali
+// (affinita' di documento, cache, cattura e console di amministrazione si basano sull'ID)
+static volatile LONG contatore_sessioni = 0;
+
+// Contatori delle scritture verso i client (risposte e chiamate di invio effettive)
+static volatile LONG cont_risposte_client = 0;
+static volatile LONG cont_invii_client = 0;
+
+// I contesti vengono presi dal pool all'accettazione della connessione e restituiti alla
+// sua chiusura; i buffer dei pacchetti passano da un comando all'altro senza azzeramento
+static PoolOggetti pool_contesti;
+static PoolOggetti pool_buffer;
+
+// Stato dell'arresto controllato: con server_running a 0 le sessioni senza scontrino aperto
+// si chiudono; allo scadere di DRENAGGIO_SCADENZA_MS si chiudono anche le altre
+static volatile LONG sessioni_attive = 0;
+static volatile LONG documenti_in_corso = 0;    // Sessioni con uno scontrino aperto
+static volatile LONG documenti_interrotti = 0;  // Sessioni terminate con lo scontrino ancora aperto
+static volatile BOOL drenaggio_forzato = FALSE;
+
+// Restituisce al pool i buffer del comando
+static void rilascia_buffer_in_volo(ComandoInVolo* v) {
+    pool_restituisci(&pool_buffer, v->pacchetto);
+    pool_restituisci(&pool_buffer, v->risposta);
+    v->pacchetto = NULL;
+    v->risposta = NULL;
+}
+
+// Rimuove caratteri di controllo (CR, LF, ACK, NAK) e spazi all'inizio e alla fine del comando
+static void pulisci_comando(char** comando, int* comando_len) {
+    while (*comando_len > 0 && (**comando == '\r' || **comando == '\n' || (unsigned char)**comando == 0x06 || (unsigned char)**comando == 0x15 || **comando == ' ')) {
+        (*comando)++;
+        (*comando_len)--;
+    }
+    while (*comando_len > 0) {
+        char c = (*comando)[*comando_len - 1];
+        if (c != '\r' && c != '\n' && (unsigned char)c != 0x06 && (unsigned char)c != 0x15 && c != ' ') break;
+        (*comando_len)--;
+    }
+}
+
+// Orologio ad alta risoluzione per le misure di trasferimento sulle linee seriali
+static LONGLONG microsecondi(void) {
+    static LARGE_INTEGER frequenza;
+    LARGE_INTEGER adesso;
+    if (frequenza.QuadPart == 0) QueryPerformanceFrequency(&frequenza);
+    QueryPerformanceCounter(&adesso);
+    return adesso.QuadPart * 1000000 / frequenza.QuadPart;
+}
+
+// Bit trasmessi per ogni byte: start, dati, parita' e stop
+static int bit_per_byte(const ParametriSeriale* p) {
+    return 1 + p->byte_size + (p->parity == NOPARITY ? 0 : 1) + (p->stop_bits == ONESTOPBIT ? 1 : 2);
+}
+
+// Millisecondi per trasmettere un byte alla velocita' della linea, arrotondati per eccesso
+static DWORD ms_per_byte(const ParametriSeriale* p) {
+    return ((DWORD)bit_per_byte(p) * 1000 + p->baud_rate - 1) / p->baud_rate;
+}
+
+// Scrive nel log byte trasferiti e velocita' effettiva di una linea seriale, confrontata con quella teorica
+static void log_statistiche_linea(const char* nome, const ParametriSeriale* p, const StatisticheLinea* st) {
+    char log_msg[256];
+    LONG64 byte_totali = st->byte_inviati + st->byte_ricevuti;
+    LONG64 effettivi = st->us_trasferimento > 0 ? byte_totali * 1000000 / st->us_trasferimento : 0;
+    snprintf(log_msg, sizeof(log_msg), "Linea %s: %lu baud%s, %lld byte inviati e %lld ricevuti in %lld ms, %lld byte/s effettivi (teorici %lu).\n",
+             nome, (unsigned long)p->baud_rate, p->rts_cts ? " RTS/CTS" : "", st->byte_inviati, st->byte_ricevuti,
+             st->us_trasferimento / 1000, effettivi, (unsigned long)(p->baud_rate / (DWORD)bit_per_byte(p)));
+    print_log(log_msg, COLOR_INFO);
+}
+
+// Scrive sul canale della sessione i dati indicati con una sola chiamata di invio
+static int scrivi_al_client(ContestoClient* c, char* dati, int len) {
+    InterlockedIncrement(&cont_invii_client);
+    if (c->sock != INVALID_SOCKET) {
+        WSABUF buf;
+        DWORD inviati = 0;
+        buf.buf = dati;
+        buf.len = (ULONG)len;
+        if (WSASend(c->sock, &buf, 1, &inviati, 0, NULL, NULL) == SOCKET_ERROR) return SOCKET_ERROR;
+        return (int)inviati;
+    }
+    // Porta aperta in modalita' overlapped: la scrittura si attende sull'evento della sessione
+    OVERLAPPED ov = {0};
+    DWORD scritti = 0;
+    ov.hEvent = c->evento_scrittura;
+    LONGLONG inizio = microsecondi();
+    if (!WriteFile(c->h_seriale, dati, (DWORD)len, &scritti, &ov)) {
+        if (GetLastError() != ERROR_IO_PENDING || !GetOverlappedResult(c->h_seriale, &ov, &scritti, TRUE)) {
+            char err_msg[100];
+            snprintf(err_msg, sizeof(err_msg), "Errore WriteFile verso il client seriale %s: %lu", c->adds, GetLastError());
+            print_log(err_msg, COLOR_ERROR);
+            return -1;
+        }
+    }
+    c->linea.byte_inviati += scritti;
+    c->linea.us_trasferimento += microsecondi() - inizio;
+    return (int)scritti;
+}
+
+// Invia al client le risposte raccolte nel buffer di uscita.
+// Va chiamata alla fine di ogni passata sui dati ricevuti e prima di ogni attesa che
+// tratterrebbe risposte gia' pronte (stampante, ammissione in coda, rele').
+static int svuota_uscita(ContestoClient* c) {
+    if (c->uscita_len == 0) return 0;
+    int inviati = scrivi_al_client(c, c->uscita, c->uscita_len);
+    InterlockedExchangeAdd(&cont_risposte_client, c->uscita_risposte);
+    c->uscita_len = 0;
+    c->uscita_risposte = 0;
+    return inviati;
+}
+
+// Accoda una risposta nel buffer di uscita del client; l'invio avviene con svuota_uscita.
+// Ritorna i byte accettati.
+static int invia_al_client(ContestoClient* c, const char* dati, int len) {
+    cattura_frame(CATTURA_A_CLIENT, c->sessione.session_id, dati, len);
+    if (len > MAX_USCITA - c->uscita_len) svuota_uscita(c);
+    if (len > MAX_USCITA) {
+        // Risposta piu' grande del buffer: inviata direttamente
+        InterlockedIncrement(&cont_risposte_client);
+        return scrivi_al_client(c, (char*)dati, len);
+    }
+    memcpy(c->uscita + c->uscita_len, dati, (size_t)len);
+    c->uscita_len += len;
+    c->uscita_risposte++;
+    return len;
+}
+
+// Tiene traccia dello scontrino aperto dalla sessione, per non interromperlo alla chiusura del server
+static void aggiorna_documento_sessione(ContestoClient* c, AffinitaDocumento affinita) {
+    if (affinita == AFFINITA_DOCUMENTO && !c->documento_aperto) {
+        c->documento_aperto = TRUE;
+        InterlockedIncrement(&documenti_in_corso);
+    } else if (affinita == AFFINITA_FINE_DOCUMENTO && c->documento_aperto) {
+        c->documento_aperto = FALSE;
+        InterlockedDecrement(&documenti_in_corso);
+    }
+}
+
+// Attende il comando in volo piu' vecchio e ne inoltra la risposta al client
+static void completa_primo_in_volo(ContestoClient* c) {
+    ComandoInVolo* v = &c->in_volo[c->primo_in_volo];
+    if (!v->richiesta.completata) svuota_uscita(c); // Le risposte pronte non aspettano la stampante
+    coda_attendi(&v->richiesta);
+    c->primo_in_volo = (c->primo_in_volo + 1) % CODA_MAX_CLIENTE;
+    c->n_in_volo--;
+
+    int risposta_len = v->richiesta.risposta_len;
+    if (v->esito_cache == CACHE_LEADER) {
+        cache_pubblica(v->comando, v->comando_len, v->risposta, risposta_len);
+    } else {
+        cache_invalida(); // Una query partita durante il comando potrebbe aver letto lo stato precedente
+    }
+
+    // Debug protocollo: stampa HEX/ASCII risposta stampante solo se abilitato
+#ifdef DEBUG_PROTOCOL
+    printf("[DEBUG] Risposta HEX dalla stampante: ");
+    for (int i = 0; i < risposta_len; i++) printf("%02X ", (unsigned char)v->risposta[i]);
+    printf("\n");
+    printf("[DEBUG] Risposta ASCII dalla stampante: ");
+    for (int i = 0; i < risposta_len; i++) {
+        char ch = v->risposta[i];
+        if (ch >= 32 && ch <= 126) putchar(ch); else putchar('.');
+    }
+    printf("\n");
+#endif
 
-// Struttura per passare argomenti al thread client seriale
-struct serial_client_args {
-    HANDLE hClientSerial; // Handle alla porta seriale del client
-    char adds[MAX_ADDS];  // Identificativo client (es. "S0")
-};
+    char debug_msg[256];
+    if (risposta_len > 0) {
+        // Il modello condiviso e' gia' stato aggiornato dal thread della coda; qui solo lo stato
+        // del documento della sessione. Una risposta troncata o con CHK errato non conta come eseguito.
+        if (pacchetto_risposta_positiva(v->risposta, risposta_len, NULL)) {
+            aggiorna_documento_sessione(c, v->richiesta.affinita);
+        }
+        int sent = invia_al_client(c, v->risposta, risposta_len);
+        snprintf(debug_msg, sizeof(debug_msg), "[DEBUG] Accodati %d bytes per il client %s.\n", sent, c->adds);
+        print_log(debug_msg, COLOR_DEBUG);
+    } else {
+        // Se la stampante NON ha risposto, invia risposta di errore protocollo al client
+        char risposta_errore[1024];
+        int errore_len = crea_risposta_errore(c->adds, FAMIGLIA_ERRORE_BLOCCANTE, "0004", "Errore comunicazione con stampante", risposta_errore, sizeof(risposta_errore));
+        int sent = invia_al_client(c, risposta_errore, errore_len);
+        snprintf(debug_msg, sizeof(debug_msg), "[DEBUG] Inviato errore protocollo al client %s (%d bytes).\n", c->adds, sent);
+        print_log(debug_msg, COLOR_DEBUG);
+    }
+    rilascia_buffer_in_volo(v); // La risposta e' gia' stata copiata nel buffer di uscita
+}
+
+static void completa_tutti_in_volo(ContestoClient* c) {
+    while (c->n_in_volo > 0) {
+        completa_primo_in_volo(c);
+    }
+}
 
-struct client_args {
-    SOCKET sock;
-    char adds[3]; // Identificativo client (2 cifre decimali, "00".."99")
-};
+// Risponde al client rispettando l'ordine dei comandi: prima si completano quelli gia' inoltrati
+static void rispondi_in_ordine(ContestoClient* c, const char* dati, int len) {
+    completa_tutti_in_volo(c);
+    invia_al_client(c, dati, len);
+}
+
+static void rispondi_errore_in_ordine(ContestoClient* c, char famiglia_errore, const char* codice_errore, const char* messaggio) {
+    char risposta_errore[1024];
+    int errore_len = crea_risposta_errore(c->adds, famiglia_errore, codice_errore, messaggio, risposta_errore, sizeof(risposta_errore));
+    if (errore_len > 0) {
+        rispondi_in_ordine(c, risposta_errore, errore_len);
+    }
+}
+
+// Corsia della coda stampante in cui viene servito il comando
+static CorsiaStampante corsia_comando(const ComandoStampante* cmd) {
+    switch (cmd->codice) {
+        case CMD_CLEAR:
+        case CMD_ANNULLA_DOC:
+        case CMD_CHIAVE:
+            return CORSIA_URGENTE;
+        case CMD_REGISTRA:
+        case CMD_STORNO:
+        case CMD_SUBTOTALE:
+        case CMD_TOTALE:
+        case CMD_FIDELITY:
+        case CMD_CHIUDI_DOC:
+            return CORSIA_DOCUMENTO;
+        default:
+            return CORSIA_INTERROGAZIONI; // Interrogazioni, report e comandi non riconosciuti
+    }
+}
+
+// Effetto del comando sull'esclusiva della stampante durante un documento commerciale
+static AffinitaDocumento affinita_comando(const ComandoStampante* cmd) {
+    switch (cmd->codice) {
+        case CMD_REGISTRA:
+        case CMD_STORNO:
+        case CMD_SUBTOTALE:
+        case CMD_FIDELITY:
+            return AFFINITA_DOCUMENTO;
+        case CMD_TOTALE:
+        case CMD_CHIUDI_DOC:
+        case CMD_ANNULLA_DOC:
+        case CMD_CLEAR:
+            return AFFINITA_FINE_DOCUMENTO;
+        default:
+            return AFFINITA_NESSUNA;
+    }
+}
+
+// Ritorna TRUE se la sessione deve chiudersi per l'arresto del server o su richiesta della
+// console di amministrazione: subito se non ha scontrini aperti, allo scadere del drenaggio
+// (o con la chiusura forzata) altrimenti
+static BOOL sessione_da_chiudere(const ContestoClient* c) {
+    if (c->chiusura == CHIUSURA_FORZATA) return TRUE;
+    if (server_running && c->chiusura == CHIUSURA_NESSUNA) return FALSE;
+    return drenaggio_forzato || !c->documento_aperto;
+}
+
+// Classe del limite di frequenza: solo i comandi indicati esplicitamente come lunghi hanno il
+// limite stretto dei report; gli altri comandi non riconosciuti hanno quello delle operazioni
+static ClasseLatenza classe_limite(const ComandoStampante* cmd, const char* comando, int comando_len) {
+    if (cmd->codice == CMD_SCONOSCIUTO) {
+        return latenza_comando_lungo(comando, comando_len) ? CLASSE_LUNGA : CLASSE_OPERAZIONE;
+    }
+    return latenza_classe(cmd->codice, comando, comando_len);
+}
+
+// Attende un token per un comando della classe. Oltre il limite il thread non legge altro dal
+// socket o dalla porta: e' il client a rallentare, senza disconnessioni. Le risposte ai comandi
+// gia' accodati vengono inviate prima di attendere.
+static void attendi_limite(ContestoClient* c, ClasseLatenza classe) {
+    DWORD attesa = limite_preleva(&c->limite, c->limite_ip, classe);
+    if (attesa == 0) return;
+
+    DWORD inizio = GetTickCount();
+    char debug_msg[160];
+    snprintf(debug_msg, sizeof(debug_msg), "[DEBUG] Client %s (%s) oltre il limite per le %s: attesa di %lu ms.\n",
+             c->adds, c->indirizzo, latenza_nome_classe(classe), (unsigned long)attesa);
+    print_log(debug_msg, COLOR_DEBUG);
+    completa_tutti_in_volo(c);
+    svuota_uscita(c);
+    while (attesa > 0 && !sessione_da_chiudere(c)) {
+        Sleep(attesa < SESSIONE_POLL_MS ? attesa : SESSIONE_POLL_MS);
+        attesa = limite_preleva(&c->limite, c->limite_ip, classe);
+    }
+    limite_registra_attesa(&c->limite, c->limite_ip, GetTickCount() - inizio);
+}
+
+// Un comando di documento mentre un altro terminale ha lo scontrino aperto attende che venga chiuso
+// finche' quel terminale conserva l'esclusiva (piu' un breve margine perche' la chiusura arrivi al
+// modello); scaduta l'esclusiva, crea_risposta lo respinge con E20 senza toccare lo scontrino altrui.
+static void attendi_documento_altrui(ContestoClient* c, const char* comando, int comando_len) {
+    ComandoStampante cmd;
+    if (comando_analizza(comando, comando_len, &cmd) != NULL || !comando_di_documento(&cmd)) return;
+    cmd.session_id = c->sessione.session_id;
+
+    BOOL in_attesa = FALSE;
+    DWORD ultima_esclusiva = GetTickCount();
+    while (!sessione_da_chiudere(c)) {
+        StatoStampante stato;
+        stampante_snapshot(&stato);
+        if (!comando_documento_altrui(&stato, &cmd)) return;
+        int sessione_affine;
+        if (coda_affinita_corrente(&sessione_affine, NULL) && sessione_affine == stato.sessione_documento) {
+            ultima_esclusiva = GetTickCount();
+        } else if (GetTickCount() - ultima_esclusiva >= DOCUMENTO_MARGINE_MS) {
+            return;
+        }
+        if (!in_attesa) {
+            char debug_msg[160];
+            snprintf(debug_msg, sizeof(debug_msg), "[DEBUG] Client %s (%s) in attesa: documento aperto dalla sessione %d.\n",
+                     c->adds, c->indirizzo, stato.sessione_documento);
+            print_log(debug_msg, COLOR_DEBUG);
+            completa_tutti_in_volo(c);
+            svuota_uscita(c);
+            in_attesa = TRUE;
+        }
+        Sleep(DOCUMENTO_POLL_MS);
+    }
+}
+
+// Processa un comando completo ricevuto dal client (gia' ripulito e terminato da '\0').
+// I comandi per la stampante vengono accodati senza attenderne la risposta, fino a
+// CODA_MAX_CLIENTE per client; le risposte vengono comunque inviate nell'ordine dei comandi.
+static void processa_comando(ContestoClient* c, const char* comando, int comando_len) {
+    InterlockedIncrement(&c->comandi);
+    char debug_msg[256];
+    snprintf(debug_msg, sizeof(debug_msg), "[DEBUG] Comando estratto da client %s: '%s' (lunghezza: %d)\n", c->adds, comando, comando_len);
+    print_log(debug_msg, COLOR_DEBUG);
+
+    // Qui puoi aggiungere comandi speciali che non vanno alla stampante
+    if (_strnicmp(comando, "FEED", 4) == 0) {
+        if (g_relay_module_enabled) {
+            print_log("Comando FEED ricevuto. Attivazione rele per avanzamento carta...", COLOR_INFO);
+            completa_tutti_in_volo(c);
+            svuota_uscita(c);
+            pulse_relay(500); // Simula la pressione di un pulsante per 500ms
+            const char* success_msg = "OK: FEED eseguito.\r\n";
+            invia_al_client(c, success_msg, (int)strlen(success_msg));
+        } else {
+            print_log("Comando FEED ricevuto, ma modulo rele disabilitato. Comando ignorato.", COLOR_WARNING);
+            const char* error_msg = "ERRORE: Modulo rele non abilitato o non disponibile.\r\n";
+            rispondi_in_ordine(c, error_msg, (int)strlen(error_msg));
+        }
+        return;
+    }
+
+    attendi_documento_altrui(c, comando, comando_len);
+
+    char risposta_locale[1024];
+    ComandoStampante cmd;
+    int risposta_locale_len = crea_risposta(c->adds, comando, comando_len, risposta_locale, sizeof(risposta_locale), &c->sessione, &cmd);
+    if (risposta_locale_len > 0) {
+        // Comando risolto dal gateway senza impegnare la stampante
+        print_log("[DEBUG] Comando risolto localmente.\n", COLOR_DEBUG);
+        rispondi_in_ordine(c, risposta_locale, risposta_locale_len);
+        return;
+    }
+
+    attendi_limite(c, classe_limite(&cmd, comando, comando_len));
+
+    // Budget del client esaurito: si attende la risposta al comando piu' vecchio
+    if (c->n_in_volo == CODA_MAX_CLIENTE) {
+        completa_primo_in_volo(c);
+    }
+    // Una query identica a una nostra ancora in volo attenderebbe una risposta che solo noi possiamo pubblicare
+    if (c->n_in_volo > 0 && cache_comando_cacheabile(comando, comando_len)) {
+        completa_tutti_in_volo(c);
+    }
+
+    ComandoInVolo* v = &c->in_volo[(c->primo_in_volo + c->n_in_volo) % CODA_MAX_CLIENTE];
+    v->pacchetto = (char*)pool_prendi(&pool_buffer);
+    v->risposta = (char*)pool_prendi(&pool_buffer);
+    if (v->pacchetto == NULL || v->risposta == NULL) {
+        rilascia_buffer_in_volo(v);
+        rispondi_errore_in_ordine(c, FAMIGLIA_ERRORE_GENERICO, "0005", "Memoria esaurita");
+        return;
+    }
+    int risposta_len = 0;
+    int sessione_affine;
+    if (coda_affinita_corrente(&sessione_affine, NULL) && sessione_affine == c->sessione.session_id) {
+        // Con il documento aperto la stampante serve solo questa sessione: attendere una query
+        // identica di un altro client (ferma dietro di noi) bloccherebbe fino allo scadere dell'esclusiva
+        v->esito_cache = CACHE_NON_CACHEABILE;
+    } else {
+        // L'attesa di una query identica in volo non supera la scadenza della classe del comando
+        v->esito_cache = cache_acquisisci(comando, comando_len, v->risposta, DIM_BUFFER_PACCHETTO, &risposta_len,
+                                          latenza_scadenza(classe_limite(&cmd, comando, comando_len)));
+    }
+    if (v->esito_cache == CACHE_HIT) {
+        pacchetto_riindirizza(v->risposta, risposta_len, c->adds); // Risposta di un altro client
+        print_log("[DEBUG] Risposta servita dalla cache.\n", COLOR_DEBUG);
+        rispondi_in_ordine(c, v->risposta, risposta_len);
+        rilascia_buffer_in_volo(v);
+        return;
+    }
+
+    v->richiesta.pacchetto_len = pacchetto_costruisci(c->adds, comando, comando_len, v->pacchetto, DIM_BUFFER_PACCHETTO).lunghezza;
+    if (v->richiesta.pacchetto_len <= 0) {
+        if (v->esito_cache == CACHE_LEADER) cache_pubblica(comando, comando_len, NULL, 0);
+        rilascia_buffer_in_volo(v);
+        rispondi_errore_in_ordine(c, FAMIGLIA_ERRORE_GENERICO, "0005", "Errore costruzione pacchetto interno");
+        return;
+    }
+    snprintf(debug_msg, sizeof(debug_msg), "[DEBUG] Pacchetto da inviare alla stampante (len=%d): '%.*s'\n", v->richiesta.pacchetto_len, v->richiesta.pacchetto_len, v->pacchetto);
+    print_log(debug_msg, COLOR_DEBUG);
+    // Debug protocollo: stampa HEX solo se abilitato
+#ifdef DEBUG_PROTOCOL
+    printf("[DEBUG] Pacchetto HEX: ");
+    for (int i = 0; i < v->richiesta.pacchetto_len; i++) printf("%02X ", (unsigned char)v->pacchetto[i]);
+    printf("\n");
+#endif
+
+    // Ammissione nella coda globale: se e' piena si liberano prima i posti di questo client,
+    // poi si attende; allo scadere il client riceve "occupato" con il tempo dopo cui ritentare
+    if (!coda_ammetti(c->sessione.session_id, 0)) {
+        completa_tutti_in_volo(c);
+        svuota_uscita(c);
+        if (!coda_ammetti(c->sessione.session_id, CODA_ATTESA_AMMISSIONE_MS)) {
+            if (v->esito_cache == CACHE_LEADER) cache_pubblica(comando, comando_len, NULL, 0);
+            char messaggio[64];
+            snprintf(messaggio, sizeof(messaggio), "OCCUPATO, RIPROVARE TRA %d MS", coda_suggerimento_retry_ms());
+            snprintf(debug_msg, sizeof(debug_msg), "Coda stampante piena: comando del client %s respinto.\n", c->adds);
+            print_log(debug_msg, COLOR_WARNING);
+            rilascia_buffer_in_volo(v);
+            rispondi_errore_in_ordine(c, FAMIGLIA_ERRORE_GENERICO, "0006", messaggio);
+            return;
+        }
+    }
+
+    if (v->esito_cache == CACHE_NON_CACHEABILE) cache_invalida();
+    memcpy(v->comando, comando, (size_t)comando_len);
+    v->comando_len = comando_len;
+    v->richiesta.pacchetto = v->pacchetto;
+    v->richiesta.risposta = v->risposta;
+    v->richiesta.max_risposta_len = DIM_BUFFER_PACCHETTO;
+    v->richiesta.session_id = c->sessione.session_id;
+    v->richiesta.corsia = corsia_comando(&cmd);
+    v->richiesta.affinita = affinita_comando(&cmd);
+    coda_accoda(&v->richiesta);
+    c->n_in_volo++;
+}
+
+// Estrae e processa tutte le righe complete presenti nel buffer di ricezione.
+// Ritorna il numero di byte consumati; l'eventuale comando incompleto resta nel buffer.
+static int processa_buffer_client(ContestoClient* c, char* buffer, int buffer_len, BOOL* scarta_riga) {
+    int start = 0;
+    char* newline;
+    while ((newline = memchr(buffer + start, '\n', buffer_len - start)) != NULL) {
+        char* riga = buffer + start;
+        int riga_len = (int)(newline - riga);
+        start += riga_len + 1;
+
+        if (*scarta_riga) { // Fine di una riga troppo lunga, gia' respinta
+            *scarta_riga = FALSE;
+            continue;
+        }
+
+        pulisci_comando(&riga, &riga_len);
+        // Se il comando è vuoto dopo la pulizia, ignoralo e passa al prossimo.
+        if (riga_len == 0) continue;
+        if (riga_len >= MAX_COMANDO) {
+            rispondi_errore_in_ordine(c, FAMIGLIA_ERRORE_GENERICO, "0007", "Comando troppo lungo");
+            continue;
+        }
+
+        char comando[MAX_COMANDO];
+        memcpy(comando, riga, (size_t)riga_len);
+        comando[riga_len] = '\0';
+        processa_comando(c, comando, riga_len);
+    }
+    return start;
+}
+
+// Prende dal pool il contesto di una nuova connessione. Solo i campi di controllo vengono
+// inizializzati: comandi in volo e buffer di uscita sono validi fino a n_in_volo e uscita_len.
+static ContestoClient* crea_contesto_client(const char* adds, SOCKET sock, HANDLE h_seriale, const char* indirizzo) {
+    ContestoClient* c = (ContestoClient*)pool_prendi(&pool_contesti);
+    if (c == NULL) return NULL;
+    c->sock = sock;
+    c->h_seriale = h_seriale;
+    c->evento_scrittura = NULL;
+    memset(&c->linea, 0, sizeof(c->linea));
+    strncpy(c->adds, adds, MAX_ADDS - 1);
+    c->adds[MAX_ADDS - 1] = '\0';
+    sessione_init(&c->sessione, (int)InterlockedIncrement(&contatore_sessioni));
+    c->primo_in_volo = 0;
+    c->n_in_volo = 0;
+    c->uscita_len = 0;
+    c->uscita_risposte = 0;
+    c->documento_aperto = FALSE;
+    strncpy(c->indirizzo, indirizzo, sizeof(c->indirizzo) - 1);
+    c->indirizzo[sizeof(c->indirizzo) - 1] = '\0';
+    c->t_connessione = GetTickCount();
+    c->comandi = 0;
+    c->chiusura = CHIUSURA_NESSUNA;
+    limite_sessione_init(&c->limite);
+    c->limite_ip = sock != INVALID_SOCKET ? limite_ip(indirizzo) : NULL;
+    AcquireSRWLockExclusive(&lock_registro);
+    c->precedente = NULL;
+    c->successivo = registro_sessioni;
+    if (registro_sessioni != NULL) registro_sessioni->precedente = c;
+    registro_sessioni = c;
+    ReleaseSRWLockExclusive(&lock_registro);
+    InterlockedIncrement(&sessioni_attive);
+    return c;
+}
+
+static void distruggi_contesto_client(ContestoClient* c) {
+    if (c->documento_aperto) {
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "Sessione %s chiusa con uno scontrino ancora aperto.\n", c->adds);
+        print_log(log_msg, COLOR_WARNING);
+        InterlockedDecrement(&documenti_in_corso);
+        InterlockedIncrement(&documenti_interrotti);
+    }
+    AcquireSRWLockExclusive(&lock_registro);
+    if (c->precedente != NULL) c->precedente->successivo = c->successivo;
+    else registro_sessioni = c->successivo;
+    if (c->successivo != NULL) c->successivo->precedente = c->precedente;
+    ReleaseSRWLockExclusive(&lock_registro);
+    pool_restituisci(&pool_contesti, c);
+    InterlockedDecrement(&sessioni_attive);
+}
 
 // Funzione eseguita da ogni thread client TCP
+// lpParam e' il contesto del client, preso dal pool da start_tcp_server
 DWORD WINAPI tcp_client_handler(LPVOID lpParam) {
-    struct client_args* args = (struct client_args*)lpParam;
-    SOCKET client_socket = args->sock;
-    char adds[3];
-    strcpy(adds, args->adds);
-    free(args);
+    ContestoClient* c = (ContestoClient*)lpParam;
+    SOCKET client_socket = c->sock;
 
-    char buffer[2048] = {0};
+    char buffer[2048]; // Valido fino a buffer_len, terminato da '\0' dopo ogni recv
     int buffer_len = 0;
+    BOOL scarta_riga = FALSE;
 
-    // Inizializza lo stato con ID di sessione univoco
-    StatoStampante stato = {0};
-    stato.session_id = rand() % 1000000;
     print_log("Nuova sessione", COLOR_WARNING);
 
     // Mostra suggerimenti utili
     printf("\n");
 
-
     while (1) {
+        if (sessione_da_chiudere(c)) {
+            print_log(server_running ? "Sessione chiusa dalla console di amministrazione.\n" : "Sessione chiusa per arresto del server.\n", COLOR_WARNING);
+            break;
+        }
+        // Attende i dati con un timeout, per accorgersi dell'arresto anche con il client inattivo
+        WSAPOLLFD attesa;
+        attesa.fd = client_socket;
+        attesa.events = POLLRDNORM;
+        attesa.revents = 0;
+        int pronti = WSAPoll(&attesa, 1, SESSIONE_POLL_MS);
+        if (pronti == 0) continue;
+        if (pronti == SOCKET_ERROR) {
+            print_log("Errore in attesa dei dati dal client. Chiusura socket e terminazione thread.", COLOR_WARNING);
+            break;
+        }
+
         // Riceve dati dal client (append al buffer)
         int bytes_received = recv(client_socket, buffer + buffer_len, sizeof(buffer) - buffer_len - 1, 0);
+        if (bytes_received < 0 && WSAGetLastError() == WSAETIMEDOUT) {
+            print_log("Client non raggiungibile (keepalive senza risposta). Chiusura socket e terminazione thread.", COLOR_WARNING);
+            break;
+        }
         if (bytes_received <= 0) {
             print_log("Connessione chiusa dal client. Chiusura socket e terminazione thread.", COLOR_WARNING);
-            closesocket(client_socket);
-            return 0; // Termina il thread e rilascia le risorse
+            break;
         }
+        cattura_frame(CATTURA_DA_CLIENT, c->sessione.session_id, buffer + buffer_len, bytes_received);
         buffer_len += bytes_received;
         buffer[buffer_len] = '\0';
 
         print_log("[DEBUG] Dati ricevuti dal client:\n", COLOR_DEBUG);
         print_log(buffer, COLOR_DEBUG);
 
-        int start = 0;
-        // Processa tutti i comandi completi presenti nel buffer
-        while (start < buffer_len) {
-            // Cerca newline per delimitare il comando
-            char *newline = memchr(buffer + start, '\n', buffer_len - start);
-            if (!newline) break;
-
-            // Estrae il comando
-            int comando_len = newline - (buffer + start);
-            char comando[128];
-            strncpy(comando, buffer + start, comando_len);
-            comando[comando_len] = '\0';
-            // Pulisci caratteri di controllo all'inizio
-            int start_idx = 0;
-            while (comando_len > 0 && (comando[start_idx] == '\r' || comando[start_idx] == '\n' || (unsigned char)comando[start_idx] == 0x06 || (unsigned char)comando[start_idx] == 0x15 || comando[start_idx] == ' ')) {
-                start_idx++;
-                comando_len--;
-            }
-            if (start_idx > 0) memmove(comando, comando + start_idx, comando_len + 1);
-            // Pulisci caratteri di controllo/spazi alla fine
-            while (comando_len > 0 && (comando[comando_len - 1] == '\r' || comando[comando_len - 1] == '\n' || (unsigned char)comando[comando_len - 1] == 0x06 || (unsigned char)comando[comando_len - 1] == 0x15 || comando[comando_len - 1] == ' ')) {
-                comando[comando_len - 1] = '\0';
-                comando_len--;
-            }
-
-            // Se il comando è vuoto dopo la pulizia, ignoralo e passa al prossimo.
-            if (comando_len == 0) {
-                start += (newline - (buffer + start)) + 1; // Avanza il puntatore start oltre la riga vuota
-                continue;
-            }
-
-            char debug_msg[256];
-            snprintf(debug_msg, sizeof(debug_msg), "[DEBUG] Comando estratto: '%s' (lunghezza: %d)\n", comando, comando_len);
-            print_log(debug_msg, COLOR_DEBUG);
-
-            // Qui puoi aggiungere comandi speciali che non vanno alla stampante
-            if (_strnicmp(comando, "FEED", 4) == 0) {
-                if (g_relay_module_enabled) {
-                    print_log("Comando FEED ricevuto. Attivazione rele per avanzamento carta...", COLOR_INFO);
-                    pulse_relay(500); // Simula la pressione di un pulsante per 500ms
-                    char* success_msg = "OK: FEED eseguito.\r\n";
-                    send(client_socket, success_msg, strlen(success_msg), 0);
-                } else {
-                    print_log("Comando FEED ricevuto, ma modulo rele disabilitato. Comando ignorato.", COLOR_WARNING);
-                    char* error_msg = "ERRORE: Modulo rele non abilitato o non disponibile.\r\n";
-                    send(client_socket, error_msg, strlen(error_msg), 0);
-                }
-                start += comando_len + 1; // Avanza al prossimo comando
-                continue;
-            }
+        // Processa tutti i comandi completi presenti nel buffer e sposta all'inizio quello incompleto
+        int consumati = processa_buffer_client(c, buffer, buffer_len, &scarta_riga);
+        buffer_len -= consumati;
+        memmove(buffer, buffer + consumati, (size_t)buffer_len);
+        buffer[buffer_len] = '\0';
 
-            char pacchetto_risposta[2048];
-            int pacchetto_len = costruisci_pacchetto(adds, comando, comando_len, pacchetto_risposta, sizeof(pacchetto_risposta));
-            
-            if (pacchetto_len > 0) {
-                snprintf(debug_msg, sizeof(debug_msg), "[DEBUG] Pacchetto da inviare alla stampante (len=%d): '%s'\n", pacchetto_len, pacchetto_risposta);
-                print_log(debug_msg, COLOR_DEBUG);
-                // Debug protocollo: stampa HEX solo se abilitato
-#ifdef DEBUG_PROTOCOL
-                printf("[DEBUG] Pacchetto HEX: ");
-                for (int i = 0; i < pacchetto_len; i++) printf("%02X ", (unsigned char)pacchetto_risposta[i]);
-                printf("\n");
-#endif
-                if (pacchetto_len > 0) {
-                    char risposta_stampante[2048] = {0};
-                    int risposta_len = invia_a_stampante_dispatcher(pacchetto_risposta, pacchetto_len, risposta_stampante, sizeof(risposta_stampante));
-                    // Debug protocollo: stampa HEX/ASCII risposta stampante solo se abilitato
-#ifdef DEBUG_PROTOCOL
-                    printf("[DEBUG] Risposta HEX dalla stampante: ");
-                    for (int i = 0; i < risposta_len; i++) printf("%02X ", (unsigned char)risposta_stampante[i]);
-                    printf("\n");
-                    printf("[DEBUG] Risposta ASCII dalla stampante: ");
-                    for (int i = 0; i < risposta_len; i++) {
-                        char c = risposta_stampante[i];
-                        if (c >= 32 && c <= 126) putchar(c); else putchar('.');
-                    }
-                    printf("\n");
-#endif
-                    
-                    // Se la stampante ha risposto, inoltra la risposta al client
-                    if (risposta_len > 0) {
-                        int sent = send(client_socket, risposta_stampante, risposta_len, 0);
-                        snprintf(debug_msg, sizeof(debug_msg), "[DEBUG] Inviati %d bytes al client.\n", sent);
-                        print_log(debug_msg, COLOR_DEBUG);
-                    } else {
-                        // Se la stampante NON ha risposto, invia risposta di errore protocollo al client
-                        char risposta_errore[2048];
-                        int errore_len = crea_risposta_errore(adds, FAMIGLIA_ERRORE_BLOCCANTE, "0004", "Errore comunicazione con stampante", risposta_errore, sizeof(risposta_errore));
-                        int sent = send(client_socket, risposta_errore, errore_len, 0);
-                        snprintf(debug_msg, sizeof(debug_msg), "[DEBUG] Inviato errore protocollo al client (%d bytes).", sent);
-                        print_log(debug_msg, COLOR_DEBUG);
-                    }
-                } else {
-                    const char* err_msg = "Errore nella costruzione del pacchetto";
-                    send(client_socket, err_msg, (int)strlen(err_msg), 0);
-                }
-                
-                // Aggiorna il buffer
-                int next_command_start = (newline - buffer) + 1;
-                memmove(buffer + start, newline + 1, buffer_len - next_command_start);
-                buffer_len -= (comando_len + 1);
-                start = next_command_start;
-            }
-        
-            // Se ci sono dati residui, li sposto all'inizio del buffer
-            if (start < buffer_len) {
-                memmove(buffer, buffer + start, buffer_len - start);
-                buffer_len -= start;
-            } else {
-                // Resetto il buffer se non ci sono dati
-                memset(buffer, 0, sizeof(buffer));
-                buffer_len = 0;
-            }
+        // Prima di tornare in recv si completano i comandi inoltrati: finche' sono in corso il
+        // socket non viene letto e il client viene rallentato dal controllo di flusso TCP
+        completa_tutti_in_volo(c);
+
+        // Riga piu' lunga del buffer: la si respinge esplicitamente invece di scartarla in silenzio
+        if (buffer_len == sizeof(buffer) - 1) {
+            print_log("Buffer ricezione client pieno e nessun newline. Comando respinto.", COLOR_WARNING);
+            rispondi_errore_in_ordine(c, FAMIGLIA_ERRORE_GENERICO, "0007", "Comando troppo lungo");
+            buffer_len = 0;
+            buffer[0] = '\0';
+            scarta_riga = TRUE;
         }
-        
-        // Se processed_upto == 0 e c'erano dati, significa che non è stato trovato un newline.
-        // Il buffer si riempirà finché non arriva un newline o si esaurisce lo spazio.
-        if (buffer_len == sizeof(buffer) -1) {
-             print_log("Buffer ricezione client pieno e nessun newline. Reset buffer.", COLOR_WARNING);
-             buffer_len = 0; // Evita overflow, scarta dati vecchi
-             buffer[0] = '\0';
-        }
-    }
 
+        // Tutte le risposte della passata partono insieme: un solo invio per i comandi in pipeline
+        svuota_uscita(c);
+    }
 
     // Cleanup
+    completa_tutti_in_volo(c);
+    svuota_uscita(c);
+    coda_rilascia_sessione(c->sessione.session_id); // Documento lasciato aperto: la stampante torna agli altri client
+    stampante_rilascia_sessione(c->sessione.session_id); // e un altro terminale potra' chiuderlo o annullarlo
     closesocket(client_socket);
+    distruggi_contesto_client(c);
     print_log("Thread client terminato\n", COLOR_WARNING);
     return 0;
 }
 
 // Funzione eseguita da ogni thread client Seriale
+// lpParam e' il contesto del client, preso dal pool da start_serial_server. La porta e' aperta
+// in modalita' overlapped: la lettura resta in corso mentre il thread attende il suo evento con
+// lo stesso intervallo dei client TCP, cosi' i dati vengono elaborati appena arrivano e l'arresto
+// del server viene notato anche con il client inattivo. Il thread chiude la porta all'uscita.
 DWORD WINAPI serial_client_handler(LPVOID lpParam) {
-    struct serial_client_args* args = (struct serial_client_args*)lpParam;
-    HANDLE hClientSerial = args->hClientSerial;
-    char adds[MAX_ADDS];
-    strncpy(adds, args->adds, MAX_ADDS);
-    adds[MAX_ADDS - 1] = '\0';
-    free(args); // Libera la memoria allocata per gli argomenti
+    ContestoClient* c = (ContestoClient*)lpParam;
+    HANDLE hClientSerial = c->h_seriale;
+    const char* adds = c->adds;
 
-    char recv_buffer[MAX_BUFFER] = {0};
+    char recv_buffer[MAX_BUFFER]; // Valido fino a recv_buffer_len
     int recv_buffer_len = 0;
     DWORD bytes_read;
+    BOOL scarta_riga = FALSE;
+    BOOL lettura_in_corso = FALSE;
 
-    StatoStampante stato = {0};
-    stato.session_id = rand() % 1000000; // ID sessione semplice
     char log_msg[256];
     snprintf(log_msg, sizeof(log_msg), "Nuova sessione seriale per client %s su handle %p", adds, hClientSerial);
     print_log(log_msg, COLOR_INFO);
 
-    // Imposta timeout per ReadFile sulla porta seriale del client
-    // Questo è importante per non bloccare indefinitamente se il client non invia nulla
-    // o per gestire la chiusura della connessione.
+    // La lettura si completa appena arriva almeno un byte (nessun timeout totale): l'attesa
+    // e' gestita sull'evento overlapped. Le scritture hanno un limite, proporzionale alla
+    // velocita' della linea, per non restare bloccate su un terminale scollegato.
     COMMTIMEOUTS timeouts = {0};
-    timeouts.ReadIntervalTimeout = 50; // Max time between two chars, ms
-    timeouts.ReadTotalTimeoutMultiplier = 10; // Multiplier per byte
-    timeouts.ReadTotalTimeoutConstant = 1000; // Constant timeout, ms (e.g., 1 sec total for a read)
-    // Write timeouts non sono strettamente necessari qui se ci aspettiamo risposte rapide
-    timeouts.WriteTotalTimeoutMultiplier = 10;
-    timeouts.WriteTotalTimeoutConstant = 1000;
-    if (!SetCommTimeouts(hClientSerial, &timeouts)) {
-        snprintf(log_msg, sizeof(log_msg), "Errore impostazione timeouts per client seriale %s. Errore: %lu", adds, GetLastError());
+    timeouts.ReadIntervalTimeout = MAXDWORD;
+    timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+    timeouts.ReadTotalTimeoutConstant = MAXDWORD - 1;
+    timeouts.WriteTotalTimeoutMultiplier = ms_per_byte(&c->linea_parametri);
+    timeouts.WriteTotalTimeoutConstant = SERIALE_MARGINE_SCRITTURA_MS;
+    OVERLAPPED ov_lettura = {0};
+    ov_lettura.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    c->evento_scrittura = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!SetCommTimeouts(hClientSerial, &timeouts) || ov_lettura.hEvent == NULL || c->evento_scrittura == NULL) {
+        snprintf(log_msg, sizeof(log_msg), "Errore preparazione della porta del client seriale %s. Errore: %lu", adds, GetLastError());
         print_log(log_msg, COLOR_ERROR);
-        // Non chiudiamo l'handle qui, lo gestirà start_serial_server
+        if (ov_lettura.hEvent != NULL) CloseHandle(ov_lettura.hEvent);
+        if (c->evento_scrittura != NULL) CloseHandle(c->evento_scrittura);
+        close_serial_port_handle(&hClientSerial);
+        distruggi_contesto_client(c);
         return 1; // Termina il thread
     }
 
-    while (server_running) {
-        // Legge dati dal client seriale (append al buffer)
-        // ReadFile con timeout leggerà quello che c'è, o tornerà dopo il timeout.
-        if (!ReadFile(hClientSerial, recv_buffer + recv_buffer_len, sizeof(recv_buffer) - recv_buffer_len - 1, &bytes_read, NULL)) {
-            DWORD error = GetLastError();
-            if (error == ERROR_OPERATION_ABORTED || error == ERROR_INVALID_HANDLE) { // Porta chiusa o errore grave
-                 snprintf(log_msg, sizeof(log_msg), "Errore lettura da client seriale %s (handle %p) o porta chiusa. Errore: %lu. Thread termina.", adds, hClientSerial, error);
-                 print_log(log_msg, COLOR_ERROR);
-                 break;
+    while (!sessione_da_chiudere(c)) {
+        // Avvia la lettura (append al buffer), se non ce n'e' gia' una in corso
+        if (!lettura_in_corso) {
+            bytes_read = 0;
+            ResetEvent(ov_lettura.hEvent);
+            if (!ReadFile(hClientSerial, recv_buffer + recv_buffer_len, sizeof(recv_buffer) - recv_buffer_len - 1, &bytes_read, &ov_lettura)) {
+                DWORD error = GetLastError();
+                if (error != ERROR_IO_PENDING) {
+                    snprintf(log_msg, sizeof(log_msg), "Errore lettura da client seriale %s (handle %p) o porta chiusa. Errore: %lu. Thread termina.", adds, hClientSerial, error);
+                    print_log(log_msg, COLOR_ERROR);
+                    break;
+                }
+                lettura_in_corso = TRUE;
             }
-            // Altri errori potrebbero essere non fatali o legati ai timeout, che sono gestiti da bytes_read == 0
-            snprintf(log_msg, sizeof(log_msg), "[DEBUG] Errore ReadFile da client seriale %s. Errore: %lu", adds, error);
-            print_log(log_msg, COLOR_DEBUG); 
-            // Potrebbe essere un timeout, continuiamo il ciclo per vedere se server_running è cambiato
-            Sleep(100); // Breve pausa in caso di errore di lettura non fatale
-            continue;
         }
-
-        if (bytes_read == 0) { // Timeout o nessuna data
-            // Se server_running è ancora true, semplicemente non c'erano dati.
-            // Se il client si disconnette fisicamente, ReadFile potrebbe continuare a tornare con 0 bytes_read
-            // o potrebbe dare un errore gestito sopra.
-            Sleep(50); // Attesa breve prima di riprovare
-            continue;
+        if (lettura_in_corso) {
+            if (WaitForSingleObject(ov_lettura.hEvent, SESSIONE_POLL_MS) == WAIT_TIMEOUT) continue;
+            lettura_in_corso = FALSE;
+            if (!GetOverlappedResult(hClientSerial, &ov_lettura, &bytes_read, FALSE)) {
+                snprintf(log_msg, sizeof(log_msg), "Errore lettura da client seriale %s (handle %p) o porta chiusa. Errore: %lu. Thread termina.", adds, hClientSerial, GetLastError());
+                print_log(log_msg, COLOR_ERROR);
+                break;
+            }
         }
+        if (bytes_read == 0) continue;
 
+        cattura_frame(CATTURA_DA_CLIENT, c->sessione.session_id, recv_buffer + recv_buffer_len, (int)bytes_read);
+        c->linea.byte_ricevuti += bytes_read;
         recv_buffer_len += bytes_read;
         recv_buffer[recv_buffer_len] = '\0';
 
-        snprintf(log_msg, sizeof(log_msg), "[DEBUG] Dati ricevuti da client seriale %s (%d bytes): %.*s", adds, bytes_read, bytes_read, recv_buffer + (recv_buffer_len - bytes_read));
+        snprintf(log_msg, sizeof(log_msg), "[DEBUG] Dati ricevuti da client seriale %s (%lu bytes): %.*s", adds, bytes_read, (int)bytes_read, recv_buffer + (recv_buffer_len - bytes_read));
         print_log(log_msg, COLOR_DEBUG);
 
-        int processed_upto = 0;
         // Processa tutti i comandi completi (newline-terminated) presenti nel buffer
-        while (processed_upto < recv_buffer_len) {
-            char* newline = strchr(recv_buffer + processed_upto, '\n');
-            if (!newline) {
-                // Comando non completo, attendi altri dati (o sposta i dati parziali all'inizio del buffer)
-                break;
-            }
-
-            int comando_len = newline - (recv_buffer + processed_upto);
-            char comando[MAX_BUFFER]; // Abbastanza grande per un comando
-            strncpy(comando, recv_buffer + processed_upto, comando_len);
-            comando[comando_len] = '\0';
-
-            // Pulisce eventuali CR prima del LF
-            if (comando_len > 0 && comando[comando_len - 1] == '\r') {
-                comando[comando_len - 1] = '\0';
-                comando_len--;
-            }
-            
-            // Avanza il puntatore di inizio per il prossimo comando nel buffer
-            processed_upto += comando_len + 1; // +1 per il newline
-            printf("\n");
-            snprintf(log_msg, sizeof(log_msg), "[DEBUG] Comando estratto da client seriale %s: '%s' (len: %d)\n", adds, comando, comando_len);
-            print_log(log_msg, COLOR_DEBUG);
-
-            if (comando_len == 0) { // Comando vuoto dopo pulizia, ignora
-                print_log("[DEBUG] Comando vuoto ricevuto da client seriale, ignorato.\n", COLOR_DEBUG);
-                continue;
-            }
-
-            char pacchetto_stampante[MAX_BUFFER];
-            int pacchetto_len = costruisci_pacchetto(adds, comando, comando_len, pacchetto_stampante, sizeof(pacchetto_stampante));
-            
-            if (pacchetto_len > 0) {
-                snprintf(log_msg, sizeof(log_msg), "[DEBUG] Pacchetto per stampante da client seriale %s (len=%d): %.*s", adds, pacchetto_len, pacchetto_len, pacchetto_stampante);
-                print_log(log_msg, COLOR_DEBUG);
-
-                char risposta_stampante[MAX_BUFFER] = {0};
-                int len_risposta_stampante = invia_a_stampante_dispatcher(pacchetto_stampante, pacchetto_len, risposta_stampante, sizeof(risposta_stampante));
-
-                if (len_risposta_stampante > 0) {
-                    snprintf(log_msg, sizeof(log_msg), "[DEBUG] Risposta da stampante per client seriale %s (%d bytes): %.*s", adds, len_risposta_stampante, len_risposta_stampante, risposta_stampante);
-                    print_log(log_msg, COLOR_DEBUG);
-                    int bytes_written = write_to_serial_port(hClientSerial, risposta_stampante, len_risposta_stampante);
-                    if (bytes_written < 0 || bytes_written != len_risposta_stampante) {
-                        snprintf(log_msg, sizeof(log_msg), "Errore scrittura risposta a client seriale %s.", adds);
-                        print_log(log_msg, COLOR_ERROR);
-                        // Potrebbe essere necessario chiudere la connessione qui se l'errore è grave
-                    }
-                } else {
-                    char risposta_errore[MAX_BUFFER];
-                    int errore_len = crea_risposta_errore(adds, FAMIGLIA_ERRORE_BLOCCANTE, "0004", "Errore comunicazione con stampante", risposta_errore, sizeof(risposta_errore));
-                    snprintf(log_msg, sizeof(log_msg), "[DEBUG] Invio errore protocollo a client seriale %s (%d bytes).", adds, errore_len);
-                    print_log(log_msg, COLOR_DEBUG);
-                    write_to_serial_port(hClientSerial, risposta_errore, errore_len);
-                }
-            } else {
-                char risposta_errore[MAX_BUFFER];
-                int errore_len = crea_risposta_errore(adds, FAMIGLIA_ERRORE_GENERICO, "0005", "Errore costruzione pacchetto interno", risposta_errore, sizeof(risposta_errore));
-                snprintf(log_msg, sizeof(log_msg), "[DEBUG] Errore costruzione pacchetto, invio errore a client seriale %s.", adds);
-                print_log(log_msg, COLOR_WARNING);
-                write_to_serial_port(hClientSerial, risposta_errore, errore_len);
-            }
-        }
+        int processed_upto = processa_buffer_client(c, recv_buffer, recv_buffer_len, &scarta_riga);
+        completa_tutti_in_volo(c);
 
         // Sposta i dati non processati (comando parziale) all'inizio del buffer
-        if (processed_upto > 0 && processed_upto < recv_buffer_len) {
-            memmove(recv_buffer, recv_buffer + processed_upto, recv_buffer_len - processed_upto);
-            recv_buffer_len -= processed_upto;
-            recv_buffer[recv_buffer_len] = '\0'; // Null-terminate again
-        } else if (processed_upto == recv_buffer_len) {
-            // Tutto il buffer è stato processato
-            recv_buffer_len = 0;
-            recv_buffer[0] = '\0';
-        }
-        // Se processed_upto == 0 e c'erano dati, significa che non è stato trovato un newline.
-        // Il buffer si riempirà finché non arriva un newline o si esaurisce lo spazio.
+        recv_buffer_len -= processed_upto;
+        memmove(recv_buffer, recv_buffer + processed_upto, (size_t)recv_buffer_len);
+        recv_buffer[recv_buffer_len] = '\0'; // Null-terminate again
+
+        // Riga piu' lunga del buffer: la si respinge esplicitamente invece di scartarla in silenzio
         if (recv_buffer_len == sizeof(recv_buffer) -1) {
-             print_log("Buffer ricezione client seriale pieno e nessun newline. Reset buffer.", COLOR_WARNING);
-             recv_buffer_len = 0; // Evita overflow, scarta dati vecchi
+             print_log("Buffer ricezione client seriale pieno e nessun newline. Comando respinto.", COLOR_WARNING);
+             rispondi_errore_in_ordine(c, FAMIGLIA_ERRORE_GENERICO, "0007", "Comando troppo lungo");
+             recv_buffer_len = 0;
              recv_buffer[0] = '\0';
+             scarta_riga = TRUE;
         }
+
+        svuota_uscita(c);
     }
 
+    if (lettura_in_corso) {
+        CancelIo(hClientSerial);
+        GetOverlappedResult(hClientSerial, &ov_lettura, &bytes_read, TRUE); // Il buffer resta in uso fino all'annullamento
+    }
+    completa_tutti_in_volo(c);
+    svuota_uscita(c);
+    coda_rilascia_sessione(c->sessione.session_id);
+    stampante_rilascia_sessione(c->sessione.session_id);
     snprintf(log_msg, sizeof(log_msg), "Thread client seriale %s terminato (handle %p).", adds, hClientSerial);
     print_log(log_msg, COLOR_WARNING);
-    // La chiusura di hClientSerial è responsabilità di start_serial_server o main
-    // in base a come viene gestito il ciclo di vita della porta seriale del client.
+    snprintf(log_msg, sizeof(log_msg), "client seriale %s", adds);
+    log_statistiche_linea(log_msg, &c->linea_parametri, &c->linea);
+    CloseHandle(ov_lettura.hEvent);
+    CloseHandle(c->evento_scrittura);
+    close_serial_port_handle(&hClientSerial);
+    distruggi_contesto_client(c);
     return 0;
 }
 
 // =====================
 // === FUNZIONI STAMPANTE ===
 // =====================
+// Classe di latenza del comando contenuto nel pacchetto
+static ClasseLatenza classe_pacchetto(const char* pacchetto, int pacchetto_len) {
+    ComandoStampante cmd;
+    int dati_len = pacchetto_len - PACCHETTO_CORNICE;
+    if (dati_len < 0) return CLASSE_LUNGA;
+    const char* dati = pacchetto + PACCHETTO_INIZIO_DATI;
+    if (comando_analizza(dati, dati_len, &cmd) != NULL) {
+        return latenza_classe(CMD_SCONOSCIUTO, dati, dati_len);
+    }
+    return latenza_classe(cmd.codice, dati, dati_len);
+}
+
+// Le interrogazioni ("<?...") non modificano la stampante: si possono ritrasmettere senza rischi
+static BOOL pacchetto_idempotente(const char* pacchetto, int pacchetto_len) {
+    return pacchetto_len >= PACCHETTO_CORNICE + 2 && pacchetto[PACCHETTO_INIZIO_DATI] == '<' && pacchetto[PACCHETTO_INIZIO_DATI + 1] == '?';
+}
+
+// Ritorna TRUE se la stampante risponde: le ultime richieste non sono tutte scadute e non sono
+// tutte fallite (connessione rifiutata o interrotta, porta seriale in errore)
+static BOOL stampante_raggiungibile(void) {
+    return !latenza_stampante_muta() && errori_consecutivi_stampante < LATENZA_SOGLIA_MUTA;
+}
+
+// Aggiorna latenze e raggiungibilita' con l'esito di una richiesta alla stampante
+// (solo thread della coda stampante)
+static void registra_esito_stampante(ClasseLatenza classe, LONGLONG trascorsi_us, DWORD scadenza_ms, const char* risposta, int risposta_len) {
+    BOOL era_raggiungibile = stampante_raggiungibile();
+    if (risposta_len > 0 && (unsigned char)risposta[risposta_len - 1] == PACCHETTO_ETX) {
+        latenza_registra(classe, trascorsi_us);
+        errori_consecutivi_stampante = 0;
+    } else {
+        if (trascorsi_us >= (LONGLONG)scadenza_ms * 1000) {
+            latenza_registra_scaduta(classe); // Gli errori immediati (es. connessione rifiutata) non sono latenza
+        }
+        errori_consecutivi_stampante++;
+    }
+    char log_msg[160];
+    if (era_raggiungibile && !stampante_raggiungibile()) {
+        snprintf(log_msg, sizeof(log_msg), "Stampante non raggiungibile: %d richieste consecutive senza risposta completa.", LATENZA_SOGLIA_MUTA);
+        print_log(log_msg, COLOR_ERROR);
+    } else if (!era_raggiungibile && stampante_raggiungibile()) {
+        print_log("Stampante di nuovo raggiungibile.", COLOR_SUCCESS);
+    }
+}
+
+// Assegna al pacchetto il pack_id successivo (cifra ciclica 0-9)
+static void assegna_pack_id(char* pacchetto, int pacchetto_len) {
+    pack_id_stampante = pack_id_stampante == '9' ? '0' : (char)(pack_id_stampante + 1);
+    pacchetto_imposta_id(pacchetto, pacchetto_len, pack_id_stampante);
+}
+
+// Battito verso la stampante inattiva, eseguito dal thread della coda dopo STAMPANTE_BATTITO_MS
+// senza comandi: un'interrogazione di stato, fuori da giornale e cattura. Mantiene viva la
+// connessione TCP e rileva una stampante spenta o scollegata in pochi secondi, prima che un
+// client le invii un comando.
+static void battito_stampante(void) {
+    char pacchetto[PACCHETTO_CORNICE + 3];
+    char risposta[256];
+    VistaPacchetto richiesta = pacchetto_costruisci(ADDS_SERVER, "<?s", 3, pacchetto, sizeof(pacchetto));
+    assegna_pack_id(pacchetto, richiesta.lunghezza);
+    DWORD scadenza_ms = latenza_scadenza(CLASSE_INTERROGAZIONE);
+    LONGLONG inizio = microsecondi();
+    int risposta_len = invia_a_stampante_dispatcher(pacchetto, richiesta.lunghezza, risposta, sizeof(risposta), scadenza_ms, 0);
+    registra_esito_stampante(CLASSE_INTERROGAZIONE, microsecondi() - inizio, scadenza_ms, risposta, risposta_len);
+    InterlockedIncrement(&cont_battiti_stampante);
+
+    // La risposta di stato riallinea il modello con i cambiamenti fatti dal pannello della stampante
+    ComandoStampante cmd;
+    comando_analizza("<?s", 3, &cmd);
+    stampante_registra_risposta(&cmd, risposta, risposta_len);
+}
+
+// Invia il pacchetto alla stampante registrando comando e risposta nel giornale e nella cattura.
+// La risposta deve arrivare entro la scadenza della classe del comando; la latenza misurata
+// aggiorna le scadenze successive. Eseguita solo dal thread della coda stampante, unico
+// scrittore del giornale.
+static int invia_a_stampante_registrata(int session_id, char* pacchetto, int pacchetto_len, char* risposta, int max_risposta_len) {
+    // Ogni comando riceve il pack_id successivo (cifra ciclica 0-9), scritto direttamente nel
+    // buffer del client; le ritrasmissioni riusano lo stesso, cosi' la stampante riconosce il
+    // duplicato e ripete l'ultima risposta
+    if (pacchetto_valido(pacchetto, pacchetto_len)) {
+        assegna_pack_id(pacchetto, pacchetto_len);
+    }
+    unsigned long long sequenza = giornale_registra_comando(pacchetto, pacchetto_len);
+    cattura_frame(CATTURA_A_STAMPANTE, session_id, pacchetto, pacchetto_len);
+
+    ClasseLatenza classe = classe_pacchetto(pacchetto, pacchetto_len);
+    DWORD scadenza_ms = latenza_scadenza(classe);
+    // La ritrasmissione anticipata richiede che la stampante ripeta il pack_id: altrimenti la
+    // risposta in ritardo al primo invio non si distinguerebbe da quella del comando successivo
+    DWORD ritrasmissione_ms = 0;
+    if (pacchetto_idempotente(pacchetto, pacchetto_len) && eco_pack_id >= ECO_PACK_ID_CONFERME) {
+        ritrasmissione_ms = latenza_ritrasmissione(classe);
+    }
+    LONGLONG inizio = microsecondi();
+    int risposta_len = invia_a_stampante_dispatcher(pacchetto, pacchetto_len, risposta, max_risposta_len, scadenza_ms, ritrasmissione_ms);
+    registra_esito_stampante(classe, microsecondi() - inizio, scadenza_ms, risposta, risposta_len);
+
+    cattura_frame(CATTURA_DA_STAMPANTE, session_id, risposta, risposta_len);
+    giornale_registra_risposta(sequenza, risposta, risposta_len);
+
+    // Il modello condiviso segue l'ordine di esecuzione della stampante, come il giornale: una
+    // risposta di stato non puo' cosi' sovrascrivere un comando eseguito dopo di essa
+    ComandoStampante cmd;
+    int dati_len = pacchetto_len - PACCHETTO_CORNICE;
+    if (dati_len >= 0 && comando_analizza(pacchetto + PACCHETTO_INIZIO_DATI, dati_len, &cmd) == NULL) {
+        cmd.session_id = session_id;
+        stampante_registra_risposta(&cmd, risposta, risposta_len);
+    }
+    return risposta_len;
+}
+
+// Apre il giornale e riallinea il modello della stampante con i comandi registrati prima del riavvio
+static void ripristina_da_giornale(void) {
+    char msg[256];
+    RicostruzioneGiornale ricostruzione;
+    if (!giornale_init(GIORNALE_FILE_DEFAULT, &ricostruzione)) {
+        snprintf(msg, sizeof(msg), "Giornale %s non disponibile: i comandi non verranno registrati.\n", GIORNALE_FILE_DEFAULT);
+        print_log(msg, COLOR_WARNING);
+        return;
+    }
+    if (ricostruzione.record == 0) {
+        snprintf(msg, sizeof(msg), "Giornale %s creato.\n", GIORNALE_FILE_DEFAULT);
+        print_log(msg, COLOR_INFO);
+        return;
+    }
+
+    if (ricostruzione.sequenza_in_sospeso != 0) {
+        // Il comando potrebbe essere stato eseguito: senza risposta il modello diventa incerto
+        comando_registra_risposta(&ricostruzione.stato, &ricostruzione.comando_in_sospeso, NULL, 0);
+    }
+    stampante_ripristina(&ricostruzione.stato);
+    snprintf(msg, sizeof(msg), "Giornale %s: %ld comandi ripercorsi (%ld rifiutati), ultima sequenza %llu.\n",
+             GIORNALE_FILE_DEFAULT, ricostruzione.comandi, ricostruzione.comandi_rifiutati, ricostruzione.ultima_sequenza);
+    print_log(msg, COLOR_INFO);
+    if (ricostruzione.sequenza_in_sospeso != 0) {
+        snprintf(msg, sizeof(msg), "Comando %s (sequenza %llu) inviato prima dell'arresto senza risposta registrata: verificarne l'esito sulla stampante.",
+                 comando_nome(ricostruzione.comando_in_sospeso.codice), ricostruzione.sequenza_in_sospeso);
+        print_log(msg, COLOR_WARNING);
+    }
+    if (ricostruzione.stato.documento_aperto) {
+        snprintf(msg, sizeof(msg), "Documento commerciale aperto al riavvio: %d righe, totale %d. Chiuderlo o annullarlo prima di proseguire.",
+                 ricostruzione.stato.righe_documento, ricostruzione.stato.totale);
+        print_log(msg, COLOR_WARNING);
+    }
+}
+
 // Funzione per inviare un pacchetto alla stampante fisica e ricevere la risposta
-int invia_a_stampante_dispatcher(const char* pacchetto, int pacchetto_len, char* risposta, int max_risposta_len) {
+int invia_a_stampante_dispatcher(const char* pacchetto, int pacchetto_len, char* risposta, int max_risposta_len, DWORD scadenza_ms, DWORD ritrasmissione_ms) {
     if (g_printer_connection_mode == MODE_TCP_IP) {
-        return invia_a_stampante_tcp(g_printer_conn_ip_address, g_printer_conn_tcp_port, pacchetto, pacchetto_len, risposta, max_risposta_len);
+        return invia_a_stampante_tcp(g_printer_conn_ip_address, g_printer_conn_tcp_port, pacchetto, pacchetto_len, risposta, max_risposta_len, scadenza_ms); // TCP non perde frame: nessuna ritrasmissione
     } else if (g_printer_connection_mode == MODE_SERIAL) {
         if (h_printer_comm_port == INVALID_HANDLE_VALUE) {
             print_log("Errore: Handle porta seriale stampante non valido. Tentativo di riapertura...", COLOR_ERROR);
-            if (!configure_serial_port(g_printer_conn_serial_port_name, &h_printer_comm_port, PRINTER_BAUD_RATE, PRINTER_PARITY, PRINTER_STOP_BITS, PRINTER_BYTE_SIZE, TRUE)) {
+            if (!configure_serial_port(g_printer_conn_serial_port_name, &h_printer_comm_port, &g_printer_serial_params, TRUE)) {
                 print_log("Fallito tentativo di riaprire la porta seriale della stampante.", COLOR_ERROR);
                 return -1; 
             }
             print_log("Porta seriale stampante riaperta con successo.", COLOR_INFO);
         }
-        return invia_a_stampante_seriale(h_printer_comm_port, pacchetto, pacchetto_len, risposta, max_risposta_len);
+        return invia_a_stampante_seriale(h_printer_comm_port, pacchetto, pacchetto_len, risposta, max_risposta_len, scadenza_ms, ritrasmissione_ms);
     } else {
         print_log("Errore: Modalita' di connessione stampante non configurata.", COLOR_ERROR);
         return -1;
     }
 }
 
-// Funzione per inviare un pacchetto alla stampante fisica via TCP/IP e ricevere la risposta
-// (Questa era la vecchia funzione invia_a_stampante)
-int invia_a_stampante_tcp(const char* ip, int porta, const char* pacchetto, int pacchetto_len, char* risposta, int max_risposta_len) {
-    SOCKET s;
-    struct sockaddr_in stampante;
-    int risposta_len = -1;
+// Attende che il socket sia pronto per gli eventi indicati prima che scadano scadenza_ms da inizio
+static BOOL attendi_socket(SOCKET s, SHORT eventi, DWORD inizio, DWORD scadenza_ms) {
+    DWORD trascorsi = GetTickCount() - inizio;
+    if (trascorsi >= scadenza_ms) return FALSE;
+    WSAPOLLFD attesa = { s, eventi, 0 };
+    return WSAPoll(&attesa, 1, (INT)(scadenza_ms - trascorsi)) > 0;
+}
 
-    s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s == INVALID_SOCKET) return -1;
+// Attiva il keepalive TCP con tempi brevi: un peer spento o scollegato, che non invia FIN ne' RST,
+// viene rilevato in KEEPALIVE_INATTIVITA_MS + KEEPALIVE_TENTATIVI * KEEPALIVE_INTERVALLO_MS invece
+// delle due ore di default. A quel punto recv e send falliscono con WSAETIMEDOUT.
+static void imposta_keepalive(SOCKET s) {
+    BOOL attivo = TRUE;
+    setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, (const char*)&attivo, sizeof(attivo));
+    DWORD inattivita_s = KEEPALIVE_INATTIVITA_MS / 1000;
+    DWORD intervallo_s = KEEPALIVE_INTERVALLO_MS / 1000;
+    DWORD tentativi = KEEPALIVE_TENTATIVI;
+    if (setsockopt(s, IPPROTO_TCP, TCP_KEEPIDLE, (const char*)&inattivita_s, sizeof(inattivita_s)) == 0
+        && setsockopt(s, IPPROTO_TCP, TCP_KEEPINTVL, (const char*)&intervallo_s, sizeof(intervallo_s)) == 0
+        && setsockopt(s, IPPROTO_TCP, TCP_KEEPCNT, (const char*)&tentativi, sizeof(tentativi)) == 0) {
+        return;
+    }
+    // Windows precedenti: stessi tempi, ma il numero di sonde e' fisso (10)
+    struct tcp_keepalive valori = { 1, KEEPALIVE_INATTIVITA_MS, KEEPALIVE_INTERVALLO_MS };
+    DWORD restituiti = 0;
+    WSAIoctl(s, SIO_KEEPALIVE_VALS, &valori, sizeof(valori), NULL, 0, &restituiti, NULL, NULL);
+}
+
+// Chiude la connessione con la stampante: il comando successivo ne aprira' una nuova
+static void chiudi_connessione_stampante(void) {
+    if (sock_stampante != INVALID_SOCKET) {
+        closesocket(sock_stampante);
+        sock_stampante = INVALID_SOCKET;
+    }
+}
+
+// Apre la connessione con la stampante entro attesa_ms da inizio, con keepalive e senza Nagle
+static SOCKET connetti_stampante(const char* ip, int porta, DWORD inizio, DWORD attesa_ms) {
+    struct sockaddr_in stampante;
+    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET) return INVALID_SOCKET;
 
     stampante.sin_family = AF_INET;
     stampante.sin_addr.s_addr = inet_addr(ip);
     stampante.sin_port = htons(porta);
 
+    u_long non_bloccante = 1; // connect e recv attendono con WSAPoll fino alla scadenza
+    ioctlsocket(s, FIONBIO, &non_bloccante);
     if (connect(s, (struct sockaddr*)&stampante, sizeof(stampante)) < 0) {
-        closesocket(s);
-        return -1;
+        int errore_connect = 0;
+        int errore_len = sizeof(errore_connect);
+        if (WSAGetLastError() != WSAEWOULDBLOCK || !attendi_socket(s, POLLOUT, inizio, attesa_ms)
+            || getsockopt(s, SOL_SOCKET, SO_ERROR, (char*)&errore_connect, &errore_len) != 0 || errore_connect != 0) {
+            closesocket(s);
+            return INVALID_SOCKET;
+        }
     }
+    BOOL nodelay = TRUE; // Il pacchetto parte con un solo send: nessun motivo di attendere
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+    imposta_keepalive(s);
+    InterlockedIncrement(&cont_connessioni_stampante);
+    return s;
+}
 
-    if (send(s, pacchetto, pacchetto_len, 0) != pacchetto_len) {
-        closesocket(s);
-        return -1;
+// Verifica la connessione riusata prima di un comando: la stampante puo' averla chiusa, o il
+// keepalive interrotta, mentre era inattiva. I byte arrivati dopo la scadenza del comando
+// precedente vengono scartati.
+static BOOL connessione_stampante_integra(SOCKET s) {
+    for (;;) {
+        WSAPOLLFD stato = { s, POLLRDNORM, 0 };
+        int pronti = WSAPoll(&stato, 1, 0);
+        if (pronti == 0) return TRUE;
+        if (pronti == SOCKET_ERROR || (stato.revents & (POLLERR | POLLNVAL))) return FALSE;
+        char scarto[256];
+        if (recv(s, scarto, sizeof(scarto), 0) <= 0) return FALSE;
+        InterlockedIncrement(&cont_risposte_scartate);
     }
+}
+
+// Funzione per inviare un pacchetto alla stampante fisica via TCP/IP e ricevere la risposta
+// (Questa era la vecchia funzione invia_a_stampante). La connessione resta aperta tra i comandi
+// e viene chiusa dopo ogni risposta incompleta; le interrogazioni rimaste senza risposta su una
+// connessione riusata e chiusa dalla stampante vengono ripetute su una nuova. Connessione e risposta completa devono arrivare
+// entro scadenza_ms; la sola connessione entro STAMPANTE_CONNESSIONE_MS, cosi' una stampante
+// spenta viene rilevata subito.
+int invia_a_stampante_tcp(const char* ip, int porta, const char* pacchetto, int pacchetto_len, char* risposta, int max_risposta_len, DWORD scadenza_ms) {
+    DWORD inizio = GetTickCount();
+    for (int tentativo = 0; tentativo < 2; tentativo++) {
+        if (sock_stampante != INVALID_SOCKET && !connessione_stampante_integra(sock_stampante)) {
+            chiudi_connessione_stampante();
+        }
+        BOOL riusata = sock_stampante != INVALID_SOCKET;
+        if (!riusata) {
+            sock_stampante = connetti_stampante(ip, porta, inizio, scadenza_ms < STAMPANTE_CONNESSIONE_MS ? scadenza_ms : STAMPANTE_CONNESSIONE_MS);
+            if (sock_stampante == INVALID_SOCKET) return -1;
+        }
+        SOCKET s = sock_stampante;
+
+        if (send(s, pacchetto, pacchetto_len, 0) != pacchetto_len) {
+            chiudi_connessione_stampante();
+            if (riusata) continue; // Connessione caduta mentre era inattiva: si riprova con una nuova
+            return -1;
+        }
 
-    // Riceve la risposta fino a ETX (0x03) o fine buffer
-    int total = 0;
-    int found_etx = 0;
-    while (total < max_risposta_len) {
-        int n = recv(s, risposta + total, max_risposta_len - total, 0);
-        if (n <= 0) break;
-        for (int i = 0; i < n; i++) {
-            if ((unsigned char)risposta[total + i] == 0x03) {
-                total += i + 1;
-                found_etx = 1;
+        // Riceve la risposta fino a ETX (0x03) o fine buffer
+        int total = 0;
+        int found_etx = 0;
+        BOOL chiusa = FALSE;
+        while (total < max_risposta_len) {
+            if (!attendi_socket(s, POLLIN, inizio, scadenza_ms)) break; // Scadenza: si ritorna quanto ricevuto
+            int n = recv(s, risposta + total, max_risposta_len - total, 0);
+            if (n <= 0) {
+                chiusa = TRUE;
                 break;
             }
+            for (int i = 0; i < n; i++) {
+                if ((unsigned char)risposta[total + i] == 0x03) {
+                    total += i + 1;
+                    found_etx = 1;
+                    break;
+                }
+            }
+            if (found_etx) break;
+            total += n;
         }
-        if (found_etx) break;
-        total += n;
+        if (found_etx) return total;
+
+        // Risposta incompleta: i byte in ritardo non devono finire nella risposta del comando successivo
+        chiudi_connessione_stampante();
+        // Una stampante che chiude la connessione dopo ogni risposta non ha letto il pacchetto
+        // inviato sulla connessione riusata: lo si ripete su una nuova. Solo per le interrogazioni,
+        // come per le ritrasmissioni seriali: la chiusura puo' anche arrivare dopo l'esecuzione di
+        // un comando, che ripetuto verrebbe eseguito due volte
+        if (riusata && chiusa && total == 0 && pacchetto_idempotente(pacchetto, pacchetto_len)) continue;
+        return total;
     }
-    risposta_len = total;
+    return -1;
+}
 
-    closesocket(s);
-    return risposta_len;
+// Esito della lettura di una risposta dalla stampante seriale
+typedef enum {
+    LETTURA_COMPLETA = 0,  // Pacchetto fino a ETX
+    LETTURA_INCOMPLETA,    // Scadenza raggiunta (o buffer pieno) prima di ETX
+    LETTURA_NAK,           // La stampante ha rifiutato il pacchetto senza eseguirlo
+    LETTURA_ERRORE         // Errore della porta
+} EsitoLettura;
+
+// Legge una risposta dalla stampante fino a ETX o alla scadenza. ACK e NAK che precedono lo STX
+// vengono tolti dalla risposta. Se la stampante ripete il pack_id dei comandi, le risposte con un
+// pack_id diverso da quello atteso (risposte in ritardo a un invio precedente) vengono scartate;
+// i byte ricevuti dopo il loro ETX, nella stessa lettura, vengono analizzati come inizio della
+// risposta attesa.
+static EsitoLettura leggi_risposta_seriale(HANDLE hComm, char* risposta, int max_risposta_len, DWORD scadenza_ms, char pack_id, int* risposta_len) {
+    int letti = 0;          // Byte nel buffer, compresi quelli oltre l'ETX della prima risposta
+    int analizzati = 0;     // Byte gia' cercati per l'ETX
+    BOOL in_risposta = FALSE; // Lo STX della risposta e' in risposta[0]
+    int fine_risposta = 0;  // Lunghezza della risposta fino all'ETX (0 = non ancora completa)
+    DWORD start_time = GetTickCount(); // Per la scadenza della risposta completa
+    LONGLONG primo_byte = 0; // La ricezione si misura dal primo byte, escludendo l'elaborazione della stampante
+    COMMTIMEOUTS timeouts;
+    GetCommTimeouts(hComm, &timeouts);
+    *risposta_len = 0;
+
+    for (;;) {
+        if (!in_risposta && letti > 0) {
+            // Prima dello STX possono arrivare ACK (pacchetto ricevuto) o NAK (pacchetto rifiutato)
+            int salta = 0;
+            while (salta < letti && (unsigned char)risposta[salta] != PACCHETTO_STX) {
+                if ((unsigned char)risposta[salta] == PACCHETTO_NAK) {
+                    linea_stampante.us_trasferimento += microsecondi() - primo_byte;
+                    return LETTURA_NAK;
+                }
+                salta++;
+            }
+            letti -= salta;
+            memmove(risposta, risposta + salta, (size_t)letti);
+            in_risposta = letti > 0;
+            analizzati = 0;
+        }
+        if (in_risposta) {
+            char* etx = memchr(risposta + analizzati, PACCHETTO_ETX, (size_t)(letti - analizzati));
+            analizzati = letti;
+            if (etx != NULL) {
+                int lunghezza = (int)(etx - risposta) + 1;
+                if (eco_pack_id >= ECO_PACK_ID_CONFERME && pacchetto_valido(risposta, lunghezza) && risposta[lunghezza - 4] != pack_id) {
+                    InterlockedIncrement(&cont_risposte_scartate);
+                    print_log("[DEBUG] Scartata risposta della stampante a un invio precedente.\n", COLOR_DEBUG);
+                    letti -= lunghezza;
+                    memmove(risposta, risposta + lunghezza, (size_t)letti);
+                    in_risposta = FALSE;
+                    continue; // I byte successivi possono gia' contenere la risposta attesa
+                }
+                fine_risposta = lunghezza; // Eventuali byte successivi non appartengono alla risposta
+                break;
+            }
+        }
+        if (letti >= max_risposta_len - 1) break;
+
+        DWORD trascorsi = GetTickCount() - start_time;
+        if (trascorsi >= scadenza_ms) break;
+        // La lettura ritorna appena e' disponibile almeno un byte, al piu' dopo il tempo rimasto
+        timeouts.ReadIntervalTimeout = MAXDWORD;
+        timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+        timeouts.ReadTotalTimeoutConstant = scadenza_ms - trascorsi;
+        SetCommTimeouts(hComm, &timeouts);
+        int bytes_chunk_read = read_from_serial_port(hComm, risposta + letti, max_risposta_len - 1 - letti);
+
+        if (bytes_chunk_read < 0) { // Errore di lettura
+            print_log("Errore lettura da seriale stampante durante attesa risposta.", COLOR_ERROR);
+            return LETTURA_ERRORE;
+        }
+        if (bytes_chunk_read == 0) continue; // Tempo rimasto esaurito: lo rileva il controllo della scadenza
+
+        if (primo_byte == 0) primo_byte = microsecondi();
+        linea_stampante.byte_ricevuti += bytes_chunk_read;
+        letti += bytes_chunk_read;
+    }
+    int total_bytes_read = fine_risposta > 0 ? fine_risposta : (in_risposta ? letti : 0);
+    risposta[total_bytes_read] = '\0';
+    if (primo_byte != 0) linea_stampante.us_trasferimento += microsecondi() - primo_byte;
+    *risposta_len = total_bytes_read;
+    return fine_risposta > 0 ? LETTURA_COMPLETA : LETTURA_INCOMPLETA;
 }
 
-// Funzione per inviare un pacchetto alla stampante fisica via Seriale e ricevere la risposta
-int invia_a_stampante_seriale(HANDLE hComm, const char* pacchetto, int pacchetto_len, char* risposta, int max_risposta_len) {
+// Funzione per inviare un pacchetto alla stampante fisica via Seriale e ricevere la risposta.
+// Un pacchetto rifiutato con NAK viene ritrasmesso subito. Con ritrasmissione_ms > 0 (solo comandi
+// idempotenti) il pacchetto viene ritrasmesso anche se la risposta non e' completa e valida entro
+// ritrasmissione_ms: la ritrasmissione ha lo stesso pack_id, quindi la stampante la riconosce come
+// duplicato. In ogni caso l'attesa complessiva non supera scadenza_ms.
+int invia_a_stampante_seriale(HANDLE hComm, const char* pacchetto, int pacchetto_len, char* risposta, int max_risposta_len, DWORD scadenza_ms, DWORD ritrasmissione_ms) {
     if (hComm == INVALID_HANDLE_VALUE) {
         print_log("Errore: Handle porta seriale stampante non valido per invio.", COLOR_ERROR);
         return -1;
     }
 
-    print_log("Invio dati alla stampante seriale...\n", COLOR_DEBUG);
-    int bytes_written = write_to_serial_port(hComm, pacchetto, pacchetto_len);
-    if (bytes_written < 0) {
-        return -2; // Errore già loggato
-    }
-    if (bytes_written != pacchetto_len) {
-        print_log("Errore: non tutti i byte sono stati scritti sulla seriale della stampante.", COLOR_WARNING);
-    }
-
-    print_log("Attesa risposta dalla stampante seriale...\n", COLOR_DEBUG);
-    memset(risposta, 0, max_risposta_len);
-    
-    // Logica di lettura della risposta dalla stampante seriale.
-    // Il protocollo prevede STX all'inizio e ETX alla fine.
-    // Bisogna leggere fino a ETX o timeout/errore.
+    char pack_id = pacchetto_len >= PACCHETTO_CORNICE ? pacchetto[pacchetto_len - 4] : 0;
+    DWORD inizio = GetTickCount();
     int total_bytes_read = 0;
-    BOOL etx_found = FALSE;
-    DWORD start_time = GetTickCount(); // Per timeout manuale sulla ricezione completa del pacchetto
-
-    while (total_bytes_read < max_risposta_len -1 && !etx_found) {
-        if (GetTickCount() - start_time > TIMEOUT_MS) { // Timeout generale per la risposta completa
-            print_log("Timeout generale attesa risposta completa da stampante seriale.", COLOR_WARNING);
-            break;
+    EsitoLettura esito = LETTURA_INCOMPLETA;
+    char log_msg[150];
+
+    for (int tentativo = 0; ; tentativo++) {
+        print_log("Invio dati alla stampante seriale...\n", COLOR_DEBUG);
+        LONGLONG inizio_invio = microsecondi();
+        int bytes_written = write_to_serial_port(hComm, pacchetto, pacchetto_len);
+        if (bytes_written < 0) {
+            return -2; // Errore già loggato
+        }
+        linea_stampante.byte_inviati += bytes_written;
+        linea_stampante.us_trasferimento += microsecondi() - inizio_invio;
+        if (bytes_written != pacchetto_len) {
+            print_log("Errore: non tutti i byte sono stati scritti sulla seriale della stampante.", COLOR_WARNING);
         }
-        char temp_char;
-        int bytes_chunk_read = read_from_serial_port(hComm, &temp_char, 1);
 
-        if (bytes_chunk_read < 0) { // Errore di lettura
-            print_log("Errore lettura da seriale stampante durante attesa risposta.", COLOR_ERROR);
-            return -3;
+        print_log("Attesa risposta dalla stampante seriale...\n", COLOR_DEBUG);
+        DWORD trascorsi = GetTickCount() - inizio;
+        DWORD resto = trascorsi < scadenza_ms ? scadenza_ms - trascorsi : 0;
+        BOOL ultimo = tentativo >= STAMPANTE_MAX_RITRASMISSIONI;
+        DWORD attesa = (!ultimo && ritrasmissione_ms > 0 && ritrasmissione_ms < resto) ? ritrasmissione_ms : resto;
+        esito = leggi_risposta_seriale(hComm, risposta, max_risposta_len, attesa, pack_id, &total_bytes_read);
+        if (esito == LETTURA_ERRORE) return -3;
+
+        if (esito == LETTURA_COMPLETA && pacchetto_valido(risposta, total_bytes_read)) {
+            // Conta le risposte consecutive con il pack_id del comando: se la stampante lo ripete,
+            // il pack_id permette di riconoscere le risposte in ritardo
+            if (risposta[total_bytes_read - 4] == pack_id) {
+                if (eco_pack_id < ECO_PACK_ID_CONFERME) eco_pack_id++;
+            } else {
+                eco_pack_id = 0;
+            }
+            break;
         }
-        if (bytes_chunk_read == 0) { // Timeout sulla singola lettura (normale se ReadIntervalTimeout è impostato)
-            Sleep(10); // Piccola pausa per non ciclare troppo velocemente
+        if (ultimo || GetTickCount() - inizio >= scadenza_ms) break;
+        if (esito == LETTURA_NAK) {
+            // Il pacchetto non e' stato eseguito: ritrasmetterlo e' sicuro per qualsiasi comando
+            InterlockedIncrement(&cont_nak_stampante);
+            snprintf(log_msg, sizeof(log_msg), "NAK dalla stampante: ritrasmissione %d del pacchetto (pack_id %c).", tentativo + 1, pack_id);
+            print_log(log_msg, COLOR_WARNING);
             continue;
         }
-
-        risposta[total_bytes_read++] = temp_char;
-        if (temp_char == 0x03) { // ETX
-            etx_found = TRUE;
-        }
+        if (ritrasmissione_ms == 0) break;
+        InterlockedIncrement(&cont_ritrasmissioni_stampante);
+        snprintf(log_msg, sizeof(log_msg), "Risposta %s dopo %lu ms: ritrasmissione %d del comando idempotente (pack_id %c).",
+                 esito == LETTURA_COMPLETA ? "con CHK errato" : "non arrivata", (unsigned long)attesa, tentativo + 1, pack_id);
+        print_log(log_msg, COLOR_WARNING);
     }
-    risposta[total_bytes_read] = '\0';
 
-    if (!etx_found && total_bytes_read > 0) {
+    if (esito == LETTURA_INCOMPLETA && total_bytes_read > 0) {
         print_log("Risposta da stampante seriale ricevuta ma senza ETX finale o buffer pieno.", COLOR_WARNING);
-    } else if (total_bytes_read == 0 && !etx_found) {
-        print_log("Nessuna risposta o risposta vuota dalla stampante seriale.", COLOR_WARNING);
+    } else if (esito == LETTURA_INCOMPLETA) {
+        snprintf(log_msg, sizeof(log_msg), "Nessuna risposta dalla stampante seriale entro %lu ms.", (unsigned long)scadenza_ms);
+        print_log(log_msg, COLOR_WARNING);
+    } else if (esito == LETTURA_NAK) {
+        print_log("Pacchetto rifiutato dalla stampante anche dopo le ritrasmissioni.", COLOR_WARNING);
     }
     
     char log_resp[200];
@@ -818,7 +1670,8 @@ void controlla_stampante(int accendi) {
 // =====================
 // Variabile globale per controllare lo stato del server
 volatile BOOL is_running = TRUE;
-SOCKET listen_socket = INVALID_SOCKET; // Socket di ascolto globale
+SOCKET socket_ascolto[MAX_INDIRIZZI_ASCOLTO]; // Socket di ascolto, uno per indirizzo configurato
+int num_socket_ascolto = 0;
 
 /**
  * Crea una risposta di errore standardizzata secondo il protocollo
@@ -831,29 +1684,39 @@ SOCKET listen_socket = INVALID_SOCKET; // Socket di ascolto globale
  * @return Lunghezza del pacchetto creato, o -1 in caso di errore
  */
 int crea_risposta_errore(const char* adds, char famiglia_errore, const char* codice_errore, const char* messaggio, char* pacchetto, int max_len) {
-    // Buffer per i dati da inviare
-    char buffer_dati[1024];
-    
-    // Formatta i dati secondo il protocollo: TIPO|FAMIGLIA|CODICE|MESSAGGIO
-    int dati_len = snprintf(buffer_dati, sizeof(buffer_dati), "%c|%c|%s|%s", 
+    // Formatta i dati secondo il protocollo (TIPO|FAMIGLIA|CODICE|MESSAGGIO) direttamente nel campo dati
+    char* dati = pacchetto + PACCHETTO_INIZIO_DATI;
+    int spazio = max_len - PACCHETTO_CORNICE + 1; // Il terminatore di snprintf cade sul pack_id
+    if (spazio <= 0) return -1;
+    int dati_len = snprintf(dati, (size_t)spazio, "%c|%c|%s|%s",
                           TIPO_MESSAGGIO_ERRORE, 
                           famiglia_errore,
                           codice_errore,
                           messaggio);
     
-    if (dati_len < 0 || dati_len >= (int)sizeof(buffer_dati)) {
+    if (dati_len < 0 || dati_len >= spazio) {
         return -1; // Errore di formattazione o buffer overflow
     }
     
-    // Usa la funzione esistente per costruire il pacchetto con checksum
-    return costruisci_pacchetto(adds, buffer_dati, dati_len, pacchetto, max_len);
+    return pacchetto_costruisci(adds, dati, dati_len, pacchetto, max_len).lunghezza;
 }
 
 // === FUNZIONE PER LOG CON TIMESTAMP ===
 // Prototipo della funzione print_separator
 void print_separator();
 
+// Livello di un messaggio di log, dedotto dal suo colore
+static LivelloLog livello_colore(int color) {
+    switch (color) {
+        case COLOR_ERROR: return LOG_ERRORI;
+        case COLOR_WARNING: return LOG_AVVISI;
+        case COLOR_DEBUG: return LOG_DEBUG;
+        default: return LOG_INFO;
+    }
+}
+
 void print_log(const char* msg, int color) {
+    if (livello_colore(color) > livello_log) return;
     time_t now = time(NULL);
     struct tm* t = localtime(&now);
     char timebuf[16];
@@ -899,62 +1762,142 @@ DWORD WINAPI server_thread_func(LPVOID lpParam) {
     return 0;
 }
 
-void start_tcp_server(int port) {
-    char log_msg[256];
-    snprintf(log_msg, sizeof(log_msg), "Tentativo di avviare il server TCP sulla porta %d...\n", port);
-    print_log(log_msg, COLOR_INFO);
+// Scrive "indirizzo:porta" del peer; gli indirizzi IPv4 accettati dal socket dual-stack
+// (::ffff:a.b.c.d) vengono mostrati in forma IPv4
+static void formatta_indirizzo(const struct sockaddr_storage* indirizzo, char* testo, size_t dimensione) {
+    char ip[INET6_ADDRSTRLEN] = "?";
+    if (indirizzo->ss_family == AF_INET6) {
+        const struct sockaddr_in6* a6 = (const struct sockaddr_in6*)indirizzo;
+        if (IN6_IS_ADDR_V4MAPPED(&a6->sin6_addr)) {
+            inet_ntop(AF_INET, (const char*)&a6->sin6_addr + 12, ip, sizeof(ip));
+            snprintf(testo, dimensione, "%s:%d", ip, ntohs(a6->sin6_port));
+            return;
+        }
+        inet_ntop(AF_INET6, &a6->sin6_addr, ip, sizeof(ip));
+        snprintf(testo, dimensione, "[%s]:%d", ip, ntohs(a6->sin6_port));
+        return;
+    }
+    const struct sockaddr_in* a4 = (const struct sockaddr_in*)indirizzo;
+    inet_ntop(AF_INET, &a4->sin_addr, ip, sizeof(ip));
+    snprintf(testo, dimensione, "%s:%d", ip, ntohs(a4->sin_port));
+}
 
-    WSADATA wsaData;
-    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (iResult != 0) {
-        snprintf(log_msg, sizeof(log_msg), "WSAStartup fallito: %d. Server TCP non avviato.", iResult);
+// Apre un socket di ascolto sull'indirizzo numerico indicato ("::", "0.0.0.0", "192.168.1.10", ...).
+// Sui socket IPv6 IPV6_V6ONLY viene disattivato: "::" accetta anche i client IPv4.
+static SOCKET apri_socket_ascolto(const char* indirizzo, int port) {
+    char log_msg[256];
+    char porta[8];
+    snprintf(porta, sizeof(porta), "%d", port);
+    struct addrinfo hints, *risultato = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+    if (getaddrinfo(indirizzo, porta, &hints, &risultato) != 0 || risultato == NULL) {
+        snprintf(log_msg, sizeof(log_msg), "Indirizzo di ascolto non valido: '%s'.\n", indirizzo);
         print_log(log_msg, COLOR_ERROR);
-        return;
+        return INVALID_SOCKET;
     }
 
-    listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (listen_socket == INVALID_SOCKET) {
-        snprintf(log_msg, sizeof(log_msg), "Creazione socket fallita: %ld. Server TCP non avviato.", WSAGetLastError());
+    SOCKET s = socket(risultato->ai_family, risultato->ai_socktype, risultato->ai_protocol);
+    if (s == INVALID_SOCKET) {
+        snprintf(log_msg, sizeof(log_msg), "Creazione socket per %s fallita: %d.\n", indirizzo, WSAGetLastError());
         print_log(log_msg, COLOR_ERROR);
-        WSACleanup();
-        return;
+        freeaddrinfo(risultato);
+        return INVALID_SOCKET;
+    }
+    if (risultato->ai_family == AF_INET6) {
+        DWORD solo_v6 = 0;
+        setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&solo_v6, sizeof(solo_v6));
+    }
+    if (bind(s, risultato->ai_addr, (int)risultato->ai_addrlen) == SOCKET_ERROR || listen(s, SOMAXCONN) == SOCKET_ERROR) {
+        snprintf(log_msg, sizeof(log_msg), "Bind/listen su %s porta %d fallito: %d.\n", indirizzo, port, WSAGetLastError());
+        print_log(log_msg, COLOR_ERROR);
+        closesocket(s);
+        s = INVALID_SOCKET;
+    }
+    freeaddrinfo(risultato);
+    return s;
+}
+
+// Arresto controllato delle sessioni, dopo la chiusura dei socket di ascolto: i thread client
+// smettono di leggere nuovi comandi, completano quelli gia' inoltrati, inviano le risposte e
+// chiudono la connessione. Le sessioni con uno scontrino aperto possono completarlo entro
+// DRENAGGIO_SCADENZA_MS. Ritorna TRUE se tutte le sessioni sono terminate.
+static BOOL drena_sessioni(void) {
+    char log_msg[256];
+    LONG eseguite_prima, eseguite_dopo;
+    coda_statistiche(NULL, &eseguite_prima, NULL);
+    LONG sessioni_iniziali = sessioni_attive;
+    LONG documenti_iniziali = documenti_in_corso;
+    LONG interrotti_prima = documenti_interrotti;
+    DWORD inizio = GetTickCount();
+
+    server_running = 0;
+    snprintf(log_msg, sizeof(log_msg), "Arresto controllato: %ld sessioni aperte, %ld con uno scontrino in corso (attesa massima %d s).\n",
+             sessioni_iniziali, documenti_iniziali, DRENAGGIO_SCADENZA_MS / 1000);
+    print_log(log_msg, COLOR_WARNING);
+    while (sessioni_attive > 0 && GetTickCount() - inizio < DRENAGGIO_SCADENZA_MS) {
+        Sleep(SESSIONE_POLL_MS);
     }
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+    LONG forzate = sessioni_attive;
+    if (forzate > 0) {
+        snprintf(log_msg, sizeof(log_msg), "Scadenza raggiunta: chiusura forzata di %ld sessioni dopo i comandi gia' inoltrati.\n", forzate);
+        print_log(log_msg, COLOR_WARNING);
+        drenaggio_forzato = TRUE;
+        DWORD inizio_forzato = GetTickCount();
+        while (sessioni_attive > 0 && GetTickCount() - inizio_forzato < DRENAGGIO_ATTESA_FORZATA_MS) {
+            Sleep(SESSIONE_POLL_MS);
+        }
+    }
 
-    if (bind(listen_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-        snprintf(log_msg, sizeof(log_msg), "Bind fallito: %ld. Server TCP non avviato.", WSAGetLastError());
+    coda_statistiche(NULL, &eseguite_dopo, NULL);
+    LONG interrotti = documenti_interrotti - interrotti_prima;
+    snprintf(log_msg, sizeof(log_msg), "Drenaggio concluso in %lu ms: %ld sessioni chiuse (%ld allo scadere), %ld comandi completati, %ld scontrini completati, %ld interrotti.\n",
+             (unsigned long)(GetTickCount() - inizio), sessioni_iniziali - sessioni_attive, forzate, eseguite_dopo - eseguite_prima,
+             documenti_iniziali - interrotti - documenti_in_corso, interrotti + documenti_in_corso);
+    print_log(log_msg, interrotti + documenti_in_corso > 0 ? COLOR_WARNING : COLOR_INFO);
+    if (sessioni_attive > 0) {
+        snprintf(log_msg, sizeof(log_msg), "%ld sessioni non terminate: i loro thread vengono abbandonati.\n", sessioni_attive);
         print_log(log_msg, COLOR_ERROR);
-        closesocket(listen_socket);
-        WSACleanup();
-        return;
+        return FALSE;
     }
+    return TRUE;
+}
 
-    if (listen(listen_socket, SOMAXCONN) == SOCKET_ERROR) {
-        snprintf(log_msg, sizeof(log_msg), "Listen fallito: %ld. Server TCP non avviato.", WSAGetLastError());
-        print_log(log_msg, COLOR_ERROR);
-        closesocket(listen_socket);
-        WSACleanup();
-        return;
+// Chiude tutti i socket di ascolto: i thread in accept ritornano con errore e terminano
+void chiudi_socket_ascolto(void) {
+    for (int i = 0; i < num_socket_ascolto; i++) {
+        if (socket_ascolto[i] != INVALID_SOCKET) {
+            closesocket(socket_ascolto[i]);
+            socket_ascolto[i] = INVALID_SOCKET;
+        }
     }
+}
 
-    snprintf(log_msg, sizeof(log_msg), "Server TCP in ascolto sulla porta %d.\nIn attesa di connessioni client...\n", port);
-    print_log(log_msg, COLOR_INFO);
+static volatile LONG contatore_id_client = 0;
+
+// Thread di accept: piu' thread attendono sullo stesso socket di ascolto e il sistema
+// consegna ogni connessione a uno solo di essi, cosi' le raffiche di riconnessioni
+// di inizio turno vengono smaltite in parallelo
+typedef struct {
+    int indice;
+    int indice_socket;
+    LONG connessioni;
+} Accettatore;
 
-    SOCKET client_socket;
-    struct sockaddr_in client_addr;
-    int client_addr_size = sizeof(client_addr);
-    static int tcp_client_id_counter = 0;
-    HANDLE h_thread;
+static DWORD WINAPI thread_accettatore(LPVOID lpParam) {
+    Accettatore* accettatore = (Accettatore*)lpParam;
+    char log_msg[256];
 
     while (is_running) {
-        client_socket = accept(listen_socket, (struct sockaddr*)&client_addr, &client_addr_size);
+        struct sockaddr_storage client_addr;
+        int client_addr_size = sizeof(client_addr);
+        SOCKET client_socket = accept(socket_ascolto[accettatore->indice_socket], (struct sockaddr*)&client_addr, &client_addr_size);
         if (client_socket == INVALID_SOCKET) {
             if (!is_running) { // Errore atteso perché abbiamo chiuso il socket
-                print_log("accept interrotto a seguito di chiusura server.", COLOR_INFO);
                 break; // Usciamo dal loop
             } else { // Errore inaspettato
                 snprintf(log_msg, sizeof(log_msg), "accept fallito con errore: %d", WSAGetLastError());
@@ -962,90 +1905,520 @@ void start_tcp_server(int port) {
                 continue; // Riprova
             }
         }
-
-        char* client_ip_str = inet_ntoa(client_addr.sin_addr); // inet_ntoa è più vecchio e IPv4-only, ma più portabile su vecchi MinGW
-        // ATTENZIONE: inet_ntoa non è thread-safe se chiamato da più thread contemporaneamente senza protezione,
-        // ma per il logging qui, dove la stringa viene usata subito, il rischio è basso.
-        snprintf(log_msg, sizeof(log_msg), "Nuova connessione TCP accettata da %s:%d\n", client_ip_str, ntohs(client_addr.sin_port));
+        accettatore->connessioni++;
+
+        // Le risposte vengono gia' raccolte nel buffer di uscita: l'algoritmo di Nagle
+        // ritarderebbe soltanto l'ultimo segmento di ogni passata in attesa dell'ACK del client
+        BOOL nodelay = TRUE;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+        // Una cassa spenta senza chiudere la connessione fa fallire recv in pochi secondi:
+        // la sessione si chiude e rilascia posti in coda ed esclusiva sulla stampante
+        imposta_keepalive(client_socket);
+
+        char client_indirizzo[INET6_ADDRSTRLEN + 16];
+        formatta_indirizzo(&client_addr, client_indirizzo, sizeof(client_indirizzo));
+        snprintf(log_msg, sizeof(log_msg), "Nuova connessione TCP accettata da %s\n", client_indirizzo);
         print_log(log_msg, COLOR_INFO);
 
-        struct client_args* args = (struct client_args*)malloc(sizeof(struct client_args));
-        if (args == NULL) {
-            print_log("Errore allocazione memoria per argomenti client TCP.", COLOR_ERROR);
+        char adds[MAX_ADDS];
+        snprintf(adds, sizeof(adds), "%02ld", (InterlockedIncrement(&contatore_id_client) - 1) % 100);
+        ContestoClient* contesto = crea_contesto_client(adds, client_socket, INVALID_HANDLE_VALUE, client_indirizzo);
+        if (contesto == NULL) {
+            print_log("Errore allocazione memoria per la sessione client TCP.", COLOR_ERROR);
             closesocket(client_socket);
             continue;
         }
-        args->sock = client_socket;
-        snprintf(args->adds, sizeof(args->adds), "%02d", tcp_client_id_counter++);
-        if (tcp_client_id_counter >= 100) tcp_client_id_counter = 0; // Reset contatore per semplicità
 
-        h_thread = CreateThread(NULL, 0, tcp_client_handler, args, 0, NULL);
+        HANDLE h_thread = CreateThread(NULL, 0, tcp_client_handler, contesto, 0, NULL);
         if (h_thread == NULL) {
-            snprintf(log_msg, sizeof(log_msg), "Errore creazione thread client TCP (ID %s, Errore WinAPI: %lu).", args->adds, GetLastError());
+            snprintf(log_msg, sizeof(log_msg), "Errore creazione thread client TCP (ID %s, Errore WinAPI: %lu).", adds, GetLastError());
             print_log(log_msg, COLOR_ERROR);
-            free(args);
+            distruggi_contesto_client(contesto);
             closesocket(client_socket);
         } else {
-            snprintf(log_msg, sizeof(log_msg), "Thread client TCP (ID %s) avviato per %s:%d.\n", args->adds, client_ip_str, ntohs(client_addr.sin_port));
+            snprintf(log_msg, sizeof(log_msg), "Thread client TCP (ID %s) avviato per %s.\n", adds, client_indirizzo);
             print_log(log_msg, COLOR_INFO);
             CloseHandle(h_thread); // Il thread è detached, chiudiamo l'handle subito
         }
     }
-
-    // Pulizia del socket di ascolto e Winsock quando il server non è più 'running'
-    closesocket(listen_socket);
-    print_log("Socket di ascolto TCP chiuso.", COLOR_INFO);
-    WSACleanup();
-    print_log("Server TCP terminato e risorse Winsock rilasciate.", COLOR_INFO);
+    return 0;
 }
 
-void start_serial_server(const char* port_name) {
-    HANDLE h_client_listen_serial = INVALID_HANDLE_VALUE;
+void start_tcp_server(int port) {
     char log_msg[256];
-
-    snprintf(log_msg, sizeof(log_msg), "Tentativo di avviare il server di ascolto sulla porta seriale: %s", port_name);
+    snprintf(log_msg, sizeof(log_msg), "Tentativo di avviare il server TCP sulla porta %d...\n", port);
     print_log(log_msg, COLOR_INFO);
 
-    if (!configure_serial_port(port_name, &h_client_listen_serial, SERIAL_BAUD_RATE, SERIAL_PARITY, SERIAL_STOP_BITS, SERIAL_BYTE_SIZE, FALSE)) {
-        snprintf(log_msg, sizeof(log_msg), "Impossibile configurare la porta seriale di ascolto %s. Server seriale non avviato.", port_name);
+    WSADATA wsaData;
+    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (iResult != 0) {
+        snprintf(log_msg, sizeof(log_msg), "WSAStartup fallito: %d. Server TCP non avviato.", iResult);
         print_log(log_msg, COLOR_ERROR);
         return;
     }
 
-    snprintf(log_msg, sizeof(log_msg), "Server in ascolto sulla porta seriale %s. Un singolo client puo' connettersi.", port_name);
-    print_log(log_msg, COLOR_INFO);
-
-    struct serial_client_args* args = (struct serial_client_args*)malloc(sizeof(struct serial_client_args));
-    if (args == NULL) {
-        print_log("Errore di allocazione memoria per argomenti thread client seriale.", COLOR_ERROR);
-        close_serial_port_handle(&h_client_listen_serial);
+    // Un socket per ogni indirizzo della lista "ind1,ind2,..."
+    char indirizzi[sizeof(g_server_listen_addresses)];
+    strncpy(indirizzi, g_server_listen_addresses, sizeof(indirizzi) - 1);
+    indirizzi[sizeof(indirizzi) - 1] = '\0';
+    num_socket_ascolto = 0;
+    for (char* indirizzo = strtok(indirizzi, ", "); indirizzo != NULL && num_socket_ascolto < MAX_INDIRIZZI_ASCOLTO; indirizzo = strtok(NULL, ", ")) {
+        SOCKET s = apri_socket_ascolto(indirizzo, port);
+        if (s == INVALID_SOCKET && strcmp(indirizzo, "::") == 0) {
+            print_log("IPv6 non disponibile: ascolto solo IPv4 su tutte le interfacce.\n", COLOR_WARNING);
+            indirizzo = "0.0.0.0";
+            s = apri_socket_ascolto(indirizzo, port);
+        }
+        if (s == INVALID_SOCKET) continue;
+        socket_ascolto[num_socket_ascolto++] = s;
+        snprintf(log_msg, sizeof(log_msg), "Server TCP in ascolto su %s porta %d.\n", indirizzo, port);
+        print_log(log_msg, COLOR_INFO);
+    }
+    if (num_socket_ascolto == 0) {
+        print_log("Nessun indirizzo di ascolto disponibile. Server TCP non avviato.", COLOR_ERROR);
+        WSACleanup();
         return;
     }
-    args->hClientSerial = h_client_listen_serial;
-    strncpy(args->adds, "S1", MAX_ADDS -1 ); // Client ID fisso per il client seriale
-    args->adds[MAX_ADDS - 1] = '\0'; // Assicura null termination
 
-    HANDLE h_thread = CreateThread(NULL, 0, serial_client_handler, args, 0, NULL);
-    if (h_thread == NULL) {
-        snprintf(log_msg, sizeof(log_msg), "Errore creazione thread client seriale (Errore WinAPI: %lu).", GetLastError());
-        print_log(log_msg, COLOR_ERROR);
-        free(args); 
-        close_serial_port_handle(&h_client_listen_serial);
-        return;
+    // Un thread di accept per processore, almeno uno per socket
+    SYSTEM_INFO sistema;
+    GetSystemInfo(&sistema);
+    int num_accettatori = (int)sistema.dwNumberOfProcessors;
+    if (num_accettatori < num_socket_ascolto) num_accettatori = num_socket_ascolto;
+    if (num_accettatori > MAX_ACCETTATORI) num_accettatori = MAX_ACCETTATORI;
+
+    Accettatore accettatori[MAX_ACCETTATORI];
+    HANDLE h_accettatori[MAX_ACCETTATORI];
+    int avviati = 0;
+    for (int i = 0; i < num_accettatori; i++) {
+        accettatori[avviati].indice = avviati;
+        accettatori[avviati].indice_socket = i % num_socket_ascolto;
+        accettatori[avviati].connessioni = 0;
+        h_accettatori[avviati] = CreateThread(NULL, 0, thread_accettatore, &accettatori[avviati], 0, NULL);
+        if (h_accettatori[avviati] != NULL) avviati++;
     }
+    snprintf(log_msg, sizeof(log_msg), "%d thread di accept su %d socket. In attesa di connessioni client...\n", avviati, num_socket_ascolto);
+    print_log(log_msg, COLOR_INFO);
 
-    print_log("Client seriale 'connesso', thread handler avviato. Il server attende la terminazione dell'handler.", COLOR_INFO);
-    WaitForSingleObject(h_thread, INFINITE);
+    if (avviati > 0) WaitForMultipleObjects((DWORD)avviati, h_accettatori, TRUE, INFINITE);
+    print_log("accept interrotto a seguito di chiusura server.", COLOR_INFO);
+    for (int i = 0; i < avviati; i++) {
+        CloseHandle(h_accettatori[i]);
+        snprintf(log_msg, sizeof(log_msg), "  Thread di accept %d (socket %d): %ld connessioni.\n", accettatori[i].indice, accettatori[i].indice_socket, accettatori[i].connessioni);
+        print_log(log_msg, COLOR_INFO);
+    }
 
-    CloseHandle(h_thread);
-    close_serial_port_handle(&h_client_listen_serial); // Chiusa qui dopo che il thread l'ha usata.
+    // Pulizia dei socket di ascolto e Winsock quando il server non è più 'running'
+    chiudi_socket_ascolto();
+    print_log("Socket di ascolto TCP chiusi.", COLOR_INFO);
+    WSACleanup();
+    print_log("Server TCP terminato e risorse Winsock rilasciate.", COLOR_INFO);
+}
 
-    snprintf(log_msg, sizeof(log_msg), "Thread client seriale terminato e porta di ascolto %s chiusa.", port_name);
-    print_log(log_msg, COLOR_INFO);
+// Apre le porte COM dei client seriali indicate (separate da virgola) e avvia una sessione per
+// ciascuna, con adds "S1", "S2", ... nell'ordine della lista. Le sessioni proseguono come quelle
+// TCP fino all'arresto del server. Ritorna il numero di porte servite.
+int start_serial_server(const char* porte) {
+    char elenco[sizeof(g_server_listen_serial_ports)];
+    char log_msg[256];
+    int avviate = 0;
+    int indice = 0;
+    strncpy(elenco, porte, sizeof(elenco) - 1);
+    elenco[sizeof(elenco) - 1] = '\0';
+
+    for (char* specifica = strtok(elenco, ", "); specifica != NULL; specifica = strtok(NULL, ", ")) {
+        if (indice == MAX_PORTE_SERIALI_CLIENT) {
+            snprintf(log_msg, sizeof(log_msg), "Troppe porte seriali client: %s e le successive vengono ignorate (massimo %d).", specifica, MAX_PORTE_SERIALI_CLIENT);
+            print_log(log_msg, COLOR_WARNING);
+            break;
+        }
+        char adds[MAX_ADDS] = { 'S', "123456789ABCDEFG"[indice++], '\0' };
+
+        // Ogni porta puo' avere velocita', formato e controllo di flusso propri (es. "COM3:19200:8E1:rtscts")
+        static const ParametriSeriale predefiniti = { SERIAL_BAUD_RATE, SERIAL_BYTE_SIZE, SERIAL_PARITY, SERIAL_STOP_BITS, FALSE, FALSE };
+        ParametriSeriale parametri;
+        char port_name[20];
+        if (!analizza_linea_seriale(specifica, &predefiniti, port_name, sizeof(port_name), &parametri)) {
+            snprintf(log_msg, sizeof(log_msg), "Parametri non validi per la porta seriale client '%s' (ID %s): porta ignorata.", specifica, adds);
+            print_log(log_msg, COLOR_ERROR);
+            continue;
+        }
+
+        HANDLE h_porta = INVALID_HANDLE_VALUE;
+        if (!configure_serial_port(port_name, &h_porta, &parametri, FALSE)) {
+            snprintf(log_msg, sizeof(log_msg), "Impossibile configurare la porta seriale client %s (ID %s): porta ignorata.", port_name, adds);
+            print_log(log_msg, COLOR_ERROR);
+            continue;
+        }
+
+        ContestoClient* contesto = crea_contesto_client(adds, INVALID_SOCKET, h_porta, port_name);
+        if (contesto == NULL) {
+            print_log("Errore allocazione memoria per la sessione client seriale.", COLOR_ERROR);
+            close_serial_port_handle(&h_porta);
+            continue;
+        }
+        contesto->linea_parametri = parametri;
+
+        HANDLE h_thread = CreateThread(NULL, 0, serial_client_handler, contesto, 0, NULL);
+        if (h_thread == NULL) {
+            snprintf(log_msg, sizeof(log_msg), "Errore creazione thread client seriale (ID %s, Errore WinAPI: %lu).", adds, GetLastError());
+            print_log(log_msg, COLOR_ERROR);
+            distruggi_contesto_client(contesto);
+            close_serial_port_handle(&h_porta);
+            continue;
+        }
+        CloseHandle(h_thread); // Il thread è detached e chiude la porta alla fine della sessione
+        snprintf(log_msg, sizeof(log_msg), "Client seriale %s servito sulla porta %s.", adds, port_name);
+        print_log(log_msg, COLOR_INFO);
+        avviate++;
+    }
+    return avviate;
 }
 
 // === MAIN SERVER ===
 // =====================
+// =========================
+// === CONSOLE DI AMMINISTRAZIONE ===
+// =========================
+// Gli stessi comandi arrivano dalla console del server e da un socket TCP in ascolto solo su
+// 127.0.0.1, servito da un thread proprio: un operatore puo' ispezionare il gateway con
+// telnet o ncat senza un terminale collegato al processo e senza toccare i thread client.
+
+// Testo della risposta a un comando di amministrazione
+typedef struct {
+    char testo[ADMIN_MAX_RISPOSTA];
+    int len;
+} RispostaAdmin;
+
+static void admin_scrivi(RispostaAdmin* r, const char* formato, ...) {
+    int spazio = (int)sizeof(r->testo) - r->len;
+    if (spazio <= 1) return;
+    va_list argomenti;
+    va_start(argomenti, formato);
+    int n = vsnprintf(r->testo + r->len, (size_t)spazio, formato, argomenti);
+    va_end(argomenti);
+    if (n > 0) r->len += n < spazio ? n : spazio - 1; // Le righe oltre il buffer vengono troncate
+}
+
+static const char* nomi_livello_log[] = { "errori", "avvisi", "info", "debug" };
+
+static void admin_sessioni(RispostaAdmin* r) {
+    DWORD adesso = GetTickCount();
+    int n = 0;
+    admin_scrivi(r, "%-8s %-4s %-8s %-30s %8s %8s %7s %9s %9s %-3s %s\r\n", "ID", "ADDS", "TIPO", "INDIRIZZO", "DURATA_S", "COMANDI", "IN_VOLO",
+                 "RALLENTATI", "ATTESA_MS", "DOC", "CHIUSURA");
+    AcquireSRWLockShared(&lock_registro);
+    for (ContestoClient* c = registro_sessioni; c != NULL; c = c->successivo) {
+        admin_scrivi(r, "%-8d %-4s %-8s %-30s %8lu %8ld %7d %9ld %9ld %-3s %s\r\n", c->sessione.session_id, c->adds,
+                     c->sock != INVALID_SOCKET ? "TCP" : "seriale", c->indirizzo, (unsigned long)((adesso - c->t_connessione) / 1000),
+                     c->comandi, c->n_in_volo, c->limite.utilizzo.rallentati, c->limite.utilizzo.attesa_ms, c->documento_aperto ? "si" : "no",
+                     c->chiusura == CHIUSURA_FORZATA ? "forzata" : (c->chiusura == CHIUSURA_DRENA ? "drenaggio" : "-"));
+        n++;
+    }
+    ReleaseSRWLockShared(&lock_registro);
+    admin_scrivi(r, "%d sessioni aperte.\r\n", n);
+}
+
+// Utilizzo per indirizzo sorgente (comandi ammessi per classe e rallentamenti)
+static void admin_client(RispostaAdmin* r) {
+    UtilizzoIp elenco[LIMITE_MAX_IP];
+    int n = limite_elenco_ip(elenco, LIMITE_MAX_IP);
+    admin_scrivi(r, "%-40s %14s %10s %8s %7s %10s %9s\r\n", "IP", "INTERROGAZIONI", "OPERAZIONI", "CHIUSURE", "LUNGHE", "RALLENTATI", "ATTESA_MS");
+    for (int i = 0; i < n; i++) {
+        const UtilizzoClient* u = &elenco[i].utilizzo;
+        admin_scrivi(r, "%-40s %14ld %10ld %8ld %7ld %10ld %9ld\r\n", elenco[i].ip, u->comandi[CLASSE_INTERROGAZIONE], u->comandi[CLASSE_OPERAZIONE],
+                     u->comandi[CLASSE_CHIUSURA], u->comandi[CLASSE_LUNGA], u->rallentati, u->attesa_ms);
+    }
+    admin_scrivi(r, "%d indirizzi.\r\n", n);
+}
+
+// Mostra i limiti di frequenza o, con tutti gli argomenti, ne imposta uno
+static BOOL admin_limite(RispostaAdmin* r, const char* riga) {
+    char comando[16], classe_testo[32], ambito_testo[32];
+    unsigned long al_minuto, raffica;
+    int letti = sscanf(riga, "%15s %31s %31s %lu %lu", comando, classe_testo, ambito_testo, &al_minuto, &raffica);
+    if (letti > 1) {
+        int classe = -1, ambito = -1;
+        for (int i = 0; i < LATENZA_NUM_CLASSI; i++) {
+            if (strcmp(classe_testo, latenza_nome_classe((ClasseLatenza)i)) == 0) classe = i;
+        }
+        for (int i = 0; i < LIMITE_NUM_AMBITI; i++) {
+            if (letti > 2 && strcmp(ambito_testo, limite_nome_ambito((AmbitoLimite)i)) == 0) ambito = i;
+        }
+        if (letti != 5 || classe < 0 || ambito < 0) {
+            admin_scrivi(r, "ERRORE: uso 'limite <interrogazioni|operazioni|chiusure|lunghe> <sessione|ip> <comandi al minuto> <raffica>' (0 al minuto = nessun limite).\r\n");
+            return FALSE;
+        }
+        limite_configura((ClasseLatenza)classe, (AmbitoLimite)ambito, (DWORD)al_minuto, (DWORD)raffica);
+    }
+    for (int i = 0; i < LATENZA_NUM_CLASSI; i++) {
+        for (int a = 0; a < LIMITE_NUM_AMBITI; a++) {
+            DWORD limite_minuto, limite_raffica;
+            limite_configurazione((ClasseLatenza)i, (AmbitoLimite)a, &limite_minuto, &limite_raffica);
+            if (limite_minuto == 0) {
+                admin_scrivi(r, "  %-14s per %-8s: nessun limite.\r\n", latenza_nome_classe((ClasseLatenza)i), limite_nome_ambito((AmbitoLimite)a));
+            } else {
+                admin_scrivi(r, "  %-14s per %-8s: %lu comandi al minuto, raffica %lu.\r\n", latenza_nome_classe((ClasseLatenza)i),
+                             limite_nome_ambito((AmbitoLimite)a), (unsigned long)limite_minuto, (unsigned long)limite_raffica);
+            }
+        }
+    }
+    return TRUE;
+}
+
+static void admin_coda(RispostaAdmin* r) {
+    LONG in_coda, eseguite, respinte;
+    coda_statistiche(&in_coda, &eseguite, &respinte);
+    admin_scrivi(r, "Coda stampante: %ld in coda o in esecuzione (massimo %d), %ld eseguiti, %ld respinti, retry suggerito %d ms.\r\n",
+                 in_coda, CODA_MAX_GLOBALE, eseguite, respinte, coda_suggerimento_retry_ms());
+    for (int i = 0; i < CODA_NUM_CORSIE; i++) {
+        LONG corsia_eseguite, attesa_media, attesa_max;
+        coda_statistiche_corsia((CorsiaStampante)i, &corsia_eseguite, &attesa_media, &attesa_max);
+        admin_scrivi(r, "  Corsia %-14s: %ld comandi, attesa media %ld ms, massima %ld ms.\r\n",
+                     coda_nome_corsia((CorsiaStampante)i), corsia_eseguite, attesa_media, attesa_max);
+    }
+    int sessione_affine;
+    LONG durata_affinita;
+    if (coda_affinita_corrente(&sessione_affine, &durata_affinita)) {
+        admin_scrivi(r, "Esclusiva per documento: sessione %d da %ld ms (scade dopo %lu s di inattivita').\r\n", sessione_affine,
+                     durata_affinita, (unsigned long)(coda_timeout_affinita() / 1000));
+    } else {
+        admin_scrivi(r, "Esclusiva per documento: nessuna.\r\n");
+    }
+    StatoStampante stato;
+    stampante_snapshot(&stato);
+    if (stato.documento_aperto) {
+        admin_scrivi(r, "Documento aperto: sessione %d.\r\n", stato.sessione_documento);
+    }
+}
+
+static void admin_stampante(RispostaAdmin* r) {
+    StatoStampante stato;
+    stampante_snapshot(&stato);
+    admin_scrivi(r, "Stato: chiave %d, lock %d, documento %s, %d righe, totale %d (versione %lu).\r\n", stato.chiave, stato.lock,
+                 stato.documento_aperto ? "aperto" : "chiuso", stato.righe_documento, stato.totale, stato.versione);
+    if (stato.incerto) {
+        admin_scrivi(r, "Modello incerto: i comandi vengono inoltrati alla stampante senza verifiche di sequenza.\r\n");
+    }
+    admin_scrivi(r, "Raggiungibile: %s (%ld battiti di inattivita').\r\n", stampante_raggiungibile() ? "si" : "NO", cont_battiti_stampante);
+    for (int i = 0; i < LATENZA_NUM_CLASSI; i++) {
+        StatisticheLatenza latenza;
+        latenza_statistiche((ClasseLatenza)i, &latenza);
+        admin_scrivi(r, "  Latenza %-14s: %ld risposte, media %lu ms, p50 %lu ms, p99 %lu ms, %ld scadute, scadenza %lu ms.\r\n",
+                     latenza_nome_classe((ClasseLatenza)i), latenza.campioni, (unsigned long)latenza.media_ms, (unsigned long)latenza.p50_ms,
+                     (unsigned long)latenza.p99_ms, latenza.scadute, (unsigned long)latenza.scadenza_ms);
+    }
+    if (g_printer_connection_mode == MODE_SERIAL) {
+        admin_scrivi(r, "Seriale %s a %lu baud: %ld NAK, %ld ritrasmissioni, %ld risposte in ritardo scartate.\r\n",
+                     g_printer_conn_serial_port_name, (unsigned long)g_printer_serial_params.baud_rate,
+                     cont_nak_stampante, cont_ritrasmissioni_stampante, cont_risposte_scartate);
+    } else {
+        admin_scrivi(r, "TCP %s:%d: connessione %s, %ld aperte finora.\r\n", g_printer_conn_ip_address, g_printer_conn_tcp_port,
+                     sock_stampante != INVALID_SOCKET ? "aperta" : "chiusa", cont_connessioni_stampante);
+    }
+    LONG hit, miss, coalescenti;
+    cache_statistiche(&hit, &miss, &coalescenti);
+    admin_scrivi(r, "Cache: %ld hit, %ld richieste accodate, %ld inviate alla stampante.\r\n", hit, coalescenti, miss);
+}
+
+// Richiede la chiusura delle sessioni con l'ID indicato. Ritorna il numero di sessioni trovate.
+static int admin_chiudi_sessione(int session_id, ChiusuraSessione chiusura) {
+    int trovate = 0;
+    AcquireSRWLockShared(&lock_registro);
+    for (ContestoClient* c = registro_sessioni; c != NULL; c = c->successivo) {
+        if (c->sessione.session_id == session_id) {
+            InterlockedExchange(&c->chiusura, chiusura);
+            trovate++;
+        }
+    }
+    ReleaseSRWLockShared(&lock_registro);
+    return trovate;
+}
+
+// Esegue un comando di amministrazione scrivendo in r il risultato, che termina con una riga
+// "OK" o "ERRORE: ...". Ritorna FALSE se il comando chiude la connessione di amministrazione.
+static BOOL esegui_comando_admin(const char* riga, RispostaAdmin* r) {
+    char comando[32] = "", argomento[32] = "", valore[32] = "";
+    sscanf(riga, "%31s %31s %31s", comando, argomento, valore);
+
+    if (comando[0] == '\0') {
+        return TRUE; // Riga vuota: nessuna risposta
+    } else if (strcmp(comando, "aiuto") == 0 || strcmp(comando, "help") == 0) {
+        admin_scrivi(r, "sessioni                 elenco delle sessioni aperte\r\n"
+                        "client                   comandi e rallentamenti per indirizzo sorgente\r\n"
+                        "limite [classe ambito al_minuto raffica]  limiti di frequenza per sessione e per ip\r\n"
+                        "coda                     profondita' della coda e delle corsie, esclusiva per documento\r\n"
+                        "stampante                stato, latenza, linea e cache della stampante\r\n"
+                        "drena <id>               chiude la sessione dopo i comandi inoltrati e l'eventuale scontrino\r\n"
+                        "chiudi <id>              chiude la sessione dopo i comandi gia' inoltrati\r\n"
+                        "rele impulso [ms]|on|off controllo del rele\r\n"
+                        "feed                     avanzamento carta (impulso del rele)\r\n"
+                        "log [errori|avvisi|info|debug]  livello dei messaggi in console\r\n"
+                        "cattura [on|off]         cattura del traffico in " CATTURA_FILE_DEFAULT "\r\n"
+                        "exit                     arresto controllato del server\r\n"
+                        "esci                     chiude la connessione di amministrazione\r\n");
+    } else if (strcmp(comando, "sessioni") == 0) {
+        admin_sessioni(r);
+    } else if (strcmp(comando, "client") == 0) {
+        admin_client(r);
+    } else if (strcmp(comando, "limite") == 0) {
+        if (!admin_limite(r, riga)) return TRUE;
+    } else if (strcmp(comando, "coda") == 0) {
+        admin_coda(r);
+    } else if (strcmp(comando, "stampante") == 0) {
+        admin_stampante(r);
+    } else if (strcmp(comando, "drena") == 0 || strcmp(comando, "chiudi") == 0) {
+        ChiusuraSessione chiusura = strcmp(comando, "drena") == 0 ? CHIUSURA_DRENA : CHIUSURA_FORZATA;
+        if (argomento[0] == '\0' || admin_chiudi_sessione(atoi(argomento), chiusura) == 0) {
+            admin_scrivi(r, "ERRORE: sessione '%s' non trovata ('sessioni' per l'elenco).\r\n", argomento);
+            return TRUE;
+        }
+        char log_msg[100];
+        snprintf(log_msg, sizeof(log_msg), "Console di amministrazione: %s della sessione %s.\n", chiusura == CHIUSURA_DRENA ? "drenaggio" : "chiusura", argomento);
+        print_log(log_msg, COLOR_WARNING);
+    } else if (strcmp(comando, "rele") == 0 || strcmp(comando, "feed") == 0) {
+        if (!g_relay_module_enabled) {
+            admin_scrivi(r, "ERRORE: Modulo rele non abilitato o non disponibile.\r\n");
+            return TRUE;
+        }
+        if (strcmp(comando, "feed") == 0) {
+            pulse_relay(200);
+        } else if (strcmp(argomento, "impulso") == 0) {
+            int durata = valore[0] ? atoi(valore) : 200;
+            if (durata <= 0 || durata > 5000) {
+                admin_scrivi(r, "ERRORE: durata dell'impulso tra 1 e 5000 ms.\r\n");
+                return TRUE;
+            }
+            pulse_relay(durata);
+        } else if (strcmp(argomento, "on") == 0) {
+            relay_on();
+        } else if (strcmp(argomento, "off") == 0) {
+            relay_off();
+        } else {
+            admin_scrivi(r, "ERRORE: uso 'rele impulso [ms]', 'rele on' o 'rele off'.\r\n");
+            return TRUE;
+        }
+    } else if (strcmp(comando, "log") == 0) {
+        if (argomento[0] != '\0') {
+            int livello = -1;
+            for (int i = 0; i <= LOG_DEBUG; i++) {
+                if (strcmp(argomento, nomi_livello_log[i]) == 0) livello = i;
+            }
+            if (livello < 0) {
+                admin_scrivi(r, "ERRORE: livello '%s' non valido (errori, avvisi, info, debug).\r\n", argomento);
+                return TRUE;
+            }
+            InterlockedExchange(&livello_log, livello);
+        }
+        admin_scrivi(r, "Livello di log: %s.\r\n", nomi_livello_log[livello_log]);
+    } else if (strcmp(comando, "cattura") == 0) {
+        if (strcmp(argomento, "on") == 0 || strcmp(argomento, "off") == 0) {
+            cattura_abilita(strcmp(argomento, "on") == 0);
+        } else if (argomento[0] != '\0') {
+            admin_scrivi(r, "ERRORE: uso 'cattura on' o 'cattura off'.\r\n");
+            return TRUE;
+        }
+        LONG catturati, scartati, troncati;
+        cattura_statistiche(&catturati, &scartati, &troncati);
+        admin_scrivi(r, "Cattura %s: %ld frame salvati, %ld scartati, %ld troncati.\r\n",
+                     cattura_abilitata() ? "attiva su " CATTURA_FILE_DEFAULT : "disattivata", catturati, scartati, troncati);
+    } else if (strcmp(comando, "exit") == 0) {
+        print_log("Comando di chiusura ricevuto. Arresto del server in corso...\n", COLOR_WARNING);
+        SetEvent(evento_arresto);
+    } else if (strcmp(comando, "esci") == 0) {
+        admin_scrivi(r, "OK\r\n");
+        return FALSE;
+    } else {
+        admin_scrivi(r, "ERRORE: comando '%s' sconosciuto ('aiuto' per l'elenco).\r\n", comando);
+        return TRUE;
+    }
+    admin_scrivi(r, "OK\r\n");
+    return TRUE;
+}
+
+// Serve una connessione di amministrazione: un comando per riga, fino a "esci" o alla chiusura
+static void servi_amministratore(SOCKET s) {
+    static RispostaAdmin risposta; // Una connessione alla volta: il buffer resta fuori dallo stack
+    char buffer[256];
+    int buffer_len = 0;
+    const char* benvenuto = "Console di amministrazione del server stampante. 'aiuto' per l'elenco dei comandi.\r\n";
+    send(s, benvenuto, (int)strlen(benvenuto), 0);
+
+    while (is_running) {
+        WSAPOLLFD attesa = { s, POLLRDNORM, 0 };
+        int pronti = WSAPoll(&attesa, 1, SESSIONE_POLL_MS);
+        if (pronti == 0) continue;
+        if (pronti == SOCKET_ERROR) return;
+        int letti = recv(s, buffer + buffer_len, (int)sizeof(buffer) - 1 - buffer_len, 0);
+        if (letti <= 0) return;
+        buffer_len += letti;
+        buffer[buffer_len] = '\0';
+
+        char* riga = buffer;
+        char* fine;
+        while ((fine = strchr(riga, '\n')) != NULL) {
+            *fine = '\0';
+            riga[strcspn(riga, "\r")] = '\0';
+            risposta.len = 0;
+            BOOL continua = esegui_comando_admin(riga, &risposta);
+            if (risposta.len > 0 && send(s, risposta.testo, risposta.len, 0) == SOCKET_ERROR) return;
+            if (!continua) return;
+            riga = fine + 1;
+        }
+        buffer_len -= (int)(riga - buffer);
+        memmove(buffer, riga, (size_t)buffer_len);
+        if (buffer_len == (int)sizeof(buffer) - 1) buffer_len = 0; // Riga troppo lunga: scartata
+    }
+}
+
+static DWORD WINAPI thread_amministrazione(LPVOID lpParam) {
+    int porta = (int)(INT_PTR)lpParam;
+    char log_msg[128];
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) return 1;
+
+    SOCKET ascolto = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in indirizzo = {0};
+    indirizzo.sin_family = AF_INET;
+    indirizzo.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Solo connessioni locali
+    indirizzo.sin_port = htons((u_short)porta);
+    if (ascolto == INVALID_SOCKET || bind(ascolto, (struct sockaddr*)&indirizzo, sizeof(indirizzo)) == SOCKET_ERROR || listen(ascolto, 1) == SOCKET_ERROR) {
+        snprintf(log_msg, sizeof(log_msg), "Console di amministrazione non disponibile sulla porta %d (errore %d).", porta, WSAGetLastError());
+        print_log(log_msg, COLOR_ERROR);
+        if (ascolto != INVALID_SOCKET) closesocket(ascolto);
+        WSACleanup();
+        return 1;
+    }
+    snprintf(log_msg, sizeof(log_msg), "Console di amministrazione in ascolto su 127.0.0.1 porta %d.\n", porta);
+    print_log(log_msg, COLOR_INFO);
+
+    while (is_running) {
+        WSAPOLLFD attesa = { ascolto, POLLRDNORM, 0 };
+        if (WSAPoll(&attesa, 1, SESSIONE_POLL_MS) <= 0) continue;
+        SOCKET s = accept(ascolto, NULL, NULL);
+        if (s == INVALID_SOCKET) continue;
+        print_log("Connessione alla console di amministrazione.\n", COLOR_INFO);
+        servi_amministratore(s);
+        closesocket(s);
+    }
+    closesocket(ascolto);
+    WSACleanup();
+    return 0;
+}
+
+// Legge i comandi dalla console del server. Senza terminale (stdin chiuso) termina subito.
+static DWORD WINAPI thread_console(LPVOID lpParam) {
+    static RispostaAdmin risposta;
+    char riga[128];
+    while (is_running && fgets(riga, sizeof(riga), stdin) != NULL) {
+        riga[strcspn(riga, "\r\n")] = 0;
+        risposta.len = 0;
+        esegui_comando_admin(riga, &risposta);
+        if (risposta.len > 0) print_colored(risposta.testo, COLOR_STATUS);
+    }
+    return 0;
+}
+
 int main() {
     system("cls"); // Pulisce lo schermo all'avvio
     char choice_buffer[128];
@@ -1074,19 +2447,29 @@ int main() {
             g_relay_module_enabled = FALSE;
             print_log("Modulo rele disabilitato dall'utente.", COLOR_WARNING);
         } else { // Default a 's' (sì)
-            char com_port_buffer[20];
-            print_colored("Inserire la porta COM del rele (default COM9): ", COLOR_INPUT);
+            char com_port_buffer[40];
+            print_colored("Inserire la porta COM del rele, eventualmente con velocita' e formato (default COM9, es. COM9:19200:8N1): ", COLOR_INPUT);
             if (fgets(com_port_buffer, sizeof(com_port_buffer), stdin) != NULL) {
                 com_port_buffer[strcspn(com_port_buffer, "\r\n")] = 0;
                 char final_com_port[20];
+                static const ParametriSeriale rele_predefiniti = { CBR_9600, 8, NOPARITY, ONESTOPBIT, FALSE, FALSE };
+                ParametriSeriale rele_parametri = rele_predefiniti;
                 if (strlen(com_port_buffer) == 0) {
                     strcpy(final_com_port, "COM9");
-                } else {
-                    strcpy(final_com_port, com_port_buffer);
+                } else if (!analizza_linea_seriale(com_port_buffer, &rele_predefiniti, final_com_port, sizeof(final_com_port), &rele_parametri)) {
+                    print_log("Porta COM del rele non valida, uso COM9 a 9600 baud.", COLOR_WARNING);
+                    strcpy(final_com_port, "COM9");
+                    rele_parametri = rele_predefiniti;
+                } else if (rele_parametri.negozia) {
+                    // La negoziazione interroga la stampante: il rele' non risponde alla sonda
+                    print_log("'auto' non e' supportato per il rele, uso la velocita' predefinita di 9600 baud.", COLOR_WARNING);
+                    rele_parametri.negozia = FALSE;
+                    rele_parametri.baud_rate = rele_predefiniti.baud_rate;
                 }
 
                 // La funzione initialize_relay_module ora si chiama relay_init
-                relay_init(final_com_port); // Tenta l'inizializzazione
+                relay_init(final_com_port, rele_parametri.baud_rate, rele_parametri.byte_size, rele_parametri.parity,
+                           rele_parametri.stop_bits, rele_parametri.rts_cts); // Tenta l'inizializzazione
 
                 if (relay_is_ready()) { // Controlla lo stato dopo l'inizializzazione
                     char success_msg[100];
@@ -1125,8 +2508,117 @@ int main() {
             }
         }
     }
-    char msg_port[50];
-    snprintf(msg_port, sizeof(msg_port), "Server ascoltera' sulla porta TCP: %d", g_server_listen_tcp_port);
+    char addr_prompt[160];
+    snprintf(addr_prompt, sizeof(addr_prompt), "Indirizzi di ascolto separati da virgola, IPv4 o IPv6 (default %s = tutte le interfacce): ", INDIRIZZI_ASCOLTO_DEFAULT);
+    print_colored(addr_prompt, COLOR_INPUT);
+    char addr_buffer[sizeof(g_server_listen_addresses)];
+    if (fgets(addr_buffer, sizeof(addr_buffer), stdin) != NULL) {
+        if (strchr(addr_buffer, '\n') == NULL) { // Se l'input è più lungo del buffer, pulisco
+            clear_stdin_buffer();
+        }
+        addr_buffer[strcspn(addr_buffer, "\r\n")] = 0;
+        if (strlen(addr_buffer) > 0) {
+            strcpy(g_server_listen_addresses, addr_buffer);
+        }
+    }
+    print_colored("Porte COM dei client seriali, separate da virgola (vuoto = nessuna): ", COLOR_INPUT);
+    char serial_buffer[sizeof(g_server_listen_serial_ports)];
+    if (fgets(serial_buffer, sizeof(serial_buffer), stdin) != NULL) {
+        if (strchr(serial_buffer, '\n') == NULL) { // Se l'input è più lungo del buffer, pulisco
+            clear_stdin_buffer();
+        }
+        serial_buffer[strcspn(serial_buffer, "\r\n")] = 0;
+        strcpy(g_server_listen_serial_ports, serial_buffer);
+    }
+    // === CONSOLE DI AMMINISTRAZIONE ===
+    char admin_prompt[128];
+    snprintf(admin_prompt, sizeof(admin_prompt), "Porta della console di amministrazione su 127.0.0.1 (0 per disabilitarla) [%d]: ", ADMIN_PORTA_DEFAULT);
+    print_colored(admin_prompt, COLOR_INPUT);
+    if (fgets(choice_buffer, sizeof(choice_buffer), stdin) != NULL) {
+        if (strchr(choice_buffer, '\n') == NULL) { // Se l'input è più lungo del buffer, pulisco
+            clear_stdin_buffer();
+        }
+        choice_buffer[strcspn(choice_buffer, "\r\n")] = 0;
+        if (strlen(choice_buffer) > 0) {
+            int admin_port = atoi(choice_buffer);
+            if (admin_port >= 0 && admin_port <= 65535 && admin_port != g_server_listen_tcp_port) {
+                g_admin_port = admin_port;
+            } else {
+                print_log("Porta della console di amministrazione non valida, uso il default.", COLOR_WARNING);
+            }
+        }
+    }
+    // === CONFIGURAZIONE CACHE COMANDI DI STATO ===
+    print_colored("--- Configurazione Cache Comandi di Stato ---\n", COLOR_SECTION);
+    char cache_buffer[128];
+    char cache_prompt[128];
+    snprintf(cache_prompt, sizeof(cache_prompt), "Comandi da servire in cache, separati da virgola ('n' per disabilitare) [%s]: ", CACHE_COMANDI_DEFAULT);
+    print_colored(cache_prompt, COLOR_INPUT);
+    const char* allowlist_cache = CACHE_COMANDI_DEFAULT;
+    if (fgets(cache_buffer, sizeof(cache_buffer), stdin) != NULL) {
+        if (strchr(cache_buffer, '\n') == NULL) { // Se l'input è più lungo del buffer, pulisco
+            clear_stdin_buffer();
+        }
+        cache_buffer[strcspn(cache_buffer, "\r\n")] = 0;
+        if (strcmp(cache_buffer, "n") == 0 || strcmp(cache_buffer, "N") == 0) {
+            allowlist_cache = "";
+        } else if (strlen(cache_buffer) > 0) {
+            allowlist_cache = cache_buffer;
+        }
+    }
+    cache_init(allowlist_cache, CACHE_TTL_MS);
+
+    // === CONFIGURAZIONE COMANDI LUNGHI ===
+    print_colored("--- Configurazione Comandi Lunghi ---\n", COLOR_SECTION);
+    char comandi_lunghi[128] = "";
+    print_colored("Prefissi dei comandi lunghi (report, chiusure Z, export del giornale), separati da virgola [tutti i comandi non riconosciuti]: ", COLOR_INPUT);
+    if (fgets(comandi_lunghi, sizeof(comandi_lunghi), stdin) != NULL) {
+        if (strchr(comandi_lunghi, '\n') == NULL) { // Se l'input è più lungo del buffer, pulisco
+            clear_stdin_buffer();
+        }
+        comandi_lunghi[strcspn(comandi_lunghi, "\r\n")] = 0;
+    }
+
+    // === CONFIGURAZIONE ESCLUSIVA PER DOCUMENTO ===
+    print_colored("--- Configurazione Esclusiva per Documento ---\n", COLOR_SECTION);
+    DWORD esclusiva_ms = CODA_AFFINITA_TIMEOUT_MS;
+    char esclusiva_buffer[16];
+    char esclusiva_prompt[160];
+    snprintf(esclusiva_prompt, sizeof(esclusiva_prompt), "Secondi di inattivita' del terminale dopo cui gli altri tornano a usare la stampante [%d]: ",
+             CODA_AFFINITA_TIMEOUT_MS / 1000);
+    print_colored(esclusiva_prompt, COLOR_INPUT);
+    if (fgets(esclusiva_buffer, sizeof(esclusiva_buffer), stdin) != NULL) {
+        if (strchr(esclusiva_buffer, '\n') == NULL) { // Se l'input è più lungo del buffer, pulisco
+            clear_stdin_buffer();
+        }
+        esclusiva_buffer[strcspn(esclusiva_buffer, "\r\n")] = 0;
+        if (strlen(esclusiva_buffer) > 0) {
+            long secondi = strtol(esclusiva_buffer, NULL, 10);
+            if (secondi > 0 && secondi <= 3600) {
+                esclusiva_ms = (DWORD)secondi * 1000;
+            } else {
+                print_log("Durata dell'esclusiva non valida, uso il default.", COLOR_WARNING);
+            }
+        }
+    }
+    pool_init(&pool_contesti, sizeof(ContestoClient), 8);
+    pool_init(&pool_buffer, DIM_BUFFER_PACCHETTO, 2 * CODA_MAX_GLOBALE); // Pacchetto e risposta per ogni posto in coda
+    stampante_init(); // Modello condiviso della stampante fisica
+    ripristina_da_giornale();
+    if (!cattura_init(CATTURA_FILE_DEFAULT)) {
+        print_log("File di cattura non disponibile: il comando 'cattura on' non avra' effetto.", COLOR_WARNING);
+    }
+    char msg_cache[200];
+    if (strlen(allowlist_cache) > 0) {
+        snprintf(msg_cache, sizeof(msg_cache), "Cache attiva per: %s (TTL %d ms)\n", allowlist_cache, CACHE_TTL_MS);
+    } else {
+        snprintf(msg_cache, sizeof(msg_cache), "Cache comandi di stato disabilitata.\n");
+    }
+    print_log(msg_cache, COLOR_INFO);
+    print_separator();
+
+    char msg_port[200];
+    snprintf(msg_port, sizeof(msg_port), "Server ascoltera' su %s, porta TCP: %d", g_server_listen_addresses, g_server_listen_tcp_port);
     print_log(msg_port, COLOR_INFO);
     print_separator();
 
@@ -1181,23 +2673,28 @@ int main() {
         print_log(msg_print_tcp, COLOR_INFO);
     } else if (g_printer_connection_mode == MODE_SERIAL) {
         print_log("Connessione stampante: Seriale selezionata.\n", COLOR_INFO);
-        print_colored("Inserisci il nome della porta COM della stampante (es. COM2): ", COLOR_INPUT);
-        if (fgets(g_printer_conn_serial_port_name, sizeof(g_printer_conn_serial_port_name), stdin) != NULL) {
-            if (strchr(g_printer_conn_serial_port_name, '\n') == NULL) { // Se l'input è più lungo del buffer, pulisco
+        print_colored("Inserisci la porta COM della stampante (es. COM2, COM2:115200:8N1:rtscts, COM2:auto): ", COLOR_INPUT);
+        char printer_line_buffer[64];
+        if (fgets(printer_line_buffer, sizeof(printer_line_buffer), stdin) != NULL) {
+            if (strchr(printer_line_buffer, '\n') == NULL) { // Se l'input è più lungo del buffer, pulisco
                 clear_stdin_buffer();
             }
-            g_printer_conn_serial_port_name[strcspn(g_printer_conn_serial_port_name, "\r\n")] = 0;
-            if (strlen(g_printer_conn_serial_port_name) == 0) {
-                print_log("Nome porta COM stampante non valido. Uscita.", COLOR_ERROR);
+            printer_line_buffer[strcspn(printer_line_buffer, "\r\n")] = 0;
+            ParametriSeriale predefiniti = g_printer_serial_params;
+            if (!analizza_linea_seriale(printer_line_buffer, &predefiniti, g_printer_conn_serial_port_name, sizeof(g_printer_conn_serial_port_name), &g_printer_serial_params)) {
+                print_log("Nome o parametri della porta COM stampante non validi. Uscita.", COLOR_ERROR);
                 return 1;
             }
             // Tentativo di aprire e configurare la porta seriale della stampante subito
-            if (!configure_serial_port(g_printer_conn_serial_port_name, &h_printer_comm_port, PRINTER_BAUD_RATE, PRINTER_PARITY, PRINTER_STOP_BITS, PRINTER_BYTE_SIZE, TRUE)) {
+            if (!configure_serial_port(g_printer_conn_serial_port_name, &h_printer_comm_port, &g_printer_serial_params, TRUE)) {
                 print_log("Impossibile configurare la porta seriale per la stampante. Controllare connessione e nome porta. Uscita.", COLOR_ERROR);
                 return 1;
             }
+            if (g_printer_serial_params.negozia) {
+                negozia_velocita_stampante(h_printer_comm_port, &g_printer_serial_params);
+            }
             char msg_print_com[100];
-            snprintf(msg_print_com, sizeof(msg_print_com), "Stampante sara' contattata sulla porta COM: %s", g_printer_conn_serial_port_name);
+            snprintf(msg_print_com, sizeof(msg_print_com), "Stampante sara' contattata sulla porta COM: %s a %lu baud", g_printer_conn_serial_port_name, (unsigned long)g_printer_serial_params.baud_rate);
             print_log(msg_print_com, COLOR_INFO);
         } else {
             print_log("Errore lettura nome porta COM stampante. Uscita.", COLOR_ERROR);
@@ -1207,6 +2704,17 @@ int main() {
         print_log("Scelta modalita' connessione stampante non valida. Uscita.", COLOR_ERROR);
         return 1;
     }
+    // Avvia il thread che serializza i comandi verso la stampante
+    latenza_init(comandi_lunghi);
+    limite_init();
+    if (!coda_init(invia_a_stampante_registrata)) {
+        print_log("Errore nella creazione del thread della coda stampante. Uscita.", COLOR_ERROR);
+        relay_cleanup();
+        return 1;
+    }
+    coda_imposta_inattivita(battito_stampante, STAMPANTE_BATTITO_MS);
+    coda_imposta_affinita(esclusiva_ms);
+
     // Avvia il thread del server
     HANDLE h_server_thread = CreateThread(NULL, 0, server_thread_func, (LPVOID)(INT_PTR)g_server_listen_tcp_port, 0, NULL);
     if (h_server_thread == NULL) {
@@ -1215,51 +2723,126 @@ int main() {
         return 1;
     }
 
+    // Client seriali: una sessione per porta, servita accanto alle connessioni TCP
+    if (strlen(g_server_listen_serial_ports) > 0) {
+        int porte_seriali = start_serial_server(g_server_listen_serial_ports);
+        char msg_seriali[100];
+        snprintf(msg_seriali, sizeof(msg_seriali), "Client seriali: %d porte in servizio.", porte_seriali);
+        print_log(msg_seriali, porte_seriali > 0 ? COLOR_INFO : COLOR_WARNING);
+    }
+
+    // Comandi di gestione: dalla console del server e dalla console di amministrazione
+    evento_arresto = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (g_admin_port > 0) {
+        HANDLE h_admin = CreateThread(NULL, 0, thread_amministrazione, (LPVOID)(INT_PTR)g_admin_port, 0, NULL);
+        if (h_admin != NULL) CloseHandle(h_admin);
+    }
+    HANDLE h_console = CreateThread(NULL, 0, thread_console, NULL, 0, NULL);
+    if (h_console != NULL) CloseHandle(h_console); // Resta bloccato in lettura fino all'uscita del processo
+
     print_separator();
-    print_log("Server in esecuzione. Digita 'exit' e premi Invio per chiudere.", COLOR_HIGHLIGHT);
+    print_log("Server in esecuzione. Digita 'exit' e premi Invio per chiudere, 'aiuto' per l'elenco dei comandi.", COLOR_HIGHLIGHT);
     print_separator();
 
-    // Loop per attendere il comando 'exit' dalla console
-    char exit_cmd[10];
-    while (is_running) {
-        if (fgets(exit_cmd, sizeof(exit_cmd), stdin) != NULL) {
-            // Rimuove il newline dal comando letto
-            exit_cmd[strcspn(exit_cmd, "\r\n")] = 0;
-
-            if (strcmp(exit_cmd, "exit") == 0) {
-                is_running = FALSE;
-                print_log("Comando di chiusura ricevuto. Arresto del server in corso...\n", COLOR_WARNING);
-                if (listen_socket != INVALID_SOCKET) {
-                    closesocket(listen_socket);
-                    listen_socket = INVALID_SOCKET;
-                }
-            } else if (strcmp(exit_cmd, "feed") == 0) {
-                if (g_relay_module_enabled) {
-                    print_log("Comando 'feed' da console: attivo rele per avanzamento carta.", COLOR_INFO);
-                    pulse_relay(200);
-                } else {
-                    print_log("Comando 'feed' non eseguibile: modulo rele non abilitato o non disponibile.", COLOR_ERROR);
-                }
-            }
-        }
-    }
+    // Attende il comando 'exit' dalla console o dalla console di amministrazione
+    WaitForSingleObject(evento_arresto, INFINITE);
+    is_running = FALSE;
+    chiudi_socket_ascolto();
 
-    // Attendi la terminazione del thread del server
+    // Attendi la terminazione del thread del server, poi lascia terminare le sessioni
     WaitForSingleObject(h_server_thread, INFINITE);
     CloseHandle(h_server_thread);
+    BOOL sessioni_terminate = drena_sessioni();
+
+    // Completa i comandi gia' accodati prima di chiudere la connessione con la stampante
+    coda_cleanup();
+    chiudi_connessione_stampante();
+    giornale_cleanup();
+    LONG cattura_catturati, cattura_scartati, cattura_troncati;
+    cattura_statistiche(&cattura_catturati, &cattura_scartati, &cattura_troncati);
+    cattura_cleanup();
+    LONG giornale_record, giornale_flush, giornale_rotazioni;
+    giornale_statistiche(&giornale_record, &giornale_flush, &giornale_rotazioni);
+    LONG coda_in_corso, coda_eseguite, coda_respinte;
+    coda_statistiche(&coda_in_corso, &coda_eseguite, &coda_respinte);
+    char msg_stat_coda[200];
+    snprintf(msg_stat_coda, sizeof(msg_stat_coda), "Coda stampante: %ld comandi eseguiti, %ld respinti per coda piena.\n", coda_eseguite, coda_respinte);
+    print_log(msg_stat_coda, COLOR_INFO);
+    snprintf(msg_stat_coda, sizeof(msg_stat_coda), "Giornale: %ld record in %ld sincronizzazioni su disco, %ld rotazioni.\n", giornale_record, giornale_flush, giornale_rotazioni);
+    print_log(msg_stat_coda, COLOR_INFO);
+    snprintf(msg_stat_coda, sizeof(msg_stat_coda), "Cattura: %ld frame salvati, %ld scartati per buffer pieno, %ld troncati.\n", cattura_catturati, cattura_scartati, cattura_troncati);
+    print_log(msg_stat_coda, COLOR_INFO);
+    LONG affinita_concesse, affinita_scadute, affinita_media, affinita_max;
+    coda_statistiche_affinita(&affinita_concesse, &affinita_scadute, &affinita_media, &affinita_max);
+    snprintf(msg_stat_coda, sizeof(msg_stat_coda), "Esclusiva documento: %ld concesse (%ld scadute per inattivita'), durata media %ld ms, massima %ld ms.\n",
+             affinita_concesse, affinita_scadute, affinita_media, affinita_max);
+    print_log(msg_stat_coda, COLOR_INFO);
+    snprintf(msg_stat_coda, sizeof(msg_stat_coda), "Uscita client: %ld risposte inviate con %ld scritture.\n", cont_risposte_client, cont_invii_client);
+    print_log(msg_stat_coda, COLOR_INFO);
+    LONG pool_blocchi, pool_in_uso, pool_prese;
+    pool_statistiche(&pool_contesti, &pool_blocchi, &pool_in_uso, &pool_prese);
+    snprintf(msg_stat_coda, sizeof(msg_stat_coda), "Pool contesti: %ld sessioni servite con %ld blocchi allocati.\n", pool_prese, pool_blocchi);
+    print_log(msg_stat_coda, COLOR_INFO);
+    pool_statistiche(&pool_buffer, &pool_blocchi, &pool_in_uso, &pool_prese);
+    snprintf(msg_stat_coda, sizeof(msg_stat_coda), "Pool buffer pacchetti: %ld prese con %ld blocchi allocati.\n", pool_prese, pool_blocchi);
+    print_log(msg_stat_coda, COLOR_INFO);
+    for (int i = 0; i < CODA_NUM_CORSIE; i++) {
+        LONG corsia_eseguite, corsia_attesa_media, corsia_attesa_max;
+        coda_statistiche_corsia((CorsiaStampante)i, &corsia_eseguite, &corsia_attesa_media, &corsia_attesa_max);
+        snprintf(msg_stat_coda, sizeof(msg_stat_coda), "  Corsia %-14s: %ld comandi, attesa media %ld ms, massima %ld ms.\n",
+                 coda_nome_corsia((CorsiaStampante)i), corsia_eseguite, corsia_attesa_media, corsia_attesa_max);
+        print_log(msg_stat_coda, COLOR_INFO);
+    }
+
+    for (int i = 0; i < LATENZA_NUM_CLASSI; i++) {
+        StatisticheLatenza latenza;
+        latenza_statistiche((ClasseLatenza)i, &latenza);
+        if (latenza.campioni == 0 && latenza.scadute == 0) continue;
+        snprintf(msg_stat_coda, sizeof(msg_stat_coda), "Latenza stampante %-14s: %ld risposte, media %lu ms, p50 %lu ms, p99 %lu ms, %ld scadute, scadenza attuale %lu ms.\n",
+                 latenza_nome_classe((ClasseLatenza)i), latenza.campioni, (unsigned long)latenza.media_ms, (unsigned long)latenza.p50_ms,
+                 (unsigned long)latenza.p99_ms, latenza.scadute, (unsigned long)latenza.scadenza_ms);
+        print_log(msg_stat_coda, COLOR_INFO);
+    }
+
+    if (g_printer_connection_mode == MODE_TCP_IP) {
+        snprintf(msg_stat_coda, sizeof(msg_stat_coda), "Stampante TCP: %ld connessioni aperte, %ld battiti di inattivita', %ld byte in ritardo scartati.\n",
+                 cont_connessioni_stampante, cont_battiti_stampante, cont_risposte_scartate);
+        print_log(msg_stat_coda, COLOR_INFO);
+    }
 
     // Pulizia finale se la stampante era seriale e la porta è aperta
+    if (g_printer_connection_mode == MODE_SERIAL) {
+        snprintf(msg_stat_coda, sizeof(msg_stat_coda), "Stampante seriale: %ld NAK, %ld ritrasmissioni di interrogazioni, %ld risposte in ritardo scartate.\n",
+                 cont_nak_stampante, cont_ritrasmissioni_stampante, cont_risposte_scartate);
+        print_log(msg_stat_coda, COLOR_INFO);
+        char nome_linea[40];
+        snprintf(nome_linea, sizeof(nome_linea), "stampante %s", g_printer_conn_serial_port_name);
+        log_statistiche_linea(nome_linea, &g_printer_serial_params, &linea_stampante);
+    }
     if (g_printer_connection_mode == MODE_SERIAL && h_printer_comm_port != INVALID_HANDLE_VALUE) {
         close_serial_port_handle(&h_printer_comm_port);
     }
 
+    // Statistiche e pulizia della cache
+    LONG cache_hit, cache_miss, cache_coalescenti;
+    cache_statistiche(&cache_hit, &cache_miss, &cache_coalescenti);
+    char msg_stat_cache[150];
+    snprintf(msg_stat_cache, sizeof(msg_stat_cache), "Cache: %ld hit, %ld richieste accodate, %ld inviate alla stampante.\n", cache_hit, cache_coalescenti, cache_miss);
+    print_log(msg_stat_cache, COLOR_INFO);
+    cache_cleanup();
+
     // Pulizia del modulo relè
     print_log("Pulizia modulo rele...", COLOR_INFO);
     relay_cleanup();
 
+    // I pool si liberano solo se nessun thread client li sta ancora usando
+    if (sessioni_terminate) {
+        pool_cleanup(&pool_contesti);
+        pool_cleanup(&pool_buffer);
+    }
+
     print_log("Server principale terminato.", COLOR_INFO);
-    
-    system("cls"); // Pulisce lo schermo prima di uscire
+    fflush(stdout); // Il riepilogo dell'arresto resta a schermo
     return 0;
 }
 
@@ -1267,7 +2850,7 @@ int main() {
 // =========================
 // === FUNZIONI HELPER SERIALI ===
 // =========================
-BOOL configure_serial_port(const char* port_name, HANDLE* hSerial, int baud_rate, BYTE parity, BYTE stop_bits, BYTE byte_size, BOOL for_printer_comm) {
+BOOL configure_serial_port(const char* port_name, HANDLE* hSerial, const ParametriSeriale* parametri, BOOL for_printer_comm) {
     char full_port_name[30];
     // Per porte COM1-COM9, il nome è "COMx". Per COM10 e oltre, è "\\\\.\\COMxx"
     if (strlen(port_name) > 4 && (strncmp(port_name, "COM", 3) == 0 && atoi(port_name + 3) >= 10)) {
@@ -1301,16 +2884,18 @@ BOOL configure_serial_port(const char* port_name, HANDLE* hSerial, int baud_rate
         return FALSE;
     }
 
-    dcbSerialParams.BaudRate = baud_rate;
-    dcbSerialParams.ByteSize = byte_size;
-    dcbSerialParams.StopBits = stop_bits;
-    dcbSerialParams.Parity   = parity;
+    dcbSerialParams.BaudRate = parametri->baud_rate;
+    dcbSerialParams.ByteSize = parametri->byte_size;
+    dcbSerialParams.StopBits = parametri->stop_bits;
+    dcbSerialParams.Parity   = parametri->parity;
     dcbSerialParams.fBinary = TRUE;
-    dcbSerialParams.fParity = (parity == NOPARITY) ? FALSE : TRUE;
-    dcbSerialParams.fOutxCtsFlow = FALSE;
+    dcbSerialParams.fParity = (parametri->parity == NOPARITY) ? FALSE : TRUE;
+    // Con RTS/CTS la trasmissione si sospende quando l'altro lato toglie CTS, e il driver
+    // toglie RTS quando il proprio buffer di ricezione si riempie: nessun byte perso ad alta velocita'
+    dcbSerialParams.fOutxCtsFlow = parametri->rts_cts;
     dcbSerialParams.fOutxDsrFlow = FALSE;
     dcbSerialParams.fDtrControl = DTR_CONTROL_ENABLE;
-    dcbSerialParams.fRtsControl = RTS_CONTROL_ENABLE;
+    dcbSerialParams.fRtsControl = parametri->rts_cts ? RTS_CONTROL_HANDSHAKE : RTS_CONTROL_ENABLE;
     dcbSerialParams.fOutX = FALSE;
     dcbSerialParams.fInX = FALSE;
     dcbSerialParams.fErrorChar = FALSE;
@@ -1324,13 +2909,14 @@ BOOL configure_serial_port(const char* port_name, HANDLE* hSerial, int baud_rate
     }
 
     COMMTIMEOUTS timeouts = {0};
-    // Per la stampante (comunicazione sincrona), timeout più brevi potrebbero andare bene.
-    // Per i client seriali (se si usa I/O sincrona nel gestore), timeout più lunghi o gestione attenta.
-    timeouts.ReadIntervalTimeout         = 100;   // Max time between arrival of two bytes (ms)
-    timeouts.ReadTotalTimeoutConstant    = for_printer_comm ? 5000 : 500; // Total timeout for read (ms)
-    timeouts.ReadTotalTimeoutMultiplier  = 10;    // Multiplier for read timeout (ms)
-    timeouts.WriteTotalTimeoutConstant   = for_printer_comm ? 2000 : 500; // Total timeout for write (ms)
-    timeouts.WriteTotalTimeoutMultiplier = 10;    // Multiplier for write timeout (ms)
+    // Le letture ritornano appena c'e' almeno un byte; l'attesa massima viene ridefinita per ogni
+    // risposta della stampante (scadenza della classe del comando) e dal gestore dei client seriali.
+    // Le scritture hanno il tempo di trasmissione alla velocita' della linea piu' un margine.
+    timeouts.ReadIntervalTimeout         = MAXDWORD;
+    timeouts.ReadTotalTimeoutMultiplier  = MAXDWORD;
+    timeouts.ReadTotalTimeoutConstant    = SERIALE_ATTESA_LETTURA_MS;
+    timeouts.WriteTotalTimeoutMultiplier = ms_per_byte(parametri);
+    timeouts.WriteTotalTimeoutConstant   = SERIALE_MARGINE_SCRITTURA_MS;
 
     if (!SetCommTimeouts(*hSerial, &timeouts)) {
         print_log("Errore SetCommTimeouts", COLOR_ERROR);
@@ -1340,15 +2926,118 @@ BOOL configure_serial_port(const char* port_name, HANDLE* hSerial, int baud_rate
 
     PurgeComm(*hSerial, PURGE_RXCLEAR | PURGE_TXCLEAR); // Pulisce i buffer della porta
 
+    BYTE parity = parametri->parity;
+    BYTE stop_bits = parametri->stop_bits;
     char msg_cfg[150];
-    snprintf(msg_cfg, sizeof(msg_cfg), "Porta %s configurata: %d baud, %d data bit, %s parita', %s stop bit.\n", 
-        port_name, baud_rate, byte_size, 
+    snprintf(msg_cfg, sizeof(msg_cfg), "Porta %s configurata: %lu baud, %d data bit, %s parita', %s stop bit%s.\n", 
+        port_name, (unsigned long)parametri->baud_rate, parametri->byte_size, 
         (parity==NOPARITY?"nessuna":(parity==ODDPARITY?"dispari":(parity==EVENPARITY?"pari":"marcata/spazio"))),
-        (stop_bits==ONESTOPBIT?"1":(stop_bits==ONE5STOPBITS?"1.5":"2")));
+        (stop_bits==ONESTOPBIT?"1":(stop_bits==ONE5STOPBITS?"1.5":"2")),
+        parametri->rts_cts ? ", controllo di flusso RTS/CTS" : "");
     print_log(msg_cfg, COLOR_SUCCESS);
     return TRUE;
 }
 
+// Interpreta una specifica "PORTA[:baud|auto][:formato][:rtscts]" (es. "COM2:115200:8N1:rtscts").
+// Il formato e' data bit (5-8), parita' (N, E, O, M, S) e stop bit (1 o 2); i campi assenti
+// prendono il valore da predefiniti. Ritorna FALSE se un campo non e' valido.
+BOOL analizza_linea_seriale(const char* specifica, const ParametriSeriale* predefiniti, char* porta, size_t dim_porta, ParametriSeriale* parametri) {
+    *parametri = *predefiniti;
+    size_t porta_len = strcspn(specifica, ":");
+    if (porta_len == 0 || porta_len >= dim_porta) return FALSE;
+    memcpy(porta, specifica, porta_len);
+    porta[porta_len] = '\0';
+
+    const char* campo = specifica + porta_len;
+    while (*campo == ':') {
+        campo++;
+        size_t campo_len = strcspn(campo, ":");
+        if (campo_len == 0) return FALSE;
+
+        if (campo_len == 4 && _strnicmp(campo, "auto", 4) == 0) {
+            parametri->negozia = TRUE;
+        } else if (campo_len == 6 && _strnicmp(campo, "rtscts", 6) == 0) {
+            parametri->rts_cts = TRUE;
+        } else if (strspn(campo, "0123456789") == campo_len) {
+            long baud = strtol(campo, NULL, 10);
+            if (baud < 110 || baud > 921600) return FALSE;
+            parametri->baud_rate = (DWORD)baud;
+        } else if (campo_len == 3 && campo[0] >= '5' && campo[0] <= '8' && (campo[2] == '1' || campo[2] == '2')) {
+            switch (toupper((unsigned char)campo[1])) {
+                case 'N': parametri->parity = NOPARITY; break;
+                case 'E': parametri->parity = EVENPARITY; break;
+                case 'O': parametri->parity = ODDPARITY; break;
+                case 'M': parametri->parity = MARKPARITY; break;
+                case 'S': parametri->parity = SPACEPARITY; break;
+                default: return FALSE;
+            }
+            parametri->byte_size = (BYTE)(campo[0] - '0');
+            parametri->stop_bits = campo[2] == '1' ? ONESTOPBIT : TWOSTOPBITS;
+        } else {
+            return FALSE;
+        }
+        campo += campo_len;
+    }
+    return TRUE;
+}
+
+// Cerca la velocita' piu' alta a cui la stampante risponde: a ogni velocita' invia una
+// richiesta di stato e attende entro SONDA_VELOCITA_TIMEOUT_MS un pacchetto valido (CHK
+// compreso), perche' a velocita' sbagliata arrivano solo byte senza senso. La velocita' della stampante si imposta sul suo
+// pannello: qui la si rileva soltanto. Se nessuna risponde si resta su quella configurata.
+BOOL negozia_velocita_stampante(HANDLE hComm, ParametriSeriale* parametri) {
+    static const DWORD velocita[] = { 115200, 57600, 38400, 19200, 9600 };
+    DWORD configurata = parametri->baud_rate;
+    char sonda[PACCHETTO_CORNICE + 3];
+    VistaPacchetto richiesta = pacchetto_costruisci(ADDS_SERVER, "<?s", 3, sonda, sizeof(sonda));
+    char log_msg[150];
+
+    COMMTIMEOUTS originali, sonda_timeouts = {0};
+    GetCommTimeouts(hComm, &originali);
+    sonda_timeouts.WriteTotalTimeoutConstant = SONDA_VELOCITA_TIMEOUT_MS;
+    SetCommTimeouts(hComm, &sonda_timeouts);
+
+    BOOL trovata = FALSE;
+    for (size_t i = 0; i < sizeof(velocita) / sizeof(velocita[0]) && !trovata; i++) {
+        DCB dcb = {0};
+        dcb.DCBlength = sizeof(dcb);
+        if (!GetCommState(hComm, &dcb)) break;
+        dcb.BaudRate = velocita[i];
+        if (!SetCommState(hComm, &dcb)) continue; // Velocita' non supportata dalla porta
+        PurgeComm(hComm, PURGE_RXCLEAR | PURGE_TXCLEAR);
+
+        if (write_to_serial_port(hComm, richiesta.byte, richiesta.lunghezza) != richiesta.lunghezza) continue;
+        // La risposta puo' arrivare in piu' letture: si raccoglie fino all'ETX, come per i comandi,
+        // e si valida solo il tratto da STX a ETX (senza gli ACK che lo precedono)
+        char risposta[256];
+        int letti = 0;
+        EsitoLettura esito = leggi_risposta_seriale(hComm, risposta, sizeof(risposta), SONDA_VELOCITA_TIMEOUT_MS,
+                                                    richiesta.byte[richiesta.lunghezza - 4], &letti);
+        if (esito == LETTURA_COMPLETA && pacchetto_valido(risposta, letti)) {
+            parametri->baud_rate = velocita[i];
+            trovata = TRUE;
+        }
+    }
+
+    if (!trovata) {
+        parametri->baud_rate = configurata;
+        DCB dcb = {0};
+        dcb.DCBlength = sizeof(dcb);
+        if (GetCommState(hComm, &dcb)) {
+            dcb.BaudRate = configurata;
+            SetCommState(hComm, &dcb);
+        }
+        snprintf(log_msg, sizeof(log_msg), "Negoziazione velocita': nessuna risposta valida dalla stampante, resta %lu baud.", (unsigned long)configurata);
+        print_log(log_msg, COLOR_WARNING);
+    } else {
+        snprintf(log_msg, sizeof(log_msg), "Negoziazione velocita': la stampante risponde a %lu baud.", (unsigned long)parametri->baud_rate);
+        print_log(log_msg, COLOR_SUCCESS);
+    }
+    SetCommTimeouts(hComm, &originali);
+    PurgeComm(hComm, PURGE_RXCLEAR | PURGE_TXCLEAR);
+    return trovata;
+}
+
 void close_serial_port_handle(HANDLE* hComm) {
     if (hComm && *hComm != INVALID_HANDLE_VALUE) {
         CloseHandle(*hComm);
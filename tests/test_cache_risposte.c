@@ -0,0 +1,131 @@
+/*
+ * File: test_cache_risposte.c
+ * Descrizione: Test di cache_risposte.c: allowlist, pubblicazione delle sole risposte valide,
+ *              generazione della cache contro le risposte arrivate dopo un'invalidazione, TTL,
+ *              attesa limitata della richiesta in volo.
+ */
+
+#include <string.h>
+#include <windows.h>
+#include "../cache_risposte.h"
+#include "../pacchetto.h"
+#include "verifica.h"
+
+static char risposta[CACHE_MAX_RISPOSTA];
+static int risposta_len;
+
+static EsitoCache acquisisci(const char* comando) {
+    return cache_acquisisci(comando, (int)strlen(comando), risposta, sizeof(risposta), &risposta_len, 100);
+}
+
+static void pubblica(const char* comando, const char* dati, int dati_len) {
+    cache_pubblica(comando, (int)strlen(comando), dati, dati_len);
+}
+
+static void test_allowlist(void) {
+    cache_init(" <?s , <?d,", 1000);
+    VERIFICA(cache_comando_cacheabile("<?s", 3));
+    VERIFICA(cache_comando_cacheabile("<?d", 3));
+    VERIFICA(!cache_comando_cacheabile("<?", 2));
+    VERIFICA(acquisisci("=R1/$100") == CACHE_NON_CACHEABILE);
+
+    cache_init("", 1000);
+    VERIFICA(acquisisci("<?s") == CACHE_NON_CACHEABILE);
+}
+
+static void test_pubblicazione(void) {
+    char pacchetto[64];
+    int len = pacchetto_costruisci("07", "S|REG|0", 7, pacchetto, sizeof(pacchetto)).lunghezza;
+    char con_ack[64];
+    con_ack[0] = PACCHETTO_ACK;
+    memcpy(con_ack + 1, pacchetto, (size_t)len);
+    char errore[64];
+    int errore_len = pacchetto_costruisci("07", "E|G|0001", 8, errore, sizeof(errore)).lunghezza;
+
+    cache_init("<?s", 1000);
+    VERIFICA(acquisisci("<?s") == CACHE_LEADER);
+    pubblica("<?s", pacchetto, len - 1);                    // Risposta parziale (lettura scaduta)
+    VERIFICA(acquisisci("<?s") == CACHE_LEADER);
+    pubblica("<?s", errore, errore_len);                    // Risposta di errore
+    VERIFICA(acquisisci("<?s") == CACHE_LEADER);
+    char corrotto[64];
+    memcpy(corrotto, pacchetto, (size_t)len);
+    corrotto[8] ^= 0x01;                                    // CHK non piu' corretto
+    pubblica("<?s", corrotto, len);
+    VERIFICA(acquisisci("<?s") == CACHE_LEADER);
+    pubblica("<?s", NULL, -1);                              // Stampante non raggiungibile
+    VERIFICA(acquisisci("<?s") == CACHE_LEADER);
+
+    // Una risposta valida preceduta da ACK viene memorizzata senza l'ACK
+    pubblica("<?s", con_ack, len + 1);
+    VERIFICA(acquisisci("<?s") == CACHE_HIT);
+    VERIFICA(risposta_len == len && memcmp(risposta, pacchetto, (size_t)len) == 0);
+
+    // Buffer del chiamante troppo piccolo: non e' un hit
+    char piccolo[4];
+    int piccolo_len;
+    VERIFICA(cache_acquisisci("<?s", 3, piccolo, sizeof(piccolo), &piccolo_len, 100) == CACHE_LEADER);
+}
+
+// Una risposta chiesta prima di un'invalidazione descrive uno stato forse superato
+static void test_generazione(void) {
+    char pacchetto[64];
+    int len = pacchetto_costruisci("07", "S|REG|0", 7, pacchetto, sizeof(pacchetto)).lunghezza;
+
+    cache_init("<?s,<?d", 1000);
+    VERIFICA(acquisisci("<?s") == CACHE_LEADER);
+    cache_invalida();
+    pubblica("<?s", pacchetto, len);
+    VERIFICA(acquisisci("<?s") == CACHE_LEADER);
+    pubblica("<?s", pacchetto, len);                        // Richiesta partita dopo l'invalidazione
+    VERIFICA(acquisisci("<?s") == CACHE_HIT);
+
+    // L'invalidazione svuota le voci valide
+    VERIFICA(acquisisci("<?d") == CACHE_LEADER);
+    pubblica("<?d", pacchetto, len);
+    cache_invalida();
+    VERIFICA(acquisisci("<?s") == CACHE_LEADER);
+    VERIFICA(acquisisci("<?d") == CACHE_LEADER);
+
+    LONG hit, miss, coalescenti;
+    cache_statistiche(&hit, &miss, &coalescenti);
+    VERIFICA(hit >= 1 && miss >= 4 && coalescenti == 0);
+}
+
+static void test_scadenza(void) {
+    char pacchetto[64];
+    int len = pacchetto_costruisci("07", "S|REG|0", 7, pacchetto, sizeof(pacchetto)).lunghezza;
+
+    cache_init("<?s", 100);
+    VERIFICA(acquisisci("<?s") == CACHE_LEADER);
+    pubblica("<?s", pacchetto, len);
+    VERIFICA(acquisisci("<?s") == CACHE_HIT);
+    Sleep(200);
+    VERIFICA(acquisisci("<?s") == CACHE_LEADER);
+}
+
+static void test_attesa_limitata(void) {
+    char pacchetto[64];
+    int len = pacchetto_costruisci("07", "S|REG|0", 7, pacchetto, sizeof(pacchetto)).lunghezza;
+
+    // Con il leader ancora in volo l'attesa scade e il chiamante va alla stampante senza sostituirlo
+    cache_init("<?s", 1000);
+    VERIFICA(acquisisci("<?s") == CACHE_LEADER);
+    DWORD inizio = GetTickCount();
+    VERIFICA(acquisisci("<?s") == CACHE_NON_CACHEABILE);
+    VERIFICA(GetTickCount() - inizio >= 90);
+
+    // La risposta del leader viene comunque memorizzata
+    pubblica("<?s", pacchetto, len);
+    VERIFICA(acquisisci("<?s") == CACHE_HIT);
+}
+
+int main(void) {
+    test_allowlist();
+    test_pubblicazione();
+    test_generazione();
+    test_scadenza();
+    test_attesa_limitata();
+    cache_cleanup();
+    return verifica_esito("test_cache_risposte");
+}
@@ -0,0 +1,230 @@
+/*
+ * File: test_comandi.c
+ * Descrizione: Test del motore dei comandi di comandi.c: analisi tramite le tabelle di
+ *              dispatch, validazione sulla sequenza del documento e aggiornamento dello stato.
+ */
+
+#include <string.h>
+#include <windows.h>
+#include "../comandi.h"
+#include "../pacchetto.h"
+#include "verifica.h"
+
+static const char* analizza(const char* comando, ComandoStampante* cmd) {
+    return comando_analizza(comando, (int)strlen(comando), cmd);
+}
+
+static void test_analisi(void) {
+    ComandoStampante cmd;
+    VERIFICA(analizza("=R12/$1500(caffe')", &cmd) == NULL);
+    VERIFICA(cmd.codice == CMD_REGISTRA && cmd.reparto == 12 && cmd.importo == 1500);
+    VERIFICA(strcmp(cmd.testo, "caffe'") == 0);
+    VERIFICA(analizza("=R1/$250", &cmd) == NULL && cmd.testo[0] == '\0');
+    VERIFICA(analizza("=R/$250", &cmd) != NULL);            // Reparto mancante
+    VERIFICA(analizza("=R1$250", &cmd) != NULL);            // Separatore mancante
+    VERIFICA(analizza("=R1/$", &cmd) != NULL);              // Importo mancante
+    VERIFICA(analizza("=R1/$1234567890", &cmd) != NULL);    // Oltre 9 cifre
+    VERIFICA(analizza("=R1/$250(nota", &cmd) != NULL);      // Parentesi non chiusa
+
+    VERIFICA(analizza("=C1", &cmd) == NULL && cmd.codice == CMD_CHIAVE && cmd.chiave == 1);
+    VERIFICA(analizza("=C6", &cmd) != NULL);
+    VERIFICA(analizza("=C10", &cmd) != NULL);               // Una sola cifra di chiave
+    VERIFICA(analizza("=T2", &cmd) == NULL && cmd.codice == CMD_TOTALE && cmd.pagamento == 2);
+    VERIFICA(analizza("=T4", &cmd) != NULL);
+    VERIFICA(analizza("=\"/Punti 120", &cmd) == NULL && cmd.codice == CMD_FIDELITY);
+    VERIFICA(strcmp(cmd.testo, "Punti 120") == 0);
+    VERIFICA(analizza("=K", &cmd) == NULL && cmd.codice == CMD_CLEAR);
+    VERIFICA(analizza("=Kx", &cmd) != NULL);                // Argomenti non previsti
+    VERIFICA(analizza("<?s", &cmd) == NULL && cmd.codice == CMD_RICHIESTA_STATO);
+    VERIFICA(analizza("<?d", &cmd) == NULL && cmd.codice == CMD_RICHIESTA_DATA);
+
+    // Comandi non gestiti localmente: nessun errore, inoltrati cosi' come sono
+    VERIFICA(analizza("=X/1", &cmd) == NULL && cmd.codice == CMD_SCONOSCIUTO);
+    VERIFICA(analizza("<?z", &cmd) == NULL && cmd.codice == CMD_SCONOSCIUTO);
+    VERIFICA(analizza("FEED", &cmd) == NULL && cmd.codice == CMD_SCONOSCIUTO);
+    VERIFICA(comando_analizza("", 0, &cmd) == NULL && cmd.codice == CMD_SCONOSCIUTO);
+    VERIFICA(analizza("=\xC3", &cmd) == NULL && cmd.codice == CMD_SCONOSCIUTO);
+}
+
+// Applica un comando analizzato senza errori
+static void applica(StatoStampante* stato, const char* comando) {
+    ComandoStampante cmd;
+    VERIFICA(analizza(comando, &cmd) == NULL);
+    VERIFICA(comando_valida(stato, &cmd) == NULL);
+    comando_applica(stato, &cmd);
+}
+
+static const char* valida(const StatoStampante* stato, const char* comando) {
+    ComandoStampante cmd;
+    if (analizza(comando, &cmd) != NULL) return "sintassi";
+    return comando_valida(stato, &cmd);
+}
+
+static void test_sequenza_documento(void) {
+    StatoStampante stato;
+    memset(&stato, 0, sizeof(stato));
+    stato.chiave = CHIAVE_SCONOSCIUTA;
+
+    // Senza documento aperto
+    VERIFICA(strcmp(valida(&stato, "=T1"), "E05") == 0);
+    VERIFICA(strcmp(valida(&stato, "=S"), "E20") == 0);
+    VERIFICA(strcmp(valida(&stato, "=a"), "E20") == 0);
+    VERIFICA(strcmp(valida(&stato, "=R0/$100"), "E08") == 0);
+    VERIFICA(strcmp(valida(&stato, "=R1/$0"), "E24") == 0);
+
+    applica(&stato, "=C1");
+    applica(&stato, "=R1/$150");
+    applica(&stato, "=R2/$200");
+    VERIFICA(stato.documento_aperto == 1 && stato.righe_documento == 2 && stato.totale == 350);
+    VERIFICA(strcmp(valida(&stato, "=C2"), "E20") == 0);   // Cambio chiave a documento aperto
+    VERIFICA(strcmp(valida(&stato, "=R1/$99999999"), "E41") == 0);
+
+    applica(&stato, "=a");
+    VERIFICA(stato.totale == 150 && stato.ultimo_importo == 0);
+    VERIFICA(strcmp(valida(&stato, "=a"), "E20") == 0);    // Doppio storno
+
+    applica(&stato, "=S");
+    applica(&stato, "=T1");
+    VERIFICA(stato.documento_aperto == 0 && stato.totale == 0 && stato.righe_documento == 0);
+
+    // Registrazione fuori dalla chiave REG o con il lock attivo
+    applica(&stato, "=C3");
+    VERIFICA(strcmp(valida(&stato, "=R1/$100"), "E21") == 0);
+    applica(&stato, "=C1");
+    applica(&stato, "=C0");
+    VERIFICA(stato.lock == 1);
+    VERIFICA(strcmp(valida(&stato, "=R1/$100"), "E21") == 0);
+}
+
+// Lo stato condiviso cambia versione solo con i comandi che hanno un effetto
+static void test_stato_condiviso(void) {
+    stampante_init();
+    StatoStampante copia;
+    stampante_snapshot(&copia);
+    VERIFICA(copia.chiave == CHIAVE_SCONOSCIUTA && copia.versione == 0);
+
+    ComandoStampante cmd;
+    analizza("<?s", &cmd);
+    stampante_applica(&cmd);
+    stampante_snapshot(&copia);
+    VERIFICA(copia.versione == 0);
+
+    analizza("=R5/$300", &cmd);
+    VERIFICA(stampante_valida(&cmd) == NULL);
+    stampante_applica(&cmd);
+    stampante_snapshot(&copia);
+    VERIFICA(copia.versione == 1 && copia.totale == 300 && copia.ultimo_reparto == 5);
+}
+
+// Comando di documento inviato dalla sessione indicata
+static ComandoStampante di_sessione(const char* comando, int session_id) {
+    ComandoStampante cmd;
+    VERIFICA(analizza(comando, &cmd) == NULL);
+    cmd.session_id = session_id;
+    return cmd;
+}
+
+static void test_documento_di_sessione(void) {
+    stampante_init();
+    ComandoStampante cmd = di_sessione("=R1/$100", 1);
+    VERIFICA(stampante_valida(&cmd) == NULL);
+    stampante_applica(&cmd);
+    StatoStampante copia;
+    stampante_snapshot(&copia);
+    VERIFICA(copia.documento_aperto == 1 && copia.sessione_documento == 1);
+
+    // Un altro terminale non entra nello scontrino aperto, anche a esclusiva scaduta
+    cmd = di_sessione("=R1/$100", 2);
+    VERIFICA(comando_documento_altrui(&copia, &cmd));
+    VERIFICA(stampante_valida(&cmd) != NULL && strcmp(stampante_valida(&cmd), "E20") == 0);
+    cmd = di_sessione("=k", 2);
+    VERIFICA(stampante_valida(&cmd) != NULL && strcmp(stampante_valida(&cmd), "E20") == 0);
+    cmd = di_sessione("<?s", 2);
+    VERIFICA(stampante_valida(&cmd) == NULL);
+    cmd = di_sessione("=R1/$100", SESSIONE_NESSUNA);
+    VERIFICA(stampante_valida(&cmd) == NULL);
+    cmd = di_sessione("=S", 1);
+    VERIFICA(stampante_valida(&cmd) == NULL);
+
+    // Alla disconnessione del proprietario lo scontrino puo' essere chiuso da un altro terminale
+    stampante_rilascia_sessione(3);
+    stampante_snapshot(&copia);
+    VERIFICA(copia.sessione_documento == 1);
+    stampante_rilascia_sessione(1);
+    stampante_snapshot(&copia);
+    VERIFICA(copia.sessione_documento == SESSIONE_NESSUNA && copia.documento_aperto == 1);
+    cmd = di_sessione("=k", 2);
+    VERIFICA(stampante_valida(&cmd) == NULL);
+    stampante_applica(&cmd);
+    stampante_snapshot(&copia);
+    VERIFICA(copia.documento_aperto == 0);
+}
+
+// Registra nello stato la risposta della stampante (dati del pacchetto, NULL = nessuna risposta)
+static int risposta(StatoStampante* stato, const char* comando, const char* dati) {
+    ComandoStampante cmd;
+    VERIFICA(analizza(comando, &cmd) == NULL);
+    if (dati == NULL) return comando_registra_risposta(stato, &cmd, NULL, 0);
+    char r[128];
+    r[0] = PACCHETTO_ACK;
+    int len = 1 + pacchetto_costruisci("01", dati, (int)strlen(dati), r + 1, sizeof(r) - 1).lunghezza;
+    return comando_registra_risposta(stato, &cmd, r, len);
+}
+
+static void test_modello_incerto(void) {
+    StatoStampante stato;
+    memset(&stato, 0, sizeof(stato));
+    stato.chiave = CHIAVE_REG;
+
+    VERIFICA(risposta(&stato, "=R1/$100", "OK") && stato.documento_aperto && stato.totale == 100);
+    VERIFICA(!risposta(&stato, "=R1/$100", "E|G|E41|Totale") && stato.totale == 100);   // Non eseguito
+    VERIFICA(!risposta(&stato, "<?d", NULL) && !stato.incerto);                        // Interrogazione persa
+
+    // =T scaduto ma forse eseguito: il modello non respinge piu' =C, =R e =S
+    VERIFICA(risposta(&stato, "=T1", NULL) && stato.incerto && stato.chiave == CHIAVE_SCONOSCIUTA);
+    VERIFICA(valida(&stato, "=C1") == NULL && valida(&stato, "=S") == NULL && valida(&stato, "=T1") == NULL);
+    VERIFICA(strcmp(valida(&stato, "=R0/$100"), "E08") == 0);                          // Argomenti sempre verificati
+    risposta(&stato, "=T1", "OK");
+    VERIFICA(!stato.incerto && !stato.documento_aperto);
+
+    // Comando sconosciuto eseguito: effetto ignoto; le interrogazioni sconosciute no
+    risposta(&stato, "<?z", "OK");
+    VERIFICA(!stato.incerto);
+    risposta(&stato, "=X/1", "OK");
+    VERIFICA(stato.incerto);
+
+    // Risposta a <?s: riallinea chiave e documento
+    VERIFICA(risposta(&stato, "<?s", "O|N|0000|CHIAVE=1 LOCK=0 DOC=0"));
+    VERIFICA(!stato.incerto && stato.chiave == 1 && !stato.documento_aperto);
+    VERIFICA(strcmp(valida(&stato, "=S"), "E20") == 0);
+    VERIFICA(!risposta(&stato, "<?s", "O|N|0000|CHIAVE=1 LOCK=0 DOC=0"));             // Nessun cambiamento
+
+    // Cambio chiave dal pannello
+    risposta(&stato, "<?s", "CHIAVE=2|DOC=0");
+    VERIFICA(stato.chiave == 2 && strcmp(valida(&stato, "=R1/$100"), "E21") == 0);
+
+    // Documento aperto senza il gateway: aperto ma incerto
+    risposta(&stato, "<?s", "CHIAVE=1 DOC=1 RIGHE=2 TOTALE=-50");
+    VERIFICA(stato.documento_aperto && stato.incerto && stato.righe_documento == 2 && stato.totale == -50);
+    VERIFICA(valida(&stato, "=a") == NULL);
+
+    // Risposta troncata o con campi non riconosciuti
+    VERIFICA(!comando_sincronizza(&stato, "CHIAVE=x DOC", 12));
+    ComandoStampante cmd;
+    analizza("=K", &cmd);
+    char r[64];
+    int len = pacchetto_costruisci("01", "OK", 2, r, sizeof(r)).lunghezza;
+    comando_registra_risposta(&stato, &cmd, r, len - 1);
+    VERIFICA(stato.incerto && stato.documento_aperto);
+    comando_registra_risposta(&stato, &cmd, r, len);
+    VERIFICA(!stato.incerto && !stato.documento_aperto);
+}
+
+int main(void) {
+    test_analisi();
+    test_sequenza_documento();
+    test_stato_condiviso();
+    test_documento_di_sessione();
+    test_modello_incerto();
+    return verifica_esito("test_comandi");
+}
@@ -0,0 +1,103 @@
+/*
+ * File: test_connessione.c
+ * Descrizione: Test del decodificatore incrementale di connessione.c: frame spezzati in letture
+ *              di ogni dimensione, testo, CHK errato e risincronizzazione dopo pacchetti troncati.
+ */
+
+#include <string.h>
+#include "../connessione.h"
+#include "verifica.h"
+
+#define MAX_FLUSSO 512
+#define MAX_ATTESI 8
+
+typedef struct {
+    char flusso[MAX_FLUSSO];
+    int len;
+} Flusso;
+
+static void aggiungi(Flusso* f, const char* dati, int len) {
+    memcpy(f->flusso + f->len, dati, (size_t)len);
+    f->len += len;
+}
+
+static void aggiungi_pacchetto(Flusso* f, const char* dati) {
+    f->len += pacchetto_costruisci("01", dati, (int)strlen(dati), f->flusso + f->len, MAX_FLUSSO - f->len).lunghezza;
+}
+
+// Passa il flusso al decodificatore a letture di 'passo' byte, come conn_ricevi, e verifica
+// che i dati dei frame consegnati siano quelli attesi, nell'ordine
+static void verifica_flusso(const Flusso* f, int passo, const char* const* attesi, int n_attesi) {
+    DecodificatoreFrame dec;
+    decodificatore_init(&dec);
+    int consegnati = 0;
+    for (int inizio = 0; inizio < f->len; inizio += passo) {
+        int letti = inizio + passo > f->len ? f->len - inizio : passo;
+        int pos = 0;
+        while (pos < letti || decodificatore_da_rileggere(&dec)) {
+            EsitoFrame esito;
+            pos += decodificatore_spingi(&dec, f->flusso + inizio + pos, letti - pos, &esito);
+            if (esito == FRAME_NESSUNO) continue;
+            const char* dati = esito == FRAME_TESTO ? dec.frame : dec.frame + PACCHETTO_INIZIO_DATI;
+            int dati_len = esito == FRAME_TESTO ? dec.len : dec.len - PACCHETTO_CORNICE;
+            VERIFICA(esito != FRAME_CHK_ERRATO);
+            VERIFICA(consegnati < n_attesi);
+            if (consegnati < n_attesi) {
+                VERIFICA(dati_len == (int)strlen(attesi[consegnati]) && memcmp(dati, attesi[consegnati], (size_t)dati_len) == 0);
+            }
+            consegnati++;
+        }
+    }
+    VERIFICA(consegnati == n_attesi);
+}
+
+static void verifica_ogni_passo(const Flusso* f, const char* const* attesi, int n_attesi) {
+    for (int passo = 1; passo <= f->len; passo++) verifica_flusso(f, passo, attesi, n_attesi);
+}
+
+static void test_frame_e_testo(void) {
+    Flusso f = { .len = 0 };
+    aggiungi(&f, "xx", 2);                                      // Byte spuri prima del pacchetto
+    aggiungi_pacchetto(&f, "O|N|0000|OK");
+    aggiungi(&f, "OK: FEED eseguito.\r\n", 20);
+    aggiungi_pacchetto(&f, "E|G|E20|Documento");
+    // "xx" senza fine riga viene abbandonato allo STX: si consegnano solo i frame completi
+    const char* attesi[] = { "O|N|0000|OK", "OK: FEED eseguito.", "E|G|E20|Documento" };
+    verifica_ogni_passo(&f, attesi, 3);
+}
+
+// Un pacchetto troncato seguito subito dal successivo: la risposta completa non va persa
+static void test_pacchetto_troncato(void) {
+    Flusso f = { .len = 0 };
+    char troncato[64];
+    int troncato_len = pacchetto_costruisci("01", "O|N|0000|STATO LUNGO", 20, troncato, sizeof(troncato)).lunghezza;
+    aggiungi(&f, troncato, troncato_len - 9);
+    aggiungi_pacchetto(&f, "OK");
+    aggiungi_pacchetto(&f, "SECONDA");
+    const char* attesi[] = { "OK", "SECONDA" };
+    verifica_ogni_passo(&f, attesi, 2);
+}
+
+// Intestazione non valida con l'inizio del pacchetto successivo tra i suoi byte
+static void test_intestazione_non_valida(void) {
+    Flusso f = { .len = 0 };
+    aggiungi(&f, "\x02" "01", 3);
+    aggiungi_pacchetto(&f, "O|N|0000|DOPO");
+    aggiungi(&f, "\x02" "01abcN", 7);
+    aggiungi_pacchetto(&f, "ULTIMA");
+    const char* attesi[] = { "O|N|0000|DOPO", "ULTIMA" };
+    verifica_ogni_passo(&f, attesi, 2);
+
+    DecodificatoreFrame dec;
+    decodificatore_init(&dec);
+    EsitoFrame esito;
+    decodificatore_spingi(&dec, f.flusso, f.len, &esito);
+    VERIFICA(esito == FRAME_PACCHETTO && dec.scartati == 3);  // Solo i byte prima del secondo STX
+}
+
+int main(void) {
+    test_frame_e_testo();
+    test_pacchetto_troncato();
+    test_intestazione_non_valida();
+    return verifica_esito("test_connessione");
+}
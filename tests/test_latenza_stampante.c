@@ -0,0 +1,105 @@
+/*
+ * File: test_latenza_stampante.c
+ * Descrizione: Test delle scadenze adattive di latenza_stampante.c: classificazione dei
+ *              comandi, percentili dell'istogramma, calcolo della scadenza e raddoppi dopo
+ *              le scadenze consecutive.
+ */
+
+#include <windows.h>
+#include "../latenza_stampante.h"
+#include "verifica.h"
+
+static void test_classificazione(void) {
+    latenza_init("=C10, =C3/");
+    VERIFICA(latenza_classe(CMD_RICHIESTA_STATO, "<?s", 3) == CLASSE_INTERROGAZIONE);
+    VERIFICA(latenza_classe(CMD_RICHIESTA_DATA, "<?d", 3) == CLASSE_INTERROGAZIONE);
+    VERIFICA(latenza_classe(CMD_REGISTRA, "=R1/$100", 8) == CLASSE_OPERAZIONE);
+    VERIFICA(latenza_classe(CMD_TOTALE, "=T1", 3) == CLASSE_CHIUSURA);
+    VERIFICA(latenza_classe(CMD_CHIUDI_DOC, "=c", 2) == CLASSE_CHIUSURA);
+    VERIFICA(latenza_classe(CMD_ANNULLA_DOC, "=k", 2) == CLASSE_CHIUSURA);
+    VERIFICA(latenza_classe(CMD_SCONOSCIUTO, "=C10", 4) == CLASSE_LUNGA);
+    VERIFICA(latenza_classe(CMD_SCONOSCIUTO, "=C3/1/2", 7) == CLASSE_LUNGA);
+    VERIFICA(latenza_classe(CMD_SCONOSCIUTO, "=C1", 3) == CLASSE_OPERAZIONE); // Piu' corto del prefisso
+    VERIFICA(latenza_classe(CMD_SCONOSCIUTO, "=X", 2) == CLASSE_OPERAZIONE);
+
+    // Senza prefissi ogni comando non riconosciuto ha la scadenza generosa
+    latenza_init("");
+    VERIFICA(latenza_classe(CMD_SCONOSCIUTO, "=X", 2) == CLASSE_LUNGA);
+    VERIFICA(!latenza_comando_lungo("=X", 2));
+}
+
+// Con poche misure vale la scadenza iniziale; poi il doppio del p99, arrotondato
+// all'estremo superiore del suo intervallo
+static void test_scadenza_da_percentile(void) {
+    latenza_init(NULL);
+    VERIFICA(latenza_scadenza(CLASSE_INTERROGAZIONE) == 3000);
+    VERIFICA(latenza_ritrasmissione(CLASSE_INTERROGAZIONE) == 0);
+
+    // 12,0 - 16,5 ms: il p50 cade nell'intervallo (12, 15], il p99 in (15, 19]
+    for (int i = 0; i < 300; i++) latenza_registra(CLASSE_INTERROGAZIONE, 12000 + (i % 10) * 500);
+    StatisticheLatenza s;
+    latenza_statistiche(CLASSE_INTERROGAZIONE, &s);
+    VERIFICA(s.campioni == 300);
+    VERIFICA(s.media_ms >= 12 && s.media_ms <= 16);
+    VERIFICA(s.p50_ms == 15);
+    VERIFICA(s.p99_ms == 19);
+    VERIFICA(s.scadenza_ms == 38);
+    VERIFICA(latenza_scadenza(CLASSE_INTERROGAZIONE) == 38);
+    VERIFICA(latenza_ritrasmissione(CLASSE_INTERROGAZIONE) == 30); // p99 sotto la minima della classe
+
+    // Misure molto brevi non portano la scadenza sotto la minima della classe
+    latenza_init(NULL);
+    for (int i = 0; i < 50; i++) latenza_registra(CLASSE_OPERAZIONE, 1000);
+    VERIFICA(latenza_scadenza(CLASSE_OPERAZIONE) == 100);
+
+    // Le chiusure del documento restano sopra i 10 s anche con risposte rapide
+    for (int i = 0; i < 50; i++) latenza_registra(CLASSE_CHIUSURA, 1000);
+    VERIFICA(latenza_scadenza(CLASSE_CHIUSURA) == 10000);
+}
+
+// Ogni scadenza consecutiva raddoppia la scadenza (al massimo 8 volte, entro la massima);
+// una risposta completa riporta tutto al calcolo normale
+static void test_raddoppi_e_stampante_muta(void) {
+    latenza_init(NULL);
+    for (int i = 0; i < 300; i++) latenza_registra(CLASSE_INTERROGAZIONE, 12000 + (i % 10) * 500);
+    DWORD base = latenza_scadenza(CLASSE_INTERROGAZIONE);
+
+    latenza_registra_scaduta(CLASSE_INTERROGAZIONE);
+    VERIFICA(latenza_scadenza(CLASSE_INTERROGAZIONE) == base * 2);
+    VERIFICA(!latenza_stampante_muta());
+    latenza_registra_scaduta(CLASSE_INTERROGAZIONE);
+    latenza_registra_scaduta(CLASSE_INTERROGAZIONE);
+    VERIFICA(latenza_scadenza(CLASSE_INTERROGAZIONE) == base * 8);
+    VERIFICA(latenza_stampante_muta());
+    latenza_registra_scaduta(CLASSE_INTERROGAZIONE);
+    VERIFICA(latenza_scadenza(CLASSE_INTERROGAZIONE) == base * 8);
+
+    latenza_registra(CLASSE_INTERROGAZIONE, 14000);
+    VERIFICA(latenza_scadenza(CLASSE_INTERROGAZIONE) == base);
+    VERIFICA(!latenza_stampante_muta());
+
+    // La scadenza iniziale raddoppiata resta entro la massima della classe
+    latenza_init(NULL);
+    for (int i = 0; i < 3; i++) latenza_registra_scaduta(CLASSE_INTERROGAZIONE);
+    VERIFICA(latenza_scadenza(CLASSE_INTERROGAZIONE) == 5000);
+}
+
+// I comandi lunghi non scendono mai sotto i 2 minuti, anche con misure brevi
+static void test_comandi_lunghi(void) {
+    latenza_init(NULL);
+    VERIFICA(latenza_scadenza(CLASSE_LUNGA) == 120000);
+    for (int i = 0; i < 50; i++) latenza_registra(CLASSE_LUNGA, 8000000);
+    VERIFICA(latenza_scadenza(CLASSE_LUNGA) == 120000);
+    latenza_registra_scaduta(CLASSE_LUNGA);
+    VERIFICA(latenza_scadenza(CLASSE_LUNGA) == 240000);
+    latenza_registra_scaduta(CLASSE_LUNGA);
+    VERIFICA(latenza_scadenza(CLASSE_LUNGA) == 300000);
+}
+
+int main(void) {
+    test_classificazione();
+    test_scadenza_da_percentile();
+    test_raddoppi_e_stampante_muta();
+    test_comandi_lunghi();
+    return verifica_esito("test_latenza_stampante");
+}
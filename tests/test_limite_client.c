@@ -0,0 +1,82 @@
+/*
+ * File: test_limite_client.c
+ * Descrizione: Test dei secchi di token di limite_client.c: raffica, ricarica nel tempo,
+ *              tetto della ricarica, limite disabilitato e secchio dell'indirizzo.
+ */
+
+#include <windows.h>
+#include "../limite_client.h"
+#include "verifica.h"
+
+// Raffica consumata di fila, poi attesa pari al tempo di un token (600/min = 1 token ogni 100 ms)
+static void test_raffica_e_ricarica(void) {
+    limite_configura(CLASSE_OPERAZIONE, LIMITE_SESSIONE, 600, 5);
+    LimiteClient sessione;
+    limite_sessione_init(&sessione);
+
+    for (int i = 0; i < 5; i++) VERIFICA(limite_preleva(&sessione, NULL, CLASSE_OPERAZIONE) == 0);
+    DWORD attesa = limite_preleva(&sessione, NULL, CLASSE_OPERAZIONE);
+    VERIFICA(attesa > 0 && attesa <= 101);
+    // Un prelievo rifiutato non consuma nulla: si deve ancora attendere, non di piu'
+    DWORD seconda = limite_preleva(&sessione, NULL, CLASSE_OPERAZIONE);
+    VERIFICA(seconda > 0 && seconda <= attesa);
+    VERIFICA(sessione.utilizzo.comandi[CLASSE_OPERAZIONE] == 5);
+
+    Sleep(attesa + 50);
+    VERIFICA(limite_preleva(&sessione, NULL, CLASSE_OPERAZIONE) == 0);
+    VERIFICA(limite_preleva(&sessione, NULL, CLASSE_OPERAZIONE) > 0);
+}
+
+// Dopo una lunga inattivita' il secchio torna pieno, ma non oltre la raffica
+static void test_tetto_ricarica(void) {
+    limite_configura(CLASSE_OPERAZIONE, LIMITE_SESSIONE, 600, 5);
+    LimiteClient sessione;
+    limite_sessione_init(&sessione);
+
+    for (int i = 0; i < 5; i++) limite_preleva(&sessione, NULL, CLASSE_OPERAZIONE);
+    Sleep(1200); // Tempo per 12 token
+    int ammessi = 0;
+    while (ammessi < 20 && limite_preleva(&sessione, NULL, CLASSE_OPERAZIONE) == 0) ammessi++;
+    VERIFICA(ammessi == 5);
+}
+
+static void test_limite_disabilitato(void) {
+    limite_configura(CLASSE_INTERROGAZIONE, LIMITE_SESSIONE, 0, 1);
+    LimiteClient sessione;
+    limite_sessione_init(&sessione);
+    for (int i = 0; i < 1000; i++) VERIFICA(limite_preleva(&sessione, NULL, CLASSE_INTERROGAZIONE) == 0);
+}
+
+// Il secchio dell'indirizzo limita anche una sessione con token disponibili, e il token gia'
+// preso dalla sessione le viene restituito
+static void test_secchio_indirizzo(void) {
+    limite_configura(CLASSE_LUNGA, LIMITE_SESSIONE, 60, 10);
+    limite_configura(CLASSE_LUNGA, LIMITE_IP, 60, 2);
+    LimiteClient* ip = limite_ip("10.0.0.5:51234");
+    VERIFICA(ip != NULL);
+    VERIFICA(ip == limite_ip("10.0.0.5:40000"));   // La porta non conta
+    VERIFICA(ip != limite_ip("[::1]:51234"));
+
+    LimiteClient prima, seconda;
+    limite_sessione_init(&prima);
+    limite_sessione_init(&seconda);
+    VERIFICA(limite_preleva(&prima, ip, CLASSE_LUNGA) == 0);
+    VERIFICA(limite_preleva(&seconda, ip, CLASSE_LUNGA) == 0);
+    VERIFICA(limite_preleva(&seconda, ip, CLASSE_LUNGA) > 0);
+    VERIFICA(seconda.utilizzo.comandi[CLASSE_LUNGA] == 1);
+    VERIFICA(ip->utilizzo.comandi[CLASSE_LUNGA] == 2);
+
+    // Senza indirizzo la seconda sessione ha ancora 9 token: quello restituito compreso
+    int ammessi = 0;
+    while (ammessi < 20 && limite_preleva(&seconda, NULL, CLASSE_LUNGA) == 0) ammessi++;
+    VERIFICA(ammessi == 9);
+}
+
+int main(void) {
+    limite_init();
+    test_raffica_e_ricarica();
+    test_tetto_ricarica();
+    test_limite_disabilitato();
+    test_secchio_indirizzo();
+    return verifica_esito("test_limite_client");
+}
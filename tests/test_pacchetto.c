@@ -0,0 +1,156 @@
+/*
+ * File: test_pacchetto.c
+ * Descrizione: Test della cornice dei pacchetti di pacchetto.c: costruzione, CHK, cambio di
+ *              adds e di pack_id, verifica dei pacchetti ricevuti.
+ */
+
+#include <string.h>
+#include "../pacchetto.h"
+#include "verifica.h"
+
+// CHK calcolato per intero: XOR da STX fino a pack_id incluso
+static unsigned char chk_atteso(const char* p, int len) {
+    unsigned char chk = 0;
+    for (int i = 0; i < len - 3; i++) chk ^= (unsigned char)p[i];
+    return chk;
+}
+
+static void test_costruzione(void) {
+    char buffer[64];
+    VistaPacchetto v = pacchetto_costruisci("07", "<?s", 3, buffer, sizeof(buffer));
+    VERIFICA(v.byte == buffer);
+    VERIFICA(v.lunghezza == 3 + PACCHETTO_CORNICE);
+    VERIFICA(memcmp(buffer, "\x02" "07003N<?s1", 11) == 0);
+    VERIFICA(buffer[v.lunghezza - 1] == PACCHETTO_ETX);
+    char hex[2];
+    pacchetto_hex(chk_atteso(buffer, v.lunghezza), hex);
+    VERIFICA(buffer[v.lunghezza - 3] == hex[0] && buffer[v.lunghezza - 2] == hex[1]);
+    VERIFICA(pacchetto_valido(buffer, v.lunghezza));
+
+    // Dati gia' scritti nel buffer (ad esempio da snprintf): nessuna copia, stesso risultato
+    char diretto[64];
+    memcpy(diretto + PACCHETTO_INIZIO_DATI, "<?s", 3);
+    VistaPacchetto w = pacchetto_costruisci("07", diretto + PACCHETTO_INIZIO_DATI, 3, diretto, sizeof(diretto));
+    VERIFICA(w.lunghezza == v.lunghezza && memcmp(diretto, buffer, (size_t)v.lunghezza) == 0);
+
+    // Buffer insufficiente: nessun pacchetto
+    VERIFICA(pacchetto_costruisci("07", "<?s", 3, buffer, 3 + PACCHETTO_CORNICE - 1).lunghezza == 0);
+
+    // Oltre PACCHETTO_MAX_DATI i dati vengono troncati e il campo len resta a tre cifre
+    static char dati[PACCHETTO_MAX_DATI + 10];
+    static char grande[PACCHETTO_MAX_DATI + 10 + PACCHETTO_CORNICE];
+    memset(dati, 'x', sizeof(dati));
+    VistaPacchetto g = pacchetto_costruisci("07", dati, (int)sizeof(dati), grande, sizeof(grande));
+    VERIFICA(g.lunghezza == PACCHETTO_MAX_DATI + PACCHETTO_CORNICE);
+    VERIFICA(memcmp(grande + 3, "999", 3) == 0);
+    VERIFICA(pacchetto_valido(grande, g.lunghezza));
+}
+
+static void test_hex(void) {
+    char hex[2];
+    pacchetto_hex(0x00, hex);
+    VERIFICA(hex[0] == '0' && hex[1] == '0');
+    pacchetto_hex(0x0A, hex);
+    VERIFICA(hex[0] == '0' && hex[1] == 'A');
+    pacchetto_hex(0xF3, hex);
+    VERIFICA(hex[0] == 'F' && hex[1] == '3');
+}
+
+// Il CHK aggiornato in XOR deve coincidere con quello di un pacchetto costruito da zero
+static void test_riindirizza_e_pack_id(void) {
+    char a[64], b[64];
+    int len = pacchetto_costruisci("00", "=R1/$100", 8, a, sizeof(a)).lunghezza;
+    pacchetto_costruisci("S3", "=R1/$100", 8, b, sizeof(b));
+    pacchetto_riindirizza(a, len, "S3");
+    VERIFICA(memcmp(a, b, (size_t)len) == 0);
+    VERIFICA(pacchetto_valido(a, len));
+
+    pacchetto_imposta_id(a, len, '7');
+    VERIFICA(a[len - 4] == '7');
+    VERIFICA(pacchetto_valido(a, len));
+    b[len - 4] = '7';
+    char hex[2];
+    pacchetto_hex(chk_atteso(b, len), hex);
+    VERIFICA(a[len - 3] == hex[0] && a[len - 2] == hex[1]);
+
+    // Ciclo completo 0-9 e ritorno: il CHK torna quello di partenza
+    char c[64];
+    memcpy(c, a, (size_t)len);
+    for (char id = '0'; id <= '9'; id++) {
+        pacchetto_imposta_id(c, len, id);
+        VERIFICA(pacchetto_valido(c, len));
+    }
+    pacchetto_imposta_id(c, len, '7');
+    VERIFICA(memcmp(a, c, (size_t)len) == 0);
+
+    // Righe di testo e pacchetti senza ETX restano invariati
+    char testo[] = "=R1/$100\r\n";
+    pacchetto_riindirizza(testo, (int)strlen(testo), "S3");
+    pacchetto_imposta_id(testo, (int)strlen(testo), '5');
+    VERIFICA(strcmp(testo, "=R1/$100\r\n") == 0);
+    memcpy(c, b, (size_t)len);
+    pacchetto_riindirizza(c, len - 1, "99");
+    VERIFICA(c[1] == 'S' && c[2] == '3');
+}
+
+static void test_valido(void) {
+    char p[64];
+    int len = pacchetto_costruisci("12", "=K", 2, p, sizeof(p)).lunghezza;
+    char q[64];
+
+    memcpy(q, p, (size_t)len);
+    q[len - 2] = q[len - 2] == '0' ? '1' : '0';                 // CHK errato
+    VERIFICA(!pacchetto_valido(q, len));
+
+    memcpy(q, p, (size_t)len);
+    q[5] = '3';                                                 // len incoerente
+    VERIFICA(!pacchetto_valido(q, len));
+
+    memcpy(q, p, (size_t)len);
+    q[6] = 'E';                                                 // Tipo diverso da 'N'
+    VERIFICA(!pacchetto_valido(q, len));
+
+    VERIFICA(!pacchetto_valido(p, len - 1));                    // Senza ETX
+    VERIFICA(!pacchetto_valido(p + 1, len - 1));                // Senza STX
+    VERIFICA(!pacchetto_valido(p, 5));
+
+    // Le cifre esadecimali minuscole del CHK sono accettate
+    memcpy(q, p, (size_t)len);
+    for (int i = len - 3; i < len - 1; i++) if (q[i] >= 'A' && q[i] <= 'F') q[i] = (char)(q[i] - 'A' + 'a');
+    VERIFICA(pacchetto_valido(q, len));
+}
+
+static void test_risposta_positiva(void) {
+    char r[64];
+    r[0] = PACCHETTO_ACK;                                       // ACK prima della risposta
+    int len = 1 + pacchetto_costruisci("12", "OK", 2, r + 1, sizeof(r) - 1).lunghezza;
+    VistaPacchetto v;
+    VERIFICA(pacchetto_risposta_positiva(r, len, &v));
+    VERIFICA(v.byte == r + 1 && v.lunghezza == len - 1);
+    r[len] = '\r';                                              // Byte dopo l'ETX ignorati
+    VERIFICA(pacchetto_risposta_positiva(r, len + 1, NULL));
+
+    VERIFICA(!pacchetto_risposta_positiva(r, len - 1, NULL));   // Troncata
+    VERIFICA(!pacchetto_risposta_positiva(r, 9, NULL));
+    r[len - 2] = r[len - 2] == '0' ? '1' : '0';                 // CHK errato
+    VERIFICA(!pacchetto_risposta_positiva(r, len, NULL));
+    VERIFICA(!pacchetto_trova(r, len, &v));
+
+    len = pacchetto_costruisci("12", "E20", 3, r, sizeof(r)).lunghezza;
+    VERIFICA(pacchetto_trova(r, len, &v));
+    VERIFICA(!pacchetto_risposta_positiva(r, len, NULL));       // Errore della stampante
+
+    // Uno STX spurio prima del pacchetto non lo nasconde
+    r[0] = PACCHETTO_STX;
+    len = 1 + pacchetto_costruisci("12", "OK", 2, r + 1, sizeof(r) - 1).lunghezza;
+    VERIFICA(pacchetto_trova(r, len, &v) && v.byte == r + 1);
+}
+
+int main(void) {
+    test_costruzione();
+    test_hex();
+    test_riindirizza_e_pack_id();
+    test_valido();
+    test_risposta_positiva();
+    return verifica_esito("test_pacchetto");
+}
@@ -0,0 +1,25 @@
+#ifndef VERIFICA_H
+#define VERIFICA_H
+
+#include <stdio.h>
+
+// Verifiche minime per i test dei moduli: ogni condizione falsa viene stampata con file e riga,
+// e il programma esce con il numero di verifiche fallite (0 = tutto corretto).
+static int verifiche_eseguite = 0;
+static int verifiche_fallite = 0;
+
+#define VERIFICA(condizione) do { \
+        verifiche_eseguite++; \
+        if (!(condizione)) { \
+            verifiche_fallite++; \
+            printf("%s:%d: FALLITA: %s\n", __FILE__, __LINE__, #condizione); \
+        } \
+    } while (0)
+
+// Stampa il riepilogo e ritorna il codice di uscita del test.
+static int verifica_esito(const char* nome) {
+    printf("%s: %d verifiche, %d fallite.\n", nome, verifiche_eseguite, verifiche_fallite);
+    return verifiche_fallite;
+}
+
+#endif // VERIFICA_H